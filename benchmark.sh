@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+
+# Runs several of the sample programs through a deterministic scripted
+# camera path (VIEWMAT_CONTROL_MODE=bench) while the library records
+# per-frame CPU and GPU timings (KUHL_BENCHMARK). Each program writes
+# <name>.csv (one row per frame) and <name>.json (mean/p95/p99 frame
+# times) into the results directory and exits on its own after the
+# requested number of frames. Because the camera path is a function of
+# the frame index, the numbers are comparable across runs, driver
+# versions, and machines.
+#
+# Usage: ./benchmark.sh [resultsDir]
+# Environment: FRAMES (default 1000), WARMUP (default 60)
+#
+# Build everything first ("make" in the repository root); this script
+# is also available as "make benchmark".
+
+# Get the directory that this script is in (might not be the same as
+# the current directory).
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+BIN_DIR="${SCRIPT_DIR}/bin"
+RESULT_DIR="${1:-${SCRIPT_DIR}/benchmark-results}"
+
+mkdir -p "${RESULT_DIR}"
+
+function benchone()
+{
+	NAME="${1}"
+	shift
+	if [[ ! -x "${BIN_DIR}/${NAME}" ]]; then
+		echo "=== Skipping ${NAME} (not built)"
+		return
+	fi
+	echo "=== Benchmarking ${NAME}"
+	( cd "${BIN_DIR}" &&
+	  VIEWMAT_CONTROL_MODE=bench \
+	  KUHL_BENCHMARK="${RESULT_DIR}/${NAME}" \
+	  KUHL_BENCHMARK_FRAMES="${FRAMES:-1000}" \
+	  KUHL_BENCHMARK_WARMUP="${WARMUP:-60}" \
+	  "./${NAME}" "$@" )
+}
+
+benchone viewer ../models/duck/duck.dae
+benchone explode ../models/duck/duck.dae
+benchone flock
+benchone panorama ../images/wide.png
+
+echo
+echo "=== Results are in ${RESULT_DIR}"
+for f in "${RESULT_DIR}"/*.json; do
+	[[ -e "${f}" ]] || continue
+	echo "--- ${f}"
+	cat "${f}"
+done
@@ -15,7 +15,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <errno.h>
 #include <time.h>
 #include <math.h>
 #include <pthread.h>
@@ -30,79 +32,175 @@
  * IPv4 fragmentation---which happens automatically. */
 #define BUFLEN 65536
 
-char *RELAY_IN_PORT = NULL; // the port we listen for UDP packets on
-char *RELAY_OUT_IP = NULL; // the address we send UDP packets to
+/* Maximum number of packets we read from a socket (and forward to each
+ * destination) with a single pair of system calls. */
+#define BATCH 64
 
-pthread_t receiverThread;
-
-int s_R; // socket we will read packets from
-socklen_t slen_R;
+/* One relay "session" forwards packets arriving on one input port to a
+ * list of destination sockets. A single relay process can serve several
+ * sessions (separate '+'-delimited groups on the command line); each
+ * session corresponds to what used to require its own relay process. */
+struct relay_session {
+	const char *inPort; // the port we listen for UDP packets on
+	const char *outIP;  // the address we send UDP packets to
+	int s_R;            // socket we will read packets from
+	std::vector<int> s_S; // list of sockets to send data to
+	std::vector<struct sockaddr_in> si_other_S; // destination address for each socket
+	struct sockaddr_in masterAddr; // where the forwarded packets came from; replies (bulk NACKs) go back here
+	socklen_t masterLen; // 0 until we have forwarded at least one packet
+};
 
+/* epoll tags: forward (master-to-slave) sockets are tagged with their
+ * session index. Reverse traffic---slaves sending bulk-transfer NACKs
+ * back to the address their packets came from, i.e. our send
+ * sockets---is tagged with the high bit set plus the session and
+ * destination indices. */
+#define REVERSE_TAG(ses, dest) (0x80000000u | ((unsigned)(ses) << 16) | (unsigned)(dest))
 
-struct sockaddr_in si_me_R;
+std::vector<relay_session> sessions;
+int epollfd; // waits for packets on every session's receive socket
 
-std::vector<int> s_S; // list of sockets to send data to
-std::vector<struct sockaddr_in> si_other_S; // list of sockaddr objects for our sockets.
-socklen_t slen_S;
+pthread_t receiverThread;
 
 bool receivedPacket = false;
 int framesPassed = 0;
 
 // This function receives incoming packets, repackages them, and then forwards them
 // on the network for consumption by the slaves. It does this in an infinite loop.
+// Packets are read and sent in batches of up to BATCH with recvmmsg() and
+// sendmmsg() so a burst of packets costs a few system calls instead of one per
+// packet per destination. The packet buffers are allocated once and the send
+// headers point at the same buffers the packets were received into, so no
+// per-packet allocation or copying occurs.
 void * receiver(void *) {
-	char buf[BUFLEN];
+	static char buf[BATCH][BUFLEN];
+	static struct iovec recvIov[BATCH];
+	static struct mmsghdr recvHdr[BATCH];
+	static struct sockaddr_in recvSrc[BATCH];
+	static struct iovec sendIov[BATCH];
+	static struct mmsghdr sendHdr[BATCH];
+	for (int i = 0; i < BATCH; i++) {
+		recvIov[i].iov_base = buf[i];
+		recvIov[i].iov_len = BUFLEN;
+		memset(&recvHdr[i], 0, sizeof(recvHdr[i]));
+		recvHdr[i].msg_hdr.msg_iov = &recvIov[i];
+		recvHdr[i].msg_hdr.msg_iovlen = 1;
+		recvHdr[i].msg_hdr.msg_name = &recvSrc[i];
+		sendIov[i].iov_base = buf[i];
+		memset(&sendHdr[i], 0, sizeof(sendHdr[i]));
+		sendHdr[i].msg_hdr.msg_iov = &sendIov[i];
+		sendHdr[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	struct epoll_event events[16];
 	while (true) {
-		// Receive any frames
-		int bytesReceived;
-		bytesReceived = recvfrom(s_R, buf, BUFLEN, 0, NULL, 0);
-		if (bytesReceived == -1) {
-			perror("DGR Relay: ERROR recvfrom");
+		int numReady = epoll_wait(epollfd, events, 16, -1);
+		if (numReady == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("DGR Relay: ERROR epoll_wait");
 			exit(EXIT_FAILURE);
 		}
 
-		receivedPacket = true;
-		framesPassed = 0;
+		for (int e = 0; e < numReady; e++) {
+			if (events[e].data.u32 & 0x80000000u) {
+				// A slave sent something (a bulk-transfer NACK) back to
+				// one of our send sockets. Forward it to the master via
+				// the receive socket so the reply comes from the address
+				// the master sent its packets to.
+				relay_session *ses = &sessions[(events[e].data.u32 >> 16) & 0x7fff];
+				int s = ses->s_S[events[e].data.u32 & 0xffff];
+				while (true) {
+					int n = recvfrom(s, buf[0], BUFLEN, MSG_DONTWAIT, NULL, NULL);
+					if (n == -1) {
+						if (errno == EAGAIN || errno == EWOULDBLOCK)
+							break;
+						perror("DGR Relay: ERROR recvfrom");
+						exit(EXIT_FAILURE);
+					}
+					if (ses->masterLen == 0)
+						continue; // haven't seen the master's address yet
+					if (sendto(ses->s_R, buf[0], n, 0,
+					           (struct sockaddr*)&ses->masterAddr, ses->masterLen) == -1)
+						perror("DGR Relay: ERROR sendto (reply to master)");
+				}
+				continue;
+			}
+			relay_session *ses = &sessions[events[e].data.u32];
 
-		// When we have received a frame, send it out!
-		for(unsigned int i = 0; i < s_S.size(); i++){
-			if (sendto(s_S[i], buf, bytesReceived, 0, (struct sockaddr*)&si_other_S[i],
-					   slen_S) == -1) {
-				perror("DGR Relay: ERROR sendto");
+			// Receive any frames (up to BATCH of them in one system
+			// call). epoll will wake us again if more are waiting.
+			for (int i = 0; i < BATCH; i++)
+				recvHdr[i].msg_hdr.msg_namelen = sizeof(recvSrc[i]);
+			int numPackets = recvmmsg(ses->s_R, recvHdr, BATCH, MSG_DONTWAIT, NULL);
+			if (numPackets == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					continue; // another wakeup already drained the socket
+				perror("DGR Relay: ERROR recvmmsg");
 				exit(EXIT_FAILURE);
 			}
-		}
 
-		/* Check if the frame that we just forwarded was informing
-		 * processes to exit. */
-		if(bytesReceived > (int) strlen("!!!dgr_died!!!") &&
-		   strcmp(buf, "!!!dgr_died!!!") == 0)
-		{
-			printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
-			exit(EXIT_SUCCESS);
+			receivedPacket = true;
+			framesPassed = 0;
+
+			// Remember the master's address so replies from the slaves
+			// can be routed back to it.
+			if (numPackets > 0 &&
+			    recvHdr[0].msg_hdr.msg_namelen >= sizeof(struct sockaddr_in)) {
+				ses->masterAddr = recvSrc[0];
+				ses->masterLen = recvHdr[0].msg_hdr.msg_namelen;
+			}
+
+			// When we have received the frames, send them out!
+			for (int i = 0; i < numPackets; i++)
+				sendIov[i].iov_len = recvHdr[i].msg_len;
+			for (unsigned int j = 0; j < ses->s_S.size(); j++) {
+				for (int i = 0; i < numPackets; i++) {
+					sendHdr[i].msg_hdr.msg_name = &ses->si_other_S[j];
+					sendHdr[i].msg_hdr.msg_namelen = sizeof(ses->si_other_S[j]);
+				}
+				int sent = 0;
+				while (sent < numPackets) {
+					int ret = sendmmsg(ses->s_S[j], sendHdr+sent, numPackets-sent, 0);
+					if (ret == -1) {
+						perror("DGR Relay: ERROR sendmmsg");
+						exit(EXIT_FAILURE);
+					}
+					sent += ret;
+				}
+			}
+
+			/* Check if the frames that we just forwarded were informing
+			 * processes to exit. The marker is a record name inside the
+			 * packet, so search the bytes rather than assuming the
+			 * packet starts with it. */
+			static const char diedMsg[] = "!!!dgr_died!!!";
+			for (int i = 0; i < numPackets; i++) {
+				if (memmem(buf[i], recvHdr[i].msg_len, diedMsg, strlen(diedMsg)) != NULL) {
+					printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
+					exit(EXIT_SUCCESS);
+				}
+			}
 		}
 	}
 }
-#endif // __MINGW32__
-
 
-int main(int argc, char **argv) {
-#ifndef __MINGW32__
-	if (argc < 4) {
-		printf("USAGE: %s port-in ipaddr-out port-out [ port2-out .. ]\n", argv[0]);
-		printf("This program will listen on a specific port for UDP packets. When one is received, it will be sent to the specified IP address. If more than one port is specified, it will send the packet to multiple ports at that IP address.\n");
-		exit(EXIT_FAILURE);
-	}
-	RELAY_IN_PORT=argv[1];
-	RELAY_OUT_IP=argv[2];
+// Sets up one session: a bound receive socket plus a send socket per
+// destination port. 'argv' points at the session's arguments (port-in
+// ipaddr-out port-out [port2-out ..]) and 'argc' is how many there are.
+void setup_session(int argc, char **argv) {
+	relay_session ses;
+	ses.inPort = argv[0];
+	ses.outIP = argv[1];
+	memset(&ses.masterAddr, 0, sizeof(ses.masterAddr));
+	ses.masterLen = 0;
 
 	// for each of the output ports, create a socket:
-	for(int i = 3; i < argc; i++){
-		printf("DGR Relay: Preparing to send data to %s on port %s\n", RELAY_OUT_IP, argv[i]);
-		
+	for(int i = 2; i < argc; i++){
+		printf("DGR Relay: Preparing to send data to %s on port %s\n", ses.outIP, argv[i]);
+
 		struct sockaddr_in _si_other_S;
 		int _s_S;
-		slen_S=sizeof(_si_other_S);
 
 		if ((_s_S=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 			perror("DGR Relay: ERROR socket");
@@ -114,33 +212,88 @@ int main(int argc, char **argv) {
 		memset((char *) &_si_other_S, 0, sizeof(_si_other_S));
 		_si_other_S.sin_family = AF_INET;
 		_si_other_S.sin_port = htons(atoi(argv[i]));
-		if (inet_aton(RELAY_OUT_IP, &_si_other_S.sin_addr) == 0) {
+		if (inet_aton(ses.outIP, &_si_other_S.sin_addr) == 0) {
 			fprintf(stderr, "DGR Relay: inet_aton() failed\n");
 			exit(1);
 		}
 
 		// add this socket to a list
-		s_S.push_back(_s_S);
-		si_other_S.push_back(_si_other_S);
-    }
-
+		ses.s_S.push_back(_s_S);
+		ses.si_other_S.push_back(_si_other_S);
+	}
 
-	printf("DGR Relay: Preparing to receive data on port %s\n", RELAY_IN_PORT);
+	printf("DGR Relay: Preparing to receive data on port %s\n", ses.inPort);
 	// Create and bind the socket that we will use to receive data from.
-	if ((s_R=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+	if ((ses.s_R=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 		perror("DGR Relay: ERROR socket");
 		exit(EXIT_FAILURE);
 	}
+	struct sockaddr_in si_me_R;
 	memset((char *) &si_me_R, 0, sizeof(si_me_R));
 	si_me_R.sin_family = AF_INET;
-	si_me_R.sin_port = htons(atoi(RELAY_IN_PORT));
+	si_me_R.sin_port = htons(atoi(ses.inPort));
 	si_me_R.sin_addr.s_addr = htonl(INADDR_ANY);
-	int _bind_result = bind(s_R, (struct sockaddr*)&si_me_R, sizeof(si_me_R));
-	if ( _bind_result == -1) {
+	if (bind(ses.s_R, (struct sockaddr*)&si_me_R, sizeof(si_me_R)) == -1) {
 		perror("DGR Relay: ERROR bind");
 		exit(EXIT_FAILURE);
 	}
 
+	sessions.push_back(ses);
+}
+#endif // __MINGW32__
+
+
+int main(int argc, char **argv) {
+#ifndef __MINGW32__
+	if (argc < 4) {
+		printf("USAGE: %s port-in ipaddr-out port-out [ port2-out .. ] [ + port-in ipaddr-out port-out .. ]\n", argv[0]);
+		printf("This program will listen on a specific port for UDP packets. When one is received, it will be sent to the specified IP address. If more than one port is specified, it will send the packet to multiple ports at that IP address. Additional port-in/ipaddr-out/port-out groups separated by a '+' argument make one relay process forward several DGR sessions at once.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Split the arguments into '+'-delimited groups and set up one
+	// session per group.
+	int groupStart = 1;
+	for (int i = 1; i <= argc; i++) {
+		if (i == argc || strcmp(argv[i], "+") == 0) {
+			if (i - groupStart < 3) {
+				fprintf(stderr, "DGR Relay: Each session needs at least port-in, ipaddr-out and port-out.\n");
+				exit(EXIT_FAILURE);
+			}
+			setup_session(i - groupStart, argv + groupStart);
+			groupStart = i+1;
+		}
+	}
+
+	// Wait for packets on every session's receive socket with a single
+	// epoll object.
+	if ((epollfd = epoll_create1(0)) == -1) {
+		perror("DGR Relay: ERROR epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int i = 0; i < sessions.size(); i++) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sessions[i].s_R, &ev) == -1) {
+			perror("DGR Relay: ERROR epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+		// Also watch the send sockets: slaves send bulk-transfer NACKs
+		// back to the address their packets came from, which is one of
+		// these sockets.
+		for (unsigned int j = 0; j < sessions[i].s_S.size(); j++) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u32 = REVERSE_TAG(i, j);
+			if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sessions[i].s_S[j], &ev) == -1) {
+				perror("DGR Relay: ERROR epoll_ctl");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
 	// listen for updates
 	if (pthread_create(&receiverThread, NULL, &receiver, NULL) != 0) {
 		perror("DGR Relay: Exiting because pthread_create() failed.");
@@ -159,7 +312,7 @@ int main(int argc, char **argv) {
 
 		int timeoutReceivedPacket = 50; // tenths of a second to timeout (if we HAVE received previous packet)
 		int timeoutFirstPacket = 150; // tenths of a second to timeout (if we have NOT received previous packet)
-		
+
 		if(receivedPacket && framesPassed > timeoutReceivedPacket) {
 		printf("DGR Relay: Exiting because we haven't received a packet within %f seconds (and we have received packets previously).\n", timeoutReceivedPacket/10.0);
 				exit(EXIT_SUCCESS);
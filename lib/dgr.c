@@ -29,7 +29,12 @@
 #endif // __MINGW32__
 
 #include <errno.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/time.h> // gettimeofday() - bulk transfer NACK timing
+#ifndef __MINGW32__
+#include <pthread.h> // receiver thread
+#endif
 #include "msg.h"
 
 
@@ -40,6 +45,9 @@ typedef struct {
 	char name[1024]; /**< The name of the variable */
 	int size;        /**< Number of bytes of data in this variable */
 	void *buffer;    /**< The bytes of data in this variable */
+	int dirty;       /**< Has this variable changed since we last sent it? */
+	int bulk;        /**< Is this record too large for a datagram (sent via the chunked bulk channel)? */
+	uint32_t transferId; /**< Master: the bulk transfer id of the last send of this record. Slave: the id of the last completed bulk transfer of this record. */
 } dgr_record;
 
 
@@ -47,6 +55,23 @@ typedef struct {
 
 /** Maximum number of records DGR can handle. */
 #define DGR_MAX_LIST_SIZE 1024
+
+/** Records larger than this many bytes don't fit in a datagram
+ * alongside the other records; they are sent over the reliable
+ * chunked bulk channel instead of inside keyframe/delta packets. */
+#define DGR_BULK_THRESHOLD 1200
+/** Payload bytes per bulk chunk, chosen to keep each chunk (plus its
+ * header and the record name) under the typical 1472-byte MTU limit. */
+#define DGR_BULK_CHUNK_BYTES 1200
+/** Maximum number of bulk transfers a slave reassembles at once. */
+#define DGR_BULK_MAX_TRANSFERS 16
+/** Maximum number of missing chunk indices in one NACK packet. */
+#define DGR_BULK_NACK_MAX 300
+
+/* Software swap-lock configuration (see dgr_swap_barrier()). */
+static int dgr_swaplock_slaves = 0;    /**< Master: number of slaves to wait for before releasing a swap; 0 disables the swap-lock. */
+static int dgr_swaplock_enabled = 0;   /**< Slave: wait for the master's release before swapping? */
+static int dgr_swaplock_timeout = 100; /**< Longest time (milliseconds) the barrier may hold up a swap. */
 /** A list of records DGR is tracking */
 static dgr_record dgr_list[DGR_MAX_LIST_SIZE]; 
 /** Size of the DGR record list */
@@ -61,6 +86,51 @@ static time_t dgr_time_lastreceive; /**< time we received last packet, 0 if have
 static int dgr_mode = 0;  /**< Set to 1 if we are master, 0 otherwise */
 static int dgr_disabled = 0; /**< Set to 1 if we are running in a DGR environment, 0 otherwise */
 
+/** Slave: maps a 16-bit record id assigned by the master onto an index
+ * into our own dgr_list. Ids are learned from keyframe packets (which
+ * carry both the id and the name); delta packets carry only ids. -1
+ * indicates an id we haven't learned yet. */
+static int dgr_id_to_index[DGR_MAX_LIST_SIZE];
+/** Master: set to 1 when the next packet must be a keyframe (e.g., the
+ * record list was reset, invalidating any ids the slaves learned). */
+static int dgr_force_keyframe = 0;
+
+/* Send-rate control (master). The DGR_SEND_HZ environment variable
+ * decouples the network send rate from the render loop: a master
+ * rendering at 144fps with DGR_SEND_HZ=60 only transmits 60 packets
+ * per second, and the changes from the frames in between coalesce
+ * into the next packet (records stay dirty until they are sent). */
+static int dgr_send_hz = -1;        /**< Target sends per second; 0 = send every frame; -1 = DGR_SEND_HZ not parsed yet. */
+static double dgr_send_next_ms = 0; /**< Earliest time the next packet may be sent. */
+/** When the oldest not-yet-sent change was made (0 = none pending).
+ * Measures how stale coalesced data is by the time it is sent, which
+ * approximates the lag rate control adds to the slaves' view. */
+static double dgr_oldest_dirty_ms = 0;
+
+/* Bandwidth statistics. Counters accumulate over a one-second window;
+ * when the window ends the per-second rates are snapshotted for
+ * dgr_stats()/dgr_print_stats() and the counters reset. */
+static double dgr_stat_window_ms = 0; /**< When the current window started, 0 = not started. */
+static long dgr_stat_bytes = 0;       /**< Bytes sent this window (including bulk chunks). */
+static long dgr_stat_packets = 0;     /**< Packets sent this window. */
+static long dgr_stat_records = 0;     /**< Records carried by this window's keyframe/delta packets. */
+static long dgr_stat_record_packets = 0; /**< Keyframe/delta packets this window (bulk chunks excluded). */
+static double dgr_stat_lag_sum = 0;   /**< Sum of oldest-change-to-send times (ms) this window. */
+static long dgr_stat_lag_count = 0;   /**< Number of lag samples this window. */
+/* The most recent completed window, returned by dgr_stats(). */
+static float dgr_snap_bytes_sec = 0;
+static float dgr_snap_packets_sec = 0;
+static float dgr_snap_records_packet = 0;
+static float dgr_snap_lag_ms = 0;
+
+#ifndef __MINGW32__
+/* Slaves normally drain the socket on a dedicated thread; defined with
+ * the rest of the receive code below. */
+static void dgr_receive_thread_start(void);
+/* Defined with the bulk-transfer code below. */
+static double dgr_now_ms(void);
+#endif
+
 
 /** Frees resources that DGR has used. */
 static void dgr_free(void)
@@ -68,9 +138,34 @@ static void dgr_free(void)
 	for(int i=0; i<dgr_list_size; i++)
 		free(dgr_list[i].buffer);
 	dgr_list_size = 0;
+
+	/* Record indices (and therefore the ids derived from them) are no
+	 * longer valid. Make the master resend names and make the slave
+	 * forget the id mapping it learned. */
+	dgr_force_keyframe = 1;
+	for(int i=0; i<DGR_MAX_LIST_SIZE; i++)
+		dgr_id_to_index[i] = -1;
 }
 
 
+#ifndef __MINGW32__
+/** Checks if a string contains an IPv4 multicast address
+ * (224.0.0.0-239.255.255.255).
+
+    @param ipAddr A string containing an IP address.
+
+    @return 1 if the string is an IPv4 multicast address, 0 otherwise.
+*/
+static int dgr_is_multicast(const char *ipAddr)
+{
+	struct in_addr addr;
+	if(ipAddr == NULL || inet_pton(AF_INET, ipAddr, &addr) != 1)
+		return 0;
+	return IN_MULTICAST(ntohl(addr.s_addr));
+}
+#endif // __MINGW32__
+
+
 /** Initializes a master DGR process that will send packets out on the network. */
 static void dgr_init_master()
 {
@@ -109,18 +204,53 @@ static void dgr_init_master()
 	for(p = servinfo; p != NULL; p = p->ai_next) {
 		if ((dgr_socket = socket(p->ai_family, p->ai_socktype,
 		                         p->ai_protocol)) == -1) {
-			msg(ERROR, "DGR: Master: socket(): %s", strerror(errno));
+			msgd("dgr", ERROR, "DGR: Master: socket(): %s", strerror(errno));
 			continue;
 		}
 		break;
 	}
 
 	if (p == NULL) {
-		msg(FATAL, "DGR Master: failed to bind socket\n");
+		msgd("dgr", FATAL, "DGR Master: failed to bind socket\n");
 		exit(EXIT_FAILURE);
 	}
 
 	dgr_addrinfo = p;
+
+	/* If the destination is a multicast group, one send reaches every
+	 * slave that joined the group---no relay process is needed unless
+	 * the packets must cross a router. The default TTL of 1 keeps
+	 * multicast packets on the local network; set DGR_MULTICAST_TTL if
+	 * they need to cross routers. */
+	if(dgr_is_multicast(ipAddr))
+	{
+		unsigned char ttl = 1;
+		const char *ttlString = getenv("DGR_MULTICAST_TTL");
+		if(ttlString != NULL)
+			ttl = (unsigned char) atoi(ttlString);
+		if(setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_TTL,
+		              &ttl, sizeof(ttl)) == -1)
+		{
+			msgd("dgr", FATAL, "DGR Master: setsockopt(IP_MULTICAST_TTL): %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		msgd("dgr", INFO, "DGR Master: Sending to multicast group %s (TTL %d).\n", ipAddr, ttl);
+	}
+
+	/* See dgr_swap_barrier(). The master must be told how many slaves
+	 * to wait for before releasing each swap. */
+	const char *swaplock = getenv("DGR_SWAPLOCK");
+	if(swaplock != NULL)
+	{
+		dgr_swaplock_slaves = atoi(swaplock);
+		if(dgr_swaplock_slaves <= 0)
+			msgd("dgr", WARNING, "DGR Master: DGR_SWAPLOCK must be set to the number of slaves; the swap-lock is disabled.\n");
+		else
+			msgd("dgr", INFO, "DGR Master: Swap-lock enabled; waiting for %d slave(s) before each buffer swap.\n", dgr_swaplock_slaves);
+	}
+	const char *swapTimeout = getenv("DGR_SWAPLOCK_TIMEOUT");
+	if(swapTimeout != NULL)
+		dgr_swaplock_timeout = atoi(swapTimeout);
 #endif // __MINGW32__
 }
 
@@ -131,10 +261,10 @@ static void dgr_init_slave()
 	const char* port = getenv("DGR_SLAVE_LISTEN_PORT");
 	if(port == NULL)
 	{
-		msg(FATAL, "DGR Slave: DGR_SLAVE_LISTEN_PORT was not set.\n");
+		msgd("dgr", FATAL, "DGR Slave: DGR_SLAVE_LISTEN_PORT was not set.\n");
 		exit(EXIT_FAILURE);
 	}
-	msg(INFO, "DGR Slave: Preparing to receive packets on port %s.\n", port);
+	msgd("dgr", INFO, "DGR Slave: Preparing to receive packets on port %s.\n", port);
 	
 	dgr_time_lastreceive = 0;
 	struct addrinfo hints, *servinfo, *p;
@@ -146,7 +276,7 @@ static void dgr_init_slave()
 
 	int rv;
 	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-		msg(FATAL, "DGR Slave: getaddrinfo: %s\n", gai_strerror(rv));
+		msgd("dgr", FATAL, "DGR Slave: getaddrinfo: %s\n", gai_strerror(rv));
 		exit(EXIT_FAILURE);
 	}
 
@@ -159,7 +289,7 @@ static void dgr_init_slave()
 		}
 		if (bind(dgr_socket, p->ai_addr, p->ai_addrlen) == -1) {
 			close(dgr_socket);
-			msg(ERROR, "DGR Slave: bind: %s", strerror(errno));
+			msgd("dgr", ERROR, "DGR Slave: bind: %s", strerror(errno));
 			continue;
 		}
 
@@ -167,11 +297,47 @@ static void dgr_init_slave()
 	}
 
 	if (p == NULL) {
-		msg(FATAL, "DGR Slave: Failed to bind socket\n");
+		msgd("dgr", FATAL, "DGR Slave: Failed to bind socket\n");
 		exit(EXIT_FAILURE);
 	}
 
 	freeaddrinfo(servinfo);
+
+	/* If the master is sending to a multicast group (the same
+	 * DGR_MASTER_DEST_IP environment variable the master uses), join
+	 * the group so the packets get delivered to us. */
+	const char *groupAddr = getenv("DGR_MASTER_DEST_IP");
+	if(dgr_is_multicast(groupAddr))
+	{
+		struct ip_mreq mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		inet_pton(AF_INET, groupAddr, &mreq.imr_multiaddr);
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if(setsockopt(dgr_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		              &mreq, sizeof(mreq)) == -1)
+		{
+			msgd("dgr", FATAL, "DGR Slave: setsockopt(IP_ADD_MEMBERSHIP): %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		msgd("dgr", INFO, "DGR Slave: Joined multicast group %s.\n", groupAddr);
+	}
+
+	/* See dgr_swap_barrier(). */
+	if(getenv("DGR_SWAPLOCK") != NULL)
+	{
+		dgr_swaplock_enabled = 1;
+		msgd("dgr", INFO, "DGR Slave: Swap-lock enabled; waiting for the master's release before each buffer swap.\n");
+	}
+	const char *swapTimeout = getenv("DGR_SWAPLOCK_TIMEOUT");
+	if(swapTimeout != NULL)
+		dgr_swaplock_timeout = atoi(swapTimeout);
+
+	/* Drain the socket on a dedicated thread so the render loop never
+	 * waits on the network (see dgr_receive_thread()). Set
+	 * DGR_SYNC_RECEIVE to read the socket on the render thread like DGR
+	 * used to. */
+	if(getenv("DGR_SYNC_RECEIVE") == NULL)
+		dgr_receive_thread_start();
 #endif // __MINGW32__
 }
 
@@ -220,12 +386,15 @@ void dgr_init(void)
 		}
 		else
 		{
-			msg(ERROR, "DGR_MODE must be 'slave' or 'master' but you set it to '%s'", mode);
+			msgd("dgr", ERROR, "DGR_MODE must be 'slave' or 'master' but you set it to '%s'", mode);
 		}
 	}
 	
 	if(dgr_disabled)
-		msg(INFO, "DGR is disabled; not a valid DGR environment.\n");
+		msgd("dgr", INFO, "DGR is disabled; not a valid DGR environment.\n");
+
+	for(int i=0; i<DGR_MAX_LIST_SIZE; i++)
+		dgr_id_to_index[i] = -1;
 
 	// if there already is a list, free it.
 	if(dgr_list_size > 0)
@@ -299,7 +468,7 @@ static void dgr_set(const char *name, const void *buffer, int size)
 
 		if(dgr_list_size > DGR_MAX_LIST_SIZE)
 		{
-			msg(FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
+			msgd("dgr", FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
 			exit(EXIT_FAILURE);
 		}
 
@@ -308,6 +477,9 @@ static void dgr_set(const char *name, const void *buffer, int size)
 		record->size = size;
 		record->buffer = malloc(size);
 		memcpy(record->buffer, buffer, size);
+		record->dirty = 1;
+		record->bulk = (size > DGR_BULK_THRESHOLD);
+		record->transferId = 0;
 
 		dgr_list_size++;
 	}
@@ -322,9 +494,25 @@ static void dgr_set(const char *name, const void *buffer, int size)
 			free(record->buffer);
 			record->buffer = malloc(size);
 			record->size = size;
+			record->dirty = 1;
+			record->bulk = (size > DGR_BULK_THRESHOLD);
 		}
+		/* Only mark the record dirty if the bytes actually changed so
+		 * dgr_send() can skip records that are set every frame to the
+		 * same value. */
+		else if(memcmp(record->buffer, buffer, size) != 0)
+			record->dirty = 1;
 		memcpy(record->buffer, buffer, size);
 	}
+
+#ifndef __MINGW32__
+	/* Remember when the oldest not-yet-sent change was made so that
+	 * dgr_send() can report how stale coalesced data gets when rate
+	 * control delays it. */
+	int idx = (index == -1) ? dgr_list_size-1 : index;
+	if(dgr_list[idx].dirty && dgr_oldest_dirty_ms == 0)
+		dgr_oldest_dirty_ms = dgr_now_ms();
+#endif
 }
 
 /** Set a variable if we are a DGR master (so that we can send it to
@@ -357,43 +545,99 @@ void dgr_setget(const char *name, void* buffer, int bufferSize)
 	{
 		int ret = dgr_get(name, buffer, bufferSize);
 		if(ret == -1)
-			msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it!\n", name);
+			msgd("dgr", ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it!\n", name);
 		else if(ret == -2)
-			msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+			msgd("dgr", ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
 
 		else if(ret != bufferSize)
-			msg(WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
+			msgd("dgr", WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
 	}
 }
 
 
+/** Version number of the DGR wire format. Bump this whenever the
+ * packet layout changes so that a mismatched master and slave print an
+ * error instead of silently misinterpreting each other's packets. */
+#define DGR_WIRE_VERSION 3
+/** Every packet starts with 'D','G','R', a version byte, and a packet
+ * type byte. */
+#define DGR_WIRE_HEADER_BYTES 5
+#define DGR_PACKET_KEYFRAME 0 /**< Packet carries every record, names included. */
+#define DGR_PACKET_DELTA 1    /**< Packet carries only changed records, ids only. */
+#define DGR_PACKET_BULK_CHUNK 2 /**< Packet carries one chunk of a record too large for a datagram. */
+#define DGR_PACKET_BULK_NACK 3  /**< Slave-to-master: asks for chunks of a bulk transfer to be resent. */
+#define DGR_PACKET_SWAP_READY 4   /**< Slave-to-master: this slave finished rendering and is ready to swap. */
+#define DGR_PACKET_SWAP_RELEASE 5 /**< Master-to-slaves: every node is ready; swap buffers now. */
+
 /** Takes the list of DGR records and puts them into a compact byte
- * stream. The format is:
- *   
- * label character string<br>
- * Null terminator at end of string<br>
+ * stream. After the 5-byte header, each record is:
+ *
+ * A 16-bit id (the record's index in the master's list).<br>
+ * Keyframes only: a 16-bit name length followed by the name (no null terminator).<br>
  * An integer indicating the size of the data that follows.<br>
  * A buffer of the data.<br>
  *
+ * Delta packets omit the name so that records which change every frame
+ * cost only a few bytes of overhead each, keeping typical packets well
+ * under the 1472-byte MTU limit and avoiding IP fragmentation. Slaves
+ * learn the id-to-name mapping from the periodic keyframes.
+ *
  * @param size The size of the data being serialized.
+ * @param onlyDirty If nonzero, only serialize records whose value has
+ * changed since the last time their dirty flag was cleared.
  * @return A serialized array of bytes (to be free()'d by the caller)
 */
-char* dgr_serialize(int *size)
+static char* dgr_serialize_records(int *size, int onlyDirty)
 {
-	int spaceNeeded = 0;
+	int spaceNeeded = DGR_WIRE_HEADER_BYTES;
+	int recordCount = 0;
 	for(int i=0; i<dgr_list_size; i++)
-		spaceNeeded += strlen(dgr_list[i].name)+1+sizeof(int)+dgr_list[i].size;
+	{
+		/* Bulk records travel over the chunked bulk channel; putting
+		 * them in a keyframe/delta would blow past the MTU. */
+		if(dgr_list[i].bulk)
+			continue;
+		if(onlyDirty && !dgr_list[i].dirty)
+			continue;
+		recordCount++;
+		spaceNeeded += sizeof(uint16_t)+sizeof(int)+dgr_list[i].size;
+		if(!onlyDirty)
+			spaceNeeded += sizeof(uint16_t)+strlen(dgr_list[i].name);
+	}
+	/* An empty delta isn't worth sending. A keyframe is sent even when
+	 * it carries no records (e.g. every record is bulk) because the
+	 * periodic keyframes double as the heartbeat slaves watch for. */
+	if(recordCount == 0 && onlyDirty)
+	{
+		*size = 0;
+		return NULL;
+	}
 	*size = spaceNeeded;
 
-	if(spaceNeeded == 0)
-		return NULL;
-	
 	char *serialized = malloc(spaceNeeded);
 	char *ptr = serialized;
+	*ptr++ = 'D';
+	*ptr++ = 'G';
+	*ptr++ = 'R';
+	*ptr++ = DGR_WIRE_VERSION;
+	*ptr++ = onlyDirty ? DGR_PACKET_DELTA : DGR_PACKET_KEYFRAME;
 	for(int i=0; i<dgr_list_size; i++)
 	{
-		int bytesPrinted = sprintf(ptr, "%s", dgr_list[i].name);
-		ptr += bytesPrinted+1; // extra byte for null terminated string.
+		if(dgr_list[i].bulk)
+			continue;
+		if(onlyDirty && !dgr_list[i].dirty)
+			continue;
+		uint16_t id = (uint16_t) i;
+		memcpy(ptr, &id, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		if(!onlyDirty)
+		{
+			uint16_t nameLen = (uint16_t) strlen(dgr_list[i].name);
+			memcpy(ptr, &nameLen, sizeof(uint16_t));
+			ptr += sizeof(uint16_t);
+			memcpy(ptr, dgr_list[i].name, nameLen);
+			ptr += nameLen;
+		}
 		memcpy(ptr, &(dgr_list[i].size), sizeof(int));
 		ptr += sizeof(int);
 		memcpy(ptr, dgr_list[i].buffer, dgr_list[i].size);
@@ -403,6 +647,17 @@ char* dgr_serialize(int *size)
 	return serialized;
 }
 
+/** Serializes every DGR record as a keyframe packet. Kept for callers
+ * that want a full snapshot of the list.
+
+ @param size The size of the data being serialized.
+ @return A serialized array of bytes (to be free()'d by the caller)
+*/
+char* dgr_serialize(int *size)
+{
+	return dgr_serialize_records(size, 0);
+}
+
 
 /** Unserializes serialized data and stores it in our global dgr_list
  * variable. We do not blow away the list, instead we just update the
@@ -413,84 +668,952 @@ char* dgr_serialize(int *size)
  **/
 static void dgr_unserialize(int size, const char *serialized)
 {
-	const char *ptr = serialized;
+	if(size < DGR_WIRE_HEADER_BYTES ||
+	   serialized[0] != 'D' || serialized[1] != 'G' || serialized[2] != 'R')
+	{
+		msgd("dgr", ERROR, "DGR Slave: Received a packet without a DGR header. Is the master running an older version of DGR?\n");
+		return;
+	}
+	if(serialized[3] != DGR_WIRE_VERSION)
+	{
+		msgd("dgr", ERROR, "DGR Slave: Received a packet with wire format version %d but we use version %d. Are the master and slave running different versions of DGR?\n", serialized[3], DGR_WIRE_VERSION);
+		return;
+	}
+	if(serialized[4] != DGR_PACKET_KEYFRAME && serialized[4] != DGR_PACKET_DELTA)
+		return; // bulk packets are dispatched by dgr_receive(), not here.
+	int isKeyframe = (serialized[4] == DGR_PACKET_KEYFRAME);
 
+	const char *ptr = serialized + DGR_WIRE_HEADER_BYTES;
 	while(ptr < serialized + size)
 	{
-		int c = 0;
+		uint16_t id;
+		memcpy(&id, ptr, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+
 		char name[1024];
-		while(*ptr != 0)
+		if(isKeyframe)
 		{
-			name[c++] = *ptr;
-			ptr++;
+			uint16_t nameLen;
+			memcpy(&nameLen, ptr, sizeof(uint16_t));
+			ptr += sizeof(uint16_t);
+			if(nameLen > sizeof(name)-1)
+			{
+				msgd("dgr", ERROR, "DGR Slave: Received a record with an unreasonably long name; discarding the rest of the packet.\n");
+				return;
+			}
+			memcpy(name, ptr, nameLen);
+			name[nameLen] = '\0';
+			ptr += nameLen;
 		}
-		name[c++] = '\0';
-		ptr++;
 		// printf("unserialized: %s\n", name);
 
-		int size = 0;
-		memcpy(&size, ptr, sizeof(int));
+		int recSize = 0;
+		memcpy(&recSize, ptr, sizeof(int));
 		ptr += sizeof(int);
 
-		dgr_set(name, ptr, size);
-		ptr += size;
+		if(isKeyframe)
+		{
+			dgr_set(name, ptr, recSize);
+			if(id < DGR_MAX_LIST_SIZE)
+				dgr_id_to_index[id] = dgr_findIndex(name);
+		}
+		else
+		{
+			/* A delta may carry an id we haven't seen a keyframe for
+			 * yet (e.g., this slave just started). Skip the record; a
+			 * keyframe containing it is at most DGR_KEYFRAME_SECONDS
+			 * away. */
+			int index = (id < DGR_MAX_LIST_SIZE) ? dgr_id_to_index[id] : -1;
+			if(index != -1)
+				dgr_set(dgr_list[index].name, ptr, recSize);
+		}
+		ptr += recSize;
+	}
+}
+
+
+/* --- Reliable bulk channel ----------------------------------------
+
+   Records larger than DGR_BULK_THRESHOLD don't fit in a datagram, so
+   they are split into self-describing chunks: every chunk carries the
+   record name, the transfer id, the total size and the chunk count,
+   letting a slave begin reassembly from whichever chunk arrives
+   first. When a transfer stalls (chunks lost), the slave sends a NACK
+   listing the missing chunk indices back to the address the chunks
+   came from, and the master retransmits just those chunks. A
+   completed transfer is stored with dgr_set(), so slaves pick bulk
+   records up with the normal dgr_setget() call.
+
+   Slaves which join late (or miss an entire transfer) are handled the
+   same way keyframes handle ordinary records: every keyframe, the
+   master re-sends chunk 0 of each bulk record as an announcement. A
+   slave that has already completed that transfer ignores it; any
+   other slave starts a reassembly from it and NACKs the rest of the
+   chunks into existence.
+
+   After the 5-byte packet header, a BULK_CHUNK packet is:
+
+   A 32-bit transfer id (a new id is assigned each time the record changes).<br>
+   A 16-bit name length followed by the record name (no null terminator).<br>
+   A 32-bit total record size in bytes.<br>
+   A 16-bit chunk count and a 16-bit chunk index.<br>
+   A 16-bit data length followed by the chunk's data.<br>
+
+   A BULK_NACK packet is the same through the name, then a 16-bit
+   count of missing chunk indices followed by that many 16-bit
+   indices. */
+
+/** The transfer id handed to the next bulk send. */
+static uint32_t dgr_bulk_next_transfer = 0;
+
+#ifndef __MINGW32__
+/** One in-progress bulk transfer being reassembled on a slave. */
+typedef struct {
+	int active;          /**< Is this slot reassembling a transfer? */
+	char name[1024];     /**< Name of the record being transferred */
+	uint32_t transferId; /**< The transfer this slot is reassembling */
+	uint32_t totalSize;  /**< Total bytes of the record */
+	uint16_t chunkCount; /**< Number of chunks in the transfer */
+	uint16_t haveCount;  /**< Number of distinct chunks received so far */
+	char *buffer;        /**< Reassembly buffer, totalSize bytes */
+	unsigned char *have; /**< One flag per chunk */
+	double lastChunkMs;  /**< When the most recent chunk arrived */
+	double lastNackMs;   /**< When we last asked for retransmits */
+	struct sockaddr_storage src; /**< Where the chunks came from; NACKs are sent here */
+	socklen_t srcLen;
+} dgr_bulk_transfer;
+/** Transfers currently being reassembled (slave only). */
+static dgr_bulk_transfer dgr_bulk_in[DGR_BULK_MAX_TRANSFERS];
+
+/** Slave: the source address of the most recent packet we received.
+ * Anything a slave needs to send back to the master (swap-ready
+ * messages) goes here; in relayed setups this is the relay, which
+ * forwards it on to the master. */
+static struct sockaddr_storage dgr_reply_addr;
+static socklen_t dgr_reply_addr_len = 0;
+
+/* Swap-lock state. The master numbers its release packets; slaves echo
+ * the number of the last release they saw in their ready packets, which
+ * lets the master ignore ready messages left over from an earlier
+ * barrier. */
+static uint32_t dgr_swap_release_frame = 0; /**< Master: count of releases sent. Slave: last release seen. */
+static int dgr_swap_ready_count = 0;          /**< Master: slaves ready for the current barrier. */
+static double dgr_swap_first_ready_ms = 0;    /**< Master: when the first ready message arrived. */
+static double dgr_swap_last_ready_ms = 0;     /**< Master: when the most recent ready message arrived. */
+
+/** The current time in milliseconds, for bulk retransmit timing. */
+static double dgr_now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+/** Sends one chunk of a bulk record to the usual DGR destination. */
+static void dgr_bulk_send_chunk(const dgr_record *rec, uint16_t chunkIndex, uint16_t chunkCount)
+{
+	char packet[DGR_WIRE_HEADER_BYTES + 4+2+1024 + 4+2+2+2 + DGR_BULK_CHUNK_BYTES];
+	char *ptr = packet;
+	*ptr++ = 'D';
+	*ptr++ = 'G';
+	*ptr++ = 'R';
+	*ptr++ = DGR_WIRE_VERSION;
+	*ptr++ = DGR_PACKET_BULK_CHUNK;
+	memcpy(ptr, &(rec->transferId), sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	uint16_t nameLen = (uint16_t) strlen(rec->name);
+	memcpy(ptr, &nameLen, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	memcpy(ptr, rec->name, nameLen);
+	ptr += nameLen;
+	uint32_t totalSize = (uint32_t) rec->size;
+	memcpy(ptr, &totalSize, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	memcpy(ptr, &chunkCount, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	memcpy(ptr, &chunkIndex, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	uint32_t offset = (uint32_t) chunkIndex * DGR_BULK_CHUNK_BYTES;
+	uint16_t dataBytes = DGR_BULK_CHUNK_BYTES;
+	if(offset + dataBytes > totalSize)
+		dataBytes = totalSize - offset;
+	memcpy(ptr, &dataBytes, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	memcpy(ptr, (char*)rec->buffer + offset, dataBytes);
+	ptr += dataBytes;
+
+	if(sendto(dgr_socket, packet, ptr-packet, 0,
+	          dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen) == -1)
+	{
+		msgd("dgr", FATAL, "DGR Master: sendto: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	dgr_stat_bytes += ptr-packet;
+	dgr_stat_packets++;
+}
+
+/** Starts a new bulk transfer of a record, sending every chunk once.
+ * Lost chunks are repaired later when the slaves NACK them. */
+static void dgr_bulk_send_record(dgr_record *rec)
+{
+	int chunkCount = (rec->size + DGR_BULK_CHUNK_BYTES - 1) / DGR_BULK_CHUNK_BYTES;
+	if(chunkCount > 65535)
+	{
+		msgd("dgr", ERROR, "DGR Master: Record '%s' is %d bytes which exceeds the %d byte bulk transfer limit; not sending it.\n",
+		    rec->name, rec->size, 65535*DGR_BULK_CHUNK_BYTES);
+		return;
+	}
+	rec->transferId = ++dgr_bulk_next_transfer;
+	msgd("dgr", DEBUG, "DGR Master: Sending '%s' (%d bytes) as %d bulk chunks (transfer %u).\n",
+	    rec->name, rec->size, chunkCount, rec->transferId);
+	for(int i=0; i<chunkCount; i++)
+		dgr_bulk_send_chunk(rec, (uint16_t) i, (uint16_t) chunkCount);
+}
+
+/** Master: drains any packets the slaves have sent back to our
+ * socket. NACKs get their missing bulk chunks retransmitted; stale
+ * NACKs (for a transfer that has since been replaced) are ignored,
+ * and the slave will re-request against the new transfer on its
+ * own. Swap-ready messages for the current barrier are tallied for
+ * dgr_swap_barrier(). */
+static void dgr_master_poll_replies(void)
+{
+	while(1)
+	{
+		struct pollfd fds;
+		fds.fd = dgr_socket;
+		fds.events = POLLIN;
+		if(poll(&fds, 1, 0) <= 0)
+			return;
+
+		char packet[2048];
+		int numbytes = recvfrom(dgr_socket, packet, sizeof(packet), 0, NULL, NULL);
+		if(numbytes < DGR_WIRE_HEADER_BYTES + 4 ||
+		   packet[0] != 'D' || packet[1] != 'G' || packet[2] != 'R' ||
+		   packet[3] != DGR_WIRE_VERSION)
+			continue;
+
+		if(packet[4] == DGR_PACKET_SWAP_READY)
+		{
+			/* Only count ready messages from slaves which have seen our
+			 * most recent release; anything else is left over from an
+			 * earlier barrier. */
+			uint32_t seenRelease;
+			memcpy(&seenRelease, packet + DGR_WIRE_HEADER_BYTES, sizeof(uint32_t));
+			if(seenRelease == dgr_swap_release_frame)
+			{
+				if(dgr_swap_ready_count == 0)
+					dgr_swap_first_ready_ms = dgr_now_ms();
+				dgr_swap_last_ready_ms = dgr_now_ms();
+				dgr_swap_ready_count++;
+			}
+			continue;
+		}
+
+		if(packet[4] != DGR_PACKET_BULK_NACK ||
+		   numbytes < DGR_WIRE_HEADER_BYTES + 6)
+			continue;
+		const char *ptr = packet + DGR_WIRE_HEADER_BYTES;
+		const char *end = packet + numbytes;
+
+		uint32_t transferId;
+		memcpy(&transferId, ptr, sizeof(uint32_t));
+		ptr += sizeof(uint32_t);
+		uint16_t nameLen;
+		memcpy(&nameLen, ptr, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		if(nameLen > 1023 || ptr+nameLen+sizeof(uint16_t) > end)
+			continue;
+		char name[1024];
+		memcpy(name, ptr, nameLen);
+		name[nameLen] = '\0';
+		ptr += nameLen;
+
+		int index = dgr_findIndex(name);
+		if(index == -1 || !dgr_list[index].bulk ||
+		   dgr_list[index].transferId != transferId)
+			continue;
+		dgr_record *rec = &(dgr_list[index]);
+		uint16_t chunkCount = (uint16_t)((rec->size + DGR_BULK_CHUNK_BYTES - 1) / DGR_BULK_CHUNK_BYTES);
+
+		uint16_t missingCount;
+		memcpy(&missingCount, ptr, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		for(int m=0; m<missingCount && ptr+sizeof(uint16_t) <= end; m++)
+		{
+			uint16_t chunkIndex;
+			memcpy(&chunkIndex, ptr, sizeof(uint16_t));
+			ptr += sizeof(uint16_t);
+			if(chunkIndex < chunkCount)
+				dgr_bulk_send_chunk(rec, chunkIndex, chunkCount);
+		}
+	}
+}
+
+/** Slave: handles one received bulk chunk, starting or continuing a
+ * reassembly. A completed transfer is stored into the record list
+ * with dgr_set() so it appears in the normal namespace. */
+static void dgr_bulk_receive_chunk(const char *packet, int size, const struct sockaddr *src, socklen_t srcLen)
+{
+	const char *ptr = packet + DGR_WIRE_HEADER_BYTES;
+	const char *end = packet + size;
+
+	if(ptr + 6 > end)
+		return;
+	uint32_t transferId;
+	memcpy(&transferId, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	uint16_t nameLen;
+	memcpy(&nameLen, ptr, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	if(nameLen > 1023 || ptr+nameLen+10 > end)
+		return;
+	char name[1024];
+	memcpy(name, ptr, nameLen);
+	name[nameLen] = '\0';
+	ptr += nameLen;
+	uint32_t totalSize;
+	memcpy(&totalSize, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	uint16_t chunkCount, chunkIndex, dataBytes;
+	memcpy(&chunkCount, ptr, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	memcpy(&chunkIndex, ptr, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	memcpy(&dataBytes, ptr, sizeof(uint16_t));
+	ptr += sizeof(uint16_t);
+	uint32_t offset = (uint32_t) chunkIndex * DGR_BULK_CHUNK_BYTES;
+	if(chunkCount == 0 || chunkIndex >= chunkCount ||
+	   offset + dataBytes > totalSize || ptr + dataBytes > end)
+	{
+		msgd("dgr", ERROR, "DGR Slave: Received a malformed bulk chunk; discarding it.\n");
+		return;
+	}
+
+	/* Keyframe announcements re-send chunk 0 of transfers we may have
+	 * already completed; ignore anything we already have. */
+	int recordIndex = dgr_findIndex(name);
+	if(recordIndex != -1 && dgr_list[recordIndex].transferId >= transferId)
+		return;
+
+	/* Find the reassembly slot for this record (or a free one). */
+	dgr_bulk_transfer *t = NULL;
+	int freeSlot = -1;
+	for(int i=0; i<DGR_BULK_MAX_TRANSFERS; i++)
+	{
+		if(dgr_bulk_in[i].active && strcmp(dgr_bulk_in[i].name, name) == 0)
+		{
+			t = &(dgr_bulk_in[i]);
+			break;
+		}
+		if(!dgr_bulk_in[i].active && freeSlot == -1)
+			freeSlot = i;
+	}
+
+	if(t != NULL && t->transferId != transferId)
+	{
+		/* The record changed on the master mid-transfer; drop the old
+		 * reassembly and start over with the newer transfer. Chunks
+		 * from transfers older than the one in progress are stale. */
+		if(transferId < t->transferId)
+			return;
+		free(t->buffer);
+		free(t->have);
+		t->active = 0;
+	}
+	if(t == NULL || !t->active)
+	{
+		if(t == NULL)
+		{
+			if(freeSlot == -1)
+			{
+				msgd("dgr", WARNING, "DGR Slave: Too many simultaneous bulk transfers; dropping a chunk of '%s'.\n", name);
+				return;
+			}
+			t = &(dgr_bulk_in[freeSlot]);
+		}
+		t->active = 1;
+		sprintf(t->name, "%s", name);
+		t->transferId = transferId;
+		t->totalSize = totalSize;
+		t->chunkCount = chunkCount;
+		t->haveCount = 0;
+		t->buffer = malloc(totalSize);
+		t->have = calloc(chunkCount, 1);
+		t->lastNackMs = 0;
+	}
+	else if(t->totalSize != totalSize || t->chunkCount != chunkCount)
+	{
+		msgd("dgr", ERROR, "DGR Slave: Bulk chunk of '%s' disagrees with the transfer in progress; discarding it.\n", name);
+		return;
+	}
+
+	memcpy(&(t->src), src, srcLen);
+	t->srcLen = srcLen;
+	t->lastChunkMs = dgr_now_ms();
+
+	if(!t->have[chunkIndex])
+	{
+		t->have[chunkIndex] = 1;
+		t->haveCount++;
+		memcpy(t->buffer + offset, ptr, dataBytes);
+	}
+
+	if(t->haveCount == t->chunkCount)
+	{
+		dgr_set(t->name, t->buffer, t->totalSize);
+		/* Remember which transfer this record came from so keyframe
+		 * announcements of the same transfer don't restart it. */
+		recordIndex = dgr_findIndex(t->name);
+		if(recordIndex != -1)
+			dgr_list[recordIndex].transferId = t->transferId;
+		msgd("dgr", DEBUG, "DGR Slave: Completed bulk transfer of '%s' (%u bytes, %u chunks).\n",
+		    t->name, t->totalSize, t->chunkCount);
+		free(t->buffer);
+		free(t->have);
+		t->active = 0;
 	}
 }
 
+/** Slave: asks the sender to retransmit the missing chunks of any
+ * transfer that has stalled. The NACK goes to the address the chunks
+ * came from, so it reaches the master directly in multicast/direct
+ * setups and reaches the relay (which forwards it to the master) in
+ * relayed setups. Transfers that stay silent for ten seconds are
+ * abandoned. */
+static void dgr_bulk_request_missing(void)
+{
+	double now = dgr_now_ms();
+	for(int i=0; i<DGR_BULK_MAX_TRANSFERS; i++)
+	{
+		dgr_bulk_transfer *t = &(dgr_bulk_in[i]);
+		if(!t->active)
+			continue;
+		if(now - t->lastChunkMs > 10000)
+		{
+			msgd("dgr", WARNING, "DGR Slave: Abandoning stalled bulk transfer of '%s' (%u of %u chunks received).\n",
+			    t->name, t->haveCount, t->chunkCount);
+			free(t->buffer);
+			free(t->have);
+			t->active = 0;
+			continue;
+		}
+		/* Wait for the burst of chunks to settle before concluding
+		 * anything is missing, and don't repeat NACKs too quickly. */
+		if(now - t->lastChunkMs < 50 || now - t->lastNackMs < 100)
+			continue;
+
+		char packet[DGR_WIRE_HEADER_BYTES + 4+2+1024 + 2 + 2*DGR_BULK_NACK_MAX];
+		char *ptr = packet;
+		*ptr++ = 'D';
+		*ptr++ = 'G';
+		*ptr++ = 'R';
+		*ptr++ = DGR_WIRE_VERSION;
+		*ptr++ = DGR_PACKET_BULK_NACK;
+		memcpy(ptr, &(t->transferId), sizeof(uint32_t));
+		ptr += sizeof(uint32_t);
+		uint16_t nameLen = (uint16_t) strlen(t->name);
+		memcpy(ptr, &nameLen, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		memcpy(ptr, t->name, nameLen);
+		ptr += nameLen;
+		char *missingCountPtr = ptr; // filled in below
+		ptr += sizeof(uint16_t);
+		uint16_t missingCount = 0;
+		for(uint16_t c=0; c<t->chunkCount && missingCount < DGR_BULK_NACK_MAX; c++)
+		{
+			if(t->have[c])
+				continue;
+			memcpy(ptr, &c, sizeof(uint16_t));
+			ptr += sizeof(uint16_t);
+			missingCount++;
+		}
+		memcpy(missingCountPtr, &missingCount, sizeof(uint16_t));
+
+		if(sendto(dgr_socket, packet, ptr-packet, 0,
+		          (struct sockaddr*) &(t->src), t->srcLen) == -1)
+			msgd("dgr", WARNING, "DGR Slave: Failed to send bulk NACK: %s", strerror(errno));
+		else
+			t->lastNackMs = now;
+	}
+}
+#endif // __MINGW32__
+
 
 /** Prints a list of variables that DGR is aware of. */
 void dgr_print_list(void)
 {
 	if(dgr_disabled)
 	{
-		msg(DEBUG, "DGR is disabled or not initialized correctly.\n");
+		msgd("dgr", DEBUG, "DGR is disabled or not initialized correctly.\n");
 		return;
 	}
-	msg(DEBUG, "Current DGR list (index, size, buffer, name):\n");
+	msgd("dgr", DEBUG, "Current DGR list (index, size, buffer, name):\n");
 	for(int i=0; i<dgr_list_size; i++)
 	{
 		dgr_record *r = &(dgr_list[i]);
-		msg(DEBUG, "%3d %5d %p %s\n", i, r->size, r->buffer, r->name);
+		msgd("dgr", DEBUG, "%3d %5d %p %s\n", i, r->size, r->buffer, r->name);
 	}
 	if(dgr_list_size == 0)
-		msg(DEBUG, "[ the list is empty ]\n");
+		msgd("dgr", DEBUG, "[ the list is empty ]\n");
 }
 
-/** Serializes and sends DGR data out across a network. */
+/** Returns a snapshot of the master's DGR bandwidth statistics,
+ * suitable for an on-screen HUD. The numbers describe the most recent
+ * completed one-second measurement window and are all 0 on a slave,
+ * when DGR is disabled, or before the first window completes.
+ *
+ * @param bytesPerSec To be filled in with bytes sent per second
+ * (keyframe, delta, and bulk packets). NULL to skip.
+ *
+ * @param packetsPerSec To be filled in with packets sent per
+ * second. NULL to skip.
+ *
+ * @param recordsPerPacket To be filled in with the average number of
+ * records carried per keyframe/delta packet. NULL to skip.
+ *
+ * @param lagMs To be filled in with the average time (milliseconds)
+ * between the oldest change coalesced into a packet and the moment
+ * the packet was sent---an estimate of the lag that send-rate control
+ * (DGR_SEND_HZ) adds to the slaves' view of the data. NULL to skip.
+ */
+void dgr_stats(float *bytesPerSec, float *packetsPerSec,
+               float *recordsPerPacket, float *lagMs)
+{
+	if(bytesPerSec != NULL)
+		*bytesPerSec = dgr_snap_bytes_sec;
+	if(packetsPerSec != NULL)
+		*packetsPerSec = dgr_snap_packets_sec;
+	if(recordsPerPacket != NULL)
+		*recordsPerPacket = dgr_snap_records_packet;
+	if(lagMs != NULL)
+		*lagMs = dgr_snap_lag_ms;
+}
+
+/** Prints the statistics that dgr_stats() reports, in the style of
+ * dgr_print_list(). Useful when sizing the network for a new
+ * installation. */
+void dgr_print_stats(void)
+{
+	if(dgr_disabled)
+	{
+		msgd("dgr", DEBUG, "DGR is disabled or not initialized correctly.\n");
+		return;
+	}
+	if(!dgr_mode)
+	{
+		msgd("dgr", DEBUG, "DGR bandwidth statistics are only collected on the master.\n");
+		return;
+	}
+	msgd("dgr", DEBUG, "DGR Master: %.1f kbytes/sec, %.1f packets/sec, %.1f records/packet, %.1f ms coalescing lag\n",
+	     dgr_snap_bytes_sec/1024.0, dgr_snap_packets_sec,
+	     dgr_snap_records_packet, dgr_snap_lag_ms);
+}
+
+#ifndef __MINGW32__
+/** Closes out the one-second statistics window if it has elapsed:
+ * snapshots the per-second rates for dgr_stats() and resets the
+ * counters. */
+static void dgr_stats_roll(double now)
+{
+	if(dgr_stat_window_ms == 0)
+		dgr_stat_window_ms = now;
+	if(now - dgr_stat_window_ms < 1000)
+		return;
+
+	double seconds = (now - dgr_stat_window_ms) / 1000.0;
+	dgr_snap_bytes_sec = dgr_stat_bytes / seconds;
+	dgr_snap_packets_sec = dgr_stat_packets / seconds;
+	/* Only keyframe/delta packets carry records; don't let bulk
+	 * chunks drag the average down. */
+	if(dgr_stat_record_packets > 0)
+		dgr_snap_records_packet = (float)dgr_stat_records / dgr_stat_record_packets;
+	else
+		dgr_snap_records_packet = 0;
+	dgr_snap_lag_ms = dgr_stat_lag_count > 0 ?
+		dgr_stat_lag_sum / dgr_stat_lag_count : 0;
+
+	dgr_stat_window_ms = now;
+	dgr_stat_bytes = 0;
+	dgr_stat_packets = 0;
+	dgr_stat_records = 0;
+	dgr_stat_record_packets = 0;
+	dgr_stat_lag_sum = 0;
+	dgr_stat_lag_count = 0;
+}
+#endif
+
+/** Minimum number of seconds between full-state keyframe packets. */
+#define DGR_KEYFRAME_SECONDS 1
+
+/** Serializes and sends DGR data out across a network. Most packets
+ * are deltas which carry only the records that changed since the last
+ * send. A full-state keyframe is sent periodically so that slaves
+ * which join late (or miss a delta packet) converge on the complete
+ * list. */
 static void dgr_send(void)
 {
 #ifndef __MINGW32__
 	if(dgr_disabled)
 		return;
 
-	int  bufSize = 0;
-	char *buf = dgr_serialize(&bufSize);
-	
-	// no need to send an empty packet.
-	if(bufSize == 0 || dgr_list_size == 0)
+	/* Parse DGR_SEND_HZ the first time we are called. */
+	if(dgr_send_hz < 0)
+	{
+		dgr_send_hz = 0;
+		const char *hzString = getenv("DGR_SEND_HZ");
+		if(hzString != NULL)
+			dgr_send_hz = atoi(hzString);
+		if(dgr_send_hz < 0)
+			dgr_send_hz = 0;
+		if(dgr_send_hz > 0)
+			msgd("dgr", INFO, "DGR Master: Limiting sends to %d packets per second (DGR_SEND_HZ).\n", dgr_send_hz);
+	}
+
+	double now = dgr_now_ms();
+	dgr_stats_roll(now);
+
+	/* Rate control: if it isn't time to send yet, don't. Changed
+	 * records stay dirty, so the changes from several frames coalesce
+	 * into the next packet we do send. Keep servicing bulk retransmit
+	 * requests so NACKed chunks are not delayed by a frame. A forced
+	 * keyframe (e.g., the record list was reset) goes out
+	 * immediately. */
+	if(dgr_send_hz > 0 && !dgr_force_keyframe && now < dgr_send_next_ms)
+	{
+		dgr_master_poll_replies();
 		return;
-	
-	/* If the message is too large to send, sendto() will not send the
-	 * message, and will set errno to EMSGSIZE. The MTU may limit the
-	 * amount of data that we can send. With an MTU of 1500, we can
-	 * only expect to send 1472 bytes. Even with the small MTU, the
-	 * system may still allow us to send larger UDP packets due to
-	 * IPv4 fragmentation. */
-	int numbytes;
-	if((numbytes = sendto(dgr_socket, buf, bufSize, 0,
-	                      dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen)) == -1) {
-		msg(FATAL, "DGR Master: sendto: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	}
+	if(dgr_send_hz > 0)
+	{
+		double period = 1000.0/dgr_send_hz;
+		dgr_send_next_ms += period;
+		/* If we fell far behind (e.g. a long frame), resynchronize
+		 * instead of sending a burst of packets to catch up. */
+		if(dgr_send_next_ms < now)
+			dgr_send_next_ms = now + period;
+	}
+
+	/* Send a keyframe containing every record at least every
+	 * DGR_KEYFRAME_SECONDS. The keyframes also act as a heartbeat:
+	 * slaves exit if they stop receiving packets, even when no
+	 * variables are changing. */
+	static time_t dgr_time_lastkeyframe = 0;
+	int keyframe = 0;
+	if(dgr_force_keyframe ||
+	   time(NULL) - dgr_time_lastkeyframe >= DGR_KEYFRAME_SECONDS)
+	{
+		keyframe = 1;
+		dgr_force_keyframe = 0;
+		dgr_time_lastkeyframe = time(NULL);
+	}
+
+	if(dgr_list_size == 0)
+		return;
+
+	/* Count the records this packet will carry (the same records
+	 * dgr_serialize_records() selects) for the statistics. */
+	int recordCount = 0;
+	for(int i=0; i<dgr_list_size; i++)
+		if(!dgr_list[i].bulk && (keyframe || dgr_list[i].dirty))
+			recordCount++;
+
+	int  bufSize = 0;
+	char *buf = dgr_serialize_records(&bufSize, !keyframe);
+
+	// no need to send an empty packet (i.e., a delta when nothing changed).
+	if(bufSize > 0)
+	{
+		/* If the message is too large to send, sendto() will not send the
+		 * message, and will set errno to EMSGSIZE. The MTU may limit the
+		 * amount of data that we can send. With an MTU of 1500, we can
+		 * only expect to send 1472 bytes. Even with the small MTU, the
+		 * system may still allow us to send larger UDP packets due to
+		 * IPv4 fragmentation. */
+		int numbytes;
+		if((numbytes = sendto(dgr_socket, buf, bufSize, 0,
+		                      dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen)) == -1) {
+			msgd("dgr", FATAL, "DGR Master: sendto: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if(numbytes != bufSize) // double check that everything got sent
+		{
+			msgd("dgr", FATAL, "DGR Master: Error sending all of the bytes in the message.");
+			exit(EXIT_FAILURE);
+		}
+		dgr_stat_bytes += numbytes;
+		dgr_stat_packets++;
+		dgr_stat_record_packets++;
+		dgr_stat_records += recordCount;
 	}
 	free(buf);
-	if(numbytes != bufSize) // double check that everything got sent
+
+	/* Records too large for keyframe/delta packets go out over the
+	 * reliable chunked bulk channel when they change. On keyframes,
+	 * unchanged bulk records are re-announced with a single chunk so
+	 * that slaves which joined late (or lost every chunk of a
+	 * transfer) discover them and NACK the missing pieces. */
+	for(int i=0; i<dgr_list_size; i++)
 	{
-		msg(FATAL, "DGR Master: Error sending all of the bytes in the message.");
-		exit(EXIT_FAILURE);
+		if(!dgr_list[i].bulk)
+			continue;
+		if(dgr_list[i].dirty)
+			dgr_bulk_send_record(&(dgr_list[i]));
+		else if(keyframe && dgr_list[i].transferId != 0)
+		{
+			uint16_t chunkCount = (uint16_t)((dgr_list[i].size + DGR_BULK_CHUNK_BYTES - 1) / DGR_BULK_CHUNK_BYTES);
+			dgr_bulk_send_chunk(&(dgr_list[i]), 0, chunkCount);
+		}
+	}
+
+	/* Retransmit any bulk chunks the slaves reported missing. */
+	dgr_master_poll_replies();
+
+	/* Everything in the packet we just sent is now known to the
+	 * slaves; don't resend it until it changes again. */
+	for(int i=0; i<dgr_list_size; i++)
+		dgr_list[i].dirty = 0;
+
+	/* Record how stale the oldest coalesced change was when it
+	 * finally went out. */
+	if(dgr_oldest_dirty_ms > 0)
+	{
+		dgr_stat_lag_sum += now - dgr_oldest_dirty_ms;
+		dgr_stat_lag_count++;
+		dgr_oldest_dirty_ms = 0;
 	}
 #endif // __MINGW32__
 }
 
+#ifndef __MINGW32__
+/* --- Threaded receive ---------------------------------------------
+
+   Reading the socket inline in dgr_update() puts poll() and
+   recvfrom() on the render thread, so a packet burst or a kernel
+   scheduling delay shows up directly as frame jitter on the wall.
+   Instead, a receiver thread blocks in recvfrom() continuously and
+   appends each datagram to one of two packet buffers; dgr_update()
+   flips which buffer the thread fills (a couple of assignments under
+   a mutex) and then unserializes the drained packets on the render
+   thread. Because the receiver thread never touches dgr_list, record
+   resolution through dgr_setget() stays single-threaded and needs no
+   locking.
+
+   The thread parses swap-release packets itself (publishing the
+   release number for dgr_swap_barrier() to wait on) since those are
+   acted on outside of dgr_update(); everything else is applied in
+   arrival order during the flip, exactly like the synchronous path.
+
+   The thread is started by dgr_init_slave(); set DGR_SYNC_RECEIVE to
+   get the old inline behavior. */
+
+/** One received datagram waiting to be applied by the render thread. */
+typedef struct
+{
+	char *data;    /**< The packet bytes (allocated by the receiver thread) */
+	int size;      /**< Number of bytes in 'data' */
+	double recvMs; /**< When the packet arrived (dgr_now_ms()) */
+	struct sockaddr_storage addr; /**< Who sent it (bulk NACKs go back here) */
+	socklen_t addr_len;
+} dgr_packet;
+
+/** Most packets either buffer may hold. If the render thread stalls
+ * long enough to hit this, the newest packets are dropped and counted;
+ * the next keyframe repairs whatever state the dropped deltas
+ * carried. */
+#define DGR_RECV_QUEUE_MAX 4096
+
+static dgr_packet *dgr_recv_buf[2] = { NULL, NULL };
+static int dgr_recv_count[2] = { 0, 0 };
+static int dgr_recv_capacity[2] = { 0, 0 };
+static int dgr_recv_write = 0; /**< Which buffer the receiver thread appends to */
+static int dgr_recv_thread_running = 0;
+static pthread_mutex_t dgr_recv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dgr_recv_cond = PTHREAD_COND_INITIALIZER;
+/** Latest swap release the receiver thread has parsed (see
+ * dgr_swap_barrier()). */
+static uint32_t dgr_swap_release_seen = 0;
+static long dgr_recv_packets = 0; /**< Total packets the thread has received */
+static long dgr_recv_dropped = 0; /**< Packets dropped because a buffer was full */
+
+/** The receiver thread: blocks in recvfrom() forever, queueing each
+ * datagram into the buffer the render thread isn't reading. */
+static void* dgr_receive_thread(void *unused)
+{
+	(void) unused;
+	char serialized[1024*1024];
+	while(1)
+	{
+		struct sockaddr_storage their_addr;
+		socklen_t addr_len = sizeof their_addr;
+		int numbytes;
+		if ((numbytes = recvfrom(dgr_socket, serialized, sizeof(serialized), 0,
+		                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
+			msgd("dgr", FATAL, "recvfrom: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&dgr_recv_mutex);
+		dgr_recv_packets++;
+		dgr_time_lastreceive = time(NULL);
+		/* Remember who sent this so replies (swap-ready messages) can
+		 * be routed back. */
+		memcpy(&dgr_reply_addr, &their_addr, addr_len);
+		dgr_reply_addr_len = addr_len;
+
+		if(numbytes >= DGR_WIRE_HEADER_BYTES + (int)sizeof(uint32_t) &&
+		   serialized[0] == 'D' && serialized[1] == 'G' && serialized[2] == 'R' &&
+		   serialized[3] == DGR_WIRE_VERSION &&
+		   serialized[4] == DGR_PACKET_SWAP_RELEASE)
+		{
+			/* Swap releases are waited on by dgr_swap_barrier(), outside
+			 * of dgr_update(); publish them instead of queueing them. */
+			uint32_t releaseFrame;
+			memcpy(&releaseFrame, serialized + DGR_WIRE_HEADER_BYTES, sizeof(uint32_t));
+			if(releaseFrame > dgr_swap_release_seen)
+				dgr_swap_release_seen = releaseFrame;
+		}
+		else if(dgr_recv_count[dgr_recv_write] >= DGR_RECV_QUEUE_MAX)
+			dgr_recv_dropped++;
+		else
+		{
+			int w = dgr_recv_write;
+			if(dgr_recv_count[w] == dgr_recv_capacity[w])
+			{
+				dgr_recv_capacity[w] = dgr_recv_capacity[w] == 0 ? 64 : dgr_recv_capacity[w]*2;
+				dgr_recv_buf[w] = realloc(dgr_recv_buf[w],
+				                          sizeof(dgr_packet)*dgr_recv_capacity[w]);
+				if(dgr_recv_buf[w] == NULL)
+				{
+					msgd("dgr", FATAL, "DGR Slave: Failed to grow the receive packet buffer.\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			dgr_packet *pkt = &dgr_recv_buf[w][dgr_recv_count[w]++];
+			pkt->data = malloc(numbytes);
+			if(pkt->data == NULL)
+			{
+				msgd("dgr", FATAL, "DGR Slave: Failed to allocate space for a received packet.\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(pkt->data, serialized, numbytes);
+			pkt->size = numbytes;
+			pkt->recvMs = dgr_now_ms();
+			memcpy(&pkt->addr, &their_addr, sizeof(their_addr));
+			pkt->addr_len = addr_len;
+		}
+		pthread_cond_broadcast(&dgr_recv_cond);
+		pthread_mutex_unlock(&dgr_recv_mutex);
+	}
+	return NULL;
+}
+
+/** Starts the receiver thread. Called by dgr_init_slave(); if the
+ * thread can't be created, DGR falls back to reading the socket
+ * synchronously in dgr_update(). */
+static void dgr_receive_thread_start(void)
+{
+	pthread_t receiver;
+	if(pthread_create(&receiver, NULL, dgr_receive_thread, NULL) != 0)
+	{
+		msgd("dgr", WARNING, "DGR Slave: Failed to create the receiver thread; reading the socket on the render thread instead.\n");
+		return;
+	}
+	pthread_detach(receiver);
+	dgr_recv_thread_running = 1;
+	msgd("dgr", INFO, "DGR Slave: Receiving packets on a dedicated thread.\n");
+}
+
+/** The threaded counterpart of dgr_receive(): flips which buffer the
+ * receiver thread fills and applies the drained packets on the
+ * calling (render) thread. Keeps the same watchdog behavior as
+ * dgr_receive(): waits up to 10 seconds for the very first packet,
+ * and exits if an established stream goes quiet for 15 seconds. */
+static void dgr_receive_flip(void)
+{
+	pthread_mutex_lock(&dgr_recv_mutex);
+
+	if(dgr_time_lastreceive == 0) // wait for the master to come up
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 10;
+		while(dgr_time_lastreceive == 0)
+		{
+			if(pthread_cond_timedwait(&dgr_recv_cond, &dgr_recv_mutex, &deadline) == ETIMEDOUT)
+			{
+				pthread_mutex_unlock(&dgr_recv_mutex);
+				msgd("dgr", FATAL, "DGR Slave: dgr_update() never received anything and timed out (10 second timeout). Exiting...\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	else if(time(NULL) - dgr_time_lastreceive >= 15)
+	{
+		pthread_mutex_unlock(&dgr_recv_mutex);
+		msgd("dgr", FATAL, "DGR Slave: dgr_update() hasn't received packets within 15 seconds. We did receive one or more packets earlier. Did the master or relay die? Exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The flip: the receiver thread switches to filling the other
+	 * buffer and this thread owns the drained one until the next
+	 * flip. */
+	int readBuffer = dgr_recv_write;
+	dgr_recv_write = !dgr_recv_write;
+	pthread_mutex_unlock(&dgr_recv_mutex);
+
+	static long flips = 0;
+	static double latencySum = 0, latencyMax = 0, lastReport = 0;
+
+	/* How long did the oldest drained packet sit in the buffer before
+	 * this flip picked it up? */
+	if(dgr_recv_count[readBuffer] > 0)
+	{
+		double latency = dgr_now_ms() - dgr_recv_buf[readBuffer][0].recvMs;
+		latencySum += latency;
+		if(latency > latencyMax)
+			latencyMax = latency;
+		flips++;
+	}
+
+	/* Apply the packets in arrival order (see dgr_receive() for why
+	 * none may be skipped). */
+	for(int i=0; i<dgr_recv_count[readBuffer]; i++)
+	{
+		dgr_packet *pkt = &dgr_recv_buf[readBuffer][i];
+		if(pkt->size >= DGR_WIRE_HEADER_BYTES &&
+		   pkt->data[0] == 'D' && pkt->data[1] == 'G' && pkt->data[2] == 'R' &&
+		   pkt->data[3] == DGR_WIRE_VERSION &&
+		   pkt->data[4] == DGR_PACKET_BULK_CHUNK)
+			dgr_bulk_receive_chunk(pkt->data, pkt->size,
+			                       (struct sockaddr *)&pkt->addr, pkt->addr_len);
+		else
+			dgr_unserialize(pkt->size, pkt->data);
+		free(pkt->data);
+	}
+	dgr_recv_count[readBuffer] = 0;
+	dgr_bulk_request_missing();
+
+	/* Report sync health every few seconds, like the swap-lock does. */
+	if(lastReport == 0)
+		lastReport = dgr_now_ms();
+	if(dgr_now_ms() - lastReport >= 5000)
+	{
+		pthread_mutex_lock(&dgr_recv_mutex);
+		long received = dgr_recv_packets;
+		long dropped = dgr_recv_dropped;
+		pthread_mutex_unlock(&dgr_recv_mutex);
+		if(flips > 0)
+			msgd("dgr", INFO, "DGR Receive: %ld packets received (%ld dropped); packets waited %.2f ms on average (max %.2f ms) for a buffer flip.\n",
+			    received, dropped, latencySum/flips, latencyMax);
+		latencySum = 0;
+		latencyMax = 0;
+		flips = 0;
+		lastReport = dgr_now_ms();
+	}
+}
+#endif // __MINGW32__
+
 /** Receives DGR data from the network.
  *
  * @param timeout If timeout > 0, dgr_receive() will block for at most
@@ -510,7 +1633,7 @@ static void dgr_receive(int timeout)
 		int seconds = 15;
 		if(time(NULL) - dgr_time_lastreceive >= seconds)
 		{
-			msg(FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master or relay die? Exiting...\n", seconds);
+			msgd("dgr", FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master or relay die? Exiting...\n", seconds);
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -521,7 +1644,7 @@ static void dgr_receive(int timeout)
 	int retval = poll(&fds, 1, timeout);
 	if(retval == -1)
 	{
-		msg(FATAL, "poll(): %s", strerror(errno));
+		msgd("dgr", FATAL, "poll(): %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 	else if(retval == 0) // nothing to read within timeout value
@@ -529,9 +1652,12 @@ static void dgr_receive(int timeout)
 		/* If a non-zero timeout value was specified and we timed out, exit() */
 		if(timeout > 0)
 		{
-			msg(FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
+			msgd("dgr", FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
 			exit(EXIT_FAILURE);
 		}
+		/* Even with nothing to read, a stalled bulk transfer may need
+		 * to ask for retransmits. */
+		dgr_bulk_request_missing();
 		return;
 	}
 	
@@ -540,17 +1666,33 @@ static void dgr_receive(int timeout)
 
 	char serialized[1024*1024];
 	int numbytes;
-	/* Read packets until there are no more to read. This ensures that
-	 * we are always using the newest packet. For example, 5 packets
-	 * might arrive while the slave is rendering a scene. We want to
-	 * make sure that we use the newest packet. */
+	/* Read packets until there are no more to read. For example, 5
+	 * packets might arrive while the slave is rendering a scene. We
+	 * apply every packet in arrival order: delta packets carry only the
+	 * records that changed, so skipping an older packet would lose the
+	 * changes it carried (until the next keyframe repaired them). */
 	while(1)
 	{
 		if ((numbytes = recvfrom(dgr_socket, serialized, 1024*1024, 0,
 		                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-			msg(FATAL, "recvfrom: %s", strerror(errno));
+			msgd("dgr", FATAL, "recvfrom: %s", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+		/* Remember who sent this so replies (swap-ready messages) can
+		 * be routed back. */
+		memcpy(&dgr_reply_addr, &their_addr, addr_len);
+		dgr_reply_addr_len = addr_len;
+		/* Bulk chunks carry a sender address for NACKs and are
+		 * reassembled separately; everything else goes through the
+		 * normal record unserializer. */
+		if(numbytes >= DGR_WIRE_HEADER_BYTES &&
+		   serialized[0] == 'D' && serialized[1] == 'G' && serialized[2] == 'R' &&
+		   serialized[3] == DGR_WIRE_VERSION &&
+		   serialized[4] == DGR_PACKET_BULK_CHUNK)
+			dgr_bulk_receive_chunk(serialized, numbytes,
+			                       (struct sockaddr *)&their_addr, addr_len);
+		else
+			dgr_unserialize(numbytes, serialized);
 
 		// if there is nothing to read anymore from the socket, break out of loop.
 		struct pollfd fds;
@@ -561,8 +1703,233 @@ static void dgr_receive(int timeout)
 			break;
 	}
 	dgr_time_lastreceive = time(NULL);
-	
-	dgr_unserialize(numbytes, serialized);
+	dgr_bulk_request_missing();
+#endif // __MINGW32__
+}
+
+/** Software swap-lock: keeps the buffer swaps of every node in a DGR
+ * cluster aligned so that adjacent displays on a tiled wall flip in
+ * unison instead of tearing against each other when frame times
+ * diverge.
+ *
+ * Each slave sends the master a swap-ready message when it finishes
+ * rendering and then waits; once the master has heard from every
+ * slave (or its timeout expires) it broadcasts a release and
+ * everybody swaps. The timeout---DGR_SWAPLOCK_TIMEOUT milliseconds,
+ * 100 by default---means one slow or crashed node delays the wall
+ * briefly instead of stalling it. Enable the swap-lock by setting
+ * DGR_SWAPLOCK to the number of slaves on the master and to any value
+ * on the slaves.
+ *
+ * Call this just before swapping buffers; viewmat_end_frame() already
+ * does. When enabled, the master periodically logs how far apart the
+ * slaves' ready messages arrived so inter-node alignment can be
+ * monitored in production. Does nothing if DGR or the swap-lock is
+ * disabled. */
+void dgr_swap_barrier(void)
+{
+#ifndef __MINGW32__
+	if(dgr_disabled)
+		return;
+
+	if(dgr_mode == 1) // master
+	{
+		if(dgr_swaplock_slaves <= 0)
+			return;
+
+		static int timeouts = 0, barriers = 0;
+		static double skewSum = 0, skewMax = 0, lastReport = 0;
+
+		/* Wait for every slave to report ready (some may have reported
+		 * already, while we were rendering). */
+		double deadline = dgr_now_ms() + dgr_swaplock_timeout;
+		dgr_master_poll_replies();
+		while(dgr_swap_ready_count < dgr_swaplock_slaves)
+		{
+			double remaining = deadline - dgr_now_ms();
+			if(remaining <= 0)
+			{
+				timeouts++;
+				break;
+			}
+			struct pollfd fds;
+			fds.fd = dgr_socket;
+			fds.events = POLLIN;
+			poll(&fds, 1, (int) remaining + 1);
+			dgr_master_poll_replies();
+		}
+
+		if(dgr_swap_ready_count >= dgr_swaplock_slaves)
+		{
+			double skew = dgr_swap_last_ready_ms - dgr_swap_first_ready_ms;
+			skewSum += skew;
+			if(skew > skewMax)
+				skewMax = skew;
+			barriers++;
+		}
+
+		/* Release the slaves. On a timeout we release anyway: the
+		 * slaves we did hear from are blocked waiting, and an early
+		 * release keeps them better aligned than letting their own
+		 * timeouts expire. */
+		dgr_swap_release_frame++;
+		dgr_swap_ready_count = 0;
+		char packet[DGR_WIRE_HEADER_BYTES + sizeof(uint32_t)];
+		packet[0] = 'D';
+		packet[1] = 'G';
+		packet[2] = 'R';
+		packet[3] = DGR_WIRE_VERSION;
+		packet[4] = DGR_PACKET_SWAP_RELEASE;
+		memcpy(packet+DGR_WIRE_HEADER_BYTES, &dgr_swap_release_frame, sizeof(uint32_t));
+		if(sendto(dgr_socket, packet, sizeof(packet), 0,
+		          dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen) == -1)
+		{
+			msgd("dgr", FATAL, "DGR Master: sendto: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		/* Report how well the wall is aligned every few seconds. */
+		if(lastReport == 0)
+			lastReport = dgr_now_ms();
+		if(dgr_now_ms() - lastReport >= 5000)
+		{
+			if(barriers > 0)
+				msgd("dgr", INFO, "DGR SwapLock: ready skew avg %.2f ms, max %.2f ms over %d swaps; %d timeout(s).\n",
+				    skewSum/barriers, skewMax, barriers, timeouts);
+			else
+				msgd("dgr", WARNING, "DGR SwapLock: every barrier in the last 5 seconds timed out (%d of them); are %d slaves really running?\n",
+				    timeouts, dgr_swaplock_slaves);
+			skewSum = 0;
+			skewMax = 0;
+			barriers = 0;
+			timeouts = 0;
+			lastReport = dgr_now_ms();
+		}
+	}
+	else // slave
+	{
+		if(!dgr_swaplock_enabled)
+			return;
+		/* The receiver thread updates the reply address as packets
+		 * arrive; take a consistent copy. */
+		struct sockaddr_storage replyAddr;
+		socklen_t replyAddrLen;
+		if(dgr_recv_thread_running)
+			pthread_mutex_lock(&dgr_recv_mutex);
+		memcpy(&replyAddr, &dgr_reply_addr, sizeof(replyAddr));
+		replyAddrLen = dgr_reply_addr_len;
+		if(dgr_recv_thread_running)
+			pthread_mutex_unlock(&dgr_recv_mutex);
+		/* Until we've received a packet we don't know where to send
+		 * the ready message; swap freely. */
+		if(replyAddrLen == 0)
+			return;
+
+		/* Tell the master we're done rendering, echoing the last
+		 * release we saw so it can tell this ready message apart from
+		 * a stale one. */
+		char packet[DGR_WIRE_HEADER_BYTES + sizeof(uint32_t)];
+		packet[0] = 'D';
+		packet[1] = 'G';
+		packet[2] = 'R';
+		packet[3] = DGR_WIRE_VERSION;
+		packet[4] = DGR_PACKET_SWAP_READY;
+		memcpy(packet+DGR_WIRE_HEADER_BYTES, &dgr_swap_release_frame, sizeof(uint32_t));
+		if(sendto(dgr_socket, packet, sizeof(packet), 0,
+		          (struct sockaddr*) &replyAddr, replyAddrLen) == -1)
+		{
+			msgd("dgr", WARNING, "DGR Slave: Failed to send swap-ready message: %s", strerror(errno));
+			return;
+		}
+
+		if(dgr_recv_thread_running)
+		{
+			/* The receiver thread parses swap releases as they arrive;
+			 * wait for it to publish one newer than the last we acted
+			 * on. */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += dgr_swaplock_timeout / 1000;
+			deadline.tv_nsec += (dgr_swaplock_timeout % 1000) * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_mutex_lock(&dgr_recv_mutex);
+			while(dgr_swap_release_seen <= dgr_swap_release_frame)
+			{
+				if(pthread_cond_timedwait(&dgr_recv_cond, &dgr_recv_mutex, &deadline) == ETIMEDOUT)
+				{
+					pthread_mutex_unlock(&dgr_recv_mutex);
+					static int timeouts = 0;
+					timeouts++;
+					if(timeouts == 1 || timeouts % 100 == 0)
+						msgd("dgr", WARNING, "DGR Slave: No swap release within %d ms (%d times so far); swapping anyway.\n",
+						    dgr_swaplock_timeout, timeouts);
+					return;
+				}
+			}
+			dgr_swap_release_frame = dgr_swap_release_seen;
+			pthread_mutex_unlock(&dgr_recv_mutex);
+			return;
+		}
+
+		/* Wait for the release, handling any ordinary DGR packets that
+		 * arrive in the meantime. */
+		double deadline = dgr_now_ms() + dgr_swaplock_timeout;
+		while(1)
+		{
+			double remaining = deadline - dgr_now_ms();
+			if(remaining <= 0)
+			{
+				static int timeouts = 0;
+				timeouts++;
+				if(timeouts == 1 || timeouts % 100 == 0)
+					msgd("dgr", WARNING, "DGR Slave: No swap release within %d ms (%d times so far); swapping anyway.\n",
+					    dgr_swaplock_timeout, timeouts);
+				return;
+			}
+			struct pollfd fds;
+			fds.fd = dgr_socket;
+			fds.events = POLLIN;
+			if(poll(&fds, 1, (int) remaining + 1) <= 0)
+				continue;
+
+			struct sockaddr_storage their_addr;
+			socklen_t addr_len = sizeof their_addr;
+			char serialized[1024*1024];
+			int numbytes;
+			if ((numbytes = recvfrom(dgr_socket, serialized, 1024*1024, 0,
+			                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
+				msgd("dgr", FATAL, "recvfrom: %s", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if(numbytes < DGR_WIRE_HEADER_BYTES ||
+			   serialized[0] != 'D' || serialized[1] != 'G' || serialized[2] != 'R' ||
+			   serialized[3] != DGR_WIRE_VERSION)
+				continue;
+			dgr_time_lastreceive = time(NULL);
+
+			if(serialized[4] == DGR_PACKET_SWAP_RELEASE &&
+			   numbytes >= DGR_WIRE_HEADER_BYTES + (int)sizeof(uint32_t))
+			{
+				uint32_t releaseFrame;
+				memcpy(&releaseFrame, serialized + DGR_WIRE_HEADER_BYTES, sizeof(uint32_t));
+				if(releaseFrame > dgr_swap_release_frame)
+				{
+					dgr_swap_release_frame = releaseFrame;
+					return;
+				}
+				/* an old release we've already acted on; keep waiting */
+			}
+			else if(serialized[4] == DGR_PACKET_BULK_CHUNK)
+				dgr_bulk_receive_chunk(serialized, numbytes,
+				                       (struct sockaddr *)&their_addr, addr_len);
+			else
+				dgr_unserialize(numbytes, serialized);
+		}
+	}
 #endif // __MINGW32__
 }
 
@@ -579,6 +1946,11 @@ void dgr_update(void)
 		dgr_send();
 	else
 	{
+#ifndef __MINGW32__
+		if(dgr_recv_thread_running)
+			dgr_receive_flip();
+		else
+#endif
 		// if it is our first time receiving, allow for a delay.
 		if(dgr_time_lastreceive == 0)
 			dgr_receive(10000);
@@ -589,7 +1961,7 @@ void dgr_update(void)
 		if(dgr_get("!!!dgr_died!!!", &died, sizeof(int)) >= 0 &&
 		   died == 1)
 		{
-			msg(DEBUG, "The master told slaves to exit. Exiting...\n");
+			msgd("dgr", DEBUG, "The master told slaves to exit. Exiting...\n");
 			exit(EXIT_SUCCESS);
 		}
 	}
@@ -603,7 +1975,7 @@ void dgr_exit(void)
 	if(dgr_is_enabled() && dgr_is_master())
 	{
 		int died = 1;
-		msg(DEBUG, "dgr_exit() is informing slaves that the master is exiting.\n");
+		msgd("dgr", DEBUG, "dgr_exit() is informing slaves that the master is exiting.\n");
 		dgr_free(); // clear the list of records to send.
 		dgr_set("!!!dgr_died!!!", &died, sizeof(int));
 		dgr_update();
@@ -20,7 +20,10 @@ extern "C" {
 void dgr_init(void);
 void dgr_update(void);
 void dgr_setget(const char *name, void* buffer, int bufferSize);
+void dgr_swap_barrier(void);
 void dgr_print_list(void);
+void dgr_stats(float *bytesPerSec, float *packetsPerSec, float *recordsPerPacket, float *lagMs);
+void dgr_print_stats(void);
 int dgr_is_master(void);
 int dgr_is_enabled(void);
 void dgr_exit(void);
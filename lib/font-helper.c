@@ -32,6 +32,71 @@ static int font_load(FT_Face* face, const char* fileName, const unsigned int poi
 	printf("Font: Loaded %s successfully\n", (*face)->family_name);
 	return 1;
 }
+
+/** Rasterizes every printable ASCII glyph once and packs the bitmaps
+	side by side into a single texture. Drawing text then only samples
+	from this atlas; no glyphs are rasterized or uploaded per string.
+
+    @param info A font_info whose face has already been loaded and
+    whose texture is currently bound.
+
+    @return ok Returns 1 on success, 0 if a glyph could not be loaded.
+*/
+static int font_build_atlas(font_info* info) {
+	FT_GlyphSlot g = info->face->glyph;
+
+	/* First pass: measure every glyph to size the atlas. Glyphs are
+	 * packed into one row with a pixel of padding between them so
+	 * linear filtering doesn't bleed neighboring glyphs together. */
+	unsigned int atlasWidth = 0, atlasHeight = 0;
+	for (int i = 0; i < FONT_ATLAS_NUM_CHARS; i++) {
+		if (FT_Load_Char(info->face, FONT_ATLAS_FIRST_CHAR + i, FT_LOAD_RENDER)) {
+			fprintf(stderr, "Font: Could not load character '%c' for font '%s'\n",
+			        FONT_ATLAS_FIRST_CHAR + i, info->face->family_name);
+			return 0;
+		}
+		atlasWidth += g->bitmap.width + 1;
+		atlasHeight = max(atlasHeight, g->bitmap.rows);
+	}
+
+	GLint maxTextureSize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if (atlasWidth > (unsigned int) maxTextureSize) {
+		fprintf(stderr, "Font: Glyph atlas for '%s' is %u pixels wide but the maximum texture size is %d; use a smaller point size.\n",
+		        info->face->family_name, atlasWidth, maxTextureSize);
+		return 0;
+	}
+
+	info->atlas_width = atlasWidth;
+	info->atlas_height = atlasHeight;
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, atlasWidth, atlasHeight, 0,
+	             GL_RED, GL_UNSIGNED_BYTE, NULL);
+	kuhl_errorcheck();
+
+	/* Second pass: upload each glyph's bitmap into its slot and record
+	 * its metrics. */
+	unsigned int x = 0;
+	for (int i = 0; i < FONT_ATLAS_NUM_CHARS; i++) {
+		if (FT_Load_Char(info->face, FONT_ATLAS_FIRST_CHAR + i, FT_LOAD_RENDER))
+			return 0;
+		if (g->bitmap.width > 0 && g->bitmap.rows > 0)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, 0, g->bitmap.width,
+			                g->bitmap.rows, GL_RED, GL_UNSIGNED_BYTE,
+			                g->bitmap.buffer);
+
+		info->glyphs[i].advance_x = g->advance.x >> 6;
+		info->glyphs[i].advance_y = g->advance.y >> 6;
+		info->glyphs[i].bitmap_w = g->bitmap.width;
+		info->glyphs[i].bitmap_h = g->bitmap.rows;
+		info->glyphs[i].bitmap_left = g->bitmap_left;
+		info->glyphs[i].bitmap_top = g->bitmap_top;
+		info->glyphs[i].tex_x = (float) x / atlasWidth;
+
+		x += g->bitmap.width + 1;
+	}
+	kuhl_errorcheck();
+	return 1;
+}
 #endif
 
 /** Initializes the vertex array object (VAO), vertex buffer object (VBO) and texture
@@ -104,12 +169,15 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 	FT_Face face;
 	if (!font_load(&face, fontFile, pointSize))
 		return 0;
-	
+
 	info->face = face;
 	info->program = program;
 	info->pointSize = pointSize;
 	info->pixelsPerPoint = pixelsPerPoint;
-	
+
+	if (!font_build_atlas(info))
+		return 0;
+
 	return 1;
 	#endif
 }
@@ -144,76 +212,87 @@ void font_release() {
 	#endif
 }
 
-static void render_char(font_info* info, const char ch, float* x, float* y, float sx, float sy, float startX, float startY) {
+/** Appends the two triangles for one glyph's quad to a vertex array.
+	Returns the number of vertices appended (6, or 0 for characters
+	that produce no quad). Each vertex is 4 floats: x, y, s, t. */
+static int emit_char(font_info* info, const char ch, float* x, float* y, float sx, float sy, float startX, GLfloat* verts) {
 	#ifdef KUHL_UTIL_USE_FREETYPE
-	FT_GlyphSlot g = info->face->glyph;
-	if(FT_Load_Char(info->face, ch, FT_LOAD_RENDER))
-		return;
-	
 	if (ch == '\n') {
 		*y -= info->pointSize * sy;
 		*x = startX;
-		return;
+		return 0;
 	} else if (ch == '\r') {
 		*x = startX;
-		return;
+		return 0;
 	}
+	if (ch < FONT_ATLAS_FIRST_CHAR || ch >= FONT_ATLAS_FIRST_CHAR + FONT_ATLAS_NUM_CHARS)
+		return 0;
+	font_glyph *glyph = &info->glyphs[ch - FONT_ATLAS_FIRST_CHAR];
 
-	glTexImage2D(
-		GL_TEXTURE_2D,
-		0,
-		GL_RED,
-		g->bitmap.width,
-		g->bitmap.rows,
-		0,
-		GL_RED,
-		GL_UNSIGNED_BYTE,
-		g->bitmap.buffer
-	);
-	kuhl_errorcheck();
-	
-	float x2 = *x + g->bitmap_left * sx;
-	float y2 = -*y - g->bitmap_top * sy;
-	float w = g->bitmap.width * sx;
-	float h = g->bitmap.rows * sy;
-	
-	GLfloat box[4][4] = {
-		{x2,     -y2    , 0, 0},
-		{x2 + w, -y2    , 1, 0},
-		{x2,     -y2 - h, 0, 1},
-		{x2 + w, -y2 - h, 1, 1},
-	};
+	float x2 = *x + glyph->bitmap_left * sx;
+	float y2 = *y + glyph->bitmap_top * sy;
+	float w = glyph->bitmap_w * sx;
+	float h = glyph->bitmap_h * sy;
 
-	glBufferData(GL_ARRAY_BUFFER, sizeof box, box, GL_DYNAMIC_DRAW);
-	kuhl_errorcheck();
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	kuhl_errorcheck();
-	
-	*x += (g->advance.x >> 6) * sx;
-	*y += (g->advance.y >> 6) * sy;
+	*x += glyph->advance_x * sx;
+	*y += glyph->advance_y * sy;
+
+	if (glyph->bitmap_w == 0 || glyph->bitmap_h == 0)
+		return 0; // spaces advance the pen but emit no quad
+
+	float s0 = glyph->tex_x;
+	float s1 = glyph->tex_x + glyph->bitmap_w / info->atlas_width;
+	float t1 = glyph->bitmap_h / info->atlas_height;
+
+	GLfloat quad[6][4] = {
+		{x2,     y2    , s0, 0 },
+		{x2 + w, y2    , s1, 0 },
+		{x2,     y2 - h, s0, t1},
+		{x2 + w, y2    , s1, 0 },
+		{x2,     y2 - h, s0, t1},
+		{x2 + w, y2 - h, s1, t1},
+	};
+	memcpy(verts, quad, sizeof quad);
+	return 6;
+	#else
+	return 0;
 	#endif
 }
 
 void font_draw(font_info* info, const char *text, float x, float y) {
 	if (info == NULL || text == NULL)
 		return;
-	
+
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, info->tex);
 	glBindVertexArray(info->vao);
 	glBindBuffer(GL_ARRAY_BUFFER, info->vbo);
 	glEnableVertexAttribArray(info->attribute_coord);
-	
+
 	y += info->pointSize; // Bitmaps start at bottom-left corner.
-	
+
 	float aspect = 1.0; //min((float) glutGet(GLUT_WINDOW_WIDTH) / width, (float) glutGet(GLUT_WINDOW_HEIGHT) / height);
 	float sx = aspect * (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_WIDTH);//
 	float sy = aspect * (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_HEIGHT);
 
 	x = -1 + x * sx;
 	y = 1 - y * sy;
-	float startX = x, startY = y;
+	float startX = x;
+
+	/* Build one quad batch for the whole string from the glyph atlas,
+	 * then draw it with a single buffer update and a single draw
+	 * call. */
+	size_t len = strlen(text);
+	GLfloat *verts = kuhl_frame_alloc(len * 6 * 4 * sizeof(GLfloat));
+	int numVerts = 0;
 	const char *p;
 	for(p = text; *p; p++)
-		render_char(info, *p, &x, &y, sx, sy, startX, startY);
+		numVerts += emit_char(info, *p, &x, &y, sx, sy, startX, verts + numVerts*4);
+
+	if (numVerts > 0) {
+		glBufferData(GL_ARRAY_BUFFER, numVerts * 4 * sizeof(GLfloat), verts, GL_DYNAMIC_DRAW);
+		kuhl_errorcheck();
+		glDrawArrays(GL_TRIANGLES, 0, numVerts);
+		kuhl_errorcheck();
+	}
 }
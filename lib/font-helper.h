@@ -16,6 +16,22 @@
 #include FT_FREETYPE_H
 #endif
 
+/** The range of characters stored in a font's glyph atlas. */
+#define FONT_ATLAS_FIRST_CHAR 32
+#define FONT_ATLAS_NUM_CHARS 95
+
+/** Placement and metrics for one glyph inside a font's atlas
+ * texture. Filled in once when the font is loaded. */
+typedef struct {
+	float advance_x; /**< Pixels to advance the pen after this glyph */
+	float advance_y;
+	float bitmap_w;  /**< Size of the glyph bitmap in pixels */
+	float bitmap_h;
+	float bitmap_left; /**< Offset from the pen to the bitmap's top-left corner */
+	float bitmap_top;
+	float tex_x;     /**< Horizontal texture coordinate of the glyph in the atlas */
+} font_glyph;
+
 typedef struct _font_info_ {
 	#ifdef KUHL_UTIL_USE_FREETYPE
 	FT_Face face;
@@ -30,6 +46,9 @@ typedef struct _font_info_ {
 	GLuint vao;
 	GLint uniform_tex;
 	GLint attribute_coord;
+	font_glyph glyphs[FONT_ATLAS_NUM_CHARS]; /**< Metrics for each glyph in the atlas */
+	unsigned int atlas_width; /**< Size of the atlas texture in pixels */
+	unsigned int atlas_height;
 } font_info;
 
 int font_init();
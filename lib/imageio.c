@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "imageio.h"
 
@@ -237,6 +239,145 @@ void* imagein(imageio_info *iio_info)
 }
 
 
+/* --- Asynchronous decoding -----------------------------------------
+
+   imagein() decodes one image on the calling thread. When a program
+   needs many images at startup (a slideshow, a model with many
+   textures), queue each one with imagein_async() and then collect the
+   results with imagein_wait(); the decodes run on a pool of worker
+   threads, one per processor, so total decode time scales with core
+   count instead of pegging one core. */
+
+/** A handle for an image decode that is (possibly) still in
+ * progress. Returned by imagein_async(); redeem it for the pixels
+ * with imagein_wait(). */
+struct imagein_future
+{
+	imageio_info *info; /**< The caller's struct; its result fields are filled in when the decode finishes. */
+	void *pixels;       /**< The decoded image; NULL until done (and afterwards, if the decode failed). */
+	int done;           /**< Has the decode finished? */
+	struct imagein_future *next; /**< The next queued decode. */
+};
+
+static pthread_mutex_t imagein_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a decode is queued; the workers wait on this. */
+static pthread_cond_t imagein_pool_cond = PTHREAD_COND_INITIALIZER;
+/** Broadcast when any decode finishes; imagein_wait() waits on this. */
+static pthread_cond_t imagein_done_cond = PTHREAD_COND_INITIALIZER;
+static struct imagein_future *imagein_queue_head = NULL;
+static struct imagein_future *imagein_queue_tail = NULL;
+static int imagein_pool_threads = 0;
+
+/** A decode worker: takes queued jobs, decodes them with imagein(),
+ * and marks them done. */
+static void* imagein_worker(void *unused)
+{
+	(void) unused;
+	while(1)
+	{
+		pthread_mutex_lock(&imagein_pool_lock);
+		while(imagein_queue_head == NULL)
+			pthread_cond_wait(&imagein_pool_cond, &imagein_pool_lock);
+		struct imagein_future *job = imagein_queue_head;
+		imagein_queue_head = job->next;
+		if(imagein_queue_head == NULL)
+			imagein_queue_tail = NULL;
+		pthread_mutex_unlock(&imagein_pool_lock);
+
+		void *pixels = imagein(job->info);
+
+		pthread_mutex_lock(&imagein_pool_lock);
+		job->pixels = pixels;
+		job->done = 1;
+		pthread_cond_broadcast(&imagein_done_cond);
+		pthread_mutex_unlock(&imagein_pool_lock);
+	}
+	return NULL;
+}
+
+/** Queues an image to be decoded on the worker pool.
+ *
+ * @param iio_info An imageio_info object, exactly as for imagein().
+ * The struct must stay valid (and must not be reused for another
+ * imagein_async() call) until imagein_wait() returns; its result
+ * fields (width, height, comment, ...) are filled in by the worker.
+ *
+ * @return A handle to redeem with imagein_wait(). */
+struct imagein_future* imagein_async(imageio_info *iio_info)
+{
+	struct imagein_future *future = malloc(sizeof(struct imagein_future));
+	future->info = iio_info;
+	future->pixels = NULL;
+	future->done = 0;
+	future->next = NULL;
+
+	pthread_mutex_lock(&imagein_pool_lock);
+	if(imagein_pool_threads == 0)
+	{
+		/* Initialize ImageMagick once, from this thread, so the
+		 * workers never race over its one-time setup. */
+		MagickCoreGenesis(NULL, MagickTrue);
+
+		int numThreads = 0;
+		const char *threadsString = getenv("IMAGEIO_DECODE_THREADS");
+		if(threadsString != NULL)
+			numThreads = atoi(threadsString);
+		if(numThreads <= 0)
+			numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(numThreads <= 0)
+			numThreads = 1;
+		for(int i=0; i<numThreads; i++)
+		{
+			pthread_t thread;
+			if(pthread_create(&thread, NULL, imagein_worker, NULL) == 0)
+			{
+				pthread_detach(thread);
+				imagein_pool_threads++;
+			}
+		}
+		if(IMAGEIO_DEBUG)
+			printf("imagein: Started %d decode worker(s).\n", imagein_pool_threads);
+	}
+
+	if(imagein_pool_threads == 0)
+	{
+		/* Couldn't start any workers; decode here and now. */
+		pthread_mutex_unlock(&imagein_pool_lock);
+		future->pixels = imagein(iio_info);
+		future->done = 1;
+		return future;
+	}
+
+	if(imagein_queue_tail == NULL)
+		imagein_queue_head = future;
+	else
+		imagein_queue_tail->next = future;
+	imagein_queue_tail = future;
+	pthread_cond_signal(&imagein_pool_cond);
+	pthread_mutex_unlock(&imagein_pool_lock);
+	return future;
+}
+
+/** Waits for a queued decode to finish and returns its pixels.
+ *
+ * @param future A handle from imagein_async(). It is freed by this
+ * call and must not be used again.
+ *
+ * @return The array of pixels (to be free()'d by the caller, exactly
+ * as with imagein()), or NULL if the decode failed. */
+void* imagein_wait(struct imagein_future *future)
+{
+	pthread_mutex_lock(&imagein_pool_lock);
+	while(!future->done)
+		pthread_cond_wait(&imagein_done_cond, &imagein_pool_lock);
+	pthread_mutex_unlock(&imagein_pool_lock);
+
+	void *pixels = future->pixels;
+	free(future);
+	return pixels;
+}
+
+
 /** Converts a string into an image with the string written on it with
  * a default font. This function returns an RGBA array that represents
  * the pixels. This method is useful to add labels or text overlays in
@@ -134,6 +134,12 @@ void* imagein(imageio_info *iio_info);
 int imageout(const imageio_info *iio_info, void* array);
 char* image_label(const char *label, int *width, int *height, float color[3], float bgcolor[4], double pointsize);
 
+/** A handle for an image decode that is still in progress; see
+ * imagein_async() in imageio.c. */
+typedef struct imagein_future imagein_future;
+imagein_future* imagein_async(imageio_info *iio_info);
+void* imagein_wait(imagein_future *future);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
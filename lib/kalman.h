@@ -30,6 +30,14 @@ typedef struct {
 void kalman_initialize(kalman_state * state, float sigma_meas, float qScale);
 float kalman_estimate(kalman_state * state, float measured);
 
+/* Batch entry points for filtering recorded sessions offline; see
+ * kalman.c for details. */
+void kalman_estimate_array(kalman_state * state, const float *measurements,
+                           const long *times, int count, float *out);
+void kalman_estimate_array_threaded(int numFilters, kalman_state **states,
+                                    const float **measurements, const long **times,
+                                    const int *counts, float **out);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
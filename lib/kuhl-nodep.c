@@ -103,6 +103,98 @@ void *kuhl_mallocFileLine(size_t size, const char *file, int line)
 	return ret;
 }
 
+/* The frame arena: a region of memory that per-frame temporaries are
+ * bump-allocated out of and that is reset in one step at the start of
+ * every frame (viewmat_begin_frame() calls kuhl_frame_reset()).
+ * Allocating from it is a pointer increment, there is no per-object
+ * free, and---unlike malloc()---it never contends with other threads
+ * (e.g., screenshot/video encoder threads) for the allocator lock. */
+static char  *kuhl_frame_region = NULL;
+static size_t kuhl_frame_region_size = 0;
+static size_t kuhl_frame_region_used = 0;
+/** Total bytes requested this frame; used to grow the region at the
+ * next reset if it was too small. */
+static size_t kuhl_frame_high_water = 0;
+/** Allocations which didn't fit in the region this frame. They are
+ * chained together so kuhl_frame_reset() can free them. The struct is
+ * padded to 16 bytes so the space following the header stays
+ * aligned. */
+struct kuhl_frame_overflow { struct kuhl_frame_overflow *next; size_t pad; };
+static struct kuhl_frame_overflow *kuhl_frame_overflow_list = NULL;
+
+/** Allocates temporary space which is valid only until the start of
+    the next frame. Use this instead of a malloc()/free() pair for
+    scratch space that a function needs for a single frame (vertex
+    staging buffers, traversal stacks, pixel readback buffers). Do NOT
+    free() the returned pointer and do NOT store it anywhere that
+    outlives the frame.
+
+    IMPORTANT: The frame arena is not thread-safe; only call this from
+    the rendering thread.
+
+    @param size The number of bytes to allocate.
+
+    @return A pointer to the space (16-byte aligned), or NULL if size
+    was 0 or an allocation failed.
+*/
+void* kuhl_frame_alloc(size_t size)
+{
+	if(size == 0)
+		return NULL;
+
+	/* Round the size up so consecutive allocations stay 16-byte
+	 * aligned. */
+	size = (size + 15) & ~(size_t)15;
+	kuhl_frame_high_water += size;
+
+	if(kuhl_frame_region_used + size <= kuhl_frame_region_size)
+	{
+		void *ptr = kuhl_frame_region + kuhl_frame_region_used;
+		kuhl_frame_region_used += size;
+		return ptr;
+	}
+
+	/* The region is too small this frame. Fall back to malloc() for
+	 * this allocation and remember it so kuhl_frame_reset() can free
+	 * it; the reset will also grow the region to the high-water mark
+	 * so subsequent frames stay on the fast path. */
+	struct kuhl_frame_overflow *o = kuhl_malloc(sizeof(struct kuhl_frame_overflow) + size);
+	if(o == NULL)
+		return NULL;
+	o->next = kuhl_frame_overflow_list;
+	kuhl_frame_overflow_list = o;
+	return o+1;
+}
+
+/** Discards everything allocated with kuhl_frame_alloc() since the
+    previous reset and grows the arena if the previous frame didn't
+    fit in it. viewmat_begin_frame() calls this once per frame;
+    programs which don't use viewmat but do use kuhl_frame_alloc()
+    should call it themselves at the start of each frame.
+*/
+void kuhl_frame_reset(void)
+{
+	while(kuhl_frame_overflow_list != NULL)
+	{
+		struct kuhl_frame_overflow *next = kuhl_frame_overflow_list->next;
+		free(kuhl_frame_overflow_list);
+		kuhl_frame_overflow_list = next;
+	}
+
+	if(kuhl_frame_high_water > kuhl_frame_region_size)
+	{
+		size_t newSize = kuhl_frame_region_size > 0 ? kuhl_frame_region_size : 4096;
+		while(newSize < kuhl_frame_high_water)
+			newSize *= 2;
+		free(kuhl_frame_region);
+		kuhl_frame_region = kuhl_malloc(newSize);
+		kuhl_frame_region_size = kuhl_frame_region == NULL ? 0 : newSize;
+	}
+
+	kuhl_frame_region_used = 0;
+	kuhl_frame_high_water = 0;
+}
+
 
 
 /** Checks if a file is readable or not by attempting to fopen() the
@@ -464,6 +556,101 @@ float kuhl_getfps(kuhl_fps_state *state)
 	return state->fps;
 }
 
+/** Initializes a fixed-timestep simulation loop. Stepping a simulation
+ * once per rendered frame ties the simulation speed to the frame rate:
+ * a machine that drops frames also runs its physics slowly, which is
+ * especially bad on a DGR wall where every node must agree on the
+ * simulation state. With a fixed timestep, elapsed render time is
+ * accumulated and the simulation is advanced by a whole number of
+ * equally-sized steps each frame, so the simulation proceeds at the
+ * same rate on every machine regardless of GPU performance.
+ *
+ * Use either the callback form:
+ *
+ *     kuhl_timestep_run(&state, update, draw);
+ *
+ * in your display function, where update(dt) advances the simulation
+ * by dt seconds and draw(alpha) renders; or the loop form:
+ *
+ *     int steps = kuhl_timestep_frame(&state);
+ *     for(int i=0; i<steps; i++)
+ *         simulate(state.dt);
+ *
+ * For smooth motion, render each object interpolated between its two
+ * most recent simulation states using state.alpha (0 = at the older
+ * state, 1 = at the newer one); otherwise objects visibly stutter
+ * whenever the render rate isn't a multiple of the step rate.
+ *
+ * @param state An empty kuhl_timestep_state object to be initialized.
+ *
+ * @param stepsPerSecond How many simulation steps make up one second
+ * (60 is a common choice). */
+void kuhl_timestep_init(kuhl_timestep_state *state, float stepsPerSecond)
+{
+	state->dt = 1.0f / stepsPerSecond;
+	state->accumulator = 0;
+	state->prevTime = -1;
+	state->alpha = 0;
+	state->steps = 0;
+	state->maxStepsPerFrame = 8;
+}
+
+/** When called every frame, returns how many fixed-size simulation
+ * steps the frame should take to keep the simulation caught up with
+ * wall-clock time, and updates state->alpha for interpolated
+ * rendering. If rendering stalls for longer than maxStepsPerFrame
+ * steps, the excess time is discarded---the simulation briefly runs
+ * slow instead of spiraling (each frame simulating so much that it
+ * stalls the next frame even more).
+ *
+ * @param state A state structure initialized by kuhl_timestep_init().
+ *
+ * @return The number of times the caller should step the simulation
+ * (possibly 0) before rendering this frame. */
+int kuhl_timestep_frame(kuhl_timestep_state *state)
+{
+	long now = kuhl_microseconds();
+	if(state->prevTime < 0)
+		state->accumulator = state->dt; // first frame: take exactly one step
+	else
+		state->accumulator += (now - state->prevTime) / 1000000.0;
+	state->prevTime = now;
+
+	int steps = (int) (state->accumulator / state->dt);
+	if(steps > state->maxStepsPerFrame)
+	{
+		steps = state->maxStepsPerFrame;
+		state->accumulator = steps * (double) state->dt;
+	}
+	state->accumulator -= steps * (double) state->dt;
+	state->alpha = (float) (state->accumulator / state->dt);
+	state->steps += steps;
+	return steps;
+}
+
+/** The callback form of the fixed-timestep loop: calls update(dt)
+ * however many times kuhl_timestep_frame() says this frame needs, then
+ * calls draw(alpha) once. Call it once per frame from your display
+ * function.
+ *
+ * @param state A state structure initialized by kuhl_timestep_init().
+ *
+ * @param update Called once per simulation step with the fixed
+ * timestep in seconds.
+ *
+ * @param draw Called once with the interpolation factor between the
+ * two most recent simulation states. May be NULL if the caller
+ * renders separately. */
+void kuhl_timestep_run(kuhl_timestep_state *state, void (*update)(float dt), void (*draw)(float alpha))
+{
+	int steps = kuhl_timestep_frame(state);
+	for(int i=0; i<steps; i++)
+		update(state->dt);
+	if(draw != NULL)
+		draw(state->alpha);
+}
+
+
 static int kuhl_random_init_done = 0; /*< Have we called srand48() yet? */
 /** Generates a random integer between min and max inclusive. This
  * uses floating point to avoid possible issues with using rand()
@@ -37,12 +37,37 @@ typedef struct
 	float fps; /**< Current estimate of FPS? */
 } kuhl_fps_state;
 
+/** This structure contains all of the state necessary to run a
+ * simulation at a fixed timestep independent of the render rate. See
+ * kuhl_timestep_init(). */
+typedef struct
+{
+	float dt; /**< Seconds of simulation time each step advances
+	           * (fixed; set by kuhl_timestep_init()). */
+	double accumulator; /**< Rendered time that hasn't been simulated
+	                     * yet, in seconds. */
+	long prevTime; /**< When kuhl_timestep_frame() last ran
+	                * (microseconds); -1 before the first frame. */
+	float alpha; /**< How far the unsimulated remainder reaches into
+	              * the next step (0 to 1). Use it to interpolate
+	              * rendering between the two most recent simulation
+	              * states. */
+	long steps; /**< Total number of simulation steps taken so far. */
+	int maxStepsPerFrame; /**< Most steps a single frame may simulate
+	                       * (default 8). Time beyond that is discarded
+	                       * so a long stall doesn't make the next
+	                       * frame simulate its way into another
+	                       * stall. */
+} kuhl_timestep_state;
+
 
 /** An alternative to malloc() which behaves the same way except it
  * prints a message when common errors occur (out of memory, trying to
  * allocate 0 bytes). */
 #define kuhl_malloc(size) kuhl_mallocFileLine(size, __FILE__, __LINE__)
 
+void* kuhl_frame_alloc(size_t size);
+void kuhl_frame_reset(void);
 
 int kuhl_can_read_file(const char *filename);
 char* kuhl_find_file(const char *filename);
@@ -60,6 +85,9 @@ long kuhl_milliseconds();
 long kuhl_milliseconds_start();
 void kuhl_getfps_init(kuhl_fps_state *state);
 float kuhl_getfps(kuhl_fps_state *state);
+void kuhl_timestep_init(kuhl_timestep_state *state, float stepsPerSecond);
+int kuhl_timestep_frame(kuhl_timestep_state *state);
+void kuhl_timestep_run(kuhl_timestep_state *state, void (*update)(float dt), void (*draw)(float alpha));
 
 #ifdef __cplusplus
 } // end extern "C"
@@ -20,10 +20,16 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h> // for FLT_MAX
+#include <limits.h> // for INT_MAX - used by the DXT encoder
+#include <stdint.h> // for fixed-size types used by the model cache
 #include <libgen.h> // for dirname()
 #include <sys/time.h> // gettimeofday()
+#include <sys/stat.h> // stat() - used by model cache
+#include <sys/mman.h> // mmap() - used by model cache
+#include <fcntl.h> // open()
 #include <unistd.h> // usleep()
 #include <time.h> // time()
+#include <pthread.h> // screenshot encoder worker thread
 #ifdef __linux__
 #include <sys/prctl.h> // kill a forked child when parent exits
 #include <signal.h>
@@ -63,9 +69,22 @@ void mat4f_from_aiMatrix4x4(float  dest[16], struct aiMatrix4x4 src)
 #endif
 
 
+static void kuhl_uniform_cache_invalidate(GLuint program);
+
+
+/** Set by kuhl_debug_init() when a GL_KHR_debug message callback is
+ * installed. Once the driver reports problems through the callback,
+ * the glGetError() polling in kuhl_errorcheck() is redundant and is
+ * skipped---glGetError() is a synchronous query and polling it
+ * throughout the draw loop costs measurable time on some drivers. */
+static int kuhl_debug_callback_installed = 0;
+
 /** Don't call this function, call kuhl_errorcheck() instead. */
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 {
+	if(kuhl_debug_callback_installed)
+		return 0;
+
 	GLenum errCode = glGetError();
 	if(errCode != GL_NO_ERROR)
 	{
@@ -76,6 +95,68 @@ int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 	return 0;
 }
 
+/** Receives messages from the OpenGL driver and routes them into
+ * msg() at a level matching the message's severity. */
+static void GLAPIENTRY kuhl_debug_callback(GLenum source, GLenum type, GLuint id,
+                                           GLenum severity, GLsizei length,
+                                           const GLchar *message, const void *userParam)
+{
+	// These parameters are required by the callback signature but we
+	// don't have a use for them.
+	(void) source;
+	(void) length;
+	(void) userParam;
+
+	const char *typeString = "other";
+	switch(type)
+	{
+		case GL_DEBUG_TYPE_ERROR:               typeString = "error";               break;
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: typeString = "deprecated behavior"; break;
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  typeString = "undefined behavior";  break;
+		case GL_DEBUG_TYPE_PORTABILITY:         typeString = "portability";         break;
+		case GL_DEBUG_TYPE_PERFORMANCE:         typeString = "performance";         break;
+	}
+
+	int level = DEBUG;
+	switch(severity)
+	{
+		case GL_DEBUG_SEVERITY_HIGH:   level = ERROR;   break;
+		case GL_DEBUG_SEVERITY_MEDIUM: level = WARNING; break;
+		case GL_DEBUG_SEVERITY_LOW:    level = INFO;    break;
+	}
+	msg(level, "OpenGL %s message (id %u): %s\n", typeString, id, message);
+}
+
+/** Installs a GL_KHR_debug message callback so the driver reports
+ * errors (with better diagnostics than glGetError() provides) as they
+ * happen. Once installed, the glGetError() polling done by
+ * kuhl_errorcheck() is skipped since it is redundant and slow on some
+ * drivers. Call this once after glewInit(); if the extension isn't
+ * available, kuhl_errorcheck() keeps polling as before. */
+void kuhl_debug_init(void)
+{
+	if(!glewIsSupported("GL_KHR_debug") && !glewIsSupported("GL_VERSION_4_3"))
+	{
+		msg(DEBUG, "GL_KHR_debug is not available; falling back to glGetError() polling.\n");
+		return;
+	}
+
+	/* Note: We deliberately do not enable GL_DEBUG_OUTPUT_SYNCHRONOUS
+	 * here; it forces the driver to report messages from the thread
+	 * and call that caused them, which serializes the pipeline. Turn
+	 * it on temporarily (and run under a debugger with a breakpoint in
+	 * kuhl_debug_callback()) when you need to find the exact call that
+	 * caused a message. */
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback(kuhl_debug_callback, NULL);
+	/* Notification-severity messages are chatty on some drivers
+	 * (buffer placement details, etc.); silence them. */
+	glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION,
+	                      0, NULL, GL_FALSE);
+	kuhl_debug_callback_installed = 1;
+	msg(DEBUG, "GL_KHR_debug message callback installed; kuhl_errorcheck() polling disabled.\n");
+}
+
 
 
 
@@ -237,6 +318,196 @@ void kuhl_delete_program(GLuint program)
 		glDeleteShader(shaders[i]);
 	}
 	glDeleteProgram(program);
+
+	/* OpenGL may reuse this program id for a future program; drop any
+	 * uniform locations we cached for it. */
+	kuhl_uniform_cache_invalidate(program);
+}
+
+/* Shader programs are cached on disk in their compiled (driver
+ * specific) form so that warm starts skip the GLSL compiler entirely.
+ * The cache file sits next to the vertex shader and contains a header
+ * followed by the blob that glGetProgramBinary() produced. The header
+ * stores a hash of both shader sources and the driver's identification
+ * strings; if the shaders are edited or the driver changes, the hash
+ * won't match and we silently fall back to compiling from source. */
+
+/** Suffix appended to a shader cache file's name. */
+#define KUHL_PROGRAM_CACHE_SUFFIX ".kuhlbin"
+/** Bump this number if the layout of kuhl_program_cache_header changes. */
+#define KUHL_PROGRAM_CACHE_VERSION 1
+
+/** Header at the start of a program binary cache file. */
+struct kuhl_program_cache_header
+{
+	char magic[8];         /**< Set to "kuhlprog" */
+	uint32_t version;      /**< KUHL_PROGRAM_CACHE_VERSION */
+	uint32_t sourceHash;   /**< Hash of shader sources and driver strings */
+	uint32_t binaryFormat; /**< Driver-specific format from glGetProgramBinary() */
+	uint32_t binaryLength; /**< Bytes of binary data following this header */
+};
+
+/** Is the OpenGL implementation able to save and load program
+ * binaries? */
+static int kuhl_private_program_binary_supported(void)
+{
+	if(!glewIsSupported("GL_ARB_get_program_binary") && !glewIsSupported("GL_VERSION_4_1"))
+		return 0;
+	/* An implementation may support the extension but expose no
+	 * binary formats. */
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	return numFormats > 0;
+}
+
+/** Hashes the text of both shaders together with the driver's
+ * identification strings. Program binaries are driver specific, so a
+ * driver upgrade must invalidate the cache just like a shader edit
+ * does. */
+static uint32_t kuhl_private_program_cache_hash(const char *vertText, const char *fragText)
+{
+	uint32_t hash = 5381;
+	const char *strings[5] = { vertText, fragText,
+	                           (const char*) glGetString(GL_VENDOR),
+	                           (const char*) glGetString(GL_RENDERER),
+	                           (const char*) glGetString(GL_VERSION) };
+	for(int i=0; i<5; i++)
+	{
+		const char *s = strings[i];
+		if(s == NULL)
+			continue;
+		while(*s)
+			hash = hash * 33 + (unsigned char) *s++;
+		hash = hash * 33 + 1; // separator so string boundaries matter
+	}
+	return hash;
+}
+
+/** Constructs the cache filename for a vertex+fragment shader pair:
+ * the vertex shader's path with the fragment shader's basename and
+ * KUHL_PROGRAM_CACHE_SUFFIX appended (a vertex shader may be paired
+ * with more than one fragment shader).
+ *
+ * @return A filename which the caller should free().
+ */
+static char* kuhl_private_program_cache_filename(const char *vertexFilename, const char *fragFilename)
+{
+	char *vertexPath = kuhl_find_file(vertexFilename);
+	const char *fragBase = strrchr(fragFilename, '/');
+	fragBase = (fragBase == NULL) ? fragFilename : fragBase+1;
+	char *cacheFilename = kuhl_malloc(strlen(vertexPath)+1+strlen(fragBase)+
+	                                  strlen(KUHL_PROGRAM_CACHE_SUFFIX)+1);
+	sprintf(cacheFilename, "%s.%s%s", vertexPath, fragBase, KUHL_PROGRAM_CACHE_SUFFIX);
+	free(vertexPath);
+	return cacheFilename;
+}
+
+/** Tries to create a GLSL program from a cached program binary.
+ *
+ * @param cacheFilename The cache file to load from.
+ * @param sourceHash The expected hash of the shader sources and driver
+ * strings; a mismatch means the cache is stale.
+ * @return The program, or 0 if the cache was missing, stale, or the
+ * driver rejected the binary.
+ */
+static GLuint kuhl_private_program_cache_load(const char *cacheFilename, uint32_t sourceHash)
+{
+	FILE *f = fopen(cacheFilename, "rb");
+	if(f == NULL)
+		return 0;
+
+	struct kuhl_program_cache_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, "kuhlprog", 8) != 0 ||
+	   header.version != KUHL_PROGRAM_CACHE_VERSION ||
+	   header.sourceHash != sourceHash ||
+	   header.binaryLength == 0)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	void *binary = kuhl_malloc(header.binaryLength);
+	if(fread(binary, header.binaryLength, 1, f) != 1)
+	{
+		free(binary);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.binaryFormat, binary, header.binaryLength);
+	free(binary);
+	/* glProgramBinary() sets an error if the format is unknown;
+	 * swallow it since we fall back to compiling from source. */
+	glGetError();
+
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(linked == GL_FALSE)
+	{
+		/* The driver rejected the binary (e.g., same driver string but
+		 * different hardware). Fall back to source. */
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/** Saves a linked GLSL program's binary into a cache file. Failures
+ * only cost us the time saved on the next warm start, so they are not
+ * fatal. */
+static void kuhl_private_program_cache_save(const char *cacheFilename, uint32_t sourceHash, GLuint program)
+{
+	GLint binaryLength = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+	if(binaryLength <= 0)
+		return;
+
+	void *binary = kuhl_malloc(binaryLength);
+	GLenum binaryFormat = 0;
+	GLsizei actualLength = 0;
+	glGetProgramBinary(program, binaryLength, &actualLength, &binaryFormat, binary);
+	if(actualLength <= 0)
+	{
+		free(binary);
+		return;
+	}
+
+	struct kuhl_program_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "kuhlprog", 8);
+	header.version = KUHL_PROGRAM_CACHE_VERSION;
+	header.sourceHash = sourceHash;
+	header.binaryFormat = binaryFormat;
+	header.binaryLength = actualLength;
+
+	/* Write to a temporary file and rename it so a crash mid-write
+	 * can't leave a truncated cache behind. */
+	char *tmpFilename = kuhl_malloc(strlen(cacheFilename)+5);
+	sprintf(tmpFilename, "%s.tmp", cacheFilename);
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f == NULL)
+	{
+		msg(DEBUG, "Unable to write shader cache file %s\n", tmpFilename);
+		free(binary);
+		free(tmpFilename);
+		return;
+	}
+	if(fwrite(&header, sizeof(header), 1, f) != 1 ||
+	   fwrite(binary, actualLength, 1, f) != 1)
+	{
+		fclose(f);
+		unlink(tmpFilename);
+	}
+	else
+	{
+		fclose(f);
+		rename(tmpFilename, cacheFilename);
+	}
+	free(binary);
+	free(tmpFilename);
 }
 
 /** Creates an OpenGL program from pair of files containing a vertex
@@ -244,6 +515,12 @@ void kuhl_delete_program(GLuint program)
  * support from the video card, error checking, and setting attribute
  * locations.
  *
+ * If the OpenGL implementation supports program binaries, the linked
+ * program is cached on disk next to the vertex shader and warm starts
+ * load the cached binary instead of running the GLSL compiler. Editing
+ * either shader or changing the video driver invalidates the cache
+ * automatically.
+ *
  * @param vertexFilename The filename of the vertex program.
  *
  * @param fragFilename The filename of the fragment program.
@@ -259,6 +536,30 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 		return 0;
 	}
 
+	/* Try to load a cached program binary before compiling anything. */
+	char *cacheFilename = NULL;
+	uint32_t sourceHash = 0;
+	int binarySupported = kuhl_private_program_binary_supported();
+	if(binarySupported)
+	{
+		char *vertText = kuhl_text_read(vertexFilename);
+		char *fragText = kuhl_text_read(fragFilename);
+		sourceHash = kuhl_private_program_cache_hash(vertText, fragText);
+		free(vertText);
+		free(fragText);
+		cacheFilename = kuhl_private_program_cache_filename(vertexFilename, fragFilename);
+
+		GLuint cached = kuhl_private_program_cache_load(cacheFilename, sourceHash);
+		if(cached != 0)
+		{
+			msg(INFO, "GLSL prog %d: Loaded cached binary for vertex (%s) & fragment (%s) shaders\n",
+			    cached, vertexFilename, fragFilename);
+			kuhl_print_program_info(cached);
+			free(cacheFilename);
+			return cached;
+		}
+	}
+
 	/* Create a program to attach our shaders to. */
 	GLuint program = glCreateProgram();
 	if(program == 0)
@@ -268,7 +569,12 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 	}
 	msg(INFO, "GLSL prog %d: Creating vertex (%s) & fragment (%s) shaders\n",
 	    program, vertexFilename, fragFilename);
-	
+
+	/* Ask the driver to keep a retrievable binary around so we can
+	 * cache it after linking. */
+	if(binarySupported)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	/* Create the shaders */
 	GLuint fragShader   = kuhl_create_shader(fragFilename, GL_FRAGMENT_SHADER);
 	GLuint vertexShader = kuhl_create_shader(vertexFilename, GL_VERTEX_SHADER);
@@ -298,7 +604,14 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 	/* We used to call glValidateProgram() here. However, some drivers
 	 * assume that you only call glValidateProgram() when you are
 	 * ready to draw (i.e., have a vertex array object set up, etc). */
-	
+
+	/* Save the program binary so the next launch skips compilation. */
+	if(binarySupported)
+	{
+		kuhl_private_program_cache_save(cacheFilename, sourceHash, program);
+		free(cacheFilename);
+	}
+
 	kuhl_print_program_info(program);
     // printf("GLSL program %d: Success!\n", program);
 	return program;
@@ -320,6 +633,135 @@ void kuhl_print_program_log(GLuint program)
 
 
 
+/** Size of the uniform location cache. Must be a power of two. Each
+ * entry is one uniform variable in one program; 512 is far more than
+ * any of our sample programs use. */
+#define KUHL_UNIFORM_CACHE_SIZE 512
+
+/** One entry in the uniform location cache. A NULL name means the slot
+ * has never been used; a program of 0 means the entry was invalidated
+ * by kuhl_delete_program() (but the slot stays on the probe chain). */
+struct kuhl_uniform_cache_entry
+{
+	GLuint program;  /**< GLSL program the uniform belongs to. */
+	char *name;      /**< Name of the uniform variable. */
+	GLint location;  /**< Cached result of glGetUniformLocation(). */
+};
+static struct kuhl_uniform_cache_entry kuhl_uniform_cache[KUHL_UNIFORM_CACHE_SIZE];
+static int kuhl_uniform_cache_full = 0;
+
+/** Hashes a program and uniform name pair into a slot in the uniform
+ * location cache. */
+static unsigned int kuhl_uniform_cache_hash(GLuint program, const char *name)
+{
+	unsigned int hash = 5381 + program;
+	while(*name)
+		hash = hash * 33 + (unsigned char) *name++;
+	return hash & (KUHL_UNIFORM_CACHE_SIZE-1);
+}
+
+/** Removes all entries for a program from the uniform location cache.
+ * Called when a program is deleted since OpenGL may reuse its id. */
+static void kuhl_uniform_cache_invalidate(GLuint program)
+{
+	for(int i=0; i<KUHL_UNIFORM_CACHE_SIZE; i++)
+		if(kuhl_uniform_cache[i].name != NULL &&
+		   kuhl_uniform_cache[i].program == program)
+			kuhl_uniform_cache[i].program = 0;
+}
+
+/** Provides functionality similar to glGetUniformLocation() with error
+ * checking and caching. The first lookup of a uniform in a program
+ * asks OpenGL for the location (a driver round-trip involving a string
+ * hash); every subsequent lookup of the same program+name pair is
+ * answered from a hash table without touching OpenGL. Uniform
+ * locations never change after a program is linked, so the cached
+ * value stays correct for the life of the program.
+ *
+ * @param program The GLSL program containing the uniform variable.
+ *
+ * @param uniformName The name of the uniform variable.
+ *
+ * @param warn If nonzero, print an error message when the uniform is
+ * missing or inactive. Pass 0 for uniforms that are allowed to be
+ * absent from the program.
+ *
+ * @return The location of the uniform variable. Returns -1 if the
+ * uniform is not found.
+ */
+static GLint kuhl_uniform_location_opt(GLuint program, const char *uniformName, int warn)
+{
+	unsigned int slot = kuhl_uniform_cache_hash(program, uniformName);
+	unsigned int insertSlot = KUHL_UNIFORM_CACHE_SIZE; // first reusable slot we pass
+	for(unsigned int probe = 0; probe < KUHL_UNIFORM_CACHE_SIZE; probe++)
+	{
+		struct kuhl_uniform_cache_entry *entry = &(kuhl_uniform_cache[slot]);
+		if(entry->name == NULL) // never-used slot: name isn't cached.
+			break;
+		if(entry->program == program && strcmp(entry->name, uniformName) == 0)
+			return entry->location;
+		if(entry->program == 0 && insertSlot == KUHL_UNIFORM_CACHE_SIZE)
+			insertSlot = slot; // invalidated entry we can overwrite
+		slot = (slot+1) & (KUHL_UNIFORM_CACHE_SIZE-1);
+	}
+
+	/* Cache miss: do the real lookup (and the error checks that only
+	 * make sense to do once per program+name pair). */
+	if(!glIsProgram(program))
+	{
+		msg(ERROR, "Can't get uniform '%s' because program %d is not a valid GLSL program.\n", uniformName, program);
+		return -1;
+	}
+	GLint loc = glGetUniformLocation(program, uniformName);
+	kuhl_errorcheck();
+	if(loc == -1 && warn)
+	{
+		msg(ERROR, "Uniform variable '%s' is missing or inactive in your GLSL program.\n", uniformName);
+		msg(ERROR, "Remember that the GLSL variables that do not affect the appearance of your program will be set to inactive by the GLSL compiler.\n");
+	}
+
+	/* Store the result (even a -1, so the message above prints once
+	 * rather than every frame). */
+	struct kuhl_uniform_cache_entry *entry = NULL;
+	if(kuhl_uniform_cache[slot].name == NULL)
+	{
+		entry = &(kuhl_uniform_cache[slot]);
+		entry->name = strdup(uniformName);
+	}
+	else if(insertSlot != KUHL_UNIFORM_CACHE_SIZE)
+	{
+		entry = &(kuhl_uniform_cache[insertSlot]);
+		free(entry->name);
+		entry->name = strdup(uniformName);
+	}
+	else if(!kuhl_uniform_cache_full)
+	{
+		msg(WARNING, "The uniform location cache is full; some uniform lookups will not be cached.\n");
+		kuhl_uniform_cache_full = 1;
+	}
+	if(entry != NULL)
+	{
+		entry->program = program;
+		entry->location = loc;
+	}
+	return loc;
+}
+
+/** Cached version of glGetUniformLocation() with error checking; see
+ * kuhl_uniform_location_opt() for details.
+ *
+ * @param program The GLSL program containing the uniform variable.
+ *
+ * @param uniformName The name of the uniform variable.
+ *
+ * @return The location of the uniform variable. Returns -1 if the
+ * uniform is not found.
+ */
+GLint kuhl_uniform_location(GLuint program, const char *uniformName)
+{
+	return kuhl_uniform_location_opt(program, uniformName, 1);
+}
+
 /** Provides functionality similar to glGetUniformLocation() with
  * error checking. However, unlike glGetUniformLocation(), this
  * function gets the location of the variable from the active OpenGL
@@ -328,6 +770,12 @@ void kuhl_print_program_log(GLuint program)
  * function may exit or return -1 if the uniform location is not
  * found.
  *
+ * Lookups are cached per program+name pair (see
+ * kuhl_uniform_location()), so only the query for the active program
+ * touches OpenGL on repeat calls. Callers that already know which
+ * program is in use can call kuhl_uniform_location() directly and
+ * avoid even that query.
+ *
  * @param uniformName The name of the uniform variable.
  *
  * @return The location of the uniform variable.
@@ -348,27 +796,8 @@ GLint kuhl_get_uniform(const char *uniformName)
 		msg(ERROR, "Can't get the uniform location of %s because no GLSL program is currently being used.\n", uniformName);
 		return -1;
 	}
-	
-	if(!glIsProgram(currentProgram))
-	{
-		msg(ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
-		return -1;
-	}
 
-	static int missingUniformCount = 0;
-	GLint loc = glGetUniformLocation(currentProgram, uniformName);
-	kuhl_errorcheck();
-	if(loc == -1 && missingUniformCount < 50)
-	{
-		msg(ERROR, "Uniform variable '%s' is missing or inactive in your GLSL program.\n", uniformName);
-		missingUniformCount++;
-		if(missingUniformCount == 50)
-		{
-			msg(ERROR, "Hiding any additional error messages related to missing/inactive uniform variables.\n");
-			msg(ERROR, "Remember that the GLSL variables that do not affect the appearance of your program will be set to inactive by the GLSL compiler.\n");
-		}
-	}
-	return loc;
+	return kuhl_uniform_location((GLuint) currentProgram, uniformName);
 }
 
 /** glGetAttribLocation() with error checking. This function behaves
@@ -535,16 +964,16 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
 
 	// The 8 vertices of the bounding box
-	float coords[8][3] = { {bbox[xmin], bbox[ymin], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmax] } };
+	float coords[8][4] = { {bbox[xmin], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmax], 1 } };
 	// Transform the 8 vertices of the bounding box
-	for(int i=0; i<8; i++)
-		mat4f_mult_vec4f_new(coords[i], mat, coords[i]);
+	mat4f_mult_vec4f_array(coords[0], mat, 8);
 	
 	/* Calculate new axis aligned bounding box */
 	for(int i=0; i<6; i=i+2) // set min values to the largest float
@@ -572,9 +1001,45 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 }
     
 
-#if 0
+/** Computes the world-space bounding box of a geometry: the
+ * geometry's bounding box transformed by its own matrix and then by
+ * an additional transformation matrix (usually the model matrix the
+ * geometry is drawn with). */
+static void kuhl_geometry_world_bbox(const kuhl_geometry *geom, const float mat[16], float bbox[6])
+{
+	memcpy(bbox, geom->aabb, sizeof(float)*6);
+	float full[16];
+	mat4f_mult_mat4f_new(full, mat, (float*) geom->matrix);
+	kuhl_bbox_transform(bbox, full);
+}
+
+/** Do two axis-aligned bounding boxes overlap? */
+static int kuhl_bbox_overlap(const float box1[6], const float box2[6])
+{
+	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
+	// If the smallest x coordinate in box1 is larger than the
+	// largest x coordinate in box2, there is no intersection when we
+	// project the bounding boxes onto to the X plane. (box1 is to
+	// the right of box2). Repeat for Y and Z planes
+	if(box1[xmin] > box2[xmax]) return 0;
+	if(box1[ymin] > box2[ymax]) return 0;
+	if(box1[zmin] > box2[zmax]) return 0;
+	// If the largest x coordinate of box1 is smaller than the
+	// smallest x coordinate in box2, there is no intersection when we
+	// project the bounding boxes onto the X plane. (box1 is to the
+	// left of box2). Repeat for Y and Z planes.
+	if(box1[xmax] < box2[xmin]) return 0;
+	if(box1[ymax] < box2[ymin]) return 0;
+	if(box1[zmax] < box2[zmin]) return 0;
+	return 1;
+}
+
 /** Checks if the axis-aligned bounding box of two kuhl_geometry objects intersect.
 
+    For checking one object against many, register the objects with
+    kuhl_collide_add() and query with kuhl_collide_overlaps() instead;
+    it avoids testing every pair.
+
     @return 1 if the bounding boxes intersect; 0 otherwise
 
     @param geom1 One of the pieces of geometry.
@@ -586,96 +1051,415 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16])
 {
 	float box1[6], box2[6];
-	for(int i=0; i<6; i++)
-	{
-		box1[i] = geom1->aabbox[i];
-		box2[i] = geom2->aabbox[i];
-	}
-	kuhl_bbox_transform(box1, mat1);
-	kuhl_bbox_transform(box2, mat1);
-
-	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
-	// If the smallest x coordinate in geom1 is larger than the
-	// largest x coordinate in geom2, there is no intersection when we
-	// project the bounding boxes onto to the X plane. (geom1 is to
-	// the right of geom2). Repeat for Y and Z planes
-	if(box1[xmin] > box2[xmax]) return 0;
-	if(box1[ymin] > box2[ymax]) return 0;
-	if(box1[zmin] > box2[zmax]) return 0;
-	// If the largest x coordinate of geom1 is smaller than the
-	// largest smallest x coordinate in geom 2, there is no
-	// intersection when we project the bounding boxes onto the X
-	// plane. (geom1 is to the left of geom2). Repeat for Y and Z
-	// planes.
-	if(box1[xmax] < box2[xmin]) return 0;
-	if(box1[ymax] < box2[ymin]) return 0;
-	if(box1[zmax] < box2[zmin]) return 0;
-	return 1;
+	kuhl_geometry_world_bbox(geom1, mat1, box1);
+	kuhl_geometry_world_bbox(geom2, mat2, box2);
+	return kuhl_bbox_overlap(box1, box2);
 }
-#endif
 
+/* Broadphase collision structure: a bounding volume hierarchy (BVH)
+ * built over the world-space bounding boxes of registered geometry.
+ * Overlap and ray queries then only descend into the parts of the
+ * scene a query can touch, so a query costs O(log n) instead of
+ * testing all n objects pairwise. The tree's topology is only rebuilt
+ * when objects are added or removed; when a registered object's
+ * transformation matrix changes, the leaf boxes are updated and the
+ * internal nodes are refit bottom-up without rebuilding. */
 
-/** Adds a texture to the provided kuhl_geometry object.
- *
- * @param geom The geometry object to add a texture to.
- *
- * @param texture The OpenGL texture ID of the texture.
- *
- * @param name The GLSL variable name that the texture should be connected to.
- *
- * @param kg_options If KG_WARN bit is set, will warn if
- * the GLSL variable is missing from the GLSL program for this piece
- * of geometry. If set to KG_FULL_LIST is set, the texture will
- * be applied to all of the geometry in this list. */
- 
-void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options)
+struct kuhl_collide_entry
 {
-	if(name == NULL || strlen(name) == 0)
+	kuhl_geometry *geom; /**< The registered geometry */
+	float mat[16];       /**< Transformation matrix it is drawn with */
+	float bbox[6];       /**< World-space bounding box */
+};
+
+struct kuhl_collide_node
+{
+	float bbox[6]; /**< Bounding box around everything below this node */
+	int left;      /**< Index of first child node (internal nodes only) */
+	int right;     /**< Index of second child node (internal nodes only) */
+	int entry;     /**< Index of this leaf's entry, or -1 for internal nodes */
+};
+
+static struct kuhl_collide_entry *kuhl_collide_entries = NULL;
+static int kuhl_collide_count = 0;
+static int kuhl_collide_capacity = 0;
+static struct kuhl_collide_node *kuhl_collide_nodes = NULL;
+static int kuhl_collide_node_count = 0;
+static int kuhl_collide_rebuild = 0; /**< Objects were added/removed; rebuild topology */
+static int kuhl_collide_refit = 0;   /**< A transform changed; refit node boxes */
+
+/** Recursively builds a BVH subtree over entries[first..first+count-1]
+ * (indices into kuhl_collide_entries), splitting at the median of the
+ * longest axis. Returns the index of the created node. Children always
+ * get larger node indices than their parent, which lets refitting run
+ * as a single reverse pass over the node array. */
+static int kuhl_collide_build(int *entries, int count)
+{
+	int nodeIndex = kuhl_collide_node_count++;
+	struct kuhl_collide_node *node = &kuhl_collide_nodes[nodeIndex];
+
+	if(count == 1)
 	{
-		msg(WARNING, "GLSL variable name was NULL or the empty string.\n");
-		return;
+		node->entry = entries[0];
+		node->left = -1;
+		node->right = -1;
+		memcpy(node->bbox, kuhl_collide_entries[entries[0]].bbox, sizeof(float)*6);
+		return nodeIndex;
 	}
-	if(geom == NULL)
+
+	/* Bounding box around all of the entries. */
+	memcpy(node->bbox, kuhl_collide_entries[entries[0]].bbox, sizeof(float)*6);
+	for(int i=1; i<count; i++)
+		for(int axis=0; axis<3; axis++)
+		{
+			float *bbox = kuhl_collide_entries[entries[i]].bbox;
+			if(bbox[axis*2] < node->bbox[axis*2])
+				node->bbox[axis*2] = bbox[axis*2];
+			if(bbox[axis*2+1] > node->bbox[axis*2+1])
+				node->bbox[axis*2+1] = bbox[axis*2+1];
+		}
+	node->entry = -1;
+
+	/* Split at the spatial midpoint of the longest axis. */
+	int axis = 0;
+	for(int i=1; i<3; i++)
+		if(node->bbox[i*2+1] - node->bbox[i*2] > node->bbox[axis*2+1] - node->bbox[axis*2])
+			axis = i;
+	float split = (node->bbox[axis*2] + node->bbox[axis*2+1]) / 2;
+
+	/* Partition the entries by their box centers. */
+	int mid = 0;
+	for(int i=0; i<count; i++)
 	{
-		msg(WARNING, "Geometry struct is null while trying to set texture %s.\n", name);
-		return;
+		float *bbox = kuhl_collide_entries[entries[i]].bbox;
+		if((bbox[axis*2] + bbox[axis*2+1]) / 2 < split)
+		{
+			int tmp = entries[i];
+			entries[i] = entries[mid];
+			entries[mid] = tmp;
+			mid++;
+		}
 	}
-	if(texture == 0)
+	/* If everything landed on one side (coincident objects), just cut
+	 * the list in half. */
+	if(mid == 0 || mid == count)
+		mid = count/2;
+
+	/* The recursive calls may move kuhl_collide_nodes if it grows, so
+	 * don't hold onto the 'node' pointer across them. */
+	int left  = kuhl_collide_build(entries, mid);
+	int right = kuhl_collide_build(entries+mid, count-mid);
+	kuhl_collide_nodes[nodeIndex].left = left;
+	kuhl_collide_nodes[nodeIndex].right = right;
+	return nodeIndex;
+}
+
+/** Brings the BVH up to date with the registered entries: rebuilds the
+ * topology if objects were added or removed, or refits the node boxes
+ * if only transformation matrices changed. */
+static void kuhl_collide_update(void)
+{
+	if(kuhl_collide_rebuild)
 	{
-		msg(WARNING, "Texture was set to 0 while trying to set texture %s\n", name);
-		return;
+		free(kuhl_collide_nodes);
+		kuhl_collide_nodes = NULL;
+		kuhl_collide_node_count = 0;
+		if(kuhl_collide_count > 0)
+		{
+			/* A binary tree with n leaves has 2n-1 nodes. */
+			kuhl_collide_nodes = kuhl_malloc(sizeof(struct kuhl_collide_node)*
+			                                 (2*kuhl_collide_count-1));
+			int *entries = kuhl_malloc(sizeof(int)*kuhl_collide_count);
+			for(int i=0; i<kuhl_collide_count; i++)
+				entries[i] = i;
+			kuhl_collide_build(entries, kuhl_collide_count);
+			free(entries);
+		}
+		kuhl_collide_rebuild = 0;
+		kuhl_collide_refit = 0;
 	}
-	if(!glIsTexture(texture))
+	else if(kuhl_collide_refit)
 	{
-		msg(WARNING, "You tried to set the texture to an invalid texture %d (detected while trying to set texture %s)\n", texture, name);
-		return;
+		/* Children have larger indices than their parents, so a single
+		 * reverse pass updates every node from its (already updated)
+		 * children. */
+		for(int i=kuhl_collide_node_count-1; i>=0; i--)
+		{
+			struct kuhl_collide_node *node = &kuhl_collide_nodes[i];
+			if(node->entry >= 0)
+				memcpy(node->bbox, kuhl_collide_entries[node->entry].bbox, sizeof(float)*6);
+			else
+				for(int axis=0; axis<3; axis++)
+				{
+					float a, b;
+					a = kuhl_collide_nodes[node->left].bbox[axis*2];
+					b = kuhl_collide_nodes[node->right].bbox[axis*2];
+					node->bbox[axis*2] = a < b ? a : b;
+					a = kuhl_collide_nodes[node->left].bbox[axis*2+1];
+					b = kuhl_collide_nodes[node->right].bbox[axis*2+1];
+					node->bbox[axis*2+1] = a > b ? a : b;
+				}
+		}
+		kuhl_collide_refit = 0;
 	}
+}
 
-	if(kg_options & KG_FULL_LIST && geom->next != NULL)
-		kuhl_geometry_texture(geom->next, texture, name, kg_options);
-	
-	if(!glIsVertexArray(geom->vao))
-	{
-		msg(WARNING, "This geometry object has an invalid vertex array object %d (detected while setting texture %s)\n", geom->vao, name);
-		return;
-	}
-	
-	/* Find the uniform variable location inside of the GLSL program. */
-	GLint samplerLocation = glGetUniformLocation(geom->program, name);
-	if(samplerLocation == -1)
+/** Registers a geometry with the broadphase collision structure, or
+ * updates its transformation matrix if it is already registered. Call
+ * it again whenever the object moves; updating a transform only refits
+ * the tree instead of rebuilding it.
+ *
+ * @param geom The geometry to register. Its bounding box must have
+ * been filled in (kuhl_geometry_attrib() does this for the
+ * "in_Position" attribute).
+ *
+ * @param mat The 4x4 transformation matrix the geometry is drawn with.
+ */
+void kuhl_collide_add(kuhl_geometry *geom, const float mat[16])
+{
+	if(geom == NULL || !geom->has_aabb)
 	{
-		if(kg_options & KG_WARN)
-			msg(WARNING, "Texture sampler '%s' was missing in GLSL program %d.\n", name, geom->program);
+		msg(WARNING, "Can't add geometry to the collision structure because it is NULL or has no bounding box.\n");
 		return;
 	}
 
-	/* If another attribute in kuhl_geometry has the same name,
-	 * overwrite it. */
-	unsigned int destIndex = geom->texture_count;
-	for(unsigned int i=0; i<geom->texture_count; i++)
+	for(int i=0; i<kuhl_collide_count; i++)
+		if(kuhl_collide_entries[i].geom == geom)
+		{
+			memcpy(kuhl_collide_entries[i].mat, mat, sizeof(float)*16);
+			kuhl_geometry_world_bbox(geom, mat, kuhl_collide_entries[i].bbox);
+			kuhl_collide_refit = 1;
+			return;
+		}
+
+	if(kuhl_collide_count == kuhl_collide_capacity)
 	{
-		if(strcmp(name, geom->textures[i].name) == 0)
-			destIndex = i;
+		kuhl_collide_capacity = kuhl_collide_capacity == 0 ? 64 : kuhl_collide_capacity*2;
+		kuhl_collide_entries = realloc(kuhl_collide_entries,
+		                               sizeof(struct kuhl_collide_entry)*kuhl_collide_capacity);
+		if(kuhl_collide_entries == NULL)
+		{
+			msg(FATAL, "Failed to allocate space for the collision structure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	struct kuhl_collide_entry *entry = &kuhl_collide_entries[kuhl_collide_count++];
+	entry->geom = geom;
+	memcpy(entry->mat, mat, sizeof(float)*16);
+	kuhl_geometry_world_bbox(geom, mat, entry->bbox);
+	kuhl_collide_rebuild = 1;
+}
+
+/** Removes a geometry from the broadphase collision structure. Does
+ * nothing if the geometry was not registered. */
+void kuhl_collide_remove(kuhl_geometry *geom)
+{
+	for(int i=0; i<kuhl_collide_count; i++)
+		if(kuhl_collide_entries[i].geom == geom)
+		{
+			kuhl_collide_entries[i] = kuhl_collide_entries[kuhl_collide_count-1];
+			kuhl_collide_count--;
+			kuhl_collide_rebuild = 1;
+			return;
+		}
+}
+
+/** Finds the registered geometries whose bounding boxes overlap the
+ * given geometry's bounding box. The geometry being queried does not
+ * need to be registered and is never included in the results.
+ *
+ * @param geom The geometry to test against the registered objects.
+ * @param mat The 4x4 transformation matrix the geometry is drawn with.
+ * @param results Array to store pointers to the overlapping geometries in.
+ * @param maxResults Capacity of the results array.
+ * @return The number of overlapping geometries stored in results.
+ */
+int kuhl_collide_overlaps(kuhl_geometry *geom, const float mat[16],
+                          kuhl_geometry **results, int maxResults)
+{
+	if(geom == NULL || !geom->has_aabb || kuhl_collide_count == 0)
+		return 0;
+	kuhl_collide_update();
+
+	float bbox[6];
+	kuhl_geometry_world_bbox(geom, mat, bbox);
+
+	int found = 0;
+	int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while(stackSize > 0)
+	{
+		struct kuhl_collide_node *node = &kuhl_collide_nodes[stack[--stackSize]];
+		if(!kuhl_bbox_overlap(bbox, node->bbox))
+			continue;
+		if(node->entry >= 0)
+		{
+			if(kuhl_collide_entries[node->entry].geom != geom)
+			{
+				if(found == maxResults)
+					return found;
+				results[found++] = kuhl_collide_entries[node->entry].geom;
+			}
+		}
+		else if(stackSize+2 <= 64)
+		{
+			stack[stackSize++] = node->left;
+			stack[stackSize++] = node->right;
+		}
+	}
+	return found;
+}
+
+/** Does a ray intersect an axis-aligned bounding box? Uses the
+ * standard slab test.
+ *
+ * @param tNear If not NULL and the ray hits the box, the distance
+ * along the ray (in units of the direction vector) of the entry point
+ * is stored here. */
+static int kuhl_bbox_ray(const float bbox[6], const float origin[3],
+                         const float direction[3], float *tNear)
+{
+	float tMin = 0, tMax = FLT_MAX;
+	for(int axis=0; axis<3; axis++)
+	{
+		if(direction[axis] == 0)
+		{
+			/* Ray is parallel to these slabs; miss unless the origin
+			 * is between them. */
+			if(origin[axis] < bbox[axis*2] || origin[axis] > bbox[axis*2+1])
+				return 0;
+			continue;
+		}
+		float t1 = (bbox[axis*2  ] - origin[axis]) / direction[axis];
+		float t2 = (bbox[axis*2+1] - origin[axis]) / direction[axis];
+		if(t1 > t2) { float tmp = t1; t1 = t2; t2 = tmp; }
+		if(t1 > tMin) tMin = t1;
+		if(t2 < tMax) tMax = t2;
+		if(tMin > tMax)
+			return 0;
+	}
+	if(tNear)
+		*tNear = tMin;
+	return 1;
+}
+
+/** Casts a ray through the registered geometries and returns the ones
+ * whose bounding boxes the ray passes through, sorted closest first.
+ * This is a broadphase test against bounding boxes, not triangles; a
+ * selection tool would typically refine the first few results itself.
+ *
+ * @param origin The starting point of the ray.
+ * @param direction The direction of the ray (need not be normalized).
+ * @param results Array to store pointers to the hit geometries in.
+ * @param maxResults Capacity of the results array.
+ * @return The number of hit geometries stored in results.
+ */
+int kuhl_collide_ray(const float origin[3], const float direction[3],
+                     kuhl_geometry **results, int maxResults)
+{
+	if(kuhl_collide_count == 0)
+		return 0;
+	kuhl_collide_update();
+
+	int found = 0;
+	float dist[64];
+	int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while(stackSize > 0)
+	{
+		struct kuhl_collide_node *node = &kuhl_collide_nodes[stack[--stackSize]];
+		float tNear;
+		if(!kuhl_bbox_ray(node->bbox, origin, direction, &tNear))
+			continue;
+		if(node->entry >= 0)
+		{
+			if(found == maxResults || found == 64)
+				return found;
+			/* Insertion sort by entry distance so the caller sees the
+			 * closest hits first. */
+			int i = found++;
+			while(i > 0 && dist[i-1] > tNear)
+			{
+				results[i] = results[i-1];
+				dist[i] = dist[i-1];
+				i--;
+			}
+			results[i] = kuhl_collide_entries[node->entry].geom;
+			dist[i] = tNear;
+		}
+		else if(stackSize+2 <= 64)
+		{
+			stack[stackSize++] = node->left;
+			stack[stackSize++] = node->right;
+		}
+	}
+	return found;
+}
+
+
+/** Adds a texture to the provided kuhl_geometry object.
+ *
+ * @param geom The geometry object to add a texture to.
+ *
+ * @param texture The OpenGL texture ID of the texture.
+ *
+ * @param name The GLSL variable name that the texture should be connected to.
+ *
+ * @param kg_options If KG_WARN bit is set, will warn if
+ * the GLSL variable is missing from the GLSL program for this piece
+ * of geometry. If set to KG_FULL_LIST is set, the texture will
+ * be applied to all of the geometry in this list. */
+ 
+void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options)
+{
+	if(name == NULL || strlen(name) == 0)
+	{
+		msg(WARNING, "GLSL variable name was NULL or the empty string.\n");
+		return;
+	}
+	if(geom == NULL)
+	{
+		msg(WARNING, "Geometry struct is null while trying to set texture %s.\n", name);
+		return;
+	}
+	if(texture == 0)
+	{
+		msg(WARNING, "Texture was set to 0 while trying to set texture %s\n", name);
+		return;
+	}
+	if(!glIsTexture(texture))
+	{
+		msg(WARNING, "You tried to set the texture to an invalid texture %d (detected while trying to set texture %s)\n", texture, name);
+		return;
+	}
+
+	if(kg_options & KG_FULL_LIST && geom->next != NULL)
+		kuhl_geometry_texture(geom->next, texture, name, kg_options);
+	
+	if(!glIsVertexArray(geom->vao))
+	{
+		msg(WARNING, "This geometry object has an invalid vertex array object %d (detected while setting texture %s)\n", geom->vao, name);
+		return;
+	}
+	
+	/* Find the uniform variable location inside of the GLSL program. */
+	GLint samplerLocation = glGetUniformLocation(geom->program, name);
+	if(samplerLocation == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(WARNING, "Texture sampler '%s' was missing in GLSL program %d.\n", name, geom->program);
+		return;
+	}
+
+	/* If another attribute in kuhl_geometry has the same name,
+	 * overwrite it. */
+	unsigned int destIndex = geom->texture_count;
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		if(strcmp(name, geom->textures[i].name) == 0)
+			destIndex = i;
 	}
 	/* If overwriting, free resources from old attribute. */
 	if(destIndex < geom->texture_count)
@@ -759,8 +1543,20 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	if(index < 0)
 		return NULL;
 
-	/* Bind the VAO and the buffer we are interested in */
 	kuhl_attrib *attrib = &(geom->attribs[index]);
+
+	/* Interleaved attributes keep a CPU copy of their data; hand that
+	 * out instead of mapping a buffer. Mark the geometry dirty so any
+	 * changes the caller makes get re-packed into the interleaved
+	 * buffer before the next draw. */
+	if(attrib->staged != NULL)
+	{
+		geom->interleaved_dirty = 1;
+		*size = geom->vertex_count * attrib->components;
+		return attrib->staged;
+	}
+
+	/* Bind the VAO and the buffer we are interested in */
 	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
 		return NULL;
 	glBindVertexArray(geom->vao);
@@ -784,6 +1580,7 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	kuhl_errorcheck();
 	if(ret == NULL)
 		return NULL;
+	geom->buffers_mapped = 1;
 	*size = bufferNumFloats;
 
 	// unbind
@@ -794,6 +1591,335 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	return ret;
 }
 
+/* Triangle-precise ray casting: kuhl_collide_ray() only narrows a ray
+ * down to the bounding boxes it passes through, which is too coarse
+ * for pointing at a surface point (a laser pointer selects the whole
+ * object). kuhl_geometry_raycast() refines this to the nearest
+ * triangle by building a BVH over the geometry's triangles the first
+ * time the geometry is ray cast. The ray is transformed into the
+ * geometry's model space instead of transforming every triangle into
+ * world space, so the BVH survives the object moving around. */
+
+struct kuhl_raycast_tri
+{
+	float v[3][3];      /**< The three vertices of the triangle */
+	unsigned int index; /**< Index of the triangle within the geometry */
+};
+
+struct kuhl_raycast_node
+{
+	float bbox[6]; /**< Bounding box around the triangles below this node */
+	int left;      /**< Index of first child node (internal nodes only) */
+	int right;     /**< Index of second child node (internal nodes only) */
+	int first;     /**< Index of this leaf's first triangle */
+	int count;     /**< Number of triangles in this leaf; 0 for internal nodes */
+};
+
+struct kuhl_raycast_bvh
+{
+	struct kuhl_raycast_tri *tris;
+	unsigned int tri_count;
+	struct kuhl_raycast_node *nodes;
+	int node_count;
+};
+
+/** Frees a geometry's cached triangle BVH. Called when the geometry is
+ * deleted or when its vertex positions are replaced. */
+static void kuhl_raycast_free(kuhl_geometry *geom)
+{
+	if(geom->raycast_bvh == NULL)
+		return;
+	free(geom->raycast_bvh->tris);
+	free(geom->raycast_bvh->nodes);
+	free(geom->raycast_bvh);
+	geom->raycast_bvh = NULL;
+}
+
+/** Recursively builds a BVH subtree over tris[first..first+count-1],
+ * splitting at the spatial midpoint of the longest axis (the same
+ * scheme the broadphase structure uses). Returns the index of the
+ * created node. */
+static int kuhl_raycast_build(struct kuhl_raycast_bvh *bvh, int first, int count)
+{
+	int nodeIndex = bvh->node_count++;
+	struct kuhl_raycast_node *node = &bvh->nodes[nodeIndex];
+
+	/* Bounding box around all of the triangles. */
+	for(int axis=0; axis<3; axis++)
+	{
+		node->bbox[axis*2  ] =  FLT_MAX;
+		node->bbox[axis*2+1] = -FLT_MAX;
+	}
+	for(int i=first; i<first+count; i++)
+		for(int corner=0; corner<3; corner++)
+			for(int axis=0; axis<3; axis++)
+			{
+				float value = bvh->tris[i].v[corner][axis];
+				if(value < node->bbox[axis*2])
+					node->bbox[axis*2] = value;
+				if(value > node->bbox[axis*2+1])
+					node->bbox[axis*2+1] = value;
+			}
+
+	if(count <= 4) // small leaves; intersecting a few triangles is cheap
+	{
+		node->left = -1;
+		node->right = -1;
+		node->first = first;
+		node->count = count;
+		return nodeIndex;
+	}
+	node->first = 0;
+	node->count = 0;
+
+	/* Split at the spatial midpoint of the longest axis. */
+	int axis = 0;
+	for(int i=1; i<3; i++)
+		if(node->bbox[i*2+1] - node->bbox[i*2] > node->bbox[axis*2+1] - node->bbox[axis*2])
+			axis = i;
+	float split = (node->bbox[axis*2] + node->bbox[axis*2+1]) / 2;
+
+	/* Partition the triangles by their centroids. */
+	int mid = first;
+	for(int i=first; i<first+count; i++)
+	{
+		struct kuhl_raycast_tri *tri = &bvh->tris[i];
+		float center = (tri->v[0][axis] + tri->v[1][axis] + tri->v[2][axis]) / 3;
+		if(center < split)
+		{
+			struct kuhl_raycast_tri tmp = *tri;
+			bvh->tris[i] = bvh->tris[mid];
+			bvh->tris[mid] = tmp;
+			mid++;
+		}
+	}
+	/* If everything landed on one side (coincident triangles), just
+	 * cut the list in half. */
+	if(mid == first || mid == first+count)
+		mid = first + count/2;
+
+	/* The recursive calls don't move bvh->nodes (it is sized up front),
+	 * but re-index anyway to match kuhl_collide_build(). */
+	int left  = kuhl_raycast_build(bvh, first, mid-first);
+	int right = kuhl_raycast_build(bvh, mid, first+count-mid);
+	bvh->nodes[nodeIndex].left = left;
+	bvh->nodes[nodeIndex].right = right;
+	return nodeIndex;
+}
+
+/** Returns the geometry's triangle BVH, building it on the first call.
+ * Returns NULL if the geometry can't be ray cast (not GL_TRIANGLES, or
+ * no "in_Position" attribute). */
+static struct kuhl_raycast_bvh* kuhl_raycast_get_bvh(kuhl_geometry *geom)
+{
+	if(geom->raycast_bvh != NULL)
+		return geom->raycast_bvh;
+	if(geom->primitive_type != GL_TRIANGLES)
+		return NULL;
+
+	GLint size = 0;
+	GLfloat *pos = kuhl_geometry_attrib_get(geom, "in_Position", &size);
+	if(pos == NULL || size < (GLint)(geom->vertex_count*3))
+		return NULL;
+
+	/* Get a CPU copy of the index array if the geometry is indexed;
+	 * otherwise consecutive vertices form triangles. */
+	GLuint *indices = NULL;
+	unsigned int triCount;
+	if(geom->indices_len > 0)
+	{
+		triCount = geom->indices_len/3;
+		indices = kuhl_malloc(sizeof(GLuint)*geom->indices_len);
+		glBindVertexArray(geom->vao);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+		GLuint *mapped = (GLuint*) glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_READ_ONLY);
+		if(mapped == NULL)
+		{
+			glBindVertexArray(0);
+			free(indices);
+			return NULL;
+		}
+		memcpy(indices, mapped, sizeof(GLuint)*geom->indices_len);
+		glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+		glBindVertexArray(0);
+		kuhl_errorcheck();
+	}
+	else
+		triCount = geom->vertex_count/3;
+	if(triCount == 0)
+	{
+		free(indices);
+		return NULL;
+	}
+
+	struct kuhl_raycast_bvh *bvh = kuhl_malloc(sizeof(struct kuhl_raycast_bvh));
+	bvh->tri_count = triCount;
+	bvh->tris = kuhl_malloc(sizeof(struct kuhl_raycast_tri)*triCount);
+	/* A binary tree with n leaves has at most 2n-1 nodes. */
+	bvh->nodes = kuhl_malloc(sizeof(struct kuhl_raycast_node)*(2*triCount-1));
+	bvh->node_count = 0;
+
+	for(unsigned int t=0; t<triCount; t++)
+	{
+		bvh->tris[t].index = t;
+		for(int corner=0; corner<3; corner++)
+		{
+			unsigned int vertex = indices ? indices[t*3+corner] : t*3+corner;
+			vec3f_copy(bvh->tris[t].v[corner], &pos[vertex*3]);
+		}
+	}
+	free(indices);
+
+	kuhl_raycast_build(bvh, 0, triCount);
+	geom->raycast_bvh = bvh;
+	return bvh;
+}
+
+/** Does a ray intersect a triangle? Standard Moller-Trumbore test;
+ * both sides of the triangle count as hits so rays can hit the inside
+ * of open meshes.
+ *
+ * @param t If the ray hits the triangle, the distance along the ray
+ * (in units of the direction vector) is stored here. */
+static int kuhl_raycast_triangle(const struct kuhl_raycast_tri *tri,
+                                 const float origin[3], const float direction[3],
+                                 float *t)
+{
+	float edge1[3], edge2[3], pvec[3], tvec[3], qvec[3];
+	vec3f_sub_new(edge1, tri->v[1], tri->v[0]);
+	vec3f_sub_new(edge2, tri->v[2], tri->v[0]);
+	vec3f_cross_new(pvec, direction, edge2);
+	float det = vec3f_dot(edge1, pvec);
+	if(det > -1e-7f && det < 1e-7f) // ray is parallel to the triangle
+		return 0;
+	float invDet = 1/det;
+	vec3f_sub_new(tvec, origin, tri->v[0]);
+	float u = vec3f_dot(tvec, pvec) * invDet;
+	if(u < 0 || u > 1)
+		return 0;
+	vec3f_cross_new(qvec, tvec, edge1);
+	float v = vec3f_dot(direction, qvec) * invDet;
+	if(v < 0 || u+v > 1)
+		return 0;
+	float dist = vec3f_dot(edge2, qvec) * invDet;
+	if(dist < 0) // the triangle is behind the ray
+		return 0;
+	*t = dist;
+	return 1;
+}
+
+/** Casts a ray against a geometry (or linked list of geometry) and
+ * finds the nearest triangle it hits, with the exact intersection
+ * point---precise enough for a laser-pointer selecting a surface
+ * point rather than a whole object. Use kuhl_collide_ray() first to
+ * narrow a scene down to a few candidate objects, then this function
+ * on those candidates.
+ *
+ * A BVH over the geometry's triangles is built on the first call (and
+ * rebuilt if the "in_Position" attribute is replaced with
+ * kuhl_geometry_attrib()), so repeated ray casts only descend into
+ * the parts of the mesh a ray can touch.
+ *
+ * @param geom The geometry to cast the ray against. If it is a linked
+ * list, the whole list is tested.
+ * @param mat The 4x4 transformation matrix the geometry is drawn
+ * with, or NULL if it is drawn untransformed.
+ * @param origin The world-space starting point of the ray.
+ * @param direction The world-space direction of the ray (need not be
+ * normalized).
+ * @param hit Filled in with the nearest intersection (may not be NULL).
+ * @return 1 if the ray hit a triangle; 0 otherwise.
+ */
+int kuhl_geometry_raycast(kuhl_geometry *geom, float mat[16],
+                          const float origin[3], const float direction[3],
+                          kuhl_raycast_hit *hit)
+{
+	if(geom == NULL || origin == NULL || direction == NULL || hit == NULL)
+		return 0;
+
+	int found = 0;
+	float bestT = FLT_MAX;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		struct kuhl_raycast_bvh *bvh = kuhl_raycast_get_bvh(g);
+		if(bvh == NULL)
+			continue;
+
+		/* Transform the ray into the geometry's model space. The ray
+		 * parameter t is preserved by the transformation, so distances
+		 * are comparable across the geometries in the list. */
+		float full[16], inv[16];
+		if(mat != NULL)
+			mat4f_mult_mat4f_new(full, mat, g->matrix);
+		else
+			memcpy(full, g->matrix, sizeof(float)*16);
+		if(mat4f_invert_new(inv, full) == 0)
+			continue; // singular matrix (e.g. scaled to nothing)
+		float rayOrigin[4]    = { origin[0], origin[1], origin[2], 1 };
+		float rayDirection[4] = { direction[0], direction[1], direction[2], 0 };
+		mat4f_mult_vec4f(rayOrigin, inv);
+		mat4f_mult_vec4f(rayDirection, inv);
+
+		int stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while(stackSize > 0)
+		{
+			struct kuhl_raycast_node *node = &bvh->nodes[stack[--stackSize]];
+			float tNear;
+			if(!kuhl_bbox_ray(node->bbox, rayOrigin, rayDirection, &tNear))
+				continue;
+			if(tNear >= bestT) // a closer hit already exists
+				continue;
+			if(node->count > 0)
+			{
+				for(int i=node->first; i<node->first+node->count; i++)
+				{
+					float t;
+					if(kuhl_raycast_triangle(&bvh->tris[i], rayOrigin, rayDirection, &t)
+					   && t < bestT)
+					{
+						bestT = t;
+						found = 1;
+						hit->t = t;
+						hit->triangle = bvh->tris[i].index;
+						hit->geom = g;
+
+						/* Normals transform by the inverse transpose of
+						 * the model matrix (which we already have the
+						 * inverse of). */
+						float edge1[3], edge2[3], normal[3];
+						vec3f_sub_new(edge1, bvh->tris[i].v[1], bvh->tris[i].v[0]);
+						vec3f_sub_new(edge2, bvh->tris[i].v[2], bvh->tris[i].v[0]);
+						vec3f_cross_new(normal, edge1, edge2);
+						for(int row=0; row<3; row++)
+							hit->normal[row] = inv[row*4+0]*normal[0] +
+							                   inv[row*4+1]*normal[1] +
+							                   inv[row*4+2]*normal[2];
+					}
+				}
+			}
+			else if(stackSize+2 <= 64)
+			{
+				stack[stackSize++] = node->left;
+				stack[stackSize++] = node->right;
+			}
+		}
+	}
+
+	if(found)
+	{
+		vec3f_scalarMult_new(hit->point, (float*) direction, hit->t);
+		vec3f_add_new(hit->point, hit->point, (float*) origin);
+		vec3f_normalize(hit->normal);
+		/* Make the normal face back toward the ray origin so callers
+		 * don't need to care about the triangle's winding. */
+		if(vec3f_dot(hit->normal, (float*) direction) > 0)
+			vec3f_scalarMult(hit->normal, -1);
+	}
+	return found;
+}
+
 /** Changes the GLSL program that is used by a kuhl_geometry object.
  *
  * @param geom A geometry that you want to change the GLSL program for.
@@ -831,29 +1957,45 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
 	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
 		kuhl_attrib *attrib = &(geom->attribs[i]);
-		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+
+		/* Interleaved attributes share the geometry's interleaved
+		 * buffer. If it hasn't been built yet, the locations for the
+		 * new program get set up when the buffer is built at the next
+		 * draw. */
+		if(attrib->staged != NULL)
+		{
+			if(geom->interleaved_bufferobject == 0)
+				continue;
+			glBindBuffer(GL_ARRAY_BUFFER, geom->interleaved_bufferobject);
+		}
+		else
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
 		kuhl_errorcheck();
 
 		// Find attribute location in the new program; enable that location
 		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
 		glEnableVertexAttribArray(attribLocation);
 
-		/* Get the size of the buffer */
-		GLint bufferSize = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-		GLint bufferNumFloats = bufferSize/sizeof(GLfloat);
-		GLint components = bufferNumFloats / geom->vertex_count;
-
 		/* Connect this vertex attribute with the (possibly different)
-		 * attribute location. */
+		 * attribute location. Interleaved attributes keep their
+		 * stride/offset; streaming attributes keep the offset of their
+		 * active region; attributes in their own buffer are tightly
+		 * packed. */
+		GLuint stride = attrib->staged != NULL ? geom->interleaved_stride : 0;
+		GLuint offset = (attrib->staged != NULL || attrib->stream_map != NULL) ? attrib->offset : 0;
 		glVertexAttribPointer(
 			attribLocation, // attribute location in glsl program
-			components, // number of elements (x,y,z)
+			attrib->components, // number of elements (x,y,z)
 			GL_FLOAT, // type of each element
 			GL_FALSE, // should OpenGL normalize values?
-			0,        // no extra data between each position
-			0 );      // offset of first element
+			stride,   // bytes between consecutive entries
+			(void*)(uintptr_t) offset); // offset of first element
 		kuhl_errorcheck();
+
+		/* Per-instance attributes keep their divisor at the new
+		 * location. */
+		if(attrib->divisor != 0)
+			glVertexAttribDivisor(attribLocation, attrib->divisor);
 	}
 
 	/* NOTE: We do not have to update the uniform locations because
@@ -877,11 +2019,22 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
  * @param name The GLSL variable name that this attribute should be
  * connected to.
  *
- * @param warnIfAttribMissing If nonzero, print a warning if the
- * attribute isn't present in the GLSL program for this geometry
- * object.
+ * @param kg_options Set KG_WARN to print a warning if the attribute
+ * isn't present in the GLSL program for this geometry object. Set
+ * KG_INSTANCED to make the attribute advance once per instance instead
+ * of once per vertex when the geometry is drawn with
+ * kuhl_geometry_draw_instanced(); in that case 'data' should contain
+ * geom->instance_count * components floats and geom->instance_count
+ * must be set before calling this function. Set KG_INTERLEAVE to pack
+ * this geometry's per-vertex attributes into a single interleaved
+ * vertex buffer instead of one buffer per attribute---interleaving
+ * helps GPUs (particularly integrated ones) fetch all of a vertex's
+ * data from one place. The interleaved buffer is built when the
+ * geometry is first drawn; pass KG_INTERLEAVE consistently for every
+ * attribute of the geometry. Per-instance attributes always get their
+ * own buffer.
  */
-void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int warnIfAttribMissing)
+void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options)
 {
 	if(name == NULL || strlen(name) == 0)
 	{
@@ -910,6 +2063,49 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 		msg(WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", geom->vao, name);
 		return;
 	}
+	int instanced = (kg_options & KG_INSTANCED) != 0;
+	if(instanced)
+	{
+		if(geom->instance_count == 0)
+		{
+			msg(WARNING, "Unable to add per-instance attribute '%s' to the geometry object because geom->instance_count is 0. Set it before calling this function.\n", name);
+			return;
+		}
+		if(!glewIsSupported("GL_ARB_instanced_arrays") && !glewIsSupported("GL_VERSION_3_3"))
+		{
+			msg(WARNING, "Unable to add per-instance attribute '%s' because this OpenGL implementation doesn't support instanced arrays.\n", name);
+			return;
+		}
+	}
+
+	/* Remember an axis-aligned bounding box around the vertex
+	 * positions so that kuhl_geometry_draw() can frustum cull this
+	 * geometry (see kuhl_cull_set_frustum()). All of the example
+	 * programs and the model loader use "in_Position" for vertex
+	 * positions. */
+	if(!instanced && components == 3 && strcmp(name, "in_Position") == 0 &&
+	   geom->vertex_count > 0)
+	{
+		for(int i=0; i<3; i++)
+		{
+			geom->aabb[i*2  ] = data[i]; // min
+			geom->aabb[i*2+1] = data[i]; // max
+		}
+		for(GLuint v=1; v<geom->vertex_count; v++)
+			for(int i=0; i<3; i++)
+			{
+				if(data[v*3+i] < geom->aabb[i*2])
+					geom->aabb[i*2] = data[v*3+i];
+				if(data[v*3+i] > geom->aabb[i*2+1])
+					geom->aabb[i*2+1] = data[v*3+i];
+			}
+		geom->has_aabb = 1;
+
+		/* The vertex positions changed, so any triangle BVH built for
+		 * kuhl_geometry_raycast() is stale. It gets rebuilt on the
+		 * next ray cast. */
+		kuhl_raycast_free(geom);
+	}
 
 	/* If this attribute isn't available in the GLSL program, move
 	 * on to the next one. */
@@ -920,7 +2116,7 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	GLint attribLocation = glGetAttribLocation(geom->program, name);
 	if(attribLocation == -1)
 	{
-		if(warnIfAttribMissing)
+		if(kg_options & KG_WARN)
 			msg(WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
 			    name, geom->program);
 		return;
@@ -940,8 +2136,19 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	{
 		/* If overwriting, free resources from old attribute. */
 		free(geom->attribs[destIndex].name);
+		if(geom->attribs[destIndex].stream_map != NULL)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[destIndex].bufferobject);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		for(int i=0; i<3; i++)
+			if(geom->attribs[destIndex].stream_fence[i] != NULL)
+				glDeleteSync(geom->attribs[destIndex].stream_fence[i]);
 		if(glIsBuffer(geom->attribs[destIndex].bufferobject))
 			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
+		if(geom->attribs[destIndex].staged != NULL)
+			free(geom->attribs[destIndex].staged);
 	}
 	msg(DEBUG, "Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", name, destIndex, attribLocation, geom->program);
 	
@@ -955,6 +2162,37 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	/* Set up this attribute. */
 	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
 	attrib->name = strdup(name);
+	attrib->divisor = instanced ? 1 : 0;
+	attrib->components = components;
+	attrib->offset = 0;
+	attrib->staged = NULL;
+	attrib->stream_map = NULL;
+	for(int i=0; i<3; i++)
+		attrib->stream_fence[i] = NULL;
+	attrib->stream_region = 0;
+	attrib->stream_fallback = 0;
+
+	/* Per-vertex attributes with KG_INTERLEAVE don't get their own
+	 * buffer object. Instead, keep a CPU copy of the data; all of the
+	 * geometry's staged attributes get packed into one interleaved
+	 * buffer when the geometry is next drawn. */
+	if((kg_options & KG_INTERLEAVE) && !instanced)
+	{
+		geom->interleaved = 1;
+		attrib->bufferobject = 0;
+		attrib->staged = kuhl_malloc(sizeof(GLfloat)*geom->vertex_count*components);
+		memcpy(attrib->staged, data, sizeof(GLfloat)*geom->vertex_count*components);
+
+		/* Force the interleaved buffer to be rebuilt since the layout
+		 * changed. */
+		if(geom->interleaved_bufferobject != 0)
+		{
+			glDeleteBuffers(1, &(geom->interleaved_bufferobject));
+			geom->interleaved_bufferobject = 0;
+		}
+		geom->interleaved_dirty = 1;
+		return;
+	}
 
 	/* Switch to our vertex array object. */
 	glBindVertexArray(geom->vao);
@@ -971,9 +2209,12 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
 	kuhl_errorcheck();
 
-	/* Copy our data into the buffer object that is currently bound. */
+	/* Copy our data into the buffer object that is currently bound.
+	 * Per-instance attributes hold one entry per instance instead of
+	 * one entry per vertex. */
+	GLuint entryCount = instanced ? geom->instance_count : geom->vertex_count;
 	glBufferData(GL_ARRAY_BUFFER,
-	             sizeof(GLfloat)*geom->vertex_count*components,
+	             sizeof(GLfloat)*entryCount*components,
 	             data, GL_STATIC_DRAW);
 	kuhl_errorcheck();
 
@@ -990,35 +2231,248 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 		0 );      // offset of first element
 	kuhl_errorcheck();
 
+	/* Tell OpenGL to advance this attribute once per instance rather
+	 * than once per vertex. (Not calling glVertexAttribDivisor() at
+	 * all for ordinary attributes keeps us working on OpenGL
+	 * implementations that don't have the function.) */
+	if(attrib->divisor != 0)
+	{
+		glVertexAttribDivisor(attribLocation, attrib->divisor);
+		kuhl_errorcheck();
+	}
+
 	// unbind
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 }
 
-/** Calculates the number of objects in the kuhl_geometry linked list.
-
-    @param geom The geometry object which you want to know the length of.
-
-    @return The number of geometry objects in the list.
-*/
-unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+/* Streaming attributes: re-specifying an attribute every frame with
+   kuhl_geometry_attrib() makes glBufferData() wait until the GPU is
+   done reading the old data (or silently allocate new storage), which
+   stalls deforming-mesh programs. kuhl_geometry_attrib_stream()
+   converts an attribute into a triple-buffered streaming buffer
+   instead: one buffer three times the attribute's size, persistently
+   mapped with GL_ARB_buffer_storage, with a fence guarding each
+   third. Each update the caller writes the next region directly
+   through the mapped pointer (no CPU-side copy, no driver
+   synchronization) while the GPU is still free to read the previous
+   regions, and the fence is only waited on if the CPU gets a full
+   three frames ahead of the GPU. On OpenGL implementations without
+   GL_ARB_buffer_storage the same calls fall back to
+   glMapBufferRange() with buffer orphaning, which still avoids the
+   mid-frame stall. */
+
+/** How many regions a streaming attribute's buffer is divided
+ * into. Three lets the CPU write one region while the GPU reads
+ * another and a third is in flight. */
+#define KUHL_STREAM_REGIONS 3
+
+/** Returns the size in bytes of one region of an attribute's
+ * streaming buffer. */
+static GLuint kuhl_attrib_stream_region_bytes(const kuhl_geometry *geom, const kuhl_attrib *attrib)
 {
-	if(geom == NULL)
-		return 0;
-	const kuhl_geometry *g = geom;
-	unsigned int count = 1;
-	while(g->next != NULL)
-	{
-		count++;
-		g = g->next;
-	}
-	return count;
+	GLuint entryCount = attrib->divisor != 0 ? geom->instance_count : geom->vertex_count;
+	return sizeof(GLfloat)*entryCount*attrib->components;
 }
 
+/** Begins a streamed update of an existing attribute. The returned
+ * pointer refers to GPU-visible memory large enough for the whole
+ * attribute (vertex_count * components floats); write the new values
+ * into it and then call kuhl_geometry_attrib_stream_commit() to make
+ * the next draw use them. The memory is write-only---don't read from
+ * it, and don't keep the pointer after committing.
+ *
+ * The first streamed update converts the attribute's buffer into a
+ * triple-buffered streaming buffer (see the comment above); the data
+ * previously uploaded with kuhl_geometry_attrib() is discarded, so
+ * the caller must write every value before committing. Attributes
+ * packed into an interleaved buffer (KG_INTERLEAVE) can't be
+ * streamed.
+ *
+ * @param geom The geometry containing the attribute.
+ * @param name The GLSL variable name of the attribute, as passed to
+ * kuhl_geometry_attrib().
+ * @return A pointer to write the attribute data into, or NULL on
+ * error.
+ */
+GLfloat* kuhl_geometry_attrib_stream(kuhl_geometry *geom, const char *name)
+{
+	if(geom == NULL || name == NULL)
+		return NULL;
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+	{
+		msg(WARNING, "Can't stream attribute '%s' because the geometry doesn't have it; add it with kuhl_geometry_attrib() first.\n", name);
+		return NULL;
+	}
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->staged != NULL)
+	{
+		msg(WARNING, "Can't stream attribute '%s' because it is packed into the geometry's interleaved buffer.\n", name);
+		return NULL;
+	}
+
+	GLuint regionBytes = kuhl_attrib_stream_region_bytes(geom, attrib);
+
+	/* Convert the attribute's buffer into a streaming buffer on the
+	 * first streamed update. */
+	if(attrib->stream_map == NULL && attrib->stream_fallback == 0)
+	{
+		if(glIsBuffer(attrib->bufferobject))
+			glDeleteBuffers(1, &(attrib->bufferobject));
+		glGenBuffers(1, &(attrib->bufferobject));
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+
+		if(glewIsSupported("GL_ARB_buffer_storage") || glewIsSupported("GL_VERSION_4_4"))
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_ARRAY_BUFFER, regionBytes*KUHL_STREAM_REGIONS, NULL, flags);
+			attrib->stream_map = glMapBufferRange(GL_ARRAY_BUFFER, 0,
+			                                      regionBytes*KUHL_STREAM_REGIONS, flags);
+			kuhl_errorcheck();
+		}
+		if(attrib->stream_map == NULL)
+		{
+			/* No persistent mapping available; allocate a normal
+			 * buffer and map/orphan it per update instead. */
+			msg(WARNING, "GL_ARB_buffer_storage is not available; streaming attribute '%s' with buffer orphaning instead of a persistent mapping.\n", name);
+			attrib->stream_fallback = 1;
+			glBufferData(GL_ARRAY_BUFFER, regionBytes, NULL, GL_STREAM_DRAW);
+		}
+		attrib->stream_region = 0;
+		attrib->offset = 0;
+
+		/* Point the VAO at region 0 of the new buffer. */
+		glBindVertexArray(geom->vao);
+		GLint attribLocation = glGetAttribLocation(geom->program, attrib->name);
+		glVertexAttribPointer(attribLocation, attrib->components, GL_FLOAT,
+		                      GL_FALSE, 0, (void*) 0);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+
+	if(attrib->stream_fallback)
+	{
+		/* Orphan the buffer so the driver gives us fresh storage
+		 * instead of making us wait for the GPU to finish with the
+		 * old contents. */
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		glBufferData(GL_ARRAY_BUFFER, regionBytes, NULL, GL_STREAM_DRAW);
+		GLfloat *ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, regionBytes,
+		                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return ptr;
+	}
+
+	/* Reuse the oldest region. Its fence was inserted after the last
+	 * draw commands that read it; with three regions in rotation the
+	 * fence has almost always been signaled long ago, so the wait
+	 * below only blocks when the CPU is a full three updates ahead of
+	 * the GPU. */
+	int next = (attrib->stream_region+1) % KUHL_STREAM_REGIONS;
+	if(attrib->stream_fence[next] != NULL)
+	{
+		GLenum r = glClientWaitSync(attrib->stream_fence[next],
+		                            GL_SYNC_FLUSH_COMMANDS_BIT,
+		                            1000000000); // 1 second, in nanoseconds
+		if(r == GL_TIMEOUT_EXPIRED || r == GL_WAIT_FAILED)
+			msg(WARNING, "Waited more than a second for the GPU to release a streaming region of attribute '%s'.\n", name);
+		glDeleteSync(attrib->stream_fence[next]);
+		attrib->stream_fence[next] = NULL;
+	}
+	return attrib->stream_map + next*(regionBytes/sizeof(GLfloat));
+}
+
+/** Completes a streamed update begun by
+ * kuhl_geometry_attrib_stream(): makes subsequent draws read the
+ * newly written region and fences off the region that draws were
+ * using until now.
+ *
+ * @param geom The geometry containing the attribute.
+ * @param name The GLSL variable name of the attribute.
+ */
+void kuhl_geometry_attrib_stream_commit(kuhl_geometry *geom, const char *name)
+{
+	if(geom == NULL || name == NULL)
+		return;
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return;
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+
+	if(attrib->stream_fallback)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	else if(attrib->stream_map != NULL)
+	{
+		GLuint regionBytes = kuhl_attrib_stream_region_bytes(geom, attrib);
+		int next = (attrib->stream_region+1) % KUHL_STREAM_REGIONS;
+
+		/* Draws from here on read the region we just wrote. */
+		glBindVertexArray(geom->vao);
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		GLint attribLocation = glGetAttribLocation(geom->program, attrib->name);
+		attrib->offset = next*regionBytes;
+		glVertexAttribPointer(attribLocation, attrib->components, GL_FLOAT,
+		                      GL_FALSE, 0, (void*)(uintptr_t) attrib->offset);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+
+		/* Every draw that reads the old region has already been
+		 * issued, so a fence inserted now is signaled once those
+		 * draws finish. */
+		if(attrib->stream_fence[attrib->stream_region] != NULL)
+			glDeleteSync(attrib->stream_fence[attrib->stream_region]);
+		attrib->stream_fence[attrib->stream_region] =
+			glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		attrib->stream_region = next;
+		kuhl_errorcheck();
+	}
+	else
+	{
+		msg(WARNING, "kuhl_geometry_attrib_stream_commit() called for attribute '%s' without a matching kuhl_geometry_attrib_stream() call.\n", name);
+		return;
+	}
+
+	/* The vertex positions just changed in a way we never saw on the
+	 * CPU: the bounding box used for frustum culling is stale (so
+	 * stop culling with it) and so is any triangle BVH built for ray
+	 * casting. */
+	if(strcmp(name, "in_Position") == 0)
+	{
+		geom->has_aabb = 0;
+		kuhl_raycast_free(geom);
+	}
+}
+
+/** Calculates the number of objects in the kuhl_geometry linked list.
+
+    @param geom The geometry object which you want to know the length of.
+
+    @return The number of geometry objects in the list.
+*/
+unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return 0;
+	const kuhl_geometry *g = geom;
+	unsigned int count = 1;
+	while(g->next != NULL)
+	{
+		count++;
+		g = g->next;
+	}
+	return count;
+}
+
+
+/** Initializes the vertex array object (VAO) associated with this
+    kuhl_geometry and initializes other variables inside of the struct.
 
-/** Initializes the vertex array object (VAO) associated with this
-    kuhl_geometry and initializes other variables inside of the struct.
-
     @param geom A kuhl_geometry struct populated with the information
     necessary to draw some geometry.
 
@@ -1055,6 +2509,7 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 
 	geom->program = program;
 	geom->vertex_count = vertexCount;
+	geom->instance_count = 0;
 	geom->primitive_type = primitive_type;
 
 	geom->attrib_count = 0;
@@ -1064,12 +2519,28 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 	geom->indices_bufferobject = 0;
 
 	mat4f_identity(geom->matrix);
+	geom->has_aabb = 0;
 	geom->has_been_drawn = 0;
+	geom->buffers_mapped = 0;
+	geom->raycast_bvh = NULL;
+
+	geom->occlusion_query = 0;
+	geom->occlusion_inflight = 0;
+	geom->occlusion_hidden = 0;
+	geom->occlusion_zeros = 0;
+	geom->occlusion_vao = 0;
+	geom->occlusion_buffer = 0;
+
+	geom->interleaved = 0;
+	geom->interleaved_bufferobject = 0;
+	geom->interleaved_stride = 0;
+	geom->interleaved_dirty = 0;
 	
 #if KUHL_UTIL_USE_ASSIMP
 	geom->assimp_node  = NULL;
 	geom->assimp_scene = NULL;
 	geom->bones        = NULL;
+	geom->pending_stage = NULL;
 #endif
 
 	geom->next = NULL;
@@ -1169,34 +2640,456 @@ void kuhl_geometry_init(kuhl_geometry *geom)
 }
 #endif
 
-/** Draws a kuhl_geometry struct to the screen. The struct passed into
- * this function should have been set up with kuhl_geometry_new() and
- * at least one position attribute with kuhl_geometry_attrib() before
- * calling this function.
+/* A shadow copy of the OpenGL binding state that kuhl_geometry_draw()
+ * changes. The shadow is synchronized with OpenGL's real state (a few
+ * glGet calls) once at the start of each top-level
+ * kuhl_geometry_draw() call and is then used to skip redundant bind
+ * calls while a linked list of geometry objects is drawn. Geometry
+ * chains produced by kuhl_load_model() typically share one program and
+ * repeatedly bind the same textures, so most of the binds can be
+ * skipped. The shadow is scratch state for a single draw call; it is
+ * never trusted across calls since applications bind programs and
+ * textures directly. */
+#define KUHL_STATE_UNKNOWN 0xffffffff
+static GLuint kuhl_state_program;
+static GLuint kuhl_state_vao;
+static unsigned int kuhl_state_texunit; /**< Active texture unit (0=GL_TEXTURE0) */
+static GLuint kuhl_state_texture[MAX_TEXTURES]; /**< GL_TEXTURE_2D binding per unit */
+
+/** Synchronizes the shadow state with OpenGL's real binding state.
+ * Only the active texture unit's binding can be queried cheaply; other
+ * units are marked unknown so the first bind to them is never
+ * skipped. */
+static void kuhl_state_sync(void)
+{
+	GLint value = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+	kuhl_state_program = value;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+	kuhl_state_vao = value;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &value);
+	kuhl_state_texunit = value - GL_TEXTURE0;
+	for(int i=0; i<MAX_TEXTURES; i++)
+		kuhl_state_texture[i] = KUHL_STATE_UNKNOWN;
+	if(kuhl_state_texunit < MAX_TEXTURES)
+	{
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &value);
+		kuhl_state_texture[kuhl_state_texunit] = value;
+	}
+}
 
- @param geom The geometry to draw to the screen. If the kuhl_geometry
- object is a part of a linked list, this function will draw each of
- the objects in order. */
-void kuhl_geometry_draw(kuhl_geometry *geom)
+/** glUseProgram() which skips the call if the program is already in
+ * use according to the shadow state. */
+static void kuhl_state_use_program(GLuint program)
 {
-	if(geom == NULL)
+	if(kuhl_state_program == program)
 		return;
-	
+	glUseProgram(program);
+	kuhl_state_program = program;
+}
+
+/** glBindVertexArray() which skips the call if the vertex array object
+ * is already bound according to the shadow state. */
+static void kuhl_state_bind_vao(GLuint vao)
+{
+	if(kuhl_state_vao == vao)
+		return;
+	glBindVertexArray(vao);
+	kuhl_state_vao = vao;
+}
+
+/** Binds a texture to GL_TEXTURE_2D on the given texture unit,
+ * skipping the glActiveTexture() and/or glBindTexture() calls when the
+ * shadow state says they would be redundant. */
+static void kuhl_state_bind_texture(unsigned int unit, GLuint texture)
+{
+	if(unit < MAX_TEXTURES && kuhl_state_texture[unit] == texture)
+		return;
+	if(kuhl_state_texunit != unit)
+	{
+		glActiveTexture(GL_TEXTURE0+unit);
+		kuhl_state_texunit = unit;
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if(unit < MAX_TEXTURES)
+		kuhl_state_texture[unit] = texture;
+}
+
+/** Packs the staged attributes of an interleaved geometry (see
+ * KG_INTERLEAVE) into a single vertex buffer and points the vertex
+ * array object at it with the appropriate strides and offsets. Called
+ * before drawing whenever the buffer is missing or the staged data has
+ * changed. */
+static void kuhl_private_geometry_interleave(kuhl_geometry *geom)
+{
+	/* Compute the stride of one interleaved vertex and the offset of
+	 * each attribute within it. */
+	GLuint stride = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->staged == NULL)
+			continue;
+		attrib->offset = stride;
+		stride += sizeof(GLfloat)*attrib->components;
+	}
+	geom->interleaved_stride = stride;
+	if(stride == 0)
+		return;
+
+	/* Pack the staged arrays into one interleaved array. */
+	GLfloat *packed = kuhl_malloc(stride*geom->vertex_count);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->staged == NULL)
+			continue;
+		for(unsigned int v=0; v<geom->vertex_count; v++)
+			memcpy((char*)packed + v*stride + attrib->offset,
+			       attrib->staged + v*attrib->components,
+			       sizeof(GLfloat)*attrib->components);
+	}
+
+	glBindVertexArray(geom->vao);
+	int newBuffer = (geom->interleaved_bufferobject == 0);
+	if(newBuffer)
+		glGenBuffers(1, &(geom->interleaved_bufferobject));
+	glBindBuffer(GL_ARRAY_BUFFER, geom->interleaved_bufferobject);
+	if(newBuffer)
+		glBufferData(GL_ARRAY_BUFFER, stride*geom->vertex_count,
+		             packed, GL_STATIC_DRAW);
+	else
+		glBufferSubData(GL_ARRAY_BUFFER, 0, stride*geom->vertex_count, packed);
 	kuhl_errorcheck();
-	
-	/* Record the OpenGL state so that we can restore it when we have
-	 * finished drawing. */
-	GLint previouslyUsedProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
-	GLint previouslyBoundTexture = 0;
-	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
-	GLint previouslyActiveTexture = 0;
-	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
-	GLint previousVAO=0;
-	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
-
-	/* Check that there is a valid program and VAO object for us to use. */
-	if(glIsProgram(geom->program) == 0 || glIsVertexArray(geom->vao) == 0)
+	free(packed);
+
+	/* Point each attribute at its slice of the interleaved buffer. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->staged == NULL)
+			continue;
+		GLint attribLocation = glGetAttribLocation(geom->program, attrib->name);
+		if(attribLocation == -1)
+			continue;
+		glEnableVertexAttribArray(attribLocation);
+		glVertexAttribPointer(attribLocation, attrib->components,
+		                      GL_FLOAT, GL_FALSE, stride,
+		                      (void*)(uintptr_t) attrib->offset);
+		kuhl_errorcheck();
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	kuhl_state_vao = 0; // keep the shadow state in sync with the bind above
+	geom->interleaved_dirty = 0;
+}
+
+/* Frustum culling: kuhl_cull_set_frustum() extracts the six frustum
+ * planes from a projection and modelview matrix. While culling is
+ * enabled, kuhl_geometry_draw() tests each geometry's bounding box
+ * against the planes and skips geometry that is entirely outside the
+ * frustum, so a large model chain only submits the meshes the camera
+ * can actually see. */
+static float kuhl_cull_planes[6][4];
+static int kuhl_cull_enabled = 0;
+static int kuhl_cull_drawn = 0;
+static int kuhl_cull_culled = 0;
+
+/** Enables frustum culling for subsequent kuhl_geometry_draw() calls.
+ * Call it once per frame (or once per eye) with the same matrices you
+ * send to your vertex program; geometry whose bounding box falls
+ * entirely outside the frustum is then skipped. Call
+ * kuhl_cull_disable() before drawing things that use different
+ * matrices (HUD overlays, etc.).
+ *
+ * @param projection The projection matrix from viewmat_get().
+ *
+ * @param modelview The modelview matrix the geometry will be drawn
+ * with. */
+void kuhl_cull_set_frustum(const float projection[16], const float modelview[16])
+{
+	float m[16];
+	mat4f_mult_mat4f_new(m, projection, modelview);
+
+	/* Gribb & Hartmann frustum plane extraction. Our matrices are
+	 * column-major, so row i, column j of the matrix is m[j*4+i]. Plane
+	 * 2i is the "min" side of axis i (left, bottom, near); plane 2i+1
+	 * is the "max" side (right, top, far). Each plane is (a,b,c,d) with
+	 * points inside the frustum satisfying a*x+b*y+c*z+d >= 0. */
+	for(int i=0; i<3; i++)
+		for(int j=0; j<4; j++)
+		{
+			kuhl_cull_planes[i*2  ][j] = m[j*4+3] + m[j*4+i];
+			kuhl_cull_planes[i*2+1][j] = m[j*4+3] - m[j*4+i];
+		}
+	kuhl_cull_enabled = 1;
+}
+
+/** Disables frustum culling until the next kuhl_cull_set_frustum()
+ * call. */
+void kuhl_cull_disable(void)
+{
+	kuhl_cull_enabled = 0;
+}
+
+/** Retrieves (and resets) counts of how many geometry structs were
+ * drawn and how many were culled since the last call.
+ *
+ * @param drawn Location to store the number of geometries drawn (may be NULL).
+ * @param culled Location to store the number of geometries culled (may be NULL).
+ */
+void kuhl_cull_stats(int *drawn, int *culled)
+{
+	if(drawn)
+		*drawn = kuhl_cull_drawn;
+	if(culled)
+		*culled = kuhl_cull_culled;
+	kuhl_cull_drawn = 0;
+	kuhl_cull_culled = 0;
+}
+
+/** Is any part of an axis-aligned bounding box inside the current
+ * frustum? Conservative: may return 1 for a box slightly outside the
+ * frustum, never returns 0 for a visible box. */
+static int kuhl_cull_aabb_visible(const float bbox[6])
+{
+	for(int p=0; p<6; p++)
+	{
+		const float *plane = kuhl_cull_planes[p];
+		/* Test the box corner farthest along the plane normal; if even
+		 * that corner is behind the plane, the whole box is outside. */
+		float x = plane[0] >= 0 ? bbox[1] : bbox[0];
+		float y = plane[1] >= 0 ? bbox[3] : bbox[2];
+		float z = plane[2] >= 0 ? bbox[5] : bbox[4];
+		if(plane[0]*x + plane[1]*y + plane[2]*z + plane[3] < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Occlusion culling: frustum culling can't help with a dense interior
+ * where distant rooms sit behind walls---those meshes are inside the
+ * frustum and get fully shaded even though no pixel of them survives
+ * the depth test. When kuhl_occlusion_enable() (or KUHL_OCCLUSION=1
+ * in the environment) turns occlusion culling on, each geometry's
+ * draw is wrapped in a GL_SAMPLES_PASSED query. A geometry whose
+ * queries keep coming back with zero visible samples stops being
+ * drawn; instead a bounding-box proxy cube (built from the same aabb
+ * that frustum culling uses) is depth-tested with color and depth
+ * writes off, and as soon as a proxy query reports visible samples
+ * the real geometry is drawn again. Query results are read several
+ * frames after they were issued and only when available, so nothing
+ * ever stalls waiting for the GPU; the price is that a geometry can
+ * reappear a frame or two late (and, because a query result mixes
+ * whichever eye issued it, a geometry is only hidden after multiple
+ * consecutive all-occluded results so stereo rendering doesn't
+ * flicker). */
+
+static int kuhl_occlusion_enabled = -1; /**< 1=on, 0=off, -1=check KUHL_OCCLUSION */
+static int kuhl_occlusion_drawn = 0;   /**< Geometries drawn normally since the last stats call */
+static int kuhl_occlusion_skipped = 0; /**< Geometries replaced by their proxy since the last stats call */
+/** A geometry is hidden only after this many consecutive queries with
+ * zero visible samples; with per-eye draws this keeps one eye's
+ * occlusion from hiding a geometry the other eye can see. */
+#define KUHL_OCCLUSION_HIDE_AFTER 2
+
+/** Turns occlusion culling on or off for subsequent
+ * kuhl_geometry_draw() calls (see the comment block above). Programs
+ * can also enable it without code changes by setting KUHL_OCCLUSION=1
+ * in the environment.
+ *
+ * @param enable 1 to enable, 0 to disable.
+ */
+void kuhl_occlusion_enable(int enable)
+{
+	kuhl_occlusion_enabled = enable ? 1 : 0;
+}
+
+/** Checks the KUHL_OCCLUSION environment variable the first time
+ * occlusion culling is consulted. */
+static int kuhl_occlusion_on(void)
+{
+	if(kuhl_occlusion_enabled == -1)
+	{
+		const char *env = getenv("KUHL_OCCLUSION");
+		kuhl_occlusion_enabled = (env != NULL && atoi(env) != 0) ? 1 : 0;
+	}
+	return kuhl_occlusion_enabled;
+}
+
+/** Retrieves (and resets) counts of how many geometry structs were
+ * drawn normally and how many were skipped as occluded since the last
+ * call.
+ *
+ * @param drawn Location to store the number of geometries drawn (may be NULL).
+ * @param skipped Location to store the number of geometries skipped (may be NULL).
+ */
+void kuhl_occlusion_stats(int *drawn, int *skipped)
+{
+	if(drawn)
+		*drawn = kuhl_occlusion_drawn;
+	if(skipped)
+		*skipped = kuhl_occlusion_skipped;
+	kuhl_occlusion_drawn = 0;
+	kuhl_occlusion_skipped = 0;
+}
+
+/** Reads the result of a geometry's in-flight occlusion query if one
+ * is ready. Never waits: if the result isn't available yet, the
+ * geometry keeps its previous visibility (temporal reuse). */
+static void kuhl_occlusion_poll(kuhl_geometry *geom)
+{
+	if(!geom->occlusion_inflight)
+		return;
+	GLuint available = 0;
+	glGetQueryObjectuiv(geom->occlusion_query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if(!available)
+		return;
+	GLuint samples = 0;
+	glGetQueryObjectuiv(geom->occlusion_query, GL_QUERY_RESULT, &samples);
+	geom->occlusion_inflight = 0;
+	if(samples > 0)
+	{
+		geom->occlusion_zeros = 0;
+		geom->occlusion_hidden = 0;
+	}
+	else
+	{
+		geom->occlusion_zeros++;
+		if(geom->occlusion_zeros >= KUHL_OCCLUSION_HIDE_AFTER)
+			geom->occlusion_hidden = 1;
+	}
+}
+
+/** Draws a depth-tested bounding-box proxy for an occluded geometry
+ * inside an occlusion query, with color and depth writes turned off.
+ * Uses the geometry's own GLSL program (only its "in_Position"
+ * attribute and GeomTransform uniform), so the proxy goes through the
+ * same transformations as the real geometry would. */
+static void kuhl_occlusion_draw_proxy(kuhl_geometry *geom)
+{
+	/* (Re)build the proxy cube if the bounding box changed. */
+	if(geom->occlusion_vao == 0 ||
+	   memcmp(geom->occlusion_aabb, geom->aabb, sizeof(geom->aabb)) != 0)
+	{
+		GLint attribLocation = glGetAttribLocation(geom->program, "in_Position");
+		if(attribLocation == -1)
+		{
+			/* Without a position attribute we can't draw a proxy;
+			 * treat the geometry as visible from now on. */
+			geom->occlusion_hidden = 0;
+			geom->occlusion_zeros = 0;
+			return;
+		}
+		memcpy(geom->occlusion_aabb, geom->aabb, sizeof(geom->aabb));
+		float x0 = geom->aabb[0], x1 = geom->aabb[1];
+		float y0 = geom->aabb[2], y1 = geom->aabb[3];
+		float z0 = geom->aabb[4], z1 = geom->aabb[5];
+		/* Two triangles per face, 36 vertices. */
+		GLfloat cube[36*3] = {
+			x0,y0,z0, x1,y0,z0, x1,y1,z0,  x0,y0,z0, x1,y1,z0, x0,y1,z0, // z min
+			x0,y0,z1, x1,y1,z1, x1,y0,z1,  x0,y0,z1, x0,y1,z1, x1,y1,z1, // z max
+			x0,y0,z0, x0,y1,z0, x0,y1,z1,  x0,y0,z0, x0,y1,z1, x0,y0,z1, // x min
+			x1,y0,z0, x1,y1,z1, x1,y1,z0,  x1,y0,z0, x1,y0,z1, x1,y1,z1, // x max
+			x0,y0,z0, x1,y0,z1, x1,y0,z0,  x0,y0,z0, x0,y0,z1, x1,y0,z1, // y min
+			x0,y1,z0, x1,y1,z0, x1,y1,z1,  x0,y1,z0, x1,y1,z1, x0,y1,z1  // y max
+		};
+		if(geom->occlusion_vao == 0)
+		{
+			glGenVertexArrays(1, &(geom->occlusion_vao));
+			glGenBuffers(1, &(geom->occlusion_buffer));
+		}
+		glBindVertexArray(geom->occlusion_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, geom->occlusion_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(attribLocation);
+		glVertexAttribPointer(attribLocation, 3, GL_FLOAT, GL_FALSE, 0, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+		kuhl_state_vao = KUHL_STATE_UNKNOWN;
+	}
+
+	kuhl_state_use_program(geom->program);
+	GLint loc = kuhl_uniform_location_opt(geom->program, "GeomTransform", 0);
+	if(loc != -1)
+		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
+
+	/* Depth-test the cube without writing to any buffer. The current
+	 * write masks are saved and restored because some display modes
+	 * (anaglyph stereo) rely on a partial color mask. */
+	GLboolean colorMask[4], depthMask;
+	glGetBooleanv(GL_COLOR_WRITEMASK, colorMask);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+
+	kuhl_state_bind_vao(geom->occlusion_vao);
+	glBeginQuery(GL_SAMPLES_PASSED, geom->occlusion_query);
+	glDrawArrays(GL_TRIANGLES, 0, 36);
+	glEndQuery(GL_SAMPLES_PASSED);
+	geom->occlusion_inflight = 1;
+
+	glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+	glDepthMask(depthMask);
+	kuhl_errorcheck();
+}
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+/* Streamed model loading (defined with the rest of the model loader
+ * below). */
+#define KUHL_LOAD_UPLOADS_PER_DRAW 8
+static int kuhl_load_uploads_left = 0;
+static void kuhl_private_mesh_stage_upload(struct kuhl_mesh_stage *stage);
+#endif
+
+/** Draws a single kuhl_geometry struct (ignoring its linked list) by
+ * binding through the shadow state. kuhl_geometry_draw() synchronizes
+ * the shadow state and restores the application's bindings around the
+ * whole list.
+ *
+ * @param instanceCount If 0, draw the geometry once. Otherwise, draw
+ * this many instances with the instanced draw calls. */
+static void kuhl_private_geometry_draw(kuhl_geometry *geom, GLuint instanceCount)
+{
+#ifdef KUHL_UTIL_USE_ASSIMP
+	/* If this geometry's attribute arrays haven't been uploaded yet
+	 * (streamed model loading, see KUHL_LOAD_STREAM), upload a few
+	 * per draw call and skip the rest; they will appear over the
+	 * next few frames. */
+	if(geom->pending_stage != NULL)
+	{
+		if(kuhl_load_uploads_left <= 0)
+			return;
+		kuhl_load_uploads_left--;
+		kuhl_private_mesh_stage_upload(geom->pending_stage);
+		/* The upload bound buffers and vertex arrays behind the
+		 * shadow state's back; don't trust the cached binding. */
+		kuhl_state_vao = KUHL_STATE_UNKNOWN;
+	}
+#endif
+
+	/* Skip geometry whose bounding box is entirely outside the view
+	 * frustum (see kuhl_cull_set_frustum()). */
+	if(kuhl_cull_enabled && geom->has_aabb)
+	{
+		float bbox[6];
+		memcpy(bbox, geom->aabb, sizeof(bbox));
+		kuhl_bbox_transform(bbox, geom->matrix);
+		if(!kuhl_cull_aabb_visible(bbox))
+		{
+			kuhl_cull_culled++;
+			return;
+		}
+		kuhl_cull_drawn++;
+	}
+
+	/* Validate the objects the first time this geometry is drawn.
+	 * glIsProgram()/glIsVertexArray() are driver round-trips, so we
+	 * don't repeat them every frame; errors from objects deleted later
+	 * still get caught by kuhl_errorcheck(). */
+	if(geom->has_been_drawn == 0 &&
+	   (glIsProgram(geom->program) == 0 || glIsVertexArray(geom->vao) == 0))
 	{
 		msg(ERROR, "Program (%d) or vertex array object (%d) were invalid\n",
 		    geom->program, geom->vao);
@@ -1204,7 +3097,34 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 		return;
 	}
 
-	glUseProgram(geom->program);
+	/* Occlusion culling (see kuhl_occlusion_enable()): poll this
+	 * geometry's query, and if recent queries found every sample
+	 * occluded, depth-test its bounding-box proxy instead of shading
+	 * the real geometry. */
+	int occlusionQuery = 0;
+	if(kuhl_occlusion_on() && geom->has_aabb)
+	{
+		if(geom->occlusion_query == 0)
+			glGenQueries(1, &(geom->occlusion_query));
+		kuhl_occlusion_poll(geom);
+		if(geom->occlusion_hidden)
+		{
+			if(!geom->occlusion_inflight)
+				kuhl_occlusion_draw_proxy(geom);
+			kuhl_occlusion_skipped++;
+			return;
+		}
+		/* Visible: watch this draw with a query (unless one is still
+		 * in flight) so we notice when it becomes occluded. */
+		if(!geom->occlusion_inflight)
+		{
+			glBeginQuery(GL_SAMPLES_PASSED, geom->occlusion_query);
+			occlusionQuery = 1;
+		}
+		kuhl_occlusion_drawn++;
+	}
+
+	kuhl_state_use_program(geom->program);
 	kuhl_errorcheck();
 
 	/* Bind all of the textures used in this geometry to texture
@@ -1213,35 +3133,43 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 	for(unsigned int i=0; i<geom->texture_count; i++)
 	{
 		kuhl_texture *tex = &(geom->textures[i]);
-		if(!glIsTexture(tex->textureId))
+
+		/* Validate the texture on the first draw only (glIsTexture()
+		 * is another driver round-trip); remember a bad texture so we
+		 * keep skipping it on later draws. */
+		if(geom->has_been_drawn == 0 && tex->textureId != 0 &&
+		   !glIsTexture(tex->textureId))
+		{
+			msg(WARNING, "Texture '%s' (%d) is not a valid texture; it won't be drawn.\n", tex->name, tex->textureId);
+			tex->textureId = 0;
+		}
+		if(tex->textureId == 0)
 			continue;
 
 		/* Check if the sampler variable is available in the GLSL
 		 * program. If not, don't send the texture. */
-		GLint loc = glGetUniformLocation(geom->program, tex->name);
+		GLint loc = kuhl_uniform_location_opt(geom->program, tex->name, 0);
 		if(loc == -1)
 			continue;
 
 		if(strcmp(tex->name, "tex") == 0)
 			hasTex = 1;
-		
+
 		/* Tell OpenGL that the texture that we refer to in our
 		 * GLSL program is going to be in texture unit number 'i'.
 		 */
 		glUniform1i(loc, i);
 		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Bind the texture that we want to use while the correct
-		 * texture unit is enabled. */
-		glBindTexture(GL_TEXTURE_2D, tex->textureId);
+		/* Bind the texture to texture unit number 'i' (skipped if it
+		 * is still bound there from the previous geometry in the
+		 * list). */
+		kuhl_state_bind_texture(i, tex->textureId);
 		kuhl_errorcheck();
 	}
 
 	/* Set the HasTex variable if it exists in the GLSL program. */
 	GLint loc;
-	loc = glGetUniformLocation(geom->program, "HasTex");
+	loc = kuhl_uniform_location_opt(geom->program, "HasTex", 0);
 	if(loc != -1)
 	    glUniform1i(loc, hasTex);
 
@@ -1250,18 +3178,18 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 	 * messages. */
 	int numBones = 0;
 #ifdef KUHL_UTIL_USE_ASSIMP
-	loc = glGetUniformLocation(geom->program, "BoneMat");
+	loc = kuhl_uniform_location_opt(geom->program, "BoneMat", 0);
 	if(loc != -1 && geom->bones)
 	{
 		glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
 		numBones = geom->bones->count;
 	}
 #endif
-	loc = glGetUniformLocation(geom->program, "NumBones");
+	loc = kuhl_uniform_location_opt(geom->program, "NumBones", 0);
 	if(loc != -1)
 	    glUniform1i(loc, numBones);
 
-	loc = glGetUniformLocation(geom->program, "GeomTransform");
+	loc = kuhl_uniform_location_opt(geom->program, "GeomTransform", 0);
 	if(loc != -1)
 		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
 	else
@@ -1286,79 +3214,322 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 		}
 	}
 
-	/* Use the vertex array object for this geometry */
-	glBindVertexArray(geom->vao);
+	/* Build (or re-upload) the interleaved vertex buffer if the staged
+	 * attribute data changed since the last draw. */
+	if(geom->interleaved &&
+	   (geom->interleaved_bufferobject == 0 || geom->interleaved_dirty))
+		kuhl_private_geometry_interleave(geom);
+
+	/* Use the vertex array object for this geometry (skipped if the
+	 * previous geometry in the list used the same one). */
+	kuhl_state_bind_vao(geom->vao);
 	kuhl_errorcheck();
 
 	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
-	 * be mapped. Here, we check if the buffers are mapped. If they
-	 * are, we unmap them before we draw the geometry. */
-	for(unsigned int i=0; i<geom->attrib_count; i++)
+	 * be mapped. If it left a buffer mapped, unmap the buffers before
+	 * we draw the geometry. The glGetBufferParameteriv() round-trips
+	 * only happen when something actually was mapped. */
+	if(geom->buffers_mapped)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
-		GLint bufferIsMapped = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
-		kuhl_errorcheck();
-		if(bufferIsMapped)
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		kuhl_errorcheck();
+		for(unsigned int i=0; i<geom->attrib_count; i++)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
+			GLint bufferIsMapped = 0;
+			glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
+			kuhl_errorcheck();
+			if(bufferIsMapped)
+				glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			kuhl_errorcheck();
+		}
+		geom->buffers_mapped = 0;
 	}
 
-	
+
 	/* If the user provided us with indices, use glDrawElements() to
 	 * draw the geometry. */
-	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+	if(geom->indices_len > 0 && geom->indices_bufferobject != 0)
 	{
-		glDrawElements(geom->primitive_type,
-		               geom->indices_len,
-		               GL_UNSIGNED_INT,
-		               NULL);
+		if(instanceCount > 0)
+			glDrawElementsInstanced(geom->primitive_type,
+			                        geom->indices_len,
+			                        GL_UNSIGNED_INT,
+			                        NULL, instanceCount);
+		else
+			glDrawElements(geom->primitive_type,
+			               geom->indices_len,
+			               GL_UNSIGNED_INT,
+			               NULL);
 		kuhl_errorcheck();
 	}
 	else
 	{
 		/* If the user didn't provide us with indices, just draw the
 		 * vertices in order. */
-		glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
+		if(instanceCount > 0)
+			glDrawArraysInstanced(geom->primitive_type, 0,
+			                      geom->vertex_count, instanceCount);
+		else
+			glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
 		kuhl_errorcheck();
 	}
 
-
-	/* For each texture unit that we bound a texture to, unbind the
-	 * texture since we have finished drawing the geometry */
-	for(unsigned int i=0; i<geom->texture_count; i++)
+	if(occlusionQuery)
 	{
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Unbind the texture */
-		glBindTexture(GL_TEXTURE_2D, 0);
-		kuhl_errorcheck();
+		glEndQuery(GL_SAMPLES_PASSED);
+		geom->occlusion_inflight = 1;
 	}
 
-	
 	/* Indicate in the struct that we have successfully drawn this
 	 * geom once. */
 	geom->has_been_drawn = 1;
+}
+
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+ *
+ * OpenGL binding state (program, vertex array object, textures) is
+ * recorded once, shadowed while the list is drawn so that redundant
+ * bind calls are skipped, and restored before this function returns.
+
+ @param geom The geometry to draw to the screen. If the kuhl_geometry
+ object is a part of a linked list, this function will draw each of
+ the objects in order.
+
+ @param instanceCount If 0, draw each geometry once. Otherwise, draw
+ this many instances of each geometry. */
+static void kuhl_private_geometry_draw_list(kuhl_geometry *geom, GLuint instanceCount)
+{
+	if(geom == NULL)
+		return;
+
+	kuhl_errorcheck();
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+	/* Budget for finishing deferred mesh uploads (streamed model
+	 * loading) during this draw call. */
+	kuhl_load_uploads_left = KUHL_LOAD_UPLOADS_PER_DRAW;
+#endif
+
+	/* Record the OpenGL state (once for the whole list, not per
+	 * geometry) so that we can restore it when we have finished
+	 * drawing. */
+	kuhl_state_sync();
+	GLuint previouslyUsedProgram   = kuhl_state_program;
+	GLuint previousVAO             = kuhl_state_vao;
+	unsigned int previouslyActiveTexture = kuhl_state_texunit;
+	GLuint previouslyBoundTexture  = kuhl_state_texture[kuhl_state_texunit < MAX_TEXTURES ? kuhl_state_texunit : 0];
+
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		kuhl_private_geometry_draw(g, instanceCount);
+
+	/* Unbind the textures that we bound (so that our bindings don't
+	 * leak out into the application) and restore the texture binding
+	 * that the application had on its active texture unit. */
+	for(unsigned int i=0; i<MAX_TEXTURES; i++)
+	{
+		GLuint restoreTo = (i == previouslyActiveTexture) ? previouslyBoundTexture : 0;
+		if(kuhl_state_texture[i] != KUHL_STATE_UNKNOWN &&
+		   kuhl_state_texture[i] != restoreTo &&
+		   restoreTo != KUHL_STATE_UNKNOWN)
+			kuhl_state_bind_texture(i, restoreTo);
+	}
 
 	/* Restore previously active texture */
-	glActiveTexture(previouslyActiveTexture);
-	
-	/* Unbind texture */
-	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+	if(kuhl_state_texunit != previouslyActiveTexture)
+		glActiveTexture(GL_TEXTURE0+previouslyActiveTexture);
 
 	/* Restore the GLSL program that was used before this function was
 	 * called. */
-	glUseProgram(previouslyUsedProgram);
-	
+	kuhl_state_use_program(previouslyUsedProgram);
+
+	/* Unbind the VAO */
+	kuhl_state_bind_vao(previousVAO);
+	kuhl_errorcheck();
+}
+
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+ *
+ * OpenGL binding state (program, vertex array object, textures) is
+ * recorded once, shadowed while the list is drawn so that redundant
+ * bind calls are skipped, and restored before this function returns.
+
+ @param geom The geometry to draw to the screen. If the kuhl_geometry
+ object is a part of a linked list, this function will draw each of
+ the objects in order. */
+void kuhl_geometry_draw(kuhl_geometry *geom)
+{
+	kuhl_private_geometry_draw_list(geom, 0);
+}
+
+/** Draws many instances of a kuhl_geometry struct with a single draw
+ * call per geometry. Each instance is drawn with the same per-vertex
+ * attributes; to make the instances differ (position, color, etc.),
+ * add one or more attributes with the KG_INSTANCED option to
+ * kuhl_geometry_attrib() and read them in your vertex program. This
+ * allows crowds, debris or flocks with 100,000+ instances to be
+ * submitted in one draw call instead of one call (plus uniform
+ * updates) per object.
+ *
+ * @param geom The geometry to draw to the screen. If the
+ * kuhl_geometry object is a part of a linked list, this function will
+ * draw each of the objects in order.
+ *
+ * @param instanceCount The number of instances to draw. Should not
+ * exceed the geom->instance_count that the per-instance attribute
+ * buffers were filled for. */
+void kuhl_geometry_draw_instanced(kuhl_geometry *geom, GLuint instanceCount)
+{
+	if(!glewIsSupported("GL_ARB_draw_instanced") && !glewIsSupported("GL_VERSION_3_1"))
+	{
+		msg(ERROR, "Can't draw instanced geometry because this OpenGL implementation doesn't support instanced rendering.\n");
+		return;
+	}
+	if(instanceCount == 0)
+		return;
+	kuhl_private_geometry_draw_list(geom, instanceCount);
+}
+
+
+/* --- Compiled draw lists -------------------------------------------
+
+   kuhl_load_model() returns its meshes as a linked list in load
+   order, so drawing a large model interleaves programs and textures
+   arbitrarily and nearly every mesh triggers a bind. The shadow state
+   cache (kuhl_state_*) can only skip a bind when two CONSECUTIVE
+   meshes share state---so the fix is to change the order: flatten
+   the chain into an array once, sort it so meshes sharing a program,
+   texture, and VAO end up adjacent, and submit from the sorted array
+   every frame. Compiling is cheap (a qsort over pointers) but only
+   needs to happen once per model, not once per frame. */
+
+/** qsort comparator for draw-list entries: groups by program first
+ * (the most expensive bind), then by the first texture, then by
+ * VAO. */
+static int kuhl_drawlist_compare(const void *aVoid, const void *bVoid)
+{
+	const kuhl_geometry *a = *(kuhl_geometry * const *) aVoid;
+	const kuhl_geometry *b = *(kuhl_geometry * const *) bVoid;
+	if(a->program != b->program)
+		return a->program < b->program ? -1 : 1;
+	GLuint aTex = a->texture_count > 0 ? a->textures[0].textureId : 0;
+	GLuint bTex = b->texture_count > 0 ? b->textures[0].textureId : 0;
+	if(aTex != bTex)
+		return aTex < bTex ? -1 : 1;
+	if(a->vao != b->vao)
+		return a->vao < b->vao ? -1 : 1;
+	return 0;
+}
+
+/** Compiles a kuhl_geometry linked list (such as the list returned
+ * by kuhl_load_model()) into a draw list: a flat array sorted by
+ * (program, texture, VAO) so that drawing it performs as few state
+ * changes as possible. The geometry structs themselves are not
+ * copied or modified; changing a geometry's matrix or vertex data
+ * does NOT require recompiling, but changing its program or textures
+ * does---just call this function again (the old array is freed).
+ *
+ * @param drawlist The draw list to compile into.
+ *
+ * @param geom The head of the kuhl_geometry linked list.
+ */
+void kuhl_drawlist_compile(kuhl_drawlist *drawlist, kuhl_geometry *geom)
+{
+	if(drawlist->items != NULL)
+		free(drawlist->items);
+
+	unsigned int count = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		count++;
+	drawlist->count = count;
+	if(count == 0)
+	{
+		drawlist->items = NULL;
+		return;
+	}
+
+	drawlist->items = kuhl_malloc(count * sizeof(kuhl_geometry*));
+	count = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		drawlist->items[count++] = g;
+
+	qsort(drawlist->items, drawlist->count, sizeof(kuhl_geometry*),
+	      kuhl_drawlist_compare);
+}
+
+/** Draws a compiled draw list. Equivalent to calling
+ * kuhl_geometry_draw() on the list the draw list was compiled from,
+ * except that the meshes are submitted in the sorted order, so the
+ * shadow state cache skips most of the program/texture/VAO binds.
+ *
+ * @param drawlist A draw list filled in by kuhl_drawlist_compile().
+ */
+void kuhl_drawlist_draw(kuhl_drawlist *drawlist)
+{
+	if(drawlist->count == 0)
+		return;
+
+	kuhl_errorcheck();
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+	/* Budget for finishing deferred mesh uploads (streamed model
+	 * loading) during this draw call. */
+	kuhl_load_uploads_left = KUHL_LOAD_UPLOADS_PER_DRAW;
+#endif
+
+	/* Record the OpenGL state (once for the whole list) so that we
+	 * can restore it when we have finished drawing---exactly as
+	 * kuhl_geometry_draw() does. */
+	kuhl_state_sync();
+	GLuint previouslyUsedProgram   = kuhl_state_program;
+	GLuint previousVAO             = kuhl_state_vao;
+	unsigned int previouslyActiveTexture = kuhl_state_texunit;
+	GLuint previouslyBoundTexture  = kuhl_state_texture[kuhl_state_texunit < MAX_TEXTURES ? kuhl_state_texunit : 0];
+
+	for(unsigned int i=0; i<drawlist->count; i++)
+		kuhl_private_geometry_draw(drawlist->items[i], 0);
+
+	/* Unbind the textures that we bound (so that our bindings don't
+	 * leak out into the application) and restore the texture binding
+	 * that the application had on its active texture unit. */
+	for(unsigned int i=0; i<MAX_TEXTURES; i++)
+	{
+		GLuint restoreTo = (i == previouslyActiveTexture) ? previouslyBoundTexture : 0;
+		if(kuhl_state_texture[i] != KUHL_STATE_UNKNOWN &&
+		   kuhl_state_texture[i] != restoreTo &&
+		   restoreTo != KUHL_STATE_UNKNOWN)
+			kuhl_state_bind_texture(i, restoreTo);
+	}
+
+	/* Restore previously active texture */
+	if(kuhl_state_texunit != previouslyActiveTexture)
+		glActiveTexture(GL_TEXTURE0+previouslyActiveTexture);
+
+	/* Restore the GLSL program that was used before this function was
+	 * called. */
+	kuhl_state_use_program(previouslyUsedProgram);
+
 	/* Unbind the VAO */
-	glBindVertexArray(previousVAO);
+	kuhl_state_bind_vao(previousVAO);
 	kuhl_errorcheck();
+}
 
-	/* Draw the next nodes in the list. */
-	kuhl_geometry_draw(geom->next);
+/** Frees the array inside a draw list (not the geometry structs,
+ * which the caller owns).
+ *
+ * @param drawlist A draw list filled in by kuhl_drawlist_compile().
+ */
+void kuhl_drawlist_free(kuhl_drawlist *drawlist)
+{
+	if(drawlist->items != NULL)
+		free(drawlist->items);
+	drawlist->items = NULL;
+	drawlist->count = 0;
 }
 
 /** Deletes kuhl_geometry struct by freeing the OpenGL buffers that
@@ -1384,12 +3555,35 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		if(attrib->name)
 			free(attrib->name);
 		attrib->name = NULL;
+		if(attrib->stream_map != NULL)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			attrib->stream_map = NULL;
+		}
+		for(int f=0; f<3; f++)
+			if(attrib->stream_fence[f] != NULL)
+			{
+				glDeleteSync(attrib->stream_fence[f]);
+				attrib->stream_fence[f] = NULL;
+			}
 		if(glIsBuffer(attrib->bufferobject))
 			glDeleteBuffers(1, &(attrib->bufferobject));
 		attrib->bufferobject = 0;
+		if(attrib->staged != NULL)
+			free(attrib->staged);
+		attrib->staged = NULL;
 	}
 	geom->attrib_count = 0;
 
+	if(glIsBuffer(geom->interleaved_bufferobject))
+		glDeleteBuffers(1, &(geom->interleaved_bufferobject));
+	geom->interleaved_bufferobject = 0;
+	geom->interleaved = 0;
+	geom->interleaved_stride = 0;
+	geom->interleaved_dirty = 0;
+
 	if(glIsBuffer(geom->indices_bufferobject))
 		glDeleteBuffers(1, &(geom->indices_bufferobject));
 	geom->indices_bufferobject = 0;
@@ -1399,6 +3593,21 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		glDeleteVertexArrays(1, &(geom->vao));
 	geom->vao = 0;
 	geom->has_been_drawn = 0;
+
+	if(geom->occlusion_query != 0)
+		glDeleteQueries(1, &(geom->occlusion_query));
+	geom->occlusion_query = 0;
+	geom->occlusion_inflight = 0;
+	geom->occlusion_hidden = 0;
+	geom->occlusion_zeros = 0;
+	if(glIsBuffer(geom->occlusion_buffer))
+		glDeleteBuffers(1, &(geom->occlusion_buffer));
+	geom->occlusion_buffer = 0;
+	if(glIsVertexArray(geom->occlusion_vao))
+		glDeleteVertexArrays(1, &(geom->occlusion_vao));
+	geom->occlusion_vao = 0;
+
+	kuhl_raycast_free(geom);
 }
 
 
@@ -1546,6 +3755,180 @@ GLuint kuhl_read_texture_rgba_array(const unsigned char* array, int width, int h
 	return kuhl_read_texture_rgba_array_wrap(array, width, height, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 }
 
+/* --- Asynchronous texture uploads ---
+ *
+ * kuhl_read_texture_rgba_array_wrap() hands the pixels to
+ * glTexImage2D() directly, which can stall the caller for tens of
+ * milliseconds on large images while the driver copies the
+ * data. The functions below stage the pixels through a small ring of
+ * pixel buffer objects (PBOs) instead: the copy into the PBO returns
+ * quickly, the driver DMAs the data into the texture in the
+ * background, and a fence sync object tells us when the transfer has
+ * finished. Callers can keep rendering while uploads drain and use
+ * kuhl_texture_resident() to find out when a texture is ready.
+ */
+
+/** Number of pixel buffer objects in the upload ring. Uploads beyond
+ * this many in flight will block until the oldest one completes. */
+#define KUHL_UPLOAD_RING_SIZE 4
+
+/** One slot in the asynchronous upload ring. */
+typedef struct
+{
+	GLuint pbo;     /**< Pixel buffer object holding the staged pixels */
+	GLuint texture; /**< Texture the pixels are being uploaded into */
+	GLsync fence;   /**< Fence signaled when the transfer has completed */
+} kuhl_upload_slot;
+
+static kuhl_upload_slot kuhl_upload_ring[KUHL_UPLOAD_RING_SIZE];
+
+/** Checks if the upload in a ring slot has completed and, if so,
+ * frees the slot's resources. Pass a nonzero 'block' value to wait
+ * for the upload to finish.
+ *
+ * @return 1 if the slot is free after this call, 0 if an upload is
+ * still in flight.
+ */
+static int kuhl_private_upload_slot_poll(kuhl_upload_slot *slot, int block)
+{
+	if(slot->fence == NULL)
+		return 1;
+
+	GLenum status;
+	do
+	{
+		/* Wait up to a second per attempt when blocking; don't wait
+		 * at all when polling. */
+		status = glClientWaitSync(slot->fence, 0,
+		                          block ? (GLuint64) 1000000000 : 0);
+	} while(block && status == GL_TIMEOUT_EXPIRED);
+	if(status == GL_TIMEOUT_EXPIRED)
+		return 0;
+
+	glDeleteSync(slot->fence);
+	glDeleteBuffers(1, &slot->pbo);
+	slot->fence = NULL;
+	slot->pbo = 0;
+	slot->texture = 0;
+	return 1;
+}
+
+/** Converts an array containing RGBA image data into an OpenGL
+ * texture like kuhl_read_texture_rgba_array_wrap() does, but streams
+ * the pixels through a pixel buffer object so this function returns
+ * without waiting for the driver to finish the transfer. The
+ * returned texture name is valid immediately but may not contain the
+ * pixels yet; use kuhl_texture_resident() to check if the upload has
+ * completed. Falls back to the synchronous path if the required
+ * OpenGL features (pixel buffer objects and sync objects) are
+ * missing.
+ *
+ * @param array Contains a row-major list of pixels in R, G, B, A
+ * format starting from the bottom left corner of the image. Each
+ * pixel is a value form 0 to 255. The array can be free()'d as soon
+ * as this function returns.
+ *
+ * @param width The width of the image represented by the array in pixels.
+ *
+ * @param height The height of the image represented by the array in pixels.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The texture name. Returns 0 on error.
+ */
+GLuint kuhl_read_texture_rgba_array_async_wrap(const unsigned char* array, int width, int height, GLuint wrapS, GLuint wrapT)
+{
+	if(!(glewIsSupported("GL_ARB_pixel_buffer_object") || GLEW_VERSION_2_1) ||
+	   !(glewIsSupported("GL_ARB_sync") || GLEW_VERSION_3_2))
+	{
+		msg(DEBUG, "PBOs or sync objects are unsupported; uploading texture synchronously.\n");
+		return kuhl_read_texture_rgba_array_wrap(array, width, height, wrapS, wrapT);
+	}
+	kuhl_errorcheck();
+
+	/* Find a free slot in the upload ring. If every slot is busy,
+	 * wait for the oldest upload to finish. */
+	kuhl_upload_slot *slot = NULL;
+	for(int i=0; i<KUHL_UPLOAD_RING_SIZE && slot == NULL; i++)
+	{
+		if(kuhl_private_upload_slot_poll(&kuhl_upload_ring[i], 0))
+			slot = &kuhl_upload_ring[i];
+	}
+	if(slot == NULL)
+	{
+		slot = &kuhl_upload_ring[0];
+		kuhl_private_upload_slot_poll(slot, 1);
+	}
+
+	/* Create the texture and allocate (but don't fill) its storage;
+	 * passing NULL to glTexImage2D() is cheap. */
+	GLuint texName = 0;
+	glGenTextures(1, &texName);
+	glBindTexture(GL_TEXTURE_2D, texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	kuhl_errorcheck();
+
+	/* Stage the pixels in a PBO. glBufferData() copies them into
+	 * driver-owned memory and returns; it does not wait for the GPU. */
+	glGenBuffers(1, &slot->pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, (size_t)width*height*4, array, GL_STREAM_DRAW);
+
+	/* With a PBO bound, the data parameter of glTexSubImage2D() is an
+	 * offset into the PBO and the transfer happens asynchronously. */
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+	                GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	/* The fence is signaled once the preceding commands (including
+	 * the transfer out of the PBO) have completed. */
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot->texture = texName;
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_errorcheck();
+	return texName;
+}
+
+/** An alias for kuhl_read_texture_rgba_array_async_wrap() with the
+    clamp-to-edge option.
+
+    @see kuhl_read_texture_rgba_array_async_wrap()
+ */
+GLuint kuhl_read_texture_rgba_array_async(const unsigned char* array, int width, int height)
+{
+	return kuhl_read_texture_rgba_array_async_wrap(array, width, height, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+}
+
+/** Checks if a texture created with
+ * kuhl_read_texture_rgba_array_async_wrap() has finished
+ * uploading. Textures created with the synchronous functions are
+ * always resident.
+ *
+ * @param texName The OpenGL texture name to check.
+ *
+ * @return 1 if the texture's pixel data is resident on the GPU; 0 if
+ * an upload is still in flight.
+ */
+int kuhl_texture_resident(GLuint texName)
+{
+	for(int i=0; i<KUHL_UPLOAD_RING_SIZE; i++)
+	{
+		if(kuhl_upload_ring[i].texture == texName &&
+		   !kuhl_private_upload_slot_poll(&kuhl_upload_ring[i], 0))
+			return 0;
+	}
+	return 1;
+}
+
 /** Creates a texture from a string of text. For example, if you want
  * a texture that says "hello world" in red on a transparent
  * background, this method can easily create that texture directly
@@ -1595,21 +3978,20 @@ void kuhl_flip_texture_rgba_array(unsigned char *image, const int width, const i
 	// printf("Flipping texture with width = %d, height = %d\n", width, height);
 	unsigned int bytesPerRow = components * width; // 1 byte per component
 	unsigned int pivot = height/2;
-	for (unsigned i = 0; i < pivot; ++i) 
+	/* Swap whole rows at a time through a scratch row: memcpy moves
+	 * the bytes in wide blocks rather than one byte per iteration,
+	 * which matters when this runs on every recorded video frame. */
+	unsigned char *scratch = kuhl_malloc(bytesPerRow);
+	for (unsigned i = 0; i < pivot; ++i)
 	{
 		unsigned char *lineTop = (image + i * bytesPerRow);
 		unsigned char *lineBottom = (image + (height - i - 1) * bytesPerRow);
 		// printf("Swapping %d with %d\n", i, height-i-1);
-		for (unsigned j = 0; j < bytesPerRow; ++j)
-		{
-			unsigned char a = *lineTop;
-			unsigned char b = *lineBottom;
-			*lineTop = b;
-			*lineBottom = a;
-			lineTop++;
-			lineBottom++;
-		}
+		memcpy(scratch, lineTop, bytesPerRow);
+		memcpy(lineTop, lineBottom, bytesPerRow);
+		memcpy(lineBottom, scratch, bytesPerRow);
 	}
+	free(scratch);
 }
 
 
@@ -1711,949 +4093,3228 @@ static float kuhl_read_texture_file_stb(const char *filename, GLuint *texName, G
 #endif // end else part of ifdef KUHL_UTIL_USE_IMAGEMAGICK
 
 
-
-/** Uses either ImageMagick (preferred) or STB (a fallback) to read an
- * image file from disk and bind it to an OpenGL texture name.
- * Requires OpenGL 2.0 or better.
- *
- * @param filename name of file to load
+/** Reads an image file into an RGBA8 array without creating an
+ * OpenGL texture. The first pixel in the returned array is the bottom
+ * left corner of the image---the same orientation that
+ * kuhl_read_texture_file() uploads. The caller should free() the
+ * returned array.
  *
- * @param texName A pointer to where the OpenGL texture name should be stored.
- * (Remember that the "texture name" is really just some unsigned int).
- *
- * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
- *
- * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
- *
- * @returns The aspect ratio of the image in the file. Since texture
- * coordinates range from 0 to 1, the caller doesn't really need to
- * know how large the image actually is. Returns a negative number on
- * error.
+ * @param filename The image file to read.
+ * @param width To be filled in with the width of the image.
+ * @param height To be filled in with the height of the image.
+ * @return The pixel data, or NULL if the file could not be read.
  */
-float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+static unsigned char* kuhl_private_read_image_rgba(const char *filename, int *width, int *height)
 {
+	char *newFilename = kuhl_find_file(filename);
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
-	return kuhl_read_texture_file_im(filename, texName, wrapS, wrapT);
+	imageio_info iioinfo;
+	iioinfo.filename   = newFilename;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	free(newFilename);
+	if(image == NULL)
+		return NULL;
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
+	if(iioinfo.comment)
+		free(iioinfo.comment);
+	return image;
 #else
-	return kuhl_read_texture_file_stb(filename, texName, wrapS, wrapT);
+	int comp = -1;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char *image = (unsigned char*) stbi_load(newFilename, width, height, &comp, STBI_rgb_alpha);
+	free(newFilename);
+	return image;
 #endif
 }
 
-/** An alias for kuhl_read_texture_file_wrap() with the clamp-to-edge option.
 
-    @see kuhl_read_texture_file_wrap()
+/* --- Compressed textures ------------------------------------------
+
+   Textures stored in DDS or KTX containers are uploaded directly with
+   glCompressedTexImage2D(), skipping both the decode and the
+   uncompressed upload. A DXT-compressed texture occupies 4-8x less
+   VRAM than RGBA8 and uploads proportionally faster.
+
+   Additionally, if the KUHL_TEXTURE_COMPRESS environment variable is
+   set, plain image files (PNG, JPEG, ...) are transcoded to DXT on
+   the CPU the first time they are loaded and the compressed mip
+   chain is cached on disk next to the original file (with a
+   ".kuhltex" suffix, like the model cache). The cache is keyed by a
+   hash of the image file's bytes, so editing the image retranscodes
+   it. DXT is lossy---leave the variable unset when exact colors
+   matter. */
+
+#define KUHL_TEXTURE_CACHE_SUFFIX ".kuhltex"
+/** Bump this number whenever the texture cache file layout changes. */
+#define KUHL_TEXTURE_CACHE_VERSION 1
+
+/** Header at the start of a transcoded texture cache file. The
+ * header is followed by mipCount mip levels, each stored as a
+ * uint32_t byte count followed by the compressed data. */
+typedef struct
+{
+	char magic[8];           /**< Set to "kuhltex\0" */
+	uint32_t version;        /**< KUHL_TEXTURE_CACHE_VERSION */
+	uint32_t contentHash[2]; /**< Hash of the source image file's bytes */
+	uint32_t glFormat;       /**< Compressed internal format of the mip data */
+	uint32_t width;          /**< Width of mip level 0 in pixels */
+	uint32_t height;         /**< Height of mip level 0 in pixels */
+	uint32_t mipCount;       /**< Number of mip levels stored in the file */
+} kuhl_texture_cache_header;
+
+/** Hashes the bytes of a file so the texture cache can detect when
+ * the source image has been edited.
+ *
+ * @param filename The file to hash.
+ * @param hash To be filled in with the 64-bit hash (as two uint32_t).
+ * @return 1 on success, 0 if the file could not be read.
  */
-float kuhl_read_texture_file(const char *filename, GLuint *texName)
+static int kuhl_private_texture_hash(const char *filename, uint32_t hash[2])
 {
-	return kuhl_read_texture_file_wrap(filename, texName, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+	uint64_t h = 5381;
+	unsigned char buf[65536];
+	size_t got;
+	while((got = fread(buf, 1, sizeof(buf), f)) > 0)
+		for(size_t i=0; i<got; i++)
+			h = h*33 + buf[i];
+	fclose(f);
+	hash[0] = (uint32_t) h;
+	hash[1] = (uint32_t) (h >> 32);
+	return 1;
 }
 
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-static void kuhl_screenshot_im(const char *outputImageFilename)
+/** Creates an OpenGL texture object set up for a compressed texture
+ * with a pre-built mip chain. The new texture is left bound so the
+ * caller can upload the mip levels.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @param mipCount The number of mip levels which will be uploaded.
+ * @return The OpenGL texture name.
+ */
+static GLuint kuhl_private_compressed_texture_new(GLuint wrapS, GLuint wrapT, int mipCount)
 {
-	// Get window size
-	int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
-	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+	GLuint texName = 0;
+	glGenTextures(1, &texName);
+	glBindTexture(GL_TEXTURE_2D, texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	/* We can't glGenerateMipmap() a compressed texture, so only use a
+	 * mipmapped filter when a mip chain is actually uploaded. */
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+	                mipCount > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mipCount-1);
+	return texName;
+}
 
-	// Allocate space for data from window
-	char *data = kuhl_malloc(windowWidth * windowHeight * 3);
-	// Read pixels from the window
-	glReadPixels(0,0,windowWidth,windowHeight,
-	             GL_RGB,GL_UNSIGNED_BYTE, data);
-	kuhl_errorcheck();
-	// Set up image output settings
-	imageio_info info_out;
-	info_out.width    = windowWidth;
-	info_out.height   = windowHeight;
-	info_out.depth    = 8; // bits/color in output image
-	info_out.quality  = 85;
-	info_out.colorspace = sRGBColorspace;
-	info_out.filename = strdup(outputImageFilename);
-	info_out.comment  = NULL;
-	info_out.type     = CharPixel;
-	info_out.map      = "RGB";
-	// Write image to disk
-	imageout(&info_out, data);
-	free(info_out.filename); // cleanup
-	free(data);
+/** Copies one 4x4 block of pixels out of an RGBA8 image, clamping
+ * reads at the right and top edges so partial blocks repeat their
+ * edge pixels. */
+static void kuhl_private_dxt_fetch_block(const unsigned char *pixels, int width, int height, int bx, int by, unsigned char block[64])
+{
+	for(int y=0; y<4; y++)
+		for(int x=0; x<4; x++)
+		{
+			int sx = bx*4+x;
+			int sy = by*4+y;
+			if(sx >= width)  sx = width-1;
+			if(sy >= height) sy = height-1;
+			memcpy(block+(y*4+x)*4, pixels+(sy*width+sx)*4, 4);
+		}
 }
-#else // KUHL_UTIL_USE_IMAGEMAGICK
 
-static void kuhl_screenshot_stb(const char *outputImageFilename)
+/** Encodes one 4x4 block of RGBA8 pixels as an 8-byte DXT color
+ * block using a range fit: the per-channel min and max colors become
+ * the two endpoints and each texel maps to the nearest of the four
+ * palette entries. Fast and simple; quality is a bit below the
+ * slower cluster-fit encoders, which is fine for a load-time
+ * transcode. */
+static void kuhl_private_dxt_color_block(const unsigned char block[64], unsigned char out[8])
 {
-	// Get window size
-	int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
-	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
-	int comp = 3; // 3 = RGB, 4 = RGBA
-	int stride_in_bytes = windowWidth*comp*sizeof(char);
-	// Allocate space for data from window
-	unsigned char *data = kuhl_malloc(stride_in_bytes*windowHeight);
-	// Read pixels from the window
-	glReadPixels(0,0,windowWidth,windowHeight,
-	             GL_RGB,GL_UNSIGNED_BYTE, data);
-	kuhl_errorcheck();
+	int minc[3] = { 255, 255, 255 };
+	int maxc[3] = { 0, 0, 0 };
+	for(int i=0; i<16; i++)
+		for(int c=0; c<3; c++)
+		{
+			int v = block[i*4+c];
+			if(v < minc[c]) minc[c] = v;
+			if(v > maxc[c]) maxc[c] = v;
+		}
 
-	kuhl_flip_texture_rgba_array(data, windowWidth, windowHeight, 3);
+	unsigned int c0 = ((maxc[0]>>3)<<11) | ((maxc[1]>>2)<<5) | (maxc[2]>>3);
+	unsigned int c1 = ((minc[0]>>3)<<11) | ((minc[1]>>2)<<5) | (minc[2]>>3);
 
-	int ok=0;
-	const char *s = outputImageFilename;
-	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
-		ok = stbi_write_png(s, windowWidth, windowHeight, comp, data, stride_in_bytes);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
-		ok = stbi_write_tga(s, windowWidth, windowHeight, comp, data);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
-		ok = stbi_write_bmp(s, windowWidth, windowHeight, comp, data);
-	free(data);
-	
-	if (!ok)
+	uint32_t indices = 0;
+	if(c0 == c1)
 	{
-		msg(FATAL, "Failed write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", outputImageFilename);
-		exit(EXIT_FAILURE);
+		/* A flat block; index 0 selects endpoint 0 everywhere. (c0 ==
+		 * c1 would select the punch-through mode where index 3 means
+		 * transparent, so don't emit index 3 here.) */
+	}
+	else
+	{
+		if(c0 < c1)
+		{
+			/* Endpoint order selects the 4-color mode (c0 > c1). */
+			unsigned int tmpc = c0; c0 = c1; c1 = tmpc;
+			for(int c=0; c<3; c++)
+			{
+				int tmp = maxc[c]; maxc[c] = minc[c]; minc[c] = tmp;
+			}
+		}
+		int palette[4][3];
+		for(int c=0; c<3; c++)
+		{
+			palette[0][c] = maxc[c];
+			palette[1][c] = minc[c];
+			palette[2][c] = (2*maxc[c] +   minc[c]) / 3;
+			palette[3][c] = (  maxc[c] + 2*minc[c]) / 3;
+		}
+		for(int i=0; i<16; i++)
+		{
+			int best = 0;
+			int bestDist = INT_MAX;
+			for(int p=0; p<4; p++)
+			{
+				int dist = 0;
+				for(int c=0; c<3; c++)
+				{
+					int d = block[i*4+c] - palette[p][c];
+					dist += d*d;
+				}
+				if(dist < bestDist)
+				{
+					bestDist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint32_t)best << (i*2);
+		}
 	}
 
+	out[0] = c0 & 0xff;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xff;
+	out[3] = c1 >> 8;
+	out[4] = indices & 0xff;
+	out[5] = (indices >>  8) & 0xff;
+	out[6] = (indices >> 16) & 0xff;
+	out[7] = (indices >> 24) & 0xff;
 }
-#endif // end else part of ifdef KUHL_UTIL_USE_IMAGEMAGICK
-
-/** Takes a screenshot of the current OpenGL screen and writes it to an image file.
-
-    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension. This function will allow you to write to any image format that ImageMagick supports. Suggestion: PNG files often work best for screenshots; try "output.png".
-*/
-void kuhl_screenshot(const char *outputImageFilename)
-{
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-	kuhl_screenshot_im(outputImageFilename);
-#else
-	kuhl_screenshot_stb(outputImageFilename);
-#endif
-}
-
-static int kuhl_video_record_frame = 0; // frame that we have recorded.
-static time_t kuhl_video_record_prev_sec = 0; // time of previous frame (seconds)
-static suseconds_t kuhl_video_record_prev_usec = 0; // time of previous frame usecs
-
-/** Records individual frames to image files that can later be
-  combined into a single video file. Call this function every frame
-  and it will capture the image data from the frame buffer and write
-  it to an image file if enough time has elapsed to record a
-  frame. Each image filename will include a frame number. This
-  function writes TIFF files to avoid unnecessary computation
-  compressing images. Instructions for converting the image files into
-  a video file using ffmpeg or avconv will be printed to standard
-  out. This may run slowly if you are saving files to a non-local
-  filesystem.
 
-    @param fileLabel If fileLabel is set to "label", this function
-    will create files such as "label-00000000.tif"
-    
-    @param fps The number of frames per second to record. Suggested value: 30.
- */
-void kuhl_video_record(const char *fileLabel, int fps)
+/** Encodes the alpha channel of one 4x4 block of RGBA8 pixels as an
+ * 8-byte DXT5 alpha block (an 8-entry ramp between the min and max
+ * alpha with 3-bit indices). */
+static void kuhl_private_dxt_alpha_block(const unsigned char block[64], unsigned char out[8])
 {
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-	char *exten = "tif";
-#else
-	char *exten = "bmp";
-#endif
-
-// Get current time
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-
-	if(kuhl_video_record_prev_sec == 0) // first time
+	int mina = 255, maxa = 0;
+	for(int i=0; i<16; i++)
 	{
-		kuhl_video_record_prev_sec  = tv.tv_sec;
-		kuhl_video_record_prev_usec = tv.tv_usec;
-		msg(INFO, "Recording %d frames per second\n", fps);
-		msg(INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
-		msg(INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(INFO, " - or -\n");
-		msg(INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		int a = block[i*4+3];
+		if(a < mina) mina = a;
+		if(a > maxa) maxa = a;
 	}
 
-	time_t sec       = tv.tv_sec;
-	suseconds_t usec = tv.tv_usec;
-
-	// useconds between recording frames
-	int usecs_over_seconds = 1000000;
-	int usec_to_wait = usecs_over_seconds / fps;
+	/* alpha0 > alpha1 selects the 8-alpha mode. */
+	out[0] = maxa;
+	out[1] = mina;
 
-	if(kuhl_video_record_prev_sec == sec &&
-	   usec - kuhl_video_record_prev_usec < usec_to_wait)
-		return; // don't take screenshot
-	else if(kuhl_video_record_prev_sec == sec-1 &&
-	        (usecs_over_seconds-kuhl_video_record_prev_usec)+usec<usec_to_wait)
-		return; // don't take screenshot
-	else
+	uint64_t indices = 0;
+	if(maxa != mina)
 	{
-		kuhl_video_record_prev_sec  = sec;
-		kuhl_video_record_prev_usec = usec;
-		char filename[1024];
-		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
-		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
-		kuhl_video_record_frame++;
+		int palette[8];
+		palette[0] = maxa;
+		palette[1] = mina;
+		for(int p=1; p<7; p++)
+			palette[p+1] = ((7-p)*maxa + p*mina) / 7;
+		for(int i=0; i<16; i++)
+		{
+			int a = block[i*4+3];
+			int best = 0;
+			int bestDist = INT_MAX;
+			for(int p=0; p<8; p++)
+			{
+				int d = a - palette[p];
+				if(d*d < bestDist)
+				{
+					bestDist = d*d;
+					best = p;
+				}
+			}
+			indices |= (uint64_t)best << (i*3);
+		}
 	}
-
+	for(int b=0; b<6; b++)
+		out[2+b] = (indices >> (b*8)) & 0xff;
 }
 
-#ifdef KUHL_UTIL_USE_ASSIMP
-
-/** This struct is used internally by kuhl_util.c to keep track of all textures that are associated with models that have been loaded. */
-typedef struct {
-	char *textureFileName; /**< The filename of a texture */
-	GLuint textureID;      /**< The OpenGL texture name for that texture */
-} textureIdMapStruct;
-#define textureIdMapMaxSize 1024*32 /**< Maximum number of textures that can be loaded from models */
-static textureIdMapStruct textureIdMap[textureIdMapMaxSize]; /**<List of textures for the models */
-static int textureIdMapSize = 0; /**< Number of items in textureIdMap */
+/** Compresses an RGBA8 image to DXT1 (opaque) or DXT5 (translucent).
+ *
+ * @param pixels The image to compress.
+ * @param width Width of the image in pixels.
+ * @param height Height of the image in pixels.
+ * @param useAlpha If nonzero, produce DXT5; otherwise DXT1.
+ * @param size To be filled in with the size of the compressed data.
+ * @return The compressed data; the caller should free() it.
+ */
+static unsigned char* kuhl_private_dxt_encode(const unsigned char *pixels, int width, int height, int useAlpha, unsigned int *size)
+{
+	int blocksWide = (width +3)/4;
+	int blocksHigh = (height+3)/4;
+	*size = blocksWide * blocksHigh * (useAlpha ? 16 : 8);
+	unsigned char *out = kuhl_malloc(*size);
+	unsigned char *dst = out;
+	unsigned char block[64];
+	for(int by=0; by<blocksHigh; by++)
+		for(int bx=0; bx<blocksWide; bx++)
+		{
+			kuhl_private_dxt_fetch_block(pixels, width, height, bx, by, block);
+			if(useAlpha)
+			{
+				kuhl_private_dxt_alpha_block(block, dst);
+				dst += 8;
+			}
+			kuhl_private_dxt_color_block(block, dst);
+			dst += 8;
+		}
+	return out;
+}
 
+/** Produces the next smaller mip level of an RGBA8 image with a box
+ * filter. The destination must be large enough for a
+ * max(width/2,1) by max(height/2,1) image. */
+static void kuhl_private_mip_halve(const unsigned char *src, int width, int height, unsigned char *dst)
+{
+	int newWidth  = width/2  > 0 ? width/2  : 1;
+	int newHeight = height/2 > 0 ? height/2 : 1;
+	for(int y=0; y<newHeight; y++)
+		for(int x=0; x<newWidth; x++)
+		{
+			/* Clamp so 1-pixel-wide/tall levels average what exists. */
+			int x0 = x*2, x1 = x*2+1 < width  ? x*2+1 : width-1;
+			int y0 = y*2, y1 = y*2+1 < height ? y*2+1 : height-1;
+			for(int c=0; c<4; c++)
+			{
+				int sum = src[(y0*width+x0)*4+c] + src[(y0*width+x1)*4+c] +
+				          src[(y1*width+x0)*4+c] + src[(y1*width+x1)*4+c];
+				dst[(y*newWidth+x)*4+c] = sum/4;
+			}
+		}
+}
 
-/** Recursively traverse a tree of ASSIMP nodes and updates the
- * bounding box information.
- *
- * @param nd A pointer to an ASSIMP aiNode struct.
+/** Tries to create a texture from a transcoded texture cache file.
  *
- * @param transform A pointer to an ASSIMP 4x4 transform matrix. When this function is called for the first time, set transform to NULL.
- *
- * @param scene An ASSIMP scene struct.
- *
- * @param bbox The calculated bounding box information (xmin, xmax, ymin, ymax, etc).
+ * @param cacheFilename The cache file to load from.
+ * @param contentHash The expected hash of the source image file; a
+ * mismatch means the image was edited and the cache is stale.
+ * @param texName A pointer to where the OpenGL texture name should be stored.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @return The aspect ratio of the texture, or a negative number if
+ * the cache was missing, stale, or corrupt.
  */
-static void kuhl_private_calc_bbox(const struct aiNode* nd, struct aiMatrix4x4* transform, const struct aiScene *scene, float bbox[6])
+static float kuhl_private_texture_cache_load(const char *cacheFilename, const uint32_t contentHash[2], GLuint *texName, GLuint wrapS, GLuint wrapT)
 {
-	/* When this method is called on the root node, the trafo matrix should be set to NULL. */
-	if(transform == NULL)
+	FILE *f = fopen(cacheFilename, "rb");
+	if(f == NULL)
+		return -1;
+
+	kuhl_texture_cache_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, "kuhltex", 8) != 0 ||
+	   header.version != KUHL_TEXTURE_CACHE_VERSION ||
+	   header.contentHash[0] != contentHash[0] ||
+	   header.contentHash[1] != contentHash[1] ||
+	   header.mipCount < 1)
 	{
-		bbox[0]=FLT_MAX;
-		bbox[1]=-FLT_MAX;
-		bbox[2]=FLT_MAX;
-		bbox[3]=-FLT_MAX;
-		bbox[4]=FLT_MAX;
-		bbox[5]=-FLT_MAX;
-		
-		// Set transform matrix to identity
-		struct aiMatrix4x4 ident;
-		aiIdentityMatrix4(&ident); 
-		transform = &ident;
+		fclose(f);
+		return -1;
 	}
 
-	// Save the transformation before we process this node.
-	struct aiMatrix4x4 previousTransform = *transform;
-	// Apply this nodes transformation matrix
-	aiMultiplyMatrix4(transform, &nd->mTransformation);
-
-	/* For each mesh */
-	for (unsigned int n=0; n < nd->mNumMeshes; ++n)
+	*texName = kuhl_private_compressed_texture_new(wrapS, wrapT, header.mipCount);
+	int width  = header.width;
+	int height = header.height;
+	for(unsigned int mip=0; mip < header.mipCount; mip++)
 	{
-		const struct aiMesh* mesh = scene->mMeshes[nd->mMeshes[n]];
-		/* For each vertex in mesh */
-		for (unsigned int t=0; t < mesh->mNumVertices; t++)
+		uint32_t mipSize;
+		if(fread(&mipSize, sizeof(mipSize), 1, f) != 1)
+			break;
+		unsigned char *data = kuhl_malloc(mipSize);
+		if(fread(data, 1, mipSize, f) != mipSize)
 		{
-			// Transform the vertex based on the transformation matrix
-			struct aiVector3D tmp = mesh->mVertices[t];
-			aiTransformVecByMatrix4(&tmp, transform);
-
-			// Update our bounding box
-			float coord[3];
-			vec3f_set(coord, tmp.x, tmp.y, tmp.z);
-			if(tmp.x < bbox[0])
-				bbox[0] = tmp.x;
-			if(tmp.x > bbox[1])
-				bbox[1] = tmp.x;
-			if(tmp.y < bbox[2])
-				bbox[2] = tmp.y;
-			if(tmp.y > bbox[3])
-				bbox[3] = tmp.y;
-			if(tmp.z < bbox[4])
-				bbox[4] = tmp.z;
-			if(tmp.z > bbox[5])
-				bbox[5] = tmp.z;
+			free(data);
+			break;
+		}
+		glCompressedTexImage2D(GL_TEXTURE_2D, mip, header.glFormat,
+		                       width, height, 0, mipSize, data);
+		free(data);
+		if(mip+1 < header.mipCount)
+		{
+			width  = width/2  > 0 ? width/2  : 1;
+			height = height/2 > 0 ? height/2 : 1;
+		}
+		else
+		{
+			fclose(f);
+			kuhl_errorcheck();
+			msg(DEBUG, "Loaded transcoded texture cache '%s' (%ux%u, %u mip levels, texName=%d)\n",
+			    cacheFilename, header.width, header.height, header.mipCount, *texName);
+			return (float)header.width/header.height;
 		}
 	}
-	
-	/* Process the children nodes using the current transformation. */
-	for (unsigned int n=0; n < nd->mNumChildren; n++)
-		kuhl_private_calc_bbox(nd->mChildren[n], transform, scene, bbox);
 
-	/* Since we are done processing this node, we need to restore the
-	* transformation matrix to whatever it was before we started
-	* working on this node. */
-	*transform = previousTransform;
+	/* The file was truncated or corrupt. */
+	fclose(f);
+	glDeleteTextures(1, texName);
+	*texName = 0;
+	return -1;
 }
 
-
-/* Searches a tree of aiNode* structs for a node that matches a given
- * name.
+/** Creates a DXT-compressed texture from a plain image file, caching
+ * the transcoded mip chain on disk so later runs skip the (slow)
+ * compression step. Called by kuhl_read_texture_file_wrap() when the
+ * KUHL_TEXTURE_COMPRESS environment variable is set.
  *
- * @param nodeName Name of the node to look for.
- * @param node Search this node and all children for a node that has the specified name.
- * @return If a matching node is found, this function returns the matching node. Otherwise, returns NULL.
+ * @param filename The image file to load.
+ * @param texName A pointer to where the OpenGL texture name should be stored.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @return The aspect ratio of the texture, or a negative number on
+ * failure (the caller should fall back to the uncompressed path).
  */
-const struct aiNode* kuhl_assimp_find_node(const char *nodeName, const struct aiNode *node)
+static float kuhl_private_texture_compress_load(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
 {
-	if(strcmp(node->mName.data, nodeName) == 0)
-		return node;
-	for(unsigned int i=0; i<node->mNumChildren; i++)
+	if(!glewIsSupported("GL_EXT_texture_compression_s3tc"))
+		return -1;
+
+	char *foundFilename = kuhl_find_file(filename);
+	uint32_t contentHash[2];
+	if(!kuhl_private_texture_hash(foundFilename, contentHash))
 	{
-		struct aiNode *child = node->mChildren[i];
-		const struct aiNode *foundNode = kuhl_assimp_find_node(nodeName, child);
-		if(foundNode != NULL)
-			return foundNode;
+		free(foundFilename);
+		return -1;
 	}
-	return NULL;
-}
+	int len = strlen(foundFilename)+strlen(KUHL_TEXTURE_CACHE_SUFFIX)+1;
+	char *cacheFilename = kuhl_malloc(len);
+	snprintf(cacheFilename, len, "%s%s", foundFilename, KUHL_TEXTURE_CACHE_SUFFIX);
+	free(foundFilename);
 
-const struct aiBone* kuhl_assimp_find_bone(const char *nodeName, const struct aiMesh *mesh)
-{
-	for(unsigned int i=0; i<mesh->mNumBones; i++)
+	float aspectRatio = kuhl_private_texture_cache_load(cacheFilename, contentHash, texName, wrapS, wrapT);
+	if(aspectRatio > 0)
 	{
-		if(strcmp(mesh->mBones[i]->mName.data, nodeName) == 0)
-			return mesh->mBones[i];
+		free(cacheFilename);
+		return aspectRatio;
 	}
-	return NULL;
-}
 
-
-
-/** Used by kuhl_print_aiScene_info() to print out information about
- * all of the nodes in the scene.
- *
- * @param modelFilename The filename of the model (only used to print filename out)
- * @param node An ASSIMP scene object to print information out about.
- * @return Number of nodes underneath and including node.
- */
-static int kuhl_print_aiNode_info(const char *modelFilename, const struct aiNode *node)
-{
-	/* Repeatedly follow parent pointer up to root node, save a string
-	 * to indicate the path to this node from the root that we can
-	 * print out. */
-	char name[2048];
-	strncpy(name, node->mName.data, 2048);
-	name[2048-1]='\0'; // make sure name is null terminated
-	struct aiNode *parent = node->mParent;
-	while(parent != NULL)
+	/* No usable cache; decode the image and transcode it. */
+	int width = -1, height = -1;
+	unsigned char *pixels = kuhl_private_read_image_rgba(filename, &width, &height);
+	if(pixels == NULL)
 	{
-		char tmp[2048];
-		snprintf(tmp, 2048, "%s->%s", parent->mName.data, name);
-		strcpy(name, tmp);
-		parent = parent->mParent;
+		free(cacheFilename);
+		return -1;
 	}
 
-	printf("%s: Node \"%s\": meshes=%u children=%u\n", modelFilename, name, node->mNumMeshes, node->mNumChildren);
-
-	int returnVal = 1; // count this node
-	
-	for(unsigned int i=0; i<node->mNumChildren; i++)
-		returnVal += kuhl_print_aiNode_info(modelFilename, node->mChildren[i]);
-	
-	return returnVal;
-}
-
-/** Prints out useful debugging information about an aiScene
- * object. It goes through the array of aiMesh objects and the array
- * of aiAnimation objects stored in the aiScene. It also calls
- * kuhl_print_aiNode_info() to recursively traverse all of the nodes
- * in the scene.
- *
- * @param modelFilename The filename of the model (only used to print filename out)
- * @param scene An ASSIMP scene object to print information out about.
- */
-static void kuhl_print_aiScene_info(const char *modelFilename, const struct aiScene *scene)
-{
-	/* Iterate through the animation information associated with this model */
-	for(unsigned int i=0; i<scene->mNumAnimations; i++)
+	/* Fully opaque images get DXT1 (4 bits/pixel); anything with
+	 * translucency gets DXT5 (8 bits/pixel). */
+	int useAlpha = 0;
+	for(int i=0; i<width*height; i++)
+		if(pixels[i*4+3] != 255)
+		{
+			useAlpha = 1;
+			break;
+		}
+	GLenum glFormat = useAlpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+	int mipCount = 1;
+	for(int w=width, h=height; w>1 || h>1; w = w/2>0?w/2:1, h = h/2>0?h/2:1)
+		mipCount++;
+
+	*texName = kuhl_private_compressed_texture_new(wrapS, wrapT, mipCount);
+
+	kuhl_texture_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "kuhltex", 8);
+	header.version = KUHL_TEXTURE_CACHE_VERSION;
+	header.contentHash[0] = contentHash[0];
+	header.contentHash[1] = contentHash[1];
+	header.glFormat = glFormat;
+	header.width    = width;
+	header.height   = height;
+	header.mipCount = mipCount;
+
+	/* A write failure (e.g. a read-only directory) isn't fatal; we
+	 * just transcode again on the next run. */
+	FILE *f = fopen(cacheFilename, "wb");
+	if(f != NULL && fwrite(&header, sizeof(header), 1, f) != 1)
 	{
-		struct aiAnimation* anim = scene->mAnimations[i];
-		printf("%s: Animation #%u: ===================================\n", modelFilename, i);
-		printf("%s: Animation #%u: name (probably blank): %s\n", modelFilename, i, anim->mName.data);
-		printf("%s: Animation #%u: duration in ticks: %f\n",     modelFilename, i, anim->mDuration);
-		printf("%s: Animation #%u: ticks per second: %f\n",      modelFilename, i, anim->mTicksPerSecond);
-		printf("%s: Animation #%u: duration in seconds: %f\n",   modelFilename, i, anim->mDuration/anim->mTicksPerSecond);
-				
-		printf("%s: Animation #%u: number of bone channels: %d\n", modelFilename, i, anim->mNumChannels);
-		printf("%s: Animation #%u: number of mesh channels: %d\n", modelFilename, i, anim->mNumMeshChannels);
+		fclose(f);
+		f = NULL;
+	}
 
-		// Bones
-		for(unsigned int j=0; j<anim->mNumChannels; j++)
+	unsigned char *level = pixels;
+	int w = width, h = height;
+	for(int mip=0; mip<mipCount; mip++)
+	{
+		unsigned int compressedSize;
+		unsigned char *compressed = kuhl_private_dxt_encode(level, w, h, useAlpha, &compressedSize);
+		glCompressedTexImage2D(GL_TEXTURE_2D, mip, glFormat, w, h, 0, compressedSize, compressed);
+		if(f != NULL)
 		{
-			struct aiNodeAnim* animNode = anim->mChannels[j];
-			printf("%s: Animation #%u: Bone channel #%u: AffectedNodeName=%s posKeys=%d, rotKeys=%d, scaleKeys=%d\n", modelFilename, i, j,
-			       animNode->mNodeName.data,
-			       animNode->mNumPositionKeys,
-			       animNode->mNumRotationKeys,
-			       animNode->mNumScalingKeys);
-
-#if 0
-			for(unsigned int i=0; i<animNode->mNumPositionKeys; i++)
-			{
-				printf("Position %d: %f %f %f time=%f\n", i,
-				       animNode->mPositionKeys[i].mValue.x,
-				       animNode->mPositionKeys[i].mValue.y,
-				       animNode->mPositionKeys[i].mValue.z,
-				       animNode->mPositionKeys[i].mTime);
-			}
-
-			for(unsigned int i=0; i<animNode->mNumScalingKeys; i++)
-			{
-				printf("Scale    %d: %f %f %f time=%f\n", i,
-				       animNode->mScalingKeys[i].mValue.x,
-				       animNode->mScalingKeys[i].mValue.y,
-				       animNode->mScalingKeys[i].mValue.z,
-				       animNode->mScalingKeys[i].mTime);
-			}
-
-			for(unsigned int i=0; i<animNode->mNumRotationKeys; i++)
+			uint32_t mipSize = compressedSize;
+			if(fwrite(&mipSize, sizeof(mipSize), 1, f) != 1 ||
+			   fwrite(compressed, 1, mipSize, f) != mipSize)
 			{
-				printf("Quat     %d: %f %f %f %f (wxyz) time=%f\n", i,
-				       animNode->mRotationKeys[i].mValue.w,
-				       animNode->mRotationKeys[i].mValue.x,
-				       animNode->mRotationKeys[i].mValue.y,
-				       animNode->mRotationKeys[i].mValue.z,
-				       animNode->mRotationKeys[i].mTime);
+				fclose(f);
+				f = NULL;
+				unlink(cacheFilename);
 			}
-#endif
 		}
+		free(compressed);
 
-		// Mesh
-		for(unsigned int j=0; j<anim->mNumMeshChannels; j++)
+		if(mip+1 < mipCount)
 		{
-			struct aiMeshAnim* animMesh = anim->mMeshChannels[j];
-			printf("%s: Animation #%u: Mesh channel #%u: Name of mesh affected: %s\n", modelFilename, i, j, animMesh->mName.data);
-			printf("%s: Animation #%u: Mesh channel #%u: Num of keys: %d\n", modelFilename, i, j, animMesh->mNumKeys);
-			for(unsigned int k=0; k<animMesh->mNumKeys; k++)
-			{
-				struct aiMeshKey mkey = animMesh->mKeys[k];
-				printf("%s: Animation #%ud: Mesh channel #%u: Key #%u: Time of this mesh key: %f\n", modelFilename, i, j, k, mkey.mTime);
-				printf("%s: Animation #%ud: Mesh channel #%u: Key #%u: Index into the mAnimMeshes array: %d\n", modelFilename, i, j, k, mkey.mValue);
-			}
+			int newWidth  = w/2 > 0 ? w/2 : 1;
+			int newHeight = h/2 > 0 ? h/2 : 1;
+			unsigned char *next = kuhl_malloc(newWidth*newHeight*4);
+			kuhl_private_mip_halve(level, w, h, next);
+			if(level != pixels)
+				free(level);
+			level = next;
+			w = newWidth;
+			h = newHeight;
 		}
 	}
+	if(level != pixels)
+		free(level);
+	free(pixels);
 
-	for(unsigned int i=0; i<scene->mNumMeshes; i++)
+	if(f != NULL)
 	{
-		struct aiMesh *mesh = scene->mMeshes[i];
-		printf("%s: Mesh #%03u: vertices=%u faces=%u bones=%u normals=%s tangents=%s bitangents=%s texcoords=%s name=\"%s\"\n",
-		       modelFilename, i, 
-		       mesh->mNumVertices,
-		       mesh->mNumFaces,
-		       mesh->mNumBones,
-		       mesh->mNormals          != NULL ? "yes" : "no ",
-		       mesh->mTangents         != NULL ? "yes" : "no ",
-		       mesh->mBitangents       != NULL ? "yes" : "no ",
-		       mesh->mTextureCoords[0] != NULL ? "yes" : "no ", // mTextureCoords is an array of pointers
-		       mesh->mName.data
-			);
-
-		for(unsigned int j=0; j<mesh->mNumBones; j++)
-		{
-			struct aiBone *bone = mesh->mBones[j];
-			printf("%s: Mesh #%u: Bone #%u: Named \"%s\" and affects %u vertices.\n",
-			       modelFilename, i, j, bone->mName.data, bone->mNumWeights);
-		}
+		fclose(f);
+		msg(INFO, "Transcoded '%s' (%dx%d) to %s and cached it at '%s'\n",
+		    filename, width, height, useAlpha ? "DXT5" : "DXT1", cacheFilename);
 	}
-
-	int numNodes = kuhl_print_aiNode_info(modelFilename, scene->mRootNode);
-	printf("%s: Contains %d node(s) & %u mesh(es)\n", modelFilename, numNodes, scene->mNumMeshes);
+	free(cacheFilename);
+	kuhl_errorcheck();
+	return (float)width/height;
 }
 
+/** Reads a DDS container holding a DXT1/DXT3/DXT5 texture and
+ * uploads its mip chain with glCompressedTexImage2D(). Called by
+ * kuhl_read_texture_file_wrap() for files with a ".dds" extension.
+ *
+ * Note that DDS files store the image top-down while OpenGL texture
+ * coordinates assume bottom-up; flipping compressed blocks is not
+ * worth the trouble, so author DDS files pre-flipped (most DDS
+ * exporters have an option for this).
+ *
+ * @param filename The DDS file to load.
+ * @param texName A pointer to where the OpenGL texture name should be stored.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @return The aspect ratio of the texture, or a negative number on error.
+ */
+static float kuhl_private_read_texture_dds(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	char *newFilename = kuhl_find_file(filename);
+	FILE *f = fopen(newFilename, "rb");
+	free(newFilename);
+	if(f == NULL)
+	{
+		msg(ERROR, "Unable to read '%s'.\n", filename);
+		return -1;
+	}
 
-/** Assimp doesn't store the full path to the textures. Here, we
-  assume that the texture path stored in the model is relative to the
-  directory the model is stored in. Or, if textureDir is provided, we
-  assume that the texture is relative to the textureDir path.
+	unsigned char header[128]; // "DDS " magic + 124 byte header
+	if(fread(header, 1, sizeof(header), f) != sizeof(header) ||
+	   memcmp(header, "DDS ", 4) != 0)
+	{
+		msg(ERROR, "'%s' is not a DDS file.\n", filename);
+		fclose(f);
+		return -1;
+	}
 
-    @param textureFile is the path to the texture stored in the model file.
-    
-    @param modelFile is the path to the model file. If textureDir is
-    NULL, we assume that the texture files are relative to this
-    directory.
+	uint32_t height, width, mipCount, fourcc;
+	memcpy(&height,   header+12, 4);
+	memcpy(&width,    header+16, 4);
+	memcpy(&mipCount, header+28, 4);
+	memcpy(&fourcc,   header+84, 4);
+	if(mipCount == 0)
+		mipCount = 1;
+
+	GLenum glFormat;
+	uint32_t blockSize;
+	if(memcmp(&fourcc, "DXT1", 4) == 0)
+	{
+		glFormat = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+		blockSize = 8;
+	}
+	else if(memcmp(&fourcc, "DXT3", 4) == 0)
+	{
+		glFormat = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+		blockSize = 16;
+	}
+	else if(memcmp(&fourcc, "DXT5", 4) == 0)
+	{
+		glFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		blockSize = 16;
+	}
+	else
+	{
+		msg(ERROR, "'%s' uses a compression format other than DXT1/DXT3/DXT5; we can't load it.\n", filename);
+		fclose(f);
+		return -1;
+	}
+	if(!glewIsSupported("GL_EXT_texture_compression_s3tc"))
+	{
+		msg(ERROR, "'%s' is DXT compressed but this GPU doesn't support S3TC textures.\n", filename);
+		fclose(f);
+		return -1;
+	}
 
-    @param textureDir is a path that the textures are supposedly
-    stored in. This is always used if it is non-NULL. It is ignored if
-    it is NULL.
+	*texName = kuhl_private_compressed_texture_new(wrapS, wrapT, mipCount);
+	uint32_t w = width, h = height;
+	for(uint32_t mip=0; mip < mipCount; mip++)
+	{
+		uint32_t mipSize = ((w+3)/4) * ((h+3)/4) * blockSize;
+		unsigned char *data = kuhl_malloc(mipSize);
+		if(fread(data, 1, mipSize, f) != mipSize)
+		{
+			msg(ERROR, "'%s' ended before mip level %u; is the file truncated?\n", filename, mip);
+			free(data);
+			fclose(f);
+			glDeleteTextures(1, texName);
+			*texName = 0;
+			return -1;
+		}
+		glCompressedTexImage2D(GL_TEXTURE_2D, mip, glFormat, w, h, 0, mipSize, data);
+		free(data);
+		w = w/2 > 0 ? w/2 : 1;
+		h = h/2 > 0 ? h/2 : 1;
+	}
+	fclose(f);
+	kuhl_errorcheck();
+	msg(DEBUG, "Finished reading '%s' (%ux%u, %u mip levels, texName=%d) as DDS\n",
+	    filename, width, height, mipCount, *texName);
+	return (float)width/height;
+}
 
-    @return A full path that specifies where the texture file should
-    be. The returned string should be free()'d.
-*/
-static char* kuhl_private_assimp_fullpath(const char *textureFile, const char *modelFile, const char *textureDir)
+/** Reads a KTX (version 1) container and uploads its mip chain with
+ * glCompressedTexImage2D(). Called by kuhl_read_texture_file_wrap()
+ * for files with a ".ktx" extension. Only simple 2D compressed
+ * textures are supported (no texture arrays, cube maps, or
+ * uncompressed KTX files).
+ *
+ * @param filename The KTX file to load.
+ * @param texName A pointer to where the OpenGL texture name should be stored.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @return The aspect ratio of the texture, or a negative number on error.
+ */
+static float kuhl_private_read_texture_ktx(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
 {
-	if(textureFile == NULL || strlen(textureFile) == 0)
+	static const unsigned char ktxMagic[12] =
+		{ 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+	char *newFilename = kuhl_find_file(filename);
+	FILE *f = fopen(newFilename, "rb");
+	free(newFilename);
+	if(f == NULL)
 	{
-		msg(FATAL, "textureFile was NULL or a zero character string.");
-		exit(EXIT_FAILURE);
+		msg(ERROR, "Unable to read '%s'.\n", filename);
+		return -1;
 	}
-	
-	/* Construct a string with the directory that should contain the texture. */
-	char *fullpath = malloc(1024);
-	if(textureDir == NULL)
+
+	/* 12-byte magic followed by 13 uint32 header fields. */
+	unsigned char magic[12];
+	uint32_t fields[13];
+	if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	   memcmp(magic, ktxMagic, sizeof(magic)) != 0 ||
+	   fread(fields, sizeof(uint32_t), 13, f) != 13)
 	{
-		if(modelFile == NULL)
+		msg(ERROR, "'%s' is not a KTX file.\n", filename);
+		fclose(f);
+		return -1;
+	}
+	uint32_t endianness        = fields[0];
+	uint32_t glType            = fields[1];
+	uint32_t glInternalFormat  = fields[4];
+	uint32_t width             = fields[6];
+	uint32_t height            = fields[7];
+	uint32_t pixelDepth        = fields[8];
+	uint32_t numArrayElements  = fields[9];
+	uint32_t numFaces          = fields[10];
+	uint32_t mipCount          = fields[11];
+	uint32_t keyValueBytes     = fields[12];
+
+	if(endianness != 0x04030201)
+	{
+		msg(ERROR, "'%s' was written on a machine with different endianness; we can't load it.\n", filename);
+		fclose(f);
+		return -1;
+	}
+	if(glType != 0 || pixelDepth > 1 || numArrayElements > 1 || numFaces != 1 ||
+	   width == 0 || height == 0)
+	{
+		msg(ERROR, "'%s' isn't a simple compressed 2D texture; we can't load it.\n", filename);
+		fclose(f);
+		return -1;
+	}
+	if(mipCount == 0)
+		mipCount = 1; // 0 asks the loader to generate mips; we just load level 0.
+	fseek(f, keyValueBytes, SEEK_CUR);
+
+	*texName = kuhl_private_compressed_texture_new(wrapS, wrapT, mipCount);
+	uint32_t w = width, h = height;
+	for(uint32_t mip=0; mip < mipCount; mip++)
+	{
+		uint32_t mipSize;
+		if(fread(&mipSize, sizeof(mipSize), 1, f) != 1)
 		{
-			msg(FATAL, "modelFile was NULL");
-			exit(EXIT_FAILURE);
+			msg(ERROR, "'%s' ended before mip level %u; is the file truncated?\n", filename, mip);
+			fclose(f);
+			glDeleteTextures(1, texName);
+			*texName = 0;
+			return -1;
 		}
-		char *editable = strdup(modelFile);
-		char *dname = dirname(editable);
-		snprintf(fullpath, 1024, "%s/%s", dname, textureFile);
-		free(editable);
+		unsigned char *data = kuhl_malloc(mipSize);
+		if(fread(data, 1, mipSize, f) != mipSize)
+		{
+			msg(ERROR, "'%s' ended before mip level %u; is the file truncated?\n", filename, mip);
+			free(data);
+			fclose(f);
+			glDeleteTextures(1, texName);
+			*texName = 0;
+			return -1;
+		}
+		glCompressedTexImage2D(GL_TEXTURE_2D, mip, glInternalFormat, w, h, 0, mipSize, data);
+		free(data);
+		/* Each mip level is padded to a multiple of 4 bytes. */
+		if(mipSize % 4 != 0)
+			fseek(f, 4 - mipSize % 4, SEEK_CUR);
+		w = w/2 > 0 ? w/2 : 1;
+		h = h/2 > 0 ? h/2 : 1;
 	}
-	else
-		snprintf(fullpath, 1024, "%s/%s", textureDir, textureFile);
-	return fullpath;
+	fclose(f);
+	kuhl_errorcheck();
+	msg(DEBUG, "Finished reading '%s' (%ux%u, %u mip levels, texName=%d) as KTX\n",
+	    filename, width, height, mipCount, *texName);
+	return (float)width/height;
 }
 
 
-/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
- * object. This function also calls kuhl_tead_texture_file() when
- * necessary to load the appropriate texture files that the model
- * refers to. This function does not create any kuhl_geometry structs
- * for the model.
+/** Uses either ImageMagick (preferred) or STB (a fallback) to read an
+ * image file from disk and bind it to an OpenGL texture name.
+ * Requires OpenGL 2.0 or better.
  *
- * @param modelFilename The filename of a model to load.
+ * Files with a ".dds" or ".ktx" extension are uploaded in their
+ * GPU-compressed form instead of being decoded. If the
+ * KUHL_TEXTURE_COMPRESS environment variable is set, other images are
+ * transcoded to DXT and the result is cached on disk next to the
+ * original file.
  *
- * @param textureDirname The directory the textures for the model are
- * stored in. If textureDirname is NULL, we assume that the textures
- * are in the same directory as the model file.
+ * @param filename name of file to load
  *
- * @return An ASSIMP aiScene object for the requested model. Returns
- * NULL on error.
+ * @param texName A pointer to where the OpenGL texture name should be stored.
+ * (Remember that the "texture name" is really just some unsigned int).
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @returns The aspect ratio of the image in the file. Since texture
+ * coordinates range from 0 to 1, the caller doesn't really need to
+ * know how large the image actually is. Returns a negative number on
+ * error.
  */
-static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname)
+float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	/* GPU-compressed containers skip the decode entirely. */
+	if(strlen(filename) > 4 && !strcasecmp(filename + strlen(filename) - 4, ".dds"))
+		return kuhl_private_read_texture_dds(filename, texName, wrapS, wrapT);
+	if(strlen(filename) > 4 && !strcasecmp(filename + strlen(filename) - 4, ".ktx"))
+		return kuhl_private_read_texture_ktx(filename, texName, wrapS, wrapT);
+
+	/* Optionally transcode plain images to DXT (cached on disk); on
+	 * failure fall back to the uncompressed path below. */
+	if(getenv("KUHL_TEXTURE_COMPRESS") != NULL)
+	{
+		float aspectRatio = kuhl_private_texture_compress_load(filename, texName, wrapS, wrapT);
+		if(aspectRatio > 0)
+			return aspectRatio;
+	}
+
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	return kuhl_read_texture_file_im(filename, texName, wrapS, wrapT);
+#else
+	return kuhl_read_texture_file_stb(filename, texName, wrapS, wrapT);
+#endif
+}
+
+/** An alias for kuhl_read_texture_file_wrap() with the clamp-to-edge option.
+
+    @see kuhl_read_texture_file_wrap()
+ */
+float kuhl_read_texture_file(const char *filename, GLuint *texName)
+{
+	return kuhl_read_texture_file_wrap(filename, texName, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+}
+
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+static void kuhl_screenshot_im(const char *outputImageFilename)
+{
+	// Get window size
+	int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
+	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+
+	// Allocate space for data from window (discarded at the start of
+	// the next frame)
+	char *data = kuhl_frame_alloc(windowWidth * windowHeight * 3);
+	// Read pixels from the window
+	glReadPixels(0,0,windowWidth,windowHeight,
+	             GL_RGB,GL_UNSIGNED_BYTE, data);
+	kuhl_errorcheck();
+	// Set up image output settings
+	imageio_info info_out;
+	info_out.width    = windowWidth;
+	info_out.height   = windowHeight;
+	info_out.depth    = 8; // bits/color in output image
+	info_out.quality  = 85;
+	info_out.colorspace = sRGBColorspace;
+	info_out.filename = strdup(outputImageFilename);
+	info_out.comment  = NULL;
+	info_out.type     = CharPixel;
+	info_out.map      = "RGB";
+	// Write image to disk
+	imageout(&info_out, data);
+	free(info_out.filename); // cleanup
+}
+#else // KUHL_UTIL_USE_IMAGEMAGICK
+
+static void kuhl_screenshot_stb(const char *outputImageFilename)
+{
+	// Get window size
+	int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
+	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+	int comp = 3; // 3 = RGB, 4 = RGBA
+	int stride_in_bytes = windowWidth*comp*sizeof(char);
+	// Allocate space for data from window (discarded at the start of
+	// the next frame)
+	unsigned char *data = kuhl_frame_alloc(stride_in_bytes*windowHeight);
+	// Read pixels from the window
+	glReadPixels(0,0,windowWidth,windowHeight,
+	             GL_RGB,GL_UNSIGNED_BYTE, data);
+	kuhl_errorcheck();
+
+	kuhl_flip_texture_rgba_array(data, windowWidth, windowHeight, 3);
+
+	int ok=0;
+	const char *s = outputImageFilename;
+	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
+		ok = stbi_write_png(s, windowWidth, windowHeight, comp, data, stride_in_bytes);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
+		ok = stbi_write_tga(s, windowWidth, windowHeight, comp, data);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
+		ok = stbi_write_bmp(s, windowWidth, windowHeight, comp, data);
+
+	if (!ok)
+	{
+		msg(FATAL, "Failed write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", outputImageFilename);
+		exit(EXIT_FAILURE);
+	}
+
+}
+#endif // end else part of ifdef KUHL_UTIL_USE_IMAGEMAGICK
+
+/** Takes a screenshot of the current OpenGL screen and writes it to an image file.
+
+    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension. This function will allow you to write to any image format that ImageMagick supports. Suggestion: PNG files often work best for screenshots; try "output.png".
+*/
+void kuhl_screenshot(const char *outputImageFilename)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	kuhl_screenshot_im(outputImageFilename);
+#else
+	kuhl_screenshot_stb(outputImageFilename);
+#endif
+}
+
+/* --- Asynchronous screenshots ---
+ *
+ * kuhl_screenshot() stalls the render thread twice: glReadPixels()
+ * waits for the GPU and then the image encoder runs synchronously.
+ * kuhl_screenshot_async() avoids both stalls: glReadPixels() targets
+ * a pixel buffer object (so it returns immediately and the GPU DMAs
+ * into the buffer in the background), a fence tells us when the
+ * readback has finished, and the flip+encode happens on a background
+ * worker thread. A bounded job queue keeps a burst of captures from
+ * exhausting memory; when the queue is full, frames are dropped with
+ * a warning rather than blocking the caller.
+ */
+
+/** Number of readbacks that can be in flight on the GPU. With two
+ * slots, a caller only ever waits if a readback started two calls ago
+ * still hasn't finished. */
+#define KUHL_SCREENSHOT_RING_SIZE 2
+/** Maximum number of frames waiting to be encoded by the worker. */
+#define KUHL_SCREENSHOT_QUEUE_SIZE 4
+
+/** A glReadPixels() transfer that is in flight on the GPU. */
+typedef struct
+{
+	GLuint pbo;     /**< Pixel buffer the GPU is reading pixels into */
+	GLsync fence;   /**< Signaled when the readback has completed */
+	int width, height;
+	char *filename; /**< Where the image should be written */
+} kuhl_screenshot_slot;
+
+/** A frame that has been read back and is waiting to be encoded. */
+typedef struct
+{
+	unsigned char *data; /**< RGB pixels, bottom row first (as glReadPixels returns) */
+	int width, height;
+	char *filename;
+} kuhl_screenshot_job;
+
+static kuhl_screenshot_slot kuhl_screenshot_ring[KUHL_SCREENSHOT_RING_SIZE];
+static kuhl_screenshot_job kuhl_screenshot_queue[KUHL_SCREENSHOT_QUEUE_SIZE];
+static int kuhl_screenshot_queue_len = 0;
+static int kuhl_screenshot_worker_started = 0;
+static pthread_t kuhl_screenshot_worker_thread;
+static pthread_mutex_t kuhl_screenshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kuhl_screenshot_avail = PTHREAD_COND_INITIALIZER; /**< signaled when a job is added */
+static pthread_cond_t kuhl_screenshot_drain = PTHREAD_COND_INITIALIZER; /**< signaled when a job finishes */
+
+/** Encodes a screenshot that has already been copied out of
+ * OpenGL. Runs on the worker thread. */
+static void kuhl_private_screenshot_encode(kuhl_screenshot_job *job)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info info_out;
+	info_out.width    = job->width;
+	info_out.height   = job->height;
+	info_out.depth    = 8; // bits/color in output image
+	info_out.quality  = 85;
+	info_out.colorspace = sRGBColorspace;
+	info_out.filename = job->filename;
+	info_out.comment  = NULL;
+	info_out.type     = CharPixel;
+	info_out.map      = "RGB";
+	imageout(&info_out, job->data);
+#else
+	kuhl_flip_texture_rgba_array(job->data, job->width, job->height, 3);
+	int ok=0;
+	const char *s = job->filename;
+	int stride_in_bytes = job->width*3*sizeof(char);
+	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
+		ok = stbi_write_png(s, job->width, job->height, 3, job->data, stride_in_bytes);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
+		ok = stbi_write_tga(s, job->width, job->height, 3, job->data);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
+		ok = stbi_write_bmp(s, job->width, job->height, 3, job->data);
+	if(!ok)
+		msg(ERROR, "Failed to write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", job->filename);
+#endif
+	free(job->data);
+	free(job->filename);
+}
+
+/** Main loop for the screenshot worker thread. */
+static void* kuhl_private_screenshot_worker(void *unused)
+{
+	while(1)
+	{
+		pthread_mutex_lock(&kuhl_screenshot_mutex);
+		while(kuhl_screenshot_queue_len == 0)
+			pthread_cond_wait(&kuhl_screenshot_avail, &kuhl_screenshot_mutex);
+		kuhl_screenshot_job job = kuhl_screenshot_queue[0];
+		for(int i=1; i<kuhl_screenshot_queue_len; i++)
+			kuhl_screenshot_queue[i-1] = kuhl_screenshot_queue[i];
+		kuhl_screenshot_queue_len--;
+		pthread_mutex_unlock(&kuhl_screenshot_mutex);
+
+		kuhl_private_screenshot_encode(&job);
+
+		pthread_mutex_lock(&kuhl_screenshot_mutex);
+		pthread_cond_broadcast(&kuhl_screenshot_drain);
+		pthread_mutex_unlock(&kuhl_screenshot_mutex);
+	}
+	return NULL;
+}
+
+/** Copies the finished readback in a ring slot out of the PBO and
+ * hands it to the worker thread. The slot must have a signaled (or
+ * waited-on) fence. */
+static void kuhl_private_screenshot_slot_finish(kuhl_screenshot_slot *slot)
+{
+	glDeleteSync(slot->fence);
+	slot->fence = NULL;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	unsigned char *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+	int queued = 0;
+	if(mapped != NULL)
+	{
+		kuhl_screenshot_job job;
+		job.width  = slot->width;
+		job.height = slot->height;
+		job.filename = slot->filename;
+		job.data = kuhl_malloc((size_t)slot->width*slot->height*3);
+		memcpy(job.data, mapped, (size_t)slot->width*slot->height*3);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+		pthread_mutex_lock(&kuhl_screenshot_mutex);
+		if(kuhl_screenshot_queue_len < KUHL_SCREENSHOT_QUEUE_SIZE)
+		{
+			kuhl_screenshot_queue[kuhl_screenshot_queue_len++] = job;
+			pthread_cond_signal(&kuhl_screenshot_avail);
+			queued = 1;
+		}
+		pthread_mutex_unlock(&kuhl_screenshot_mutex);
+
+		if(!queued)
+		{
+			msg(WARNING, "Screenshot encoder can't keep up; dropping %s\n", job.filename);
+			free(job.data);
+			free(job.filename);
+		}
+	}
+	else
+	{
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		msg(ERROR, "Failed to map screenshot buffer for %s\n", slot->filename);
+		free(slot->filename);
+	}
+	slot->filename = NULL;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteBuffers(1, &slot->pbo);
+	slot->pbo = 0;
+}
+
+/** Takes a screenshot of the current OpenGL screen without making
+    the caller wait for the GPU readback or the image encoder. The
+    pixels are read into a pixel buffer object and encoded on a
+    background thread; the image file may not exist on disk until
+    shortly after this function returns. Call
+    kuhl_screenshot_async_finish() before exiting to ensure all
+    pending screenshots have been written.
+
+    @param outputImageFilename The name of the image file that you
+    want to record the screenshot in.
+*/
+void kuhl_screenshot_async(const char *outputImageFilename)
+{
+	if(!(glewIsSupported("GL_ARB_pixel_buffer_object") || GLEW_VERSION_2_1) ||
+	   !(glewIsSupported("GL_ARB_sync") || GLEW_VERSION_3_2))
+	{
+		msg(DEBUG, "PBOs or sync objects are unsupported; taking screenshot synchronously.\n");
+		kuhl_screenshot(outputImageFilename);
+		return;
+	}
+
+	if(!kuhl_screenshot_worker_started)
+	{
+		if(pthread_create(&kuhl_screenshot_worker_thread, NULL,
+		                  kuhl_private_screenshot_worker, NULL) != 0)
+		{
+			msg(ERROR, "Failed to create screenshot worker thread; taking screenshot synchronously.\n");
+			kuhl_screenshot(outputImageFilename);
+			return;
+		}
+		kuhl_screenshot_worker_started = 1;
+	}
+
+	/* Collect any readbacks that have completed since the last call
+	 * and find a free ring slot. */
+	kuhl_screenshot_slot *slot = NULL;
+	for(int i=0; i<KUHL_SCREENSHOT_RING_SIZE; i++)
+	{
+		kuhl_screenshot_slot *s = &kuhl_screenshot_ring[i];
+		if(s->fence != NULL &&
+		   glClientWaitSync(s->fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+			kuhl_private_screenshot_slot_finish(s);
+		if(s->fence == NULL && slot == NULL)
+			slot = s;
+	}
+	/* If every slot is still in flight, wait for the oldest one. This
+	 * is the only place this function can block on the GPU. */
+	if(slot == NULL)
+	{
+		slot = &kuhl_screenshot_ring[0];
+		glClientWaitSync(slot->fence, 0, (GLuint64) 1000000000);
+		kuhl_private_screenshot_slot_finish(slot);
+	}
+
+	slot->width  = glutGet(GLUT_WINDOW_WIDTH);
+	slot->height = glutGet(GLUT_WINDOW_HEIGHT);
+	slot->filename = strdup(outputImageFilename);
+
+	/* With a PBO bound to GL_PIXEL_PACK_BUFFER, glReadPixels()
+	 * returns immediately and the GPU writes the pixels into the
+	 * buffer in the background. */
+	glGenBuffers(1, &slot->pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)slot->width*slot->height*3,
+	             NULL, GL_STREAM_READ);
+	glReadPixels(0, 0, slot->width, slot->height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	kuhl_errorcheck();
+}
+
+/** Waits until every screenshot started with kuhl_screenshot_async()
+    has been handed to the encoder and written. Call this before your
+    program exits. */
+void kuhl_screenshot_async_finish(void)
+{
+	/* Flush any readbacks still in flight on the GPU. */
+	for(int i=0; i<KUHL_SCREENSHOT_RING_SIZE; i++)
+	{
+		kuhl_screenshot_slot *s = &kuhl_screenshot_ring[i];
+		if(s->fence != NULL)
+		{
+			glClientWaitSync(s->fence, 0, (GLuint64) 1000000000);
+			kuhl_private_screenshot_slot_finish(s);
+		}
+	}
+	/* Wait for the worker to drain the queue. */
+	if(kuhl_screenshot_worker_started)
+	{
+		pthread_mutex_lock(&kuhl_screenshot_mutex);
+		while(kuhl_screenshot_queue_len > 0)
+			pthread_cond_wait(&kuhl_screenshot_drain, &kuhl_screenshot_mutex);
+		pthread_mutex_unlock(&kuhl_screenshot_mutex);
+	}
+}
+
+static int kuhl_video_record_frame = 0; // frame that we have recorded.
+static time_t kuhl_video_record_prev_sec = 0; // time of previous frame (seconds)
+static suseconds_t kuhl_video_record_prev_usec = 0; // time of previous frame usecs
+
+/** Records individual frames to image files that can later be
+  combined into a single video file. Call this function every frame
+  and it will capture the image data from the frame buffer and write
+  it to an image file if enough time has elapsed to record a
+  frame. Each image filename will include a frame number. This
+  function writes TIFF files to avoid unnecessary computation
+  compressing images. Instructions for converting the image files into
+  a video file using ffmpeg or avconv will be printed to standard
+  out. This may run slowly if you are saving files to a non-local
+  filesystem.
+
+    @param fileLabel If fileLabel is set to "label", this function
+    will create files such as "label-00000000.tif"
+    
+    @param fps The number of frames per second to record. Suggested value: 30.
+ */
+void kuhl_video_record(const char *fileLabel, int fps)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	char *exten = "tif";
+#else
+	char *exten = "bmp";
+#endif
+
+// Get current time
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	if(kuhl_video_record_prev_sec == 0) // first time
+	{
+		kuhl_video_record_prev_sec  = tv.tv_sec;
+		kuhl_video_record_prev_usec = tv.tv_usec;
+		msg(INFO, "Recording %d frames per second\n", fps);
+		msg(INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
+		msg(INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+		msg(INFO, " - or -\n");
+		msg(INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+		msg(INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+	}
+
+	time_t sec       = tv.tv_sec;
+	suseconds_t usec = tv.tv_usec;
+
+	// useconds between recording frames
+	int usecs_over_seconds = 1000000;
+	int usec_to_wait = usecs_over_seconds / fps;
+
+	if(kuhl_video_record_prev_sec == sec &&
+	   usec - kuhl_video_record_prev_usec < usec_to_wait)
+		return; // don't take screenshot
+	else if(kuhl_video_record_prev_sec == sec-1 &&
+	        (usecs_over_seconds-kuhl_video_record_prev_usec)+usec<usec_to_wait)
+		return; // don't take screenshot
+	else
+	{
+		kuhl_video_record_prev_sec  = sec;
+		kuhl_video_record_prev_usec = usec;
+		char filename[1024];
+		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
+		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
+		kuhl_video_record_frame++;
+	}
+
+}
+
+/* --- Piped video recording ---
+ *
+ * kuhl_video_record() writes one image file per frame and leaves the
+ * encoding to the user. That produces tens of thousands of files for
+ * a long session and can saturate a network filesystem. The
+ * functions below instead pipe raw frames straight into an ffmpeg (or
+ * avconv) process and produce a single video file with no
+ * intermediate images. The pixels are read back through a pair of
+ * pixel buffer objects so that the readback of one frame overlaps
+ * with writing the previous frame to the pipe.
+ */
+
+static FILE *kuhl_video_pipe = NULL;     /**< Pipe to the encoder process */
+static GLuint kuhl_video_pipe_pbo[2] = { 0, 0 }; /**< Double-buffered readback */
+static int kuhl_video_pipe_filled[2] = { 0, 0 }; /**< Does this PBO contain a frame? */
+static int kuhl_video_pipe_index = 0;    /**< PBO to use for the next readback */
+static int kuhl_video_pipe_width = 0, kuhl_video_pipe_height = 0;
+static time_t kuhl_video_pipe_prev_sec = 0;
+static suseconds_t kuhl_video_pipe_prev_usec = 0;
+
+/** Records video by piping raw frames directly into ffmpeg (or
+  avconv, if ffmpeg is not installed). Call this function every frame;
+  it grabs frames at the requested rate like kuhl_video_record() does,
+  but produces a single video file with no intermediate image
+  files. Call kuhl_video_record_pipe_finish() when you are done to
+  close the video file cleanly.
+
+    @param fileLabel If fileLabel is set to "label", this function
+    will record to "label.mp4".
+
+    @param fps The number of frames per second to record. Suggested value: 30.
+ */
+void kuhl_video_record_pipe(const char *fileLabel, int fps)
+{
+	int width  = glutGet(GLUT_WINDOW_WIDTH);
+	int height = glutGet(GLUT_WINDOW_HEIGHT);
+
+	if(kuhl_video_pipe == NULL) // first time
+	{
+		kuhl_video_pipe_width  = width;
+		kuhl_video_pipe_height = height;
+
+		/* The encoder is told the frames are bottom-up rgb24 data
+		 * (exactly what glReadPixels() gives us) and flips them
+		 * itself, so we never touch the pixels on the CPU. */
+		char command[2048];
+		snprintf(command, 2048,
+		         "ffmpeg -loglevel error -y -f rawvideo -pixel_format rgb24 "
+		         "-video_size %dx%d -framerate %d -i - -vf vflip "
+		         "-pix_fmt yuv420p \"%s.mp4\" || "
+		         "avconv -loglevel error -y -f rawvideo -pixel_format rgb24 "
+		         "-video_size %dx%d -framerate %d -i - -vf vflip "
+		         "-pix_fmt yuv420p \"%s.mp4\"",
+		         width, height, fps, fileLabel,
+		         width, height, fps, fileLabel);
+		kuhl_video_pipe = popen(command, "w");
+		if(kuhl_video_pipe == NULL)
+		{
+			msg(ERROR, "Failed to start video encoder (is ffmpeg or avconv installed?)\n");
+			return;
+		}
+		glGenBuffers(2, kuhl_video_pipe_pbo);
+		msg(INFO, "Recording %d frames per second to %s.mp4\n", fps, fileLabel);
+	}
+
+	if(width != kuhl_video_pipe_width || height != kuhl_video_pipe_height)
+	{
+		/* The encoder expects a fixed frame size; skip frames while
+		 * the window size doesn't match. */
+		msg(WARNING, "Window was resized while recording video; skipping frame.\n");
+		return;
+	}
+
+	/* Limit the recording rate the same way kuhl_video_record() does. */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	int usecs_over_seconds = 1000000;
+	int usec_to_wait = usecs_over_seconds / fps;
+	if(kuhl_video_pipe_prev_sec != 0)
+	{
+		if(kuhl_video_pipe_prev_sec == tv.tv_sec &&
+		   tv.tv_usec - kuhl_video_pipe_prev_usec < usec_to_wait)
+			return;
+		if(kuhl_video_pipe_prev_sec == tv.tv_sec-1 &&
+		   (usecs_over_seconds-kuhl_video_pipe_prev_usec)+tv.tv_usec < usec_to_wait)
+			return;
+	}
+	kuhl_video_pipe_prev_sec  = tv.tv_sec;
+	kuhl_video_pipe_prev_usec = tv.tv_usec;
+
+	size_t frameBytes = (size_t)width*height*3;
+	int cur  = kuhl_video_pipe_index;
+	int prev = 1-cur;
+
+	/* Start an asynchronous readback of this frame into one PBO... */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, kuhl_video_pipe_pbo[cur]);
+	glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, GL_STREAM_READ);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	kuhl_video_pipe_filled[cur] = 1;
+
+	/* ...and write the frame read back on the previous call to the
+	 * pipe. By the time we map it, the frame-old transfer has usually
+	 * completed, so the map doesn't stall. */
+	if(kuhl_video_pipe_filled[prev])
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, kuhl_video_pipe_pbo[prev]);
+		unsigned char *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if(mapped != NULL)
+		{
+			if(fwrite(mapped, frameBytes, 1, kuhl_video_pipe) != 1)
+				msg(ERROR, "Failed to write frame to video encoder.\n");
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		kuhl_video_pipe_filled[prev] = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_video_pipe_index = prev;
+	kuhl_errorcheck();
+}
+
+/** Flushes the last frame and closes the video file started by
+    kuhl_video_record_pipe(). */
+void kuhl_video_record_pipe_finish(void)
+{
+	if(kuhl_video_pipe == NULL)
+		return;
+
+	/* Write out the frame still sitting in the other PBO. */
+	size_t frameBytes = (size_t)kuhl_video_pipe_width*kuhl_video_pipe_height*3;
+	for(int i=0; i<2; i++)
+	{
+		if(kuhl_video_pipe_filled[i])
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, kuhl_video_pipe_pbo[i]);
+			unsigned char *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+			if(mapped != NULL)
+			{
+				fwrite(mapped, frameBytes, 1, kuhl_video_pipe);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			kuhl_video_pipe_filled[i] = 0;
+		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteBuffers(2, kuhl_video_pipe_pbo);
+	kuhl_video_pipe_pbo[0] = 0;
+	kuhl_video_pipe_pbo[1] = 0;
+
+	if(pclose(kuhl_video_pipe) != 0)
+		msg(ERROR, "The video encoder exited with an error (is ffmpeg or avconv installed?)\n");
+	kuhl_video_pipe = NULL;
+}
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+
+/** This struct is used internally by kuhl_util.c to keep track of all textures that are associated with models that have been loaded. */
+typedef struct {
+	char *textureFileName; /**< The filename of a texture */
+	GLuint textureID;      /**< The OpenGL texture name for that texture */
+	int inAtlas;           /**< 1 if this texture was packed into a shared atlas page */
+	float uvScale[2];      /**< Scales this texture's [0,1] texcoords into its atlas sub-rectangle (1,1 if not packed) */
+	float uvOffset[2];     /**< Offsets this texture's [0,1] texcoords into its atlas sub-rectangle (0,0 if not packed) */
+} textureIdMapStruct;
+#define textureIdMapMaxSize 1024*32 /**< Maximum number of textures that can be loaded from models */
+static textureIdMapStruct textureIdMap[textureIdMapMaxSize]; /**<List of textures for the models */
+static int textureIdMapSize = 0; /**< Number of items in textureIdMap */
+
+/* If the KUHL_TEXTURE_ATLAS environment variable is set, small
+ * material textures are packed together into shared "atlas" pages
+ * instead of each getting their own OpenGL texture. Meshes whose
+ * textures share a page also share a texture bind in
+ * kuhl_geometry_draw(), and many small textures stop wasting a full
+ * mipmap chain each. */
+#define KUHL_ATLAS_PAGE_SIZE 1024 /**< Width and height of one atlas page in pixels */
+#define KUHL_ATLAS_MAX_DIM 256    /**< Textures larger than this in either dimension are not packed */
+#define KUHL_ATLAS_PAD 2          /**< Pixels of padding between packed textures */
+
+/** One texture waiting to be packed into an atlas page. */
+struct kuhl_atlas_pending
+{
+	char *fullpath;        /**< Resolved filename; becomes the textureIdMap entry's key. */
+	unsigned char *pixels; /**< RGBA8 pixel data, bottom row first. */
+	int width, height;     /**< Size of the image in pixels. */
+	int x, y;              /**< Position assigned to this texture within its page. */
+};
+
+/** qsort comparison function which sorts pending atlas textures from
+ * tallest to shortest so that each shelf in a page is filled with
+ * textures of similar height. */
+static int kuhl_private_atlas_compare(const void *a, const void *b)
+{
+	return ((const struct kuhl_atlas_pending*)b)->height -
+	       ((const struct kuhl_atlas_pending*)a)->height;
+}
+
+/** Uploads one finished atlas page and records each packed texture's
+ * page and sub-rectangle in the texture ID map. Frees the packed
+ * pixel data; the filenames become the new map entries' keys.
+ *
+ * @param page The composited RGBA8 page pixels.
+ * @param pending The list of textures being packed.
+ * @param first Index of the first pending texture on this page.
+ * @param last Index one past the last pending texture on this page.
+ */
+static void kuhl_private_atlas_flush(const unsigned char *page, struct kuhl_atlas_pending *pending, int first, int last)
+{
+	if(first >= last)
+		return;
+
+	/* Atlas pages must clamp: packed textures can't tile, and
+	 * repeating would sample a neighboring texture. Note that deep
+	 * mipmap levels of a page blend neighboring textures together;
+	 * the padding keeps the first few levels clean, which is all
+	 * that small textures typically use. */
+	GLuint pageTex = kuhl_read_texture_rgba_array_wrap(page, KUHL_ATLAS_PAGE_SIZE, KUHL_ATLAS_PAGE_SIZE, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+
+	for(int i=first; i<last; i++)
+	{
+		if(textureIdMapSize >= textureIdMapMaxSize)
+		{
+			msg(FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
+			exit(EXIT_FAILURE);
+		}
+		textureIdMapStruct *entry = &textureIdMap[textureIdMapSize++];
+		entry->textureFileName = pending[i].fullpath;
+		entry->textureID = pageTex;
+		entry->inAtlas = 1;
+		entry->uvScale[0]  = (float)pending[i].width  / KUHL_ATLAS_PAGE_SIZE;
+		entry->uvScale[1]  = (float)pending[i].height / KUHL_ATLAS_PAGE_SIZE;
+		entry->uvOffset[0] = (float)pending[i].x / KUHL_ATLAS_PAGE_SIZE;
+		entry->uvOffset[1] = (float)pending[i].y / KUHL_ATLAS_PAGE_SIZE;
+		free(pending[i].pixels);
+	}
+}
+
+
+/** Recursively traverse a tree of ASSIMP nodes and updates the
+ * bounding box information.
+ *
+ * @param nd A pointer to an ASSIMP aiNode struct.
+ *
+ * @param transform A pointer to an ASSIMP 4x4 transform matrix. When this function is called for the first time, set transform to NULL.
+ *
+ * @param scene An ASSIMP scene struct.
+ *
+ * @param bbox The calculated bounding box information (xmin, xmax, ymin, ymax, etc).
+ */
+static void kuhl_private_calc_bbox(const struct aiNode* nd, struct aiMatrix4x4* transform, const struct aiScene *scene, float bbox[6])
+{
+	/* When this method is called on the root node, the trafo matrix should be set to NULL. */
+	if(transform == NULL)
+	{
+		bbox[0]=FLT_MAX;
+		bbox[1]=-FLT_MAX;
+		bbox[2]=FLT_MAX;
+		bbox[3]=-FLT_MAX;
+		bbox[4]=FLT_MAX;
+		bbox[5]=-FLT_MAX;
+		
+		// Set transform matrix to identity
+		struct aiMatrix4x4 ident;
+		aiIdentityMatrix4(&ident); 
+		transform = &ident;
+	}
+
+	// Save the transformation before we process this node.
+	struct aiMatrix4x4 previousTransform = *transform;
+	// Apply this nodes transformation matrix
+	aiMultiplyMatrix4(transform, &nd->mTransformation);
+
+	/* For each mesh */
+	for (unsigned int n=0; n < nd->mNumMeshes; ++n)
+	{
+		const struct aiMesh* mesh = scene->mMeshes[nd->mMeshes[n]];
+		/* For each vertex in mesh */
+		for (unsigned int t=0; t < mesh->mNumVertices; t++)
+		{
+			// Transform the vertex based on the transformation matrix
+			struct aiVector3D tmp = mesh->mVertices[t];
+			aiTransformVecByMatrix4(&tmp, transform);
+
+			// Update our bounding box
+			float coord[3];
+			vec3f_set(coord, tmp.x, tmp.y, tmp.z);
+			if(tmp.x < bbox[0])
+				bbox[0] = tmp.x;
+			if(tmp.x > bbox[1])
+				bbox[1] = tmp.x;
+			if(tmp.y < bbox[2])
+				bbox[2] = tmp.y;
+			if(tmp.y > bbox[3])
+				bbox[3] = tmp.y;
+			if(tmp.z < bbox[4])
+				bbox[4] = tmp.z;
+			if(tmp.z > bbox[5])
+				bbox[5] = tmp.z;
+		}
+	}
+	
+	/* Process the children nodes using the current transformation. */
+	for (unsigned int n=0; n < nd->mNumChildren; n++)
+		kuhl_private_calc_bbox(nd->mChildren[n], transform, scene, bbox);
+
+	/* Since we are done processing this node, we need to restore the
+	* transformation matrix to whatever it was before we started
+	* working on this node. */
+	*transform = previousTransform;
+}
+
+
+/* Searches a tree of aiNode* structs for a node that matches a given
+ * name.
+ *
+ * @param nodeName Name of the node to look for.
+ * @param node Search this node and all children for a node that has the specified name.
+ * @return If a matching node is found, this function returns the matching node. Otherwise, returns NULL.
+ */
+const struct aiNode* kuhl_assimp_find_node(const char *nodeName, const struct aiNode *node)
+{
+	if(strcmp(node->mName.data, nodeName) == 0)
+		return node;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+	{
+		struct aiNode *child = node->mChildren[i];
+		const struct aiNode *foundNode = kuhl_assimp_find_node(nodeName, child);
+		if(foundNode != NULL)
+			return foundNode;
+	}
+	return NULL;
+}
+
+const struct aiBone* kuhl_assimp_find_bone(const char *nodeName, const struct aiMesh *mesh)
+{
+	for(unsigned int i=0; i<mesh->mNumBones; i++)
+	{
+		if(strcmp(mesh->mBones[i]->mName.data, nodeName) == 0)
+			return mesh->mBones[i];
+	}
+	return NULL;
+}
+
+
+
+/** Used by kuhl_print_aiScene_info() to print out information about
+ * all of the nodes in the scene.
+ *
+ * @param modelFilename The filename of the model (only used to print filename out)
+ * @param node An ASSIMP scene object to print information out about.
+ * @return Number of nodes underneath and including node.
+ */
+static int kuhl_print_aiNode_info(const char *modelFilename, const struct aiNode *node)
+{
+	/* Repeatedly follow parent pointer up to root node, save a string
+	 * to indicate the path to this node from the root that we can
+	 * print out. */
+	char name[2048];
+	strncpy(name, node->mName.data, 2048);
+	name[2048-1]='\0'; // make sure name is null terminated
+	struct aiNode *parent = node->mParent;
+	while(parent != NULL)
+	{
+		char tmp[2048];
+		snprintf(tmp, 2048, "%s->%s", parent->mName.data, name);
+		strcpy(name, tmp);
+		parent = parent->mParent;
+	}
+
+	printf("%s: Node \"%s\": meshes=%u children=%u\n", modelFilename, name, node->mNumMeshes, node->mNumChildren);
+
+	int returnVal = 1; // count this node
+	
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		returnVal += kuhl_print_aiNode_info(modelFilename, node->mChildren[i]);
+	
+	return returnVal;
+}
+
+/** Prints out useful debugging information about an aiScene
+ * object. It goes through the array of aiMesh objects and the array
+ * of aiAnimation objects stored in the aiScene. It also calls
+ * kuhl_print_aiNode_info() to recursively traverse all of the nodes
+ * in the scene.
+ *
+ * @param modelFilename The filename of the model (only used to print filename out)
+ * @param scene An ASSIMP scene object to print information out about.
+ */
+static void kuhl_print_aiScene_info(const char *modelFilename, const struct aiScene *scene)
+{
+	/* Iterate through the animation information associated with this model */
+	for(unsigned int i=0; i<scene->mNumAnimations; i++)
+	{
+		struct aiAnimation* anim = scene->mAnimations[i];
+		printf("%s: Animation #%u: ===================================\n", modelFilename, i);
+		printf("%s: Animation #%u: name (probably blank): %s\n", modelFilename, i, anim->mName.data);
+		printf("%s: Animation #%u: duration in ticks: %f\n",     modelFilename, i, anim->mDuration);
+		printf("%s: Animation #%u: ticks per second: %f\n",      modelFilename, i, anim->mTicksPerSecond);
+		printf("%s: Animation #%u: duration in seconds: %f\n",   modelFilename, i, anim->mDuration/anim->mTicksPerSecond);
+				
+		printf("%s: Animation #%u: number of bone channels: %d\n", modelFilename, i, anim->mNumChannels);
+		printf("%s: Animation #%u: number of mesh channels: %d\n", modelFilename, i, anim->mNumMeshChannels);
+
+		// Bones
+		for(unsigned int j=0; j<anim->mNumChannels; j++)
+		{
+			struct aiNodeAnim* animNode = anim->mChannels[j];
+			printf("%s: Animation #%u: Bone channel #%u: AffectedNodeName=%s posKeys=%d, rotKeys=%d, scaleKeys=%d\n", modelFilename, i, j,
+			       animNode->mNodeName.data,
+			       animNode->mNumPositionKeys,
+			       animNode->mNumRotationKeys,
+			       animNode->mNumScalingKeys);
+
+#if 0
+			for(unsigned int i=0; i<animNode->mNumPositionKeys; i++)
+			{
+				printf("Position %d: %f %f %f time=%f\n", i,
+				       animNode->mPositionKeys[i].mValue.x,
+				       animNode->mPositionKeys[i].mValue.y,
+				       animNode->mPositionKeys[i].mValue.z,
+				       animNode->mPositionKeys[i].mTime);
+			}
+
+			for(unsigned int i=0; i<animNode->mNumScalingKeys; i++)
+			{
+				printf("Scale    %d: %f %f %f time=%f\n", i,
+				       animNode->mScalingKeys[i].mValue.x,
+				       animNode->mScalingKeys[i].mValue.y,
+				       animNode->mScalingKeys[i].mValue.z,
+				       animNode->mScalingKeys[i].mTime);
+			}
+
+			for(unsigned int i=0; i<animNode->mNumRotationKeys; i++)
+			{
+				printf("Quat     %d: %f %f %f %f (wxyz) time=%f\n", i,
+				       animNode->mRotationKeys[i].mValue.w,
+				       animNode->mRotationKeys[i].mValue.x,
+				       animNode->mRotationKeys[i].mValue.y,
+				       animNode->mRotationKeys[i].mValue.z,
+				       animNode->mRotationKeys[i].mTime);
+			}
+#endif
+		}
+
+		// Mesh
+		for(unsigned int j=0; j<anim->mNumMeshChannels; j++)
+		{
+			struct aiMeshAnim* animMesh = anim->mMeshChannels[j];
+			printf("%s: Animation #%u: Mesh channel #%u: Name of mesh affected: %s\n", modelFilename, i, j, animMesh->mName.data);
+			printf("%s: Animation #%u: Mesh channel #%u: Num of keys: %d\n", modelFilename, i, j, animMesh->mNumKeys);
+			for(unsigned int k=0; k<animMesh->mNumKeys; k++)
+			{
+				struct aiMeshKey mkey = animMesh->mKeys[k];
+				printf("%s: Animation #%ud: Mesh channel #%u: Key #%u: Time of this mesh key: %f\n", modelFilename, i, j, k, mkey.mTime);
+				printf("%s: Animation #%ud: Mesh channel #%u: Key #%u: Index into the mAnimMeshes array: %d\n", modelFilename, i, j, k, mkey.mValue);
+			}
+		}
+	}
+
+	for(unsigned int i=0; i<scene->mNumMeshes; i++)
+	{
+		struct aiMesh *mesh = scene->mMeshes[i];
+		printf("%s: Mesh #%03u: vertices=%u faces=%u bones=%u normals=%s tangents=%s bitangents=%s texcoords=%s name=\"%s\"\n",
+		       modelFilename, i, 
+		       mesh->mNumVertices,
+		       mesh->mNumFaces,
+		       mesh->mNumBones,
+		       mesh->mNormals          != NULL ? "yes" : "no ",
+		       mesh->mTangents         != NULL ? "yes" : "no ",
+		       mesh->mBitangents       != NULL ? "yes" : "no ",
+		       mesh->mTextureCoords[0] != NULL ? "yes" : "no ", // mTextureCoords is an array of pointers
+		       mesh->mName.data
+			);
+
+		for(unsigned int j=0; j<mesh->mNumBones; j++)
+		{
+			struct aiBone *bone = mesh->mBones[j];
+			printf("%s: Mesh #%u: Bone #%u: Named \"%s\" and affects %u vertices.\n",
+			       modelFilename, i, j, bone->mName.data, bone->mNumWeights);
+		}
+	}
+
+	int numNodes = kuhl_print_aiNode_info(modelFilename, scene->mRootNode);
+	printf("%s: Contains %d node(s) & %u mesh(es)\n", modelFilename, numNodes, scene->mNumMeshes);
+}
+
+
+/** Assimp doesn't store the full path to the textures. Here, we
+  assume that the texture path stored in the model is relative to the
+  directory the model is stored in. Or, if textureDir is provided, we
+  assume that the texture is relative to the textureDir path.
+
+    @param textureFile is the path to the texture stored in the model file.
+    
+    @param modelFile is the path to the model file. If textureDir is
+    NULL, we assume that the texture files are relative to this
+    directory.
+
+    @param textureDir is a path that the textures are supposedly
+    stored in. This is always used if it is non-NULL. It is ignored if
+    it is NULL.
+
+    @return A full path that specifies where the texture file should
+    be. The returned string should be free()'d.
+*/
+static char* kuhl_private_assimp_fullpath(const char *textureFile, const char *modelFile, const char *textureDir)
+{
+	if(textureFile == NULL || strlen(textureFile) == 0)
+	{
+		msg(FATAL, "textureFile was NULL or a zero character string.");
+		exit(EXIT_FAILURE);
+	}
+	
+	/* Construct a string with the directory that should contain the texture. */
+	char *fullpath = malloc(1024);
+	if(textureDir == NULL)
+	{
+		if(modelFile == NULL)
+		{
+			msg(FATAL, "modelFile was NULL");
+			exit(EXIT_FAILURE);
+		}
+		char *editable = strdup(modelFile);
+		char *dname = dirname(editable);
+		snprintf(fullpath, 1024, "%s/%s", dname, textureFile);
+		free(editable);
+	}
+	else
+		snprintf(fullpath, 1024, "%s/%s", textureDir, textureFile);
+	return fullpath;
+}
+
+
+/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
+ * object. This function also calls kuhl_tead_texture_file() when
+ * necessary to load the appropriate texture files that the model
+ * refers to. This function does not create any kuhl_geometry structs
+ * for the model.
+ *
+ * @param modelFilename The filename of a model to load.
+ *
+ * @param textureDirname The directory the textures for the model are
+ * stored in. If textureDirname is NULL, we assume that the textures
+ * are in the same directory as the model file.
+ *
+ * @return An ASSIMP aiScene object for the requested model. Returns
+ * NULL on error.
+ */
+static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname)
 {
 	/* If we get here, we need to add the file to the sceneMap. */
 	msg(INFO, "Loading model: %s\n", modelFilename);
 
-	/* Write assimp messages to msg log */
-	struct aiLogStream stream;
-	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
-	if(stream.callback != msg_assimp_callback)
+	/* Write assimp messages to msg log */
+	struct aiLogStream stream;
+	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
+	if(stream.callback != msg_assimp_callback)
+	{
+		// we only need to set this up once.
+		stream.callback = msg_assimp_callback;
+		stream.user = strdup(modelFilename); // memory leak
+		aiAttachLogStream(&stream);
+	}
+	
+	/* Try loading the model. We are using a postprocessing preset
+	 * here so we don't have to set many options. */
+	char *modelFilenameVarying = strdup(modelFilename); // aiImportFile doesn't declare filaname parameter as const!
+
+	/* We will load the file and do significant processing (split
+	 * large meshes into smaller ones, triangulate polygons in meshes,
+	 * apply transformation matrices. For more information about model
+	 * loading options, see:
+	 * http://assimp.sourceforge.net/lib_html/postprocess_8h.html
+	 *
+	 * The postprocess procedures can greatly influence how long it
+	 * takes to load a model. If you are trying to load a large model,
+	 * try setting the post-process settings to 0.
+	 *
+	 * Other options which trigger multiple other options:
+	 * aiProcessPreset_TargetRealtime_Fast
+	 * aiProcessPreset_TargetRealtime_Quality
+	 * aiProcessPreset_TargetRealtime_MaxQuality
+	 *
+	 * Individual options:
+	 * 0                     - do nothing
+	 * aiProcess_Triangulate - Triangulate polygons into triangles
+	 * aiProcess_SortByPType - Put each primitive type into its own mesh
+	 * aiProcess_GenNormals  - Generate flat normals if normals aren't present in file
+	 * aiProcess_GenSmoothNormals - Generate smooth normals if normals aren't present in file
+	 * aiProcess_LimitBoneWeights - Limits bone weights per vertex to 4
+	 * aiProcess_JoinIdenticalVertices - Ensures that the model uses an index buffer.
+	 * aiProcess_PreTransformVertices - Pretransforms all vertices according to matrices in the model file
+	 */
+
+	// If we are generating smooth normals, don't smooth edges that
+	// are 80 degrees or higher (i.e., use flat normals on a cube).
+	struct aiPropertyStore* propStore = aiCreatePropertyStore();
+	aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", 50.0f);
+	// Import/load the model
+	int aiProcessFlags = aiProcess_Triangulate|aiProcess_SortByPType; // required! Use only these flags for fast loading.
+	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
+	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
+	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
+	free(modelFilenameVarying);
+	if(scene == NULL)
+		return NULL;
+
+	/* Print warning messages if the model uses features that our code
+	 * doesn't support (even though ASSIMP might support them. */
+	if(scene->mNumCameras > 0)
+		msg(DEBUG, "%s: This model has %u camera(s) embedded in it that we are ignoring.\n",
+		       modelFilename, scene->mNumCameras);
+	if(scene->mNumLights > 0)
+		msg(DEBUG, "%s: This model has %u light(s) embedded in it that we are ignoring.\n",
+		       modelFilename, scene->mNumLights);
+	if(scene->mNumTextures > 0)
+		msg(DEBUG, "%s: This model has %u texture(s) embedded in it. This program currently ignores embedded textures.\n",
+		       modelFilename, scene->mNumTextures);
+
+	// Uncomment this line to print additional information about the model:
+	// kuhl_print_aiScene_info(modelFilename, scene);
+
+	/* For safety, zero out our texture ID map if it is supposed to be empty right now. */
+	if(textureIdMapSize == 0)
+	{
+		for(int i=0; i<textureIdMapMaxSize; i++)
+		{
+			textureIdMap[i].textureFileName = NULL;
+			textureIdMap[i].textureID = 0;
+			textureIdMap[i].inAtlas = 0;
+			textureIdMap[i].uvScale[0] = 1;
+			textureIdMap[i].uvScale[1] = 1;
+			textureIdMap[i].uvOffset[0] = 0;
+			textureIdMap[i].uvOffset[1] = 0;
+		}
+	}
+
+	/* Determine which materials are candidates for the texture
+	 * atlas. A packed texture can no longer tile, so only materials
+	 * whose meshes keep their texture coordinates inside [0,1] may be
+	 * packed. */
+	int atlasEnabled = (getenv("KUHL_TEXTURE_ATLAS") != NULL);
+	int *materialCanAtlas = NULL;
+	struct kuhl_atlas_pending *atlasPending = NULL;
+	int atlasPendingCount = 0;
+	int atlasPendingCapacity = 0;
+	if(atlasEnabled && scene->mNumMaterials > 0)
+	{
+		materialCanAtlas = kuhl_malloc(sizeof(int)*scene->mNumMaterials);
+		for(unsigned int m=0; m < scene->mNumMaterials; m++)
+			materialCanAtlas[m] = 1;
+		for(unsigned int m=0; m < scene->mNumMeshes; m++)
+		{
+			const struct aiMesh *mesh = scene->mMeshes[m];
+			if(mesh->mTextureCoords[0] == NULL)
+				continue;
+			for(unsigned int i=0; i<mesh->mNumVertices; i++)
+			{
+				float u = mesh->mTextureCoords[0][i].x;
+				float v = mesh->mTextureCoords[0][i].y;
+				if(u < 0 || u > 1 || v < 0 || v > 1)
+				{
+					materialCanAtlas[mesh->mMaterialIndex] = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
+	for(unsigned int m=0; m < scene->mNumMaterials; m++)
+	{
+		struct aiString path;
+		GLuint texIndex = 0;
+
+
+		if(aiGetMaterialTexture(scene->mMaterials[m], aiTextureType_DIFFUSE,  texIndex, &path, NULL, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS)
+		{
+			/* Don't load a texture that we have already loaded. */
+			char *fullpath = kuhl_private_assimp_fullpath(path.data, modelFilename, textureDirname);
+			int alreadyExists = 0;
+			for(int i=0; i<textureIdMapSize; i++)
+			{
+				if(strcmp(fullpath, textureIdMap[i].textureFileName) == 0)
+				{
+					alreadyExists=1;
+					break;
+				}
+			}
+			if(alreadyExists > 0) // no need to reload an already loaded texture
+			{
+				free(fullpath);
+				continue; // skip to next material.
+			}
+
+			/* If this texture is an atlas candidate, read its pixels
+			 * now and set it aside; it is packed into a page after
+			 * every material has been seen. Textures which turn out
+			 * to be too large fall through to the normal path below
+			 * without re-reading the file. */
+			if(atlasEnabled && materialCanAtlas != NULL && materialCanAtlas[m])
+			{
+				int width = 0, height = 0;
+				unsigned char *pixels = kuhl_private_read_image_rgba(fullpath, &width, &height);
+				if(pixels != NULL && width <= KUHL_ATLAS_MAX_DIM && height <= KUHL_ATLAS_MAX_DIM)
+				{
+					if(atlasPendingCount == atlasPendingCapacity)
+					{
+						atlasPendingCapacity = atlasPendingCapacity == 0 ? 16 : atlasPendingCapacity*2;
+						atlasPending = realloc(atlasPending, sizeof(struct kuhl_atlas_pending)*atlasPendingCapacity);
+					}
+					struct kuhl_atlas_pending *p = &atlasPending[atlasPendingCount++];
+					p->fullpath = fullpath; // ownership moves to the pending entry
+					p->pixels = pixels;
+					p->width = width;
+					p->height = height;
+					p->x = 0;
+					p->y = 0;
+					continue; // skip to next material.
+				}
+				if(pixels != NULL)
+				{
+					/* Too large to pack; upload the pixels we already
+					 * have as a standalone texture. */
+					texIndex = kuhl_read_texture_rgba_array_wrap(pixels, width, height, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+					free(pixels);
+					if(textureIdMapSize >= textureIdMapMaxSize)
+					{
+						msg(FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
+						exit(EXIT_FAILURE);
+					}
+					textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
+					textureIdMap[textureIdMapSize].textureID = texIndex;
+					textureIdMapSize++;
+					free(fullpath);
+					continue; // skip to next material.
+				}
+				/* Couldn't read the file; fall through so the normal
+				 * path prints its warning. */
+			}
+
+			if(kuhl_read_texture_file(fullpath, &texIndex) < 0)
+			{
+				msg(WARNING, "%s refers to texture %s which we could not find at %s\n", modelFilename, path.data, fullpath);
+			}
+
+			/* Store the texture information in our list structure so
+			 * we can find the textureID from the filename when we
+			 * render the scene. */
+			if(textureIdMapSize >= textureIdMapMaxSize)
+			{
+				msg(FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
+				exit(EXIT_FAILURE);
+			}
+			textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
+			textureIdMap[textureIdMapSize].textureID = texIndex;
+			textureIdMapSize++;
+			free(fullpath);
+		}
+
+		/* If we failed to load a diffuse texture and there are no
+		 * other textures, we shouldn't print a
+		 * warning/error. However, if there is no diffuse and
+		 * other textures exist, print a message and exit so the
+		 * user knows that non-diffuse textures aren't going to be
+		 * loaded. */
+		#define TEX_TYPE_LEN 12
+		static const enum aiTextureType texTypeList[TEX_TYPE_LEN] = {
+			aiTextureType_DIFFUSE,   aiTextureType_SPECULAR,     aiTextureType_AMBIENT,
+			aiTextureType_EMISSIVE,  aiTextureType_HEIGHT,       aiTextureType_NORMALS,
+			aiTextureType_SHININESS, aiTextureType_OPACITY,      aiTextureType_DISPLACEMENT,
+			aiTextureType_LIGHTMAP,  aiTextureType_REFLECTION,   aiTextureType_UNKNOWN };
+		
+		static const char *texTypeListStr[TEX_TYPE_LEN] = {"DIFFUSE", "SPECULAR", "AMBIENT",
+		                                                   "EMISSIVE", "HEIGHT", "NORMALS",
+		                                                   "SHININESS","OPACITY","DISPLACEMENT",
+		                                                   "LIGHTMAP","REFLECTION","UNKNOWN" };
+
+		int textureCount = 0;
+		for(int i=1; i<TEX_TYPE_LEN; i++) // skip diffuse
+			textureCount += aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[i]);
+		if(textureCount > 0) // if there is a non-diffuse texture
+		{
+			char buf[1024] = "";
+			int buflen = 0;
+			buflen += snprintf(buf+buflen, 1024-buflen, "Ignoring some textures in material: ");
+			for(int i=1; i<TEX_TYPE_LEN; i++)
+			{
+				int count = aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[i]);
+				if(count > 0)
+					buflen += snprintf(buf+buflen, 1024-buflen, "%s=%d ", texTypeListStr[i], count);
+			}
+			msg(DEBUG, "%s", buf);
+
+			if(aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[0]) > 1)
+				msg(DEBUG, "The material also has more than one diffuse texture.\n");
+		}
+	}
+
+	if(materialCanAtlas != NULL)
+		free(materialCanAtlas);
+
+	/* Pack any textures we set aside into atlas pages using a simple
+	 * shelf packer: textures are placed left to right along a shelf,
+	 * and a new shelf starts when a texture doesn't fit. */
+	if(atlasPendingCount > 0)
+	{
+		qsort(atlasPending, atlasPendingCount, sizeof(struct kuhl_atlas_pending), kuhl_private_atlas_compare);
+
+		unsigned char *page = kuhl_malloc(KUHL_ATLAS_PAGE_SIZE*KUHL_ATLAS_PAGE_SIZE*4);
+		memset(page, 0, KUHL_ATLAS_PAGE_SIZE*KUHL_ATLAS_PAGE_SIZE*4);
+		int x = 0, y = 0, shelfHeight = 0;
+		int pageFirst = 0, pageCount = 0;
+		for(int i=0; i<atlasPendingCount; i++)
+		{
+			struct kuhl_atlas_pending *p = &atlasPending[i];
+			if(x + p->width > KUHL_ATLAS_PAGE_SIZE)
+			{
+				x = 0;
+				y += shelfHeight + KUHL_ATLAS_PAD;
+				shelfHeight = 0;
+			}
+			if(y + p->height > KUHL_ATLAS_PAGE_SIZE)
+			{
+				/* This page is full; upload it and start another. */
+				kuhl_private_atlas_flush(page, atlasPending, pageFirst, i);
+				memset(page, 0, KUHL_ATLAS_PAGE_SIZE*KUHL_ATLAS_PAGE_SIZE*4);
+				x = 0;
+				y = 0;
+				shelfHeight = 0;
+				pageFirst = i;
+				pageCount++;
+			}
+			for(int row=0; row < p->height; row++)
+				memcpy(page + ((y+row)*KUHL_ATLAS_PAGE_SIZE + x)*4,
+				       p->pixels + row*p->width*4,
+				       p->width*4);
+			p->x = x;
+			p->y = y;
+			x += p->width + KUHL_ATLAS_PAD;
+			if(p->height > shelfHeight)
+				shelfHeight = p->height;
+		}
+		kuhl_private_atlas_flush(page, atlasPending, pageFirst, atlasPendingCount);
+		pageCount++;
+		free(page);
+		free(atlasPending);
+		msg(INFO, "Packed %d texture(s) from %s into %d atlas page(s) (%dx%d)\n",
+		    atlasPendingCount, modelFilename, pageCount,
+		    KUHL_ATLAS_PAGE_SIZE, KUHL_ATLAS_PAGE_SIZE);
+	}
+
+	return scene;
+}
+
+/** Given a aiNodeAnim object and a time, return an appropriate
+ * transformation matrix.
+ *
+ * @param transformResult The resulting transformation matrix.
+ * @param na The aiNodeAnim to generate the matrix form.
+ * @param ticks The time of the animation in TICKS (not seconds!)
+ */
+static void kuhl_private_anim_matrix(float transformResult[16], const struct aiNodeAnim *na, double ticks)
+{
+
+	/* Find indices of start and stop position keys */
+	unsigned int positionStart = 0;
+	for(unsigned int j=0; j<na->mNumPositionKeys-1; j++)
+		if(ticks < na->mPositionKeys[j+1].mTime)
+		{
+			positionStart = j;
+			break;
+		}
+	unsigned int positionEnd = positionStart+1;
+	if(positionEnd >= na->mNumPositionKeys)
+		positionEnd = positionStart;
+	/* Determine where we are in relation to the two nearest keys */
+	float deltaTime = na->mPositionKeys[positionEnd].mTime - na->mPositionKeys[positionStart].mTime;
+	float factor;
+	if(deltaTime != 0)
+		factor = (ticks - na->mPositionKeys[positionStart].mTime)/deltaTime;
+	else
+		factor = 0;
+	
+	/* Interpolate between two nearest keys */
+	float positionValStart[3] = { na->mPositionKeys[positionStart].mValue.x,
+	                              na->mPositionKeys[positionStart].mValue.y,
+	                              na->mPositionKeys[positionStart].mValue.z };
+	float positionValEnd[3] = { na->mPositionKeys[positionEnd].mValue.x,
+	                            na->mPositionKeys[positionEnd].mValue.y,
+	                            na->mPositionKeys[positionEnd].mValue.z };
+	float positionValMid[3];
+	vec3f_scalarMult(positionValStart, (1-factor));
+	vec3f_scalarMult(positionValEnd, factor);
+	vec3f_add_new(positionValMid, positionValStart, positionValEnd);
+	float positionMatrix[16];
+	mat4f_translateVec_new(positionMatrix, positionValMid);
+
+	/* Find indices of start and stop rotation keys */
+	unsigned int rotationStart = 0;
+	for(unsigned int j=0; j<na->mNumRotationKeys-1; j++)
+		if(ticks < na->mRotationKeys[j+1].mTime)
+		{
+			rotationStart = j;
+			break;
+		}
+	unsigned int rotationEnd = rotationStart+1;
+	if(rotationEnd >= na->mNumRotationKeys)
+		rotationEnd = rotationStart;
+	/* Determine where we are in relation to the two nearest keys */
+	deltaTime = na->mRotationKeys[rotationEnd].mTime - na->mRotationKeys[rotationStart].mTime;
+	if(deltaTime != 0)
+		factor = (ticks - na->mRotationKeys[rotationStart].mTime)/deltaTime;
+	else
+		factor = 0;
+	/* Interpolate between two nearest keys */
+	float rotationValStart[4] = { na->mRotationKeys[rotationStart].mValue.x,
+	                              na->mRotationKeys[rotationStart].mValue.y,
+	                              na->mRotationKeys[rotationStart].mValue.z,
+	                              na->mRotationKeys[rotationStart].mValue.w };
+	float rotationValEnd[4] = { na->mRotationKeys[rotationEnd].mValue.x,
+	                            na->mRotationKeys[rotationEnd].mValue.y,
+	                            na->mRotationKeys[rotationEnd].mValue.z,
+	                            na->mRotationKeys[rotationEnd].mValue.w };
+	float rotationValMid[4];
+	//vec4f_normalize(rotationValStart);
+	//vec4f_normalize(rotationValEnd);
+	quatf_slerp_new(rotationValMid, rotationValStart, rotationValEnd, factor);
+	float rotationMatrix[16];
+	mat4f_rotateQuatVec_new(rotationMatrix, rotationValMid);
+
+	/* Find indices of start and stop scaling keys */
+	unsigned int scalingStart = 0;
+	for(unsigned int j=0; j<na->mNumScalingKeys-1; j++)
+		if(ticks < na->mScalingKeys[j+1].mTime)
+		{
+			scalingStart = j;
+			break;
+		}
+	unsigned int scalingEnd = scalingStart+1;
+	if(scalingEnd >= na->mNumScalingKeys)
+		scalingEnd = scalingStart;
+	/* Determine where we are in relation to the two nearest keys */
+	deltaTime = na->mScalingKeys[scalingEnd].mTime - na->mScalingKeys[scalingStart].mTime;
+	if(deltaTime != 0)
+		factor = (ticks - na->mScalingKeys[scalingStart].mTime)/deltaTime;
+	else
+		factor = 0;
+	/* Interpolate between two nearest keys */
+	float scalingValStart[3] = { na->mScalingKeys[scalingStart].mValue.x,
+	                             na->mScalingKeys[scalingStart].mValue.y,
+	                             na->mScalingKeys[scalingStart].mValue.z };
+	float scalingValEnd[3] = { na->mScalingKeys[scalingEnd].mValue.x,
+	                           na->mScalingKeys[scalingEnd].mValue.y,
+	                           na->mScalingKeys[scalingEnd].mValue.z };
+	float scalingValMid[3];
+	vec3f_scalarMult(scalingValStart, (1-factor));
+	vec3f_scalarMult(scalingValEnd, factor);
+	vec3f_add_new(scalingValMid, scalingValStart, scalingValEnd);
+	float scalingMatrix[16];
+	mat4f_scaleVec_new(scalingMatrix, scalingValMid);
+	
+	// transformResult = translation * rotation * scaling
+	mat4f_mult_mat4f_new(transformResult, positionMatrix, rotationMatrix);
+	mat4f_mult_mat4f_new(transformResult, transformResult, scalingMatrix);
+}
+
+/** Finds the pair of keyframes bracketing a time in a vector key
+ * track and copies their values out so the interpolation itself can
+ * be done later in a batch (see kuhl_skeleton_update()).
+ *
+ * @param keys The key track to search.
+ * @param numKeys The number of keys in the track.
+ * @param ticks The time of the animation in TICKS (not seconds!)
+ * @param startVal To be filled in with the earlier key's value.
+ * @param endVal To be filled in with the later key's value.
+ * @return How far between the two keys 'ticks' falls (0 to 1).
+ */
+static float kuhl_private_anim_vector_keys(const struct aiVectorKey *keys, unsigned int numKeys, double ticks, float startVal[3], float endVal[3])
+{
+	unsigned int start = 0;
+	for(unsigned int j=0; j<numKeys-1; j++)
+		if(ticks < keys[j+1].mTime)
+		{
+			start = j;
+			break;
+		}
+	unsigned int end = start+1;
+	if(end >= numKeys)
+		end = start;
+	float deltaTime = keys[end].mTime - keys[start].mTime;
+	float factor = 0;
+	if(deltaTime != 0)
+		factor = (ticks - keys[start].mTime)/deltaTime;
+	vec3f_set(startVal, keys[start].mValue.x, keys[start].mValue.y, keys[start].mValue.z);
+	vec3f_set(endVal,   keys[end].mValue.x,   keys[end].mValue.y,   keys[end].mValue.z);
+	return factor;
+}
+
+/** Same as kuhl_private_anim_vector_keys() but for a quaternion key
+ * track. */
+static float kuhl_private_anim_quat_keys(const struct aiQuatKey *keys, unsigned int numKeys, double ticks, float startVal[4], float endVal[4])
+{
+	unsigned int start = 0;
+	for(unsigned int j=0; j<numKeys-1; j++)
+		if(ticks < keys[j+1].mTime)
+		{
+			start = j;
+			break;
+		}
+	unsigned int end = start+1;
+	if(end >= numKeys)
+		end = start;
+	float deltaTime = keys[end].mTime - keys[start].mTime;
+	float factor = 0;
+	if(deltaTime != 0)
+		factor = (ticks - keys[start].mTime)/deltaTime;
+	vec4f_set(startVal, keys[start].mValue.x, keys[start].mValue.y, keys[start].mValue.z, keys[start].mValue.w);
+	vec4f_set(endVal,   keys[end].mValue.x,   keys[end].mValue.y,   keys[end].mValue.z,   keys[end].mValue.w);
+	return factor;
+}
+
+/* Returns the transformation matrix for a node (without considering
+ * the transformations of the parent node). If there is no animation
+ * information, the matrix is stored in the node itself. If there is
+ * animation information, we ignore the matrix in the node and instead
+ * calculate a matrix based on the animation information.
+ *
+ * @param transformResult To be filled in with the matrix for the
+ * requested node.
+ *
+ * @param scene The ASSIMP scene object containing the node.
+ *
+ * @param node The ASSIMP node object that we want animation
+ * information about.
+ *
+ * @param animationNum If the file contains more than one animation,
+ * indicates which animation to use. If you don't know, set this to 0.
+ *
+ * @param t The time in seconds that you want the animation matrix
+ * for. If time is negative, this function is guaranteed to return the
+ * transformation matrix in the node.
+ *
+ * @return Returns 1 if we successfully returned a matrix based on
+ * animation information. Returns 0 if we simply returned the
+ * transformation matrix in the node itself.
+ */
+static int kuhl_private_node_matrix(float transformResult[16],
+                                    const struct aiScene *scene,
+                                    const struct aiNode *node,
+                                    unsigned int animationNum, double t)
+{
+	/* Copy the transform matrix from the node itself. This is the
+	 * matrix that the user will see if we are unable to find the
+	 * requested animation matrix for this node. */
+	mat4f_from_aiMatrix4x4(transformResult, node->mTransformation);
+	
+	/* Return the transformation matrix from the node if: (1) The
+	 * requested animation number is too large. (2) A negative time
+	 * value is requested. */
+	if(animationNum >= scene->mNumAnimations || t < 0)
+		return 0;
+
+	struct aiAnimation *anim = scene->mAnimations[animationNum];
+
+	/* If the time value too large for the animation, return the
+	 * transformation matrix form the node. */
+	double currentTick = t * anim->mTicksPerSecond;
+	if(currentTick > anim->mDuration)
+		return 0;
+
+	/* Find the channel corresponding to the node name passed in as
+	 * parameter. */
+	for(unsigned int i=0; i<anim->mNumChannels; i++)
 	{
-		// we only need to set this up once.
-		stream.callback = msg_assimp_callback;
-		stream.user = strdup(modelFilename); // memory leak
-		aiAttachLogStream(&stream);
+		if(strcmp(anim->mChannels[i]->mNodeName.data, node->mName.data) == 0)
+		{
+			/* Get this node's matrix according to the animation
+			 * information. */
+			struct aiNodeAnim *na = anim->mChannels[i];
+			kuhl_private_anim_matrix(transformResult, na, currentTick);
+			return 1;
+		}
 	}
-	
-	/* Try loading the model. We are using a postprocessing preset
-	 * here so we don't have to set many options. */
-	char *modelFilenameVarying = strdup(modelFilename); // aiImportFile doesn't declare filaname parameter as const!
 
-	/* We will load the file and do significant processing (split
-	 * large meshes into smaller ones, triangulate polygons in meshes,
-	 * apply transformation matrices. For more information about model
-	 * loading options, see:
-	 * http://assimp.sourceforge.net/lib_html/postprocess_8h.html
-	 *
-	 * The postprocess procedures can greatly influence how long it
-	 * takes to load a model. If you are trying to load a large model,
-	 * try setting the post-process settings to 0.
-	 *
-	 * Other options which trigger multiple other options:
-	 * aiProcessPreset_TargetRealtime_Fast
-	 * aiProcessPreset_TargetRealtime_Quality
-	 * aiProcessPreset_TargetRealtime_MaxQuality
-	 *
-	 * Individual options:
-	 * 0                     - do nothing
-	 * aiProcess_Triangulate - Triangulate polygons into triangles
-	 * aiProcess_SortByPType - Put each primitive type into its own mesh
-	 * aiProcess_GenNormals  - Generate flat normals if normals aren't present in file
-	 * aiProcess_GenSmoothNormals - Generate smooth normals if normals aren't present in file
-	 * aiProcess_LimitBoneWeights - Limits bone weights per vertex to 4
-	 * aiProcess_JoinIdenticalVertices - Ensures that the model uses an index buffer.
-	 * aiProcess_PreTransformVertices - Pretransforms all vertices according to matrices in the model file
-	 */
+	return 0;
+}
 
-	// If we are generating smooth normals, don't smooth edges that
-	// are 80 degrees or higher (i.e., use flat normals on a cube).
-	struct aiPropertyStore* propStore = aiCreatePropertyStore();
-	aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", 50.0f);
-	// Import/load the model
-	int aiProcessFlags = aiProcess_Triangulate|aiProcess_SortByPType; // required! Use only these flags for fast loading.
-	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
-	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
-	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
-	free(modelFilenameVarying);
-	if(scene == NULL)
+
+/* Appends two kuhl_geometry lists together and returns the first item
+ * in the list.
+ *
+ * @param a The list of geometry that should be appended to.
+ *
+ * @param b The lits of geometry to append to the end of the 'a' list.
+ *
+ * @return The first kuhl_geometry object in the appended
+ * list. Typically, this will equal 'a'. This function returns NULL if
+ * both 'a' and 'b' are null. It returns 'b' if only 'a' is null.
+ */
+kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
+{
+	if(a == NULL && b == NULL)
 		return NULL;
+	if(a == NULL && b != NULL)
+		return b;
+	if(a != NULL && b == NULL)
+		return a;
 
-	/* Print warning messages if the model uses features that our code
-	 * doesn't support (even though ASSIMP might support them. */
-	if(scene->mNumCameras > 0)
-		msg(DEBUG, "%s: This model has %u camera(s) embedded in it that we are ignoring.\n",
-		       modelFilename, scene->mNumCameras);
-	if(scene->mNumLights > 0)
-		msg(DEBUG, "%s: This model has %u light(s) embedded in it that we are ignoring.\n",
-		       modelFilename, scene->mNumLights);
-	if(scene->mNumTextures > 0)
-		msg(DEBUG, "%s: This model has %u texture(s) embedded in it. This program currently ignores embedded textures.\n",
-		       modelFilename, scene->mNumTextures);
+	kuhl_geometry *origA = a;
+	while(a->next != NULL)
+		a = a->next;
+	a->next = b;
+	return origA;
+}
 
-	// Uncomment this line to print additional information about the model:
-	// kuhl_print_aiScene_info(modelFilename, scene);
 
-	/* For safety, zero out our texture ID map if it is supposed to be empty right now. */
-	if(textureIdMapSize == 0)
+
+/* --- Parallel mesh conversion ---
+ *
+ * Turning each aiMesh into flat per-vertex attribute arrays
+ * (deinterleaving positions/normals/colors/texcoords, gathering bone
+ * weights, flattening face indices) is pure CPU work, and on scenes
+ * with hundreds of meshes it used to take longer than the ASSIMP
+ * import itself. kuhl_private_load_model() now only records a "stage"
+ * per mesh while it walks the node tree; kuhl_load_model() then
+ * converts all of the stages in parallel on a worker pool and uploads
+ * the finished arrays into OpenGL buffers on the context thread.
+ *
+ * Setting the KUHL_LOAD_STREAM environment variable defers most of
+ * the uploads further: only a few meshes are uploaded per
+ * kuhl_geometry_draw() call, so the first frame appears sooner and
+ * the model fills in over the following frames.
+ */
+
+/** CPU-side converted attribute arrays for one mesh, waiting to be
+ * uploaded into the mesh's kuhl_geometry. */
+struct kuhl_mesh_stage
+{
+	const struct aiScene *scene;
+	const struct aiMesh *mesh;
+	kuhl_geometry *geom;        /**< The geometry the arrays belong to. */
+	unsigned int primitiveType; /**< Indices per primitive (1=points, 2=lines, 3=triangles). */
+	float *positions;
+	float *normals;   /**< NULL if the mesh has no normals. */
+	float *colors;    /**< NULL if the mesh has neither vertex colors nor a material color. */
+	float *texCoords; /**< NULL if the mesh has no texture coordinates. */
+	float *boneIndices; /**< NULL if the mesh has no bones. */
+	float *boneWeights; /**< NULL if the mesh has no bones. */
+	GLuint *indices;    /**< NULL if the mesh has no faces. */
+	GLuint numIndices;
+	float uvScale[2];  /**< Maps texcoords into a texture atlas sub-rectangle; (1,1) when the texture isn't packed. */
+	float uvOffset[2]; /**< @see uvScale */
+};
+
+/** The stages collected while walking the node tree of the model
+ * currently being loaded (models are loaded one at a time). */
+static struct kuhl_mesh_stage **kuhl_load_stages = NULL;
+static int kuhl_load_stage_count = 0;
+static int kuhl_load_stage_capacity = 0;
+/** Next stage a conversion worker should claim. */
+static volatile int kuhl_load_stage_next = 0;
+
+/** Converts one staged mesh's assimp data into flat attribute
+ * arrays. This is pure CPU work and runs on the loader worker
+ * pool. */
+static void kuhl_private_mesh_stage_convert(struct kuhl_mesh_stage *stage)
+{
+	const struct aiMesh *mesh = stage->mesh;
+
+	/* Store the vertex positions */
+	stage->positions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
+	for(unsigned int i=0; i<mesh->mNumVertices; i++)
+	{
+		stage->positions[i*3+0] = (mesh->mVertices)[i].x;
+		stage->positions[i*3+1] = (mesh->mVertices)[i].y;
+		stage->positions[i*3+2] = (mesh->mVertices)[i].z;
+	}
+
+	/* Store the normal vectors */
+	if(mesh->mNormals != NULL)
+	{
+		stage->normals = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			stage->normals[i*3+0] = (mesh->mNormals)[i].x;
+			stage->normals[i*3+1] = (mesh->mNormals)[i].y;
+			stage->normals[i*3+2] = (mesh->mNormals)[i].z;
+		}
+	}
+
+	/* Store the vertex colors */
+	// Note: mesh->mColors is a C array, not a pointer
+	if(mesh->mColors[0] != NULL)
+	{
+		/* Don't use alpha by default; changing this to 4 may
+		   require the size of in_Color the vertex program to be
+		   adjusted. */
+		static const int colorComps = 3;
+		stage->colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			stage->colors[i*colorComps+0] = mesh->mColors[0][i].r;
+			stage->colors[i*colorComps+1] = mesh->mColors[0][i].g;
+			stage->colors[i*colorComps+2] = mesh->mColors[0][i].b;
+			if(colorComps == 4)
+				stage->colors[i*colorComps+3] = mesh->mColors[0][i].a;
+		}
+	}
+	/* If there are no vertex colors, try to use material colors instead */
+	else
+	{
+		/* It would be more efficient to send material colors as a
+		 * uniform variable. However, by using this approach, we
+		 * don't need to use both a material color uniform and a
+		 * vertex color attribute in a GLSL program that displays
+		 * a model. */
+		const struct aiMaterial *mtl = stage->scene->mMaterials[mesh->mMaterialIndex];
+		struct aiColor4D diffuse;
+		if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
+		{
+			static const int colorComps = 3;
+			stage->colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
+			for(unsigned int i=0; i<mesh->mNumVertices; i++)
+			{
+				stage->colors[i*colorComps+0] = diffuse.r;
+				stage->colors[i*colorComps+1] = diffuse.g;
+				stage->colors[i*colorComps+2] = diffuse.b;
+				// Alpha is not handled for now.
+			}
+		}
+	}
+
+	/* Store the texture coordinates */
+	// Note: mesh->mTextureCoords is a C array, not a pointer
+	if(mesh->mTextureCoords[0] != NULL)
+	{
+		stage->texCoords = kuhl_malloc(sizeof(float)*mesh->mNumVertices*2);
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			/* The scale and offset are the identity unless this
+			 * mesh's texture was packed into an atlas page. */
+			stage->texCoords[i*2+0] = stage->uvOffset[0] + mesh->mTextureCoords[0][i].x * stage->uvScale[0];
+			stage->texCoords[i*2+1] = stage->uvOffset[1] + mesh->mTextureCoords[0][i].y * stage->uvScale[1];
+		}
+	}
+
+	/* Fill in bone information */
+	if(mesh->mBones != NULL && mesh->mNumBones > 0)
+	{
+		float *indices = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
+		float *weights = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
+		/* For each vertex */
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			/* Zero out weights */
+			for(int j=0; j<4; j++)
+			{
+				// If weight is zero, it doesn't matter what the index
+				// is as long as it isn't out of bounds.
+				indices[i*4+j] = 0;
+				weights[i*4+j] = 0;
+			}
+
+			int count = 0; /* How many bones refer to this vertex? */
+
+			/* For each bone */
+			for(unsigned int j=0; j<mesh->mNumBones; j++)
+			{
+				/* Each vertex that this bone refers to. */
+				for(unsigned int k=0; k<mesh->mBones[j]->mNumWeights; k++)
+				{
+					/* If this bone refers to a vertex that matches the one
+					   that we are on, use the data and send it to the vertex program.
+					 */
+					unsigned int idx = mesh->mBones[j]->mWeights[k].mVertexId;
+					float wght       = mesh->mBones[j]->mWeights[k].mWeight;
+					if(idx == i)
+					{
+						indices[i*4+count] = (float) j;
+						weights[i*4+count] = wght;
+						count++;
+					} // end if vertices match
+				} // end for each vertex the bone refers to
+			} // end for each bone
+		} // end for each vertex in mesh
+
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			if(weights[i*4+0] == 0)
+			{
+				msg(FATAL, "Every vertex should have at least one weight but vertex %ud has no weights!", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+		stage->boneIndices = indices;
+		stage->boneWeights = weights;
+	} // end if there are bones
+
+	if(mesh->mNumFaces > 0)
+	{
+		/* Get indices to draw with */
+		stage->numIndices = mesh->mNumFaces * stage->primitiveType;
+		stage->indices = kuhl_malloc(sizeof(GLuint)*stage->numIndices);
+		for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
+		{
+			const struct aiFace* face = &mesh->mFaces[t];
+			for(unsigned int x = 0; x < stage->primitiveType; x++) // for each index
+				stage->indices[t*stage->primitiveType+x] = face->mIndices[x];
+		}
+	}
+}
+
+/** Uploads a staged mesh's converted arrays into its kuhl_geometry
+ * and frees the staging space. Must run on the thread which owns the
+ * GL context. */
+static void kuhl_private_mesh_stage_upload(struct kuhl_mesh_stage *stage)
+{
+	kuhl_geometry *geom = stage->geom;
+
+	kuhl_geometry_attrib(geom, stage->positions, 3, "in_Position", KG_INTERLEAVE);
+	free(stage->positions);
+	if(stage->normals != NULL)
+	{
+		kuhl_geometry_attrib(geom, stage->normals, 3, "in_Normal", KG_INTERLEAVE);
+		free(stage->normals);
+	}
+	if(stage->colors != NULL)
+	{
+		kuhl_geometry_attrib(geom, stage->colors, 3, "in_Color", KG_INTERLEAVE);
+		free(stage->colors);
+	}
+	if(stage->texCoords != NULL)
+	{
+		kuhl_geometry_attrib(geom, stage->texCoords, 2, "in_TexCoord", KG_WARN|KG_INTERLEAVE);
+		free(stage->texCoords);
+	}
+	if(stage->boneIndices != NULL)
+	{
+		kuhl_geometry_attrib(geom, stage->boneIndices, 4, "in_BoneIndex", KG_INTERLEAVE);
+		kuhl_geometry_attrib(geom, stage->boneWeights, 4, "in_BoneWeight", KG_INTERLEAVE);
+		free(stage->boneIndices);
+		free(stage->boneWeights);
+	}
+	if(stage->indices != NULL)
+	{
+		kuhl_geometry_indices(geom, stage->indices, stage->numIndices);
+		free(stage->indices);
+	}
+
+	geom->pending_stage = NULL;
+	free(stage);
+}
+
+/** A conversion worker: claims staged meshes until none remain. The
+ * GL context thread runs this too while it waits for the workers. */
+static void* kuhl_private_load_worker(void *arg)
+{
+	(void) arg;
+	while(1)
+	{
+		int i = __sync_fetch_and_add(&kuhl_load_stage_next, 1);
+		if(i >= kuhl_load_stage_count)
+			break;
+		kuhl_private_mesh_stage_convert(kuhl_load_stages[i]);
+	}
+	return NULL;
+}
+
+/** Recursively calls itself to create one or more kuhl_geometry
+ * structs for all of the nodes in the scene.
+ *
+ * @param sc The scene that we want to render.
+ *
+ * @param nd The current node that we are rendering.
+ */
+static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
+                                              const struct aiNode* nd,
+                                              GLuint program,
+                                              float currentTransform[16],
+                                              const char* modelFilename,
+                                              const char* textureDirname)
+{
+	/* Each node in the scene has a transform matrix that should
+	 * affect all of the nodes under it. The currentTransform matrix
+	 * is the current matrix based on any nodes above the one that we
+	 * are currently processing. Here, we update the currentTransform
+	 * to include the matrix in the node we are currently on. */
+
+	/* Save our current transform so we can reapply it when we are
+	 * finished processing this node */
+	float origTransform[16];
+	mat4f_copy(origTransform, currentTransform);
+	
+	/* Get this node's transform matrix and convert it into a plain array. */
+	float thisTransform[16];
+	mat4f_from_aiMatrix4x4(thisTransform, nd->mTransformation);
+
+	/* Apply this node's transformation to our current transform. */
+	mat4f_mult_mat4f_new(currentTransform, currentTransform, thisTransform);
+
+	kuhl_geometry *first_geom = NULL;
+	
+	/* Create a kuhl_geometry object for each of the meshes assigned
+	 * to this ASSIMP node. */
+	for(unsigned int n=0; n < nd->mNumMeshes; n++)
 	{
-		for(int i=0; i<textureIdMapMaxSize; i++)
+		const struct aiMesh* mesh = sc->mMeshes[nd->mMeshes[n]];
+
+		/* Confirm that the mesh has only one primitive type. */
+		if(mesh->mPrimitiveTypes == 0)
 		{
-			textureIdMap[i].textureFileName = NULL;
-			textureIdMap[i].textureID = 0;
+			msg(ERROR, "Primitive type not set by ASSIMP in mesh.\n");
+			continue;
+		}
+		// Check if more than one bit (i.e., primitive type) is in this mesh.
+		if((mesh->mPrimitiveTypes & (mesh->mPrimitiveTypes-1)) != 0) 
+		{
+			msg(ERROR, "This mesh has more than one primitive "
+			    "type in it. The model should be loaded with the "
+			    "aiProcess_SortByPType flag set.\n");
+			continue;
 		}
-	}
 
-	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
-	for(unsigned int m=0; m < scene->mNumMaterials; m++)
-	{
-		struct aiString path;
-		GLuint texIndex = 0;
+		/* We assume that each mesh has its own primitive type. Here
+		 * we identify that type by number and by the OpenGL name.. */
+		unsigned int meshPrimitiveType;
+		int meshPrimitiveTypeGL;
+		if(mesh->mPrimitiveTypes & aiPrimitiveType_POINT)
+		{
+			meshPrimitiveType = 1;
+			meshPrimitiveTypeGL = GL_POINTS;
+		}
+		else if(mesh->mPrimitiveTypes & aiPrimitiveType_LINE)
+		{
+			meshPrimitiveType = 2;
+			meshPrimitiveTypeGL = GL_LINES;
+		}
+		else if(mesh->mPrimitiveTypes & aiPrimitiveType_TRIANGLE)
+		{
+			meshPrimitiveType = 3;
+			meshPrimitiveTypeGL = GL_TRIANGLES;
+		}
+		else if(mesh->mPrimitiveTypes & aiPrimitiveType_POLYGON)
+		{
+			msg(WARNING, "Mesh %u (%u/%u meshes in node \"%s\"): We only "
+			    "support drawing triangle, line, or point meshes. "
+			    "This mesh contained polygons, and we are skipping it. "
+			    "To resolve this problem, ensure that the file is loaded "
+			    "with aiProcess_Triangulage to force ASSIMP to triangulate "
+			    "the model.\n",
+			    nd->mMeshes[n], n+1, nd->mNumMeshes, nd->mName.data);
+			continue;
+		}
+		else
+		{
+			msg(ERROR, "Unknown primitive type in mesh.\n");
+			continue;
+		}
+		
+		/* Allocate space and initialize kuhl_geometry. One kuhl_geometry
+		 * will be used per mesh. We
+		 * allocate each one individually (instead of malloc()'ing one
+		 * large space for all of the meshes in this node so each of
+		 * the objects can be free()'d) */
+		kuhl_geometry *geom = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+		kuhl_geometry_new(geom, program, mesh->mNumVertices,
+		                  meshPrimitiveTypeGL);
 
+		/* Set up kuhl_geometry linked list */
+		first_geom = kuhl_geometry_append(first_geom, geom);
 
-		if(aiGetMaterialTexture(scene->mMaterials[m], aiTextureType_DIFFUSE,  texIndex, &path, NULL, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS)
+		geom->assimp_node = (struct aiNode*) nd;
+		geom->assimp_scene = (struct aiScene*) sc;
+		mat4f_copy(geom->matrix, currentTransform);
+
+		if(mesh->mBones != NULL && mesh->mNumBones > MAX_BONES)
 		{
-			/* Don't load a texture that we have already loaded. */
-			char *fullpath = kuhl_private_assimp_fullpath(path.data, modelFilename, textureDirname);
-			int alreadyExists = 0;
+			msg(FATAL, "This mesh has %d bones but we only support %d",
+			    mesh->mNumBones, MAX_BONES);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Stage the CPU-side attribute conversion for this mesh. The
+		 * conversion itself (deinterleaving vertex data, gathering
+		 * bone weights, flattening indices) runs on the worker pool
+		 * in kuhl_load_model() after the whole tree has been
+		 * walked. */
+		struct kuhl_mesh_stage *stage = kuhl_malloc(sizeof(struct kuhl_mesh_stage));
+		stage->scene = sc;
+		stage->mesh = mesh;
+		stage->geom = geom;
+		stage->primitiveType = meshPrimitiveType;
+		stage->positions = NULL;
+		stage->normals = NULL;
+		stage->colors = NULL;
+		stage->texCoords = NULL;
+		stage->boneIndices = NULL;
+		stage->boneWeights = NULL;
+		stage->indices = NULL;
+		stage->numIndices = 0;
+		stage->uvScale[0] = 1;
+		stage->uvScale[1] = 1;
+		stage->uvOffset[0] = 0;
+		stage->uvOffset[1] = 0;
+		geom->pending_stage = stage;
+
+		if(kuhl_load_stage_count == kuhl_load_stage_capacity)
+		{
+			kuhl_load_stage_capacity = kuhl_load_stage_capacity == 0 ? 64 : kuhl_load_stage_capacity*2;
+			kuhl_load_stages = realloc(kuhl_load_stages, sizeof(struct kuhl_mesh_stage*)*kuhl_load_stage_capacity);
+		}
+		kuhl_load_stages[kuhl_load_stage_count++] = stage;
+
+		/* Find our texture and tell our kuhl_geometry object about
+		 * it. */
+		struct aiString texPath;	//contains filename of texture
+		int texIndex = 0;
+		if(AI_SUCCESS == aiGetMaterialTexture(sc->mMaterials[mesh->mMaterialIndex],
+		                                      aiTextureType_DIFFUSE, texIndex, &texPath,
+		                                      NULL, NULL, NULL, NULL, NULL, NULL))
+		{
+			textureIdMapStruct *entry = NULL;
+			char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
 			for(int i=0; i<textureIdMapSize; i++)
 			{
-				if(strcmp(fullpath, textureIdMap[i].textureFileName) == 0)
+				if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
 				{
-					alreadyExists=1;
+					entry = &textureIdMap[i];
 					break;
 				}
 			}
-			if(alreadyExists > 0) // no need to reload an already loaded texture
-			{
-				free(fullpath);
-				continue; // skip to next material.
-			}
-
-			if(kuhl_read_texture_file(fullpath, &texIndex) < 0)
+			free(fullpath);
+			if(entry == NULL || entry->textureID == 0)
 			{
-				msg(WARNING, "%s refers to texture %s which we could not find at %s\n", modelFilename, path.data, fullpath);
+				msg(WARNING, "Mesh %u uses texture '%s'."
+				    "This texture should have been loaded earlier, but we can't find it now.",
+				    nd->mMeshes[n], texPath.data);
 			}
-
-			/* Store the texture information in our list structure so
-			 * we can find the textureID from the filename when we
-			 * render the scene. */
-			if(textureIdMapSize >= textureIdMapMaxSize)
+			else
 			{
-				msg(FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
-				exit(EXIT_FAILURE);
-			}
-			textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
-			textureIdMap[textureIdMapSize].textureID = texIndex;
-			textureIdMapSize++;
-			free(fullpath);
-		}
-
-		/* If we failed to load a diffuse texture and there are no
-		 * other textures, we shouldn't print a
-		 * warning/error. However, if there is no diffuse and
-		 * other textures exist, print a message and exit so the
-		 * user knows that non-diffuse textures aren't going to be
-		 * loaded. */
-		#define TEX_TYPE_LEN 12
-		static const enum aiTextureType texTypeList[TEX_TYPE_LEN] = {
-			aiTextureType_DIFFUSE,   aiTextureType_SPECULAR,     aiTextureType_AMBIENT,
-			aiTextureType_EMISSIVE,  aiTextureType_HEIGHT,       aiTextureType_NORMALS,
-			aiTextureType_SHININESS, aiTextureType_OPACITY,      aiTextureType_DISPLACEMENT,
-			aiTextureType_LIGHTMAP,  aiTextureType_REFLECTION,   aiTextureType_UNKNOWN };
-		
-		static const char *texTypeListStr[TEX_TYPE_LEN] = {"DIFFUSE", "SPECULAR", "AMBIENT",
-		                                                   "EMISSIVE", "HEIGHT", "NORMALS",
-		                                                   "SHININESS","OPACITY","DISPLACEMENT",
-		                                                   "LIGHTMAP","REFLECTION","UNKNOWN" };
+				if(entry->inAtlas)
+				{
+					/* The texture shares an atlas page; this mesh's
+					 * texcoords get remapped into the texture's
+					 * sub-rectangle when the stage is converted. */
+					stage->uvScale[0]  = entry->uvScale[0];
+					stage->uvScale[1]  = entry->uvScale[1];
+					stage->uvOffset[0] = entry->uvOffset[0];
+					stage->uvOffset[1] = entry->uvOffset[1];
+				}
+				else
+				{
+					/* If model uses texture and we found the texture file,
+					   Make sure we repeat instead of clamp textures */
+					glBindTexture(GL_TEXTURE_2D, entry->textureID);
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+					kuhl_errorcheck();
+				}
 
-		int textureCount = 0;
-		for(int i=1; i<TEX_TYPE_LEN; i++) // skip diffuse
-			textureCount += aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[i]);
-		if(textureCount > 0) // if there is a non-diffuse texture
-		{
-			char buf[1024] = "";
-			int buflen = 0;
-			buflen += snprintf(buf+buflen, 1024-buflen, "Ignoring some textures in material: ");
-			for(int i=1; i<TEX_TYPE_LEN; i++)
-			{
-				int count = aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[i]);
-				if(count > 0)
-					buflen += snprintf(buf+buflen, 1024-buflen, "%s=%d ", texTypeListStr[i], count);
+				kuhl_geometry_texture(geom, entry->textureID, "tex", 0);
 			}
-			msg(DEBUG, "%s", buf);
-
-			if(aiGetMaterialTextureCount(scene->mMaterials[m], texTypeList[0]) > 1)
-				msg(DEBUG, "The material also has more than one diffuse texture.\n");
-		}
-	}
-
-	return scene;
-}
-
-/** Given a aiNodeAnim object and a time, return an appropriate
- * transformation matrix.
- *
- * @param transformResult The resulting transformation matrix.
- * @param na The aiNodeAnim to generate the matrix form.
- * @param ticks The time of the animation in TICKS (not seconds!)
- */
-static void kuhl_private_anim_matrix(float transformResult[16], const struct aiNodeAnim *na, double ticks)
-{
-
-	/* Find indices of start and stop position keys */
-	unsigned int positionStart = 0;
-	for(unsigned int j=0; j<na->mNumPositionKeys-1; j++)
-		if(ticks < na->mPositionKeys[j+1].mTime)
-		{
-			positionStart = j;
-			break;
-		}
-	unsigned int positionEnd = positionStart+1;
-	if(positionEnd >= na->mNumPositionKeys)
-		positionEnd = positionStart;
-	/* Determine where we are in relation to the two nearest keys */
-	float deltaTime = na->mPositionKeys[positionEnd].mTime - na->mPositionKeys[positionStart].mTime;
-	float factor;
-	if(deltaTime != 0)
-		factor = (ticks - na->mPositionKeys[positionStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	
-	/* Interpolate between two nearest keys */
-	float positionValStart[3] = { na->mPositionKeys[positionStart].mValue.x,
-	                              na->mPositionKeys[positionStart].mValue.y,
-	                              na->mPositionKeys[positionStart].mValue.z };
-	float positionValEnd[3] = { na->mPositionKeys[positionEnd].mValue.x,
-	                            na->mPositionKeys[positionEnd].mValue.y,
-	                            na->mPositionKeys[positionEnd].mValue.z };
-	float positionValMid[3];
-	vec3f_scalarMult(positionValStart, (1-factor));
-	vec3f_scalarMult(positionValEnd, factor);
-	vec3f_add_new(positionValMid, positionValStart, positionValEnd);
-	float positionMatrix[16];
-	mat4f_translateVec_new(positionMatrix, positionValMid);
-
-	/* Find indices of start and stop rotation keys */
-	unsigned int rotationStart = 0;
-	for(unsigned int j=0; j<na->mNumRotationKeys-1; j++)
-		if(ticks < na->mRotationKeys[j+1].mTime)
-		{
-			rotationStart = j;
-			break;
 		}
-	unsigned int rotationEnd = rotationStart+1;
-	if(rotationEnd >= na->mNumRotationKeys)
-		rotationEnd = rotationStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mRotationKeys[rotationEnd].mTime - na->mRotationKeys[rotationStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mRotationKeys[rotationStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float rotationValStart[4] = { na->mRotationKeys[rotationStart].mValue.x,
-	                              na->mRotationKeys[rotationStart].mValue.y,
-	                              na->mRotationKeys[rotationStart].mValue.z,
-	                              na->mRotationKeys[rotationStart].mValue.w };
-	float rotationValEnd[4] = { na->mRotationKeys[rotationEnd].mValue.x,
-	                            na->mRotationKeys[rotationEnd].mValue.y,
-	                            na->mRotationKeys[rotationEnd].mValue.z,
-	                            na->mRotationKeys[rotationEnd].mValue.w };
-	float rotationValMid[4];
-	//vec4f_normalize(rotationValStart);
-	//vec4f_normalize(rotationValEnd);
-	quatf_slerp_new(rotationValMid, rotationValStart, rotationValEnd, factor);
-	float rotationMatrix[16];
-	mat4f_rotateQuatVec_new(rotationMatrix, rotationValMid);
 
-	/* Find indices of start and stop scaling keys */
-	unsigned int scalingStart = 0;
-	for(unsigned int j=0; j<na->mNumScalingKeys-1; j++)
-		if(ticks < na->mScalingKeys[j+1].mTime)
+		/* Initialize list of bone matrices if this mesh has bones. */
+		if(mesh->mNumBones > 0)
 		{
-			scalingStart = j;
-			break;
+			kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
+			bones->count = mesh->mNumBones;
+			bones->mesh = n;
+			bones->matricesValid = 0;
+			for(unsigned int b=0; b < mesh->mNumBones; b++)
+				bones->boneList[b] = mesh->mBones[b];
+			// bone name lookups are resolved by kuhl_update_model().
+			for(unsigned int b=0; b < MAX_BONES; b++)
+				bones->nodeIndex[b] = -1;
+			// set any unused bone matrices to the identity.
+			for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
+				mat4f_identity(bones->matrices[b]);
+			geom->bones = bones;
 		}
-	unsigned int scalingEnd = scalingStart+1;
-	if(scalingEnd >= na->mNumScalingKeys)
-		scalingEnd = scalingStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mScalingKeys[scalingEnd].mTime - na->mScalingKeys[scalingStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mScalingKeys[scalingStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float scalingValStart[3] = { na->mScalingKeys[scalingStart].mValue.x,
-	                             na->mScalingKeys[scalingStart].mValue.y,
-	                             na->mScalingKeys[scalingStart].mValue.z };
-	float scalingValEnd[3] = { na->mScalingKeys[scalingEnd].mValue.x,
-	                           na->mScalingKeys[scalingEnd].mValue.y,
-	                           na->mScalingKeys[scalingEnd].mValue.z };
-	float scalingValMid[3];
-	vec3f_scalarMult(scalingValStart, (1-factor));
-	vec3f_scalarMult(scalingValEnd, factor);
-	vec3f_add_new(scalingValMid, scalingValStart, scalingValEnd);
-	float scalingMatrix[16];
-	mat4f_scaleVec_new(scalingMatrix, scalingValMid);
-	
-	// transformResult = translation * rotation * scaling
-	mat4f_mult_mat4f_new(transformResult, positionMatrix, rotationMatrix);
-	mat4f_mult_mat4f_new(transformResult, transformResult, scalingMatrix);
+
+		msg(DEBUG, "Mesh #%03u in node \"%s\" (node has %d meshes): verts=%d indices=%d primType=%d normals=%s colors=%s texCoords=%s bones=%d tex=%s",
+		       nd->mMeshes[n], nd->mName.data, nd->mNumMeshes,
+		       mesh->mNumVertices,
+		       mesh->mNumFaces*meshPrimitiveType,
+		       meshPrimitiveType,
+		       mesh->mNormals       == NULL ? "n" : "y",
+		       mesh->mColors[0]==NULL ? "n" : "y", // mColors is an array of pointers
+		       mesh->mTextureCoords[0] == NULL ? "n" : "y",   // mTextureCoords is an array of pointers
+		       mesh->mNumBones,
+		       geom->texture_count == 0 ? "(null)" : texPath.data);
+	} // end for each mesh in node
+
+	/* Process all of the meshes in the aiNode's children too */
+	for (unsigned int i = 0; i < nd->mNumChildren; i++)
+	{
+		kuhl_geometry *child_geom = kuhl_private_load_model(sc, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname);
+		first_geom = kuhl_geometry_append(first_geom, child_geom);
+	}
+
+	/* Restore the transform matrix to exactly as it was when this
+	 * function was called by the caller. */
+	mat4f_copy(currentTransform, origTransform);
+
+	return first_geom;
 }
 
-/* Returns the transformation matrix for a node (without considering
- * the transformations of the parent node). If there is no animation
- * information, the matrix is stored in the node itself. If there is
- * animation information, we ignore the matrix in the node and instead
- * calculate a matrix based on the animation information.
- *
- * @param transformResult To be filled in with the matrix for the
- * requested node.
- *
- * @param scene The ASSIMP scene object containing the node.
- *
- * @param node The ASSIMP node object that we want animation
- * information about.
- *
- * @param animationNum If the file contains more than one animation,
- * indicates which animation to use. If you don't know, set this to 0.
- *
- * @param t The time in seconds that you want the animation matrix
- * for. If time is negative, this function is guaranteed to return the
- * transformation matrix in the node.
+
+/* --- Baked animation cache ---
  *
- * @return Returns 1 if we successfully returned a matrix based on
- * animation information. Returns 0 if we simply returned the
- * transformation matrix in the node itself.
+ * kuhl_update_model() used to resolve every bone name with a
+ * recursive string search of the aiNode tree and then recompute that
+ * node's transform by re-walking to the root---once per bone, per
+ * geometry, per frame. The cache below flattens the node hierarchy
+ * into an array (parents stored before children) once per scene,
+ * resolves all name lookups to array indices once, and then updates
+ * the hierarchy with a single linear pass which only recomputes the
+ * matrices that can actually have changed: nodes without an animation
+ * channel (and channels whose tracks hold a single key) are computed
+ * once and never again, and a node's root-relative matrix is reused
+ * whenever neither it nor any ancestor changed.
  */
-static int kuhl_private_node_matrix(float transformResult[16],
-                                    const struct aiScene *scene,
-                                    const struct aiNode *node,
-                                    unsigned int animationNum, double t)
+
+struct kuhl_skeleton_node
 {
-	/* Copy the transform matrix from the node itself. This is the
-	 * matrix that the user will see if we are unable to find the
-	 * requested animation matrix for this node. */
-	mat4f_from_aiMatrix4x4(transformResult, node->mTransformation);
-	
-	/* Return the transformation matrix from the node if: (1) The
-	 * requested animation number is too large. (2) A negative time
-	 * value is requested. */
-	if(animationNum >= scene->mNumAnimations || t < 0)
-		return 0;
+	const struct aiNode *node; /**< The assimp node this entry mirrors */
+	int parent;                /**< Index of the parent entry; -1 for the root */
+	const struct aiNodeAnim *channel; /**< Channel driving this node in the resolved animation, or NULL */
+	int channelConstant; /**< 1 if every track in the channel holds a single key (the channel can't animate) */
+	float local[16];     /**< Cached transform relative to the parent node */
+	float global[16];    /**< Cached transform relative to the root */
+	int localValid;      /**< 0 until local has been computed at least once */
+	int dirty;           /**< 1 if global changed during the most recent update pass */
+};
+
+typedef struct kuhl_skeleton_struct
+{
+	const struct aiScene *scene; /**< The scene this skeleton was baked from */
+	int count;                   /**< Number of nodes in the scene */
+	struct kuhl_skeleton_node *nodes; /**< Flat copy of the node hierarchy, parents before children */
+	unsigned int resolvedAnim;   /**< The animation number the channel pointers are resolved for */
+	double cachedTick;           /**< Animation tick the globals were computed at; -1 means "bind pose", -2 means "never computed" */
+	float *batch;                /**< Scratch for batch channel interpolation (33 floats per node) */
+	int *batchNodes;             /**< Scratch: which node each batched channel belongs to */
+	struct kuhl_skeleton_struct *next;
+} kuhl_skeleton;
+
+/** All of the skeletons baked so far (one per loaded aiScene). */
+static kuhl_skeleton *kuhl_skeleton_list = NULL;
+
+static int kuhl_skeleton_count_nodes(const struct aiNode *node)
+{
+	int count = 1;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		count += kuhl_skeleton_count_nodes(node->mChildren[i]);
+	return count;
+}
 
-	struct aiAnimation *anim = scene->mAnimations[animationNum];
+/** Copies the aiNode tree into the flat node array in preorder so
+ * that every node's parent appears earlier in the array. */
+static void kuhl_skeleton_fill(kuhl_skeleton *sk, const struct aiNode *node, int parent)
+{
+	int index = sk->count++;
+	sk->nodes[index].node = node;
+	sk->nodes[index].parent = parent;
+	sk->nodes[index].channel = NULL;
+	sk->nodes[index].channelConstant = 0;
+	sk->nodes[index].localValid = 0;
+	sk->nodes[index].dirty = 0;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		kuhl_skeleton_fill(sk, node->mChildren[i], index);
+}
 
-	/* If the time value too large for the animation, return the
-	 * transformation matrix form the node. */
-	double currentTick = t * anim->mTicksPerSecond;
-	if(currentTick > anim->mDuration)
-		return 0;
+/** Points each node at the animation channel which drives it (if
+ * any). This is the only place names are compared; everything after
+ * it works with indices and pointers. */
+static void kuhl_skeleton_resolve_channels(kuhl_skeleton *sk, unsigned int animationNum)
+{
+	for(int i=0; i<sk->count; i++)
+	{
+		sk->nodes[i].channel = NULL;
+		sk->nodes[i].channelConstant = 0;
+		sk->nodes[i].localValid = 0;
+	}
 
-	/* Find the channel corresponding to the node name passed in as
-	 * parameter. */
-	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	if(animationNum < sk->scene->mNumAnimations)
 	{
-		if(strcmp(anim->mChannels[i]->mNodeName.data, node->mName.data) == 0)
+		const struct aiAnimation *anim = sk->scene->mAnimations[animationNum];
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
 		{
-			/* Get this node's matrix according to the animation
-			 * information. */
-			struct aiNodeAnim *na = anim->mChannels[i];
-			kuhl_private_anim_matrix(transformResult, na, currentTick);
-			return 1;
+			const struct aiNodeAnim *na = anim->mChannels[c];
+			for(int i=0; i<sk->count; i++)
+			{
+				if(strcmp(na->mNodeName.data, sk->nodes[i].node->mName.data) == 0)
+				{
+					sk->nodes[i].channel = na;
+					sk->nodes[i].channelConstant =
+						(na->mNumPositionKeys <= 1 &&
+						 na->mNumRotationKeys <= 1 &&
+						 na->mNumScalingKeys  <= 1);
+					break;
+				}
+			}
 		}
 	}
 
-	return 0;
+	sk->resolvedAnim = animationNum;
+	sk->cachedTick = -2; // force the next update pass to run
 }
 
+/** Returns the baked skeleton for a scene, creating it on first
+ * use. */
+static kuhl_skeleton* kuhl_skeleton_get(const struct aiScene *scene)
+{
+	for(kuhl_skeleton *sk = kuhl_skeleton_list; sk != NULL; sk = sk->next)
+		if(sk->scene == scene)
+			return sk;
+
+	kuhl_skeleton *sk = kuhl_malloc(sizeof(kuhl_skeleton));
+	sk->scene = scene;
+	sk->nodes = kuhl_malloc(sizeof(struct kuhl_skeleton_node) *
+	                        kuhl_skeleton_count_nodes(scene->mRootNode));
+	sk->count = 0;
+	kuhl_skeleton_fill(sk, scene->mRootNode, -1);
+	/* Scratch space for kuhl_skeleton_update() to gather every
+	 * animated channel's keyframe endpoints into contiguous arrays:
+	 * per node, two endpoint vec3s + result + factor each for
+	 * position and scaling (10 floats each) and two endpoint
+	 * quaternions + result + factor for rotation (13 floats). */
+	sk->batch = kuhl_malloc(sizeof(float) * 33 * sk->count);
+	sk->batchNodes = kuhl_malloc(sizeof(int) * sk->count);
+	sk->resolvedAnim = (unsigned int) -1; // force channel resolution
+	sk->cachedTick = -2;
+	sk->next = kuhl_skeleton_list;
+	kuhl_skeleton_list = sk;
+	return sk;
+}
 
-/* Appends two kuhl_geometry lists together and returns the first item
- * in the list.
- *
- * @param a The list of geometry that should be appended to.
- *
- * @param b The lits of geometry to append to the end of the 'a' list.
- *
- * @return The first kuhl_geometry object in the appended
- * list. Typically, this will equal 'a'. This function returns NULL if
- * both 'a' and 'b' are null. It returns 'b' if only 'a' is null.
- */
-kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
+/** Finds the index of a node in the baked skeleton by name. Unlike
+ * kuhl_assimp_find_node(), this is a linear scan of a flat array, and
+ * callers cache the returned index. Returns -1 if not found. */
+static int kuhl_skeleton_find_name(const kuhl_skeleton *sk, const char *nodeName)
 {
-	if(a == NULL && b == NULL)
-		return NULL;
-	if(a == NULL && b != NULL)
-		return b;
-	if(a != NULL && b == NULL)
-		return a;
+	for(int i=0; i<sk->count; i++)
+		if(strcmp(sk->nodes[i].node->mName.data, nodeName) == 0)
+			return i;
+	return -1;
+}
 
-	kuhl_geometry *origA = a;
-	while(a->next != NULL)
-		a = a->next;
-	a->next = b;
-	return origA;
+/** Brings the skeleton's cached matrices up to date for the given
+ * animation and time. After this returns, every node's global matrix
+ * is current and node->dirty indicates whether it changed since the
+ * previous pass. */
+static void kuhl_skeleton_update(kuhl_skeleton *sk, unsigned int animationNum, float time)
+{
+	if(animationNum != sk->resolvedAnim)
+		kuhl_skeleton_resolve_channels(sk, animationNum);
+
+	/* The tick we evaluate channels at; -1 means the animation
+	 * doesn't apply (bind pose) and node matrices are used instead,
+	 * matching kuhl_private_node_matrix(). */
+	double tick = -1;
+	if(animationNum < sk->scene->mNumAnimations && time >= 0)
+	{
+		const struct aiAnimation *anim = sk->scene->mAnimations[animationNum];
+		double t = time * anim->mTicksPerSecond;
+		if(t <= anim->mDuration)
+			tick = t;
+	}
+
+	if(tick == sk->cachedTick)
+		return; // nothing can have changed
+
+	/* Whether we crossed between "animation active" and "bind pose"
+	 * since the last pass; if so, even constant channels must be
+	 * re-evaluated. */
+	int activeChanged = (tick < 0) != (sk->cachedTick < 0);
+
+	/* Carve the scratch block into the gather arrays for the batch
+	 * interpolation kernels. */
+	float *posStart  = sk->batch;
+	float *posEnd    = posStart  + 3*sk->count;
+	float *posVal    = posEnd    + 3*sk->count;
+	float *posT      = posVal    + 3*sk->count;
+	float *quatStart = posT      +   sk->count;
+	float *quatEnd   = quatStart + 4*sk->count;
+	float *quatVal   = quatEnd   + 4*sk->count;
+	float *quatT     = quatVal   + 4*sk->count;
+	float *sclStart  = quatT     +   sk->count;
+	float *sclEnd    = sclStart  + 3*sk->count;
+	float *sclVal    = sclEnd    + 3*sk->count;
+	float *sclT      = sclVal    + 3*sk->count;
+	int batchCount = 0;
+
+	/* First sweep: decide which nodes must be re-evaluated. Animated
+	 * channels only have their keyframe endpoints gathered here; the
+	 * interpolation itself runs below as three vectorized sweeps over
+	 * the gathered arrays rather than node by node. */
+	for(int i=0; i<sk->count; i++)
+	{
+		struct kuhl_skeleton_node *n = &(sk->nodes[i]);
+
+		int recompute = !n->localValid;
+		if(n->channel != NULL && (activeChanged || !n->channelConstant))
+			recompute = 1;
+
+		if(recompute)
+		{
+			if(n->channel != NULL && tick >= 0)
+			{
+				const struct aiNodeAnim *na = n->channel;
+				posT[batchCount]  = kuhl_private_anim_vector_keys(na->mPositionKeys, na->mNumPositionKeys, tick, posStart + 3*batchCount, posEnd + 3*batchCount);
+				quatT[batchCount] = kuhl_private_anim_quat_keys(na->mRotationKeys, na->mNumRotationKeys, tick, quatStart + 4*batchCount, quatEnd + 4*batchCount);
+				sclT[batchCount]  = kuhl_private_anim_vector_keys(na->mScalingKeys, na->mNumScalingKeys, tick, sclStart + 3*batchCount, sclEnd + 3*batchCount);
+				sk->batchNodes[batchCount] = i;
+				batchCount++;
+			}
+			else
+				mat4f_from_aiMatrix4x4(n->local, n->node->mTransformation);
+			n->localValid = 1;
+		}
+
+		/* A node's global matrix must be recomputed if its own local
+		 * matrix changed or if any ancestor's did. Parents appear
+		 * earlier in the array, so the parent's dirty flag is already
+		 * settled. (The flags don't depend on the matrix values, so
+		 * they can be settled before the batched locals exist.) */
+		n->dirty = recompute || (n->parent >= 0 && sk->nodes[n->parent].dirty);
+	}
+
+	/* Interpolate every gathered channel in one sweep per track type,
+	 * then compose the local matrices. */
+	if(batchCount > 0)
+	{
+		vec3f_lerp_array(posVal, posStart, posEnd, posT, batchCount);
+		quatf_slerp_array(quatVal, quatStart, quatEnd, quatT, batchCount);
+		vec3f_lerp_array(sclVal, sclStart, sclEnd, sclT, batchCount);
+		for(int b=0; b<batchCount; b++)
+		{
+			struct kuhl_skeleton_node *n = &(sk->nodes[sk->batchNodes[b]]);
+			float positionMatrix[16], rotationMatrix[16], scalingMatrix[16];
+			mat4f_translateVec_new(positionMatrix, posVal + 3*b);
+			mat4f_rotateQuatVec_new(rotationMatrix, quatVal + 4*b);
+			mat4f_scaleVec_new(scalingMatrix, sclVal + 3*b);
+			// local = translation * rotation * scaling
+			mat4f_mult_mat4f_new(n->local, positionMatrix, rotationMatrix);
+			mat4f_mult_mat4f_new(n->local, n->local, scalingMatrix);
+		}
+	}
+
+	/* Final sweep: rebuild the global matrices of dirty nodes. */
+	for(int i=0; i<sk->count; i++)
+	{
+		struct kuhl_skeleton_node *n = &(sk->nodes[i]);
+		if(!n->dirty)
+			continue;
+		if(n->parent >= 0)
+			mat4f_mult_mat4f_new(n->global, sk->nodes[n->parent].global, n->local);
+		else
+			mat4f_copy(n->global, n->local);
+	}
+
+	sk->cachedTick = tick;
 }
 
+/** Setup a model to draw at a specific time.
+
+    @param modelFilename Name of model file to update.
 
+    @param animationNum The animation to use. If the file only
+    contains one animation, set it to 0.
 
-/** Recursively calls itself to create one or more kuhl_geometry
- * structs for all of the nodes in the scene.
+    @param time The time in seconds to set the animation to. Setting
+    time to a negative displays the model in its bind pose.
+*/
+void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time)
+{
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		/* The aiScene object that this kuhl_geometry refers to. */
+		struct aiScene *scene = g->assimp_scene;
+		/* The aiNode object that this kuhl_geometry refers to. */
+		struct aiNode *node = g->assimp_node;
+
+		/* If the geometry contains no animations, isn't associated
+		 * with an ASSIMP scene or node, then there is no need to try
+		 * to animate it. */
+		if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
+			continue;
+
+		kuhl_skeleton *sk = kuhl_skeleton_get(scene);
+		kuhl_skeleton_update(sk, animationNum, time);
+
+		/* If there are no bones, update g->matrix. If there are
+		 * bones, we assume that the bones will drive the
+		 * animation. */
+		if(g->bones == NULL)
+		{
+			for(int i=0; i<sk->count; i++)
+			{
+				if(sk->nodes[i].node == node)
+				{
+					mat4f_copy(g->matrix, sk->nodes[i].global);
+					break;
+				}
+			}
+			continue;
+		}
+
+		/* Update the list of bone matrices. */
+		for(int b=0; b < g->bones->count; b++) // For each bone
+		{
+			/* Resolve the bone's name to a skeleton index the first
+			 * time we see it. */
+			int idx = g->bones->nodeIndex[b];
+			if(idx < 0)
+			{
+				idx = kuhl_skeleton_find_name(sk, g->bones->boneList[b]->mName.data);
+				if(idx < 0)
+				{
+					msg(FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
+					exit(EXIT_FAILURE);
+				}
+				g->bones->nodeIndex[b] = idx;
+			}
+
+			/* Skip bones whose node (and every ancestor of it) is
+			 * unchanged since the last pass. */
+			if(g->bones->matricesValid && !sk->nodes[idx].dirty)
+				continue;
+
+			/* Apply the bone offset to the node's root-relative
+			 * matrix. */
+			float offset[16];
+			mat4f_from_aiMatrix4x4(offset, g->bones->boneList[b]->mOffsetMatrix);
+			mat4f_mult_mat4f_new(g->bones->matrices[b], sk->nodes[idx].global, offset);
+		} // end for each bone
+		g->bones->matricesValid = 1;
+	} // end for each geometry
+}
+
+/* --- Binary model cache ---
  *
- * @param sc The scene that we want to render.
+ * Importing a large model with ASSIMP can take a long time because of
+ * the postprocessing that we ask ASSIMP to do (see
+ * kuhl_private_assimp_load()). Since the data we actually send to
+ * OpenGL is just a set of flattened per-vertex arrays, we can write
+ * those arrays out to a file next to the model the first time the
+ * model is loaded. On subsequent runs, we mmap() that file and copy
+ * the arrays straight into OpenGL buffers---skipping ASSIMP
+ * entirely. On a large model, this can turn a 30+ second load into a
+ * fraction of a second.
  *
- * @param nd The current node that we are rendering.
+ * The cache file is not portable between machines with different
+ * endianness and is automatically regenerated whenever it is older
+ * than the model file. Models which contain animations or bones are
+ * not cached because they require the ASSIMP scene at runtime.
  */
-static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
-                                              const struct aiNode* nd,
-                                              GLuint program,
-                                              float currentTransform[16],
-                                              const char* modelFilename,
-                                              const char* textureDirname)
+
+/** Appended to a model filename to produce the cache filename. */
+#define KUHL_MODEL_CACHE_SUFFIX ".kuhlcache"
+/** Bump this number whenever the cache file layout changes. */
+#define KUHL_MODEL_CACHE_VERSION 1
+
+/** Header at the start of a model cache file. All fields in the
+ * cache file are 4 bytes so that the arrays stay aligned when the
+ * file is mmap()'d. */
+typedef struct
 {
-	/* Each node in the scene has a transform matrix that should
-	 * affect all of the nodes under it. The currentTransform matrix
-	 * is the current matrix based on any nodes above the one that we
-	 * are currently processing. Here, we update the currentTransform
-	 * to include the matrix in the node we are currently on. */
+	char magic[8];        /**< Set to "kuhlmdl\0" */
+	uint32_t version;     /**< KUHL_MODEL_CACHE_VERSION */
+	uint32_t mesh_count;  /**< Number of meshes stored in the file */
+	float bbox[6];        /**< Bounding box of the model (xmin, xmax, ymin, ...) */
+} kuhl_model_cache_header;
+
+/** Header for each mesh in a model cache file. The mesh header is
+ * followed by the texture path (padded to a multiple of 4 bytes),
+ * vertex positions, normals, colors, texture coordinates, and
+ * indices---each only present if the corresponding count/flag is
+ * nonzero. */
+typedef struct
+{
+	uint32_t primitive_type; /**< GL_TRIANGLES, GL_LINES or GL_POINTS */
+	uint32_t vertex_count;   /**< Number of vertices in this mesh */
+	uint32_t index_count;    /**< Number of indices (may be 0) */
+	uint32_t has_normal;     /**< Is a normal array present? */
+	uint32_t has_color;      /**< Is a color array present? */
+	uint32_t has_texcoord;   /**< Is a texcoord array present? */
+	uint32_t texpath_len;    /**< Bytes of texture path incl. padding (0=no texture) */
+	float matrix[16];        /**< Transformation matrix for this mesh */
+} kuhl_model_cache_mesh;
+
+/** Constructs the name of the cache file for a model. The returned
+ * string should be free()'d. */
+static char* kuhl_private_cache_filename(const char *modelFilename)
+{
+	int len = strlen(modelFilename)+strlen(KUHL_MODEL_CACHE_SUFFIX)+1;
+	char *cacheFilename = kuhl_malloc(len);
+	snprintf(cacheFilename, len, "%s%s", modelFilename, KUHL_MODEL_CACHE_SUFFIX);
+	return cacheFilename;
+}
+
+/** Recursively counts the meshes in an ASSIMP node tree which
+ * kuhl_private_load_model() would actually turn into kuhl_geometry
+ * objects (i.e., meshes with a point, line or triangle primitive
+ * type). */
+static uint32_t kuhl_private_cache_count_meshes(const struct aiScene *sc, const struct aiNode *nd)
+{
+	uint32_t count = 0;
+	for(unsigned int n=0; n < nd->mNumMeshes; n++)
+	{
+		const struct aiMesh *mesh = sc->mMeshes[nd->mMeshes[n]];
+		if(mesh->mPrimitiveTypes & (aiPrimitiveType_POINT|aiPrimitiveType_LINE|aiPrimitiveType_TRIANGLE))
+			count++;
+	}
+	for(unsigned int i=0; i < nd->mNumChildren; i++)
+		count += kuhl_private_cache_count_meshes(sc, nd->mChildren[i]);
+	return count;
+}
 
-	/* Save our current transform so we can reapply it when we are
-	 * finished processing this node */
+/** Recursively writes the flattened mesh data for an ASSIMP node
+ * tree to a cache file. This function mirrors the traversal done by
+ * kuhl_private_load_model() so the cached meshes exactly match what
+ * the ASSIMP path would have produced.
+ *
+ * @return 1 on success, 0 on a write error.
+ */
+static int kuhl_private_cache_write_node(FILE *f, const struct aiScene *sc,
+                                         const struct aiNode *nd,
+                                         float currentTransform[16],
+                                         const char *modelFilename,
+                                         const char *textureDirname)
+{
+	/* Update the current transform exactly as kuhl_private_load_model() does. */
 	float origTransform[16];
 	mat4f_copy(origTransform, currentTransform);
-	
-	/* Get this node's transform matrix and convert it into a plain array. */
 	float thisTransform[16];
 	mat4f_from_aiMatrix4x4(thisTransform, nd->mTransformation);
-
-	/* Apply this node's transformation to our current transform. */
 	mat4f_mult_mat4f_new(currentTransform, currentTransform, thisTransform);
 
-	kuhl_geometry *first_geom = NULL;
-	
-	/* Create a kuhl_geometry object for each of the meshes assigned
-	 * to this ASSIMP node. */
-	for(unsigned int n=0; n < nd->mNumMeshes; n++)
-	{
-		const struct aiMesh* mesh = sc->mMeshes[nd->mMeshes[n]];
+	int success = 1;
 
-		/* Confirm that the mesh has only one primitive type. */
-		if(mesh->mPrimitiveTypes == 0)
-		{
-			msg(ERROR, "Primitive type not set by ASSIMP in mesh.\n");
-			continue;
-		}
-		// Check if more than one bit (i.e., primitive type) is in this mesh.
-		if((mesh->mPrimitiveTypes & (mesh->mPrimitiveTypes-1)) != 0) 
-		{
-			msg(ERROR, "This mesh has more than one primitive "
-			    "type in it. The model should be loaded with the "
-			    "aiProcess_SortByPType flag set.\n");
-			continue;
-		}
+	for(unsigned int n=0; success && n < nd->mNumMeshes; n++)
+	{
+		const struct aiMesh *mesh = sc->mMeshes[nd->mMeshes[n]];
 
-		/* We assume that each mesh has its own primitive type. Here
-		 * we identify that type by number and by the OpenGL name.. */
+		/* Number of vertices per primitive; skip meshes which
+		 * kuhl_private_load_model() would also skip. */
 		unsigned int meshPrimitiveType;
 		int meshPrimitiveTypeGL;
 		if(mesh->mPrimitiveTypes & aiPrimitiveType_POINT)
@@ -2671,366 +7332,385 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			meshPrimitiveType = 3;
 			meshPrimitiveTypeGL = GL_TRIANGLES;
 		}
-		else if(mesh->mPrimitiveTypes & aiPrimitiveType_POLYGON)
-		{
-			msg(WARNING, "Mesh %u (%u/%u meshes in node \"%s\"): We only "
-			    "support drawing triangle, line, or point meshes. "
-			    "This mesh contained polygons, and we are skipping it. "
-			    "To resolve this problem, ensure that the file is loaded "
-			    "with aiProcess_Triangulage to force ASSIMP to triangulate "
-			    "the model.\n",
-			    nd->mMeshes[n], n+1, nd->mNumMeshes, nd->mName.data);
-			continue;
-		}
 		else
-		{
-			msg(ERROR, "Unknown primitive type in mesh.\n");
 			continue;
-		}
-		
-		/* Allocate space and initialize kuhl_geometry. One kuhl_geometry
-		 * will be used per mesh. We
-		 * allocate each one individually (instead of malloc()'ing one
-		 * large space for all of the meshes in this node so each of
-		 * the objects can be free()'d) */
-		kuhl_geometry *geom = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
-		kuhl_geometry_new(geom, program, mesh->mNumVertices,
-		                  meshPrimitiveTypeGL);
-
-		/* Set up kuhl_geometry linked list */
-		first_geom = kuhl_geometry_append(first_geom, geom);
 
-		geom->assimp_node = (struct aiNode*) nd;
-		geom->assimp_scene = (struct aiScene*) sc;
-		mat4f_copy(geom->matrix, currentTransform);
+		kuhl_model_cache_mesh mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.primitive_type = meshPrimitiveTypeGL;
+		mh.vertex_count   = mesh->mNumVertices;
+		mh.index_count    = mesh->mNumFaces * meshPrimitiveType;
+		mh.has_normal     = mesh->mNormals != NULL ? 1 : 0;
+		mat4f_copy(mh.matrix, currentTransform);
+
+		/* Material diffuse color is used when there are no vertex
+		 * colors, matching kuhl_private_load_model(). */
+		struct aiColor4D diffuse;
+		int haveDiffuse = 0;
+		if(mesh->mColors[0] != NULL)
+			mh.has_color = 1;
+		else if(AI_SUCCESS == aiGetMaterialColor(sc->mMaterials[mesh->mMaterialIndex], AI_MATKEY_COLOR_DIFFUSE, &diffuse))
+		{
+			mh.has_color = 1;
+			haveDiffuse = 1;
+		}
+		mh.has_texcoord = mesh->mTextureCoords[0] != NULL ? 1 : 0;
 
-		/* Store the vertex position attribute into the kuhl_geometry struct */
-		float *vertexPositions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
-		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		/* Store the full path to the diffuse texture (if present) so
+		 * the cached model can reload it without the material list. */
+		char *texFullpath = NULL;
+		struct aiString texPath;
+		if(AI_SUCCESS == aiGetMaterialTexture(sc->mMaterials[mesh->mMaterialIndex],
+		                                      aiTextureType_DIFFUSE, 0, &texPath,
+		                                      NULL, NULL, NULL, NULL, NULL, NULL))
 		{
-			vertexPositions[i*3+0] = (mesh->mVertices)[i].x;
-			vertexPositions[i*3+1] = (mesh->mVertices)[i].y;
-			vertexPositions[i*3+2] = (mesh->mVertices)[i].z;
+			texFullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
+			/* Pad the string (including the NUL byte) to a multiple
+			 * of 4 bytes to keep the arrays that follow aligned. */
+			mh.texpath_len = ((strlen(texFullpath)+1+3)/4)*4;
 		}
-		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0);
-		free(vertexPositions);
 
-		/* Store the normal vectors in the kuhl_geometry struct */
-		if(mesh->mNormals != NULL)
+		if(fwrite(&mh, sizeof(mh), 1, f) != 1)
+			success = 0;
+
+		if(success && mh.texpath_len > 0)
 		{
-			float *normals = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				normals[i*3+0] = (mesh->mNormals)[i].x;
-				normals[i*3+1] = (mesh->mNormals)[i].y;
-				normals[i*3+2] = (mesh->mNormals)[i].z;
-			}
-			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", 0);
-			free(normals);
+			char pad[4] = { 0,0,0,0 };
+			size_t slen = strlen(texFullpath)+1;
+			if(fwrite(texFullpath, slen, 1, f) != 1 ||
+			   (mh.texpath_len-slen > 0 && fwrite(pad, mh.texpath_len-slen, 1, f) != 1))
+				success = 0;
 		}
+		if(texFullpath != NULL)
+			free(texFullpath);
 
-		/* Store the vertex color attribute */
-		// Note: mesh->mColors is a C array, not a pointer
-		if(mesh->mColors[0] != NULL)
+		/* Flatten and write the vertex arrays. */
+		if(success)
 		{
-			/* Don't use alpha by default; changing this to 4 may
-			   require the size of in_Color the vertex program to be
-			   adjusted. */
-			static const int colorComps = 3; 
-			float *colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
+			float *buf = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
 			for(unsigned int i=0; i<mesh->mNumVertices; i++)
 			{
-				colors[i*colorComps+0] = mesh->mColors[0][i].r;
-				colors[i*colorComps+1] = mesh->mColors[0][i].g;
-				colors[i*colorComps+2] = mesh->mColors[0][i].b;
-				if(colorComps == 4)
-					colors[i*colorComps+3] = mesh->mColors[0][i].a;
+				buf[i*3+0] = mesh->mVertices[i].x;
+				buf[i*3+1] = mesh->mVertices[i].y;
+				buf[i*3+2] = mesh->mVertices[i].z;
 			}
-			kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
-			free(colors);
-		}
-		/* If there are no vertex colors, try to use material colors instead */
-		else
-		{
-			/* It would be more efficient to send material colors as a
-			 * uniform variable. However, by using this approach, we
-			 * don't need to use both a material color uniform and a
-			 * vertex color attribute in a GLSL program that displays
-			 * a model. */
-			const struct aiMaterial *mtl = sc->mMaterials[mesh->mMaterialIndex];
-			struct aiColor4D diffuse;
-			if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
+			if(fwrite(buf, sizeof(float)*mesh->mNumVertices*3, 1, f) != 1)
+				success = 0;
+
+			if(success && mh.has_normal)
 			{
-				static const int colorComps = 3;
-				float *colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
 				for(unsigned int i=0; i<mesh->mNumVertices; i++)
 				{
-					colors[i*colorComps+0] = diffuse.r;
-					colors[i*colorComps+1] = diffuse.g;
-					colors[i*colorComps+2] = diffuse.b;
-					// Alpha is not handled for now.
+					buf[i*3+0] = mesh->mNormals[i].x;
+					buf[i*3+1] = mesh->mNormals[i].y;
+					buf[i*3+2] = mesh->mNormals[i].z;
 				}
-				kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
-				free(colors);
+				if(fwrite(buf, sizeof(float)*mesh->mNumVertices*3, 1, f) != 1)
+					success = 0;
 			}
-		}
-		
-		/* Store the texture coordinate attribute */
-		// Note: mesh->mTextureCoords is a C array, not a pointer
-		if(mesh->mTextureCoords[0] != NULL)
-		{
-			float *texCoord = kuhl_malloc(sizeof(float)*mesh->mNumVertices*2);
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				texCoord[i*2+0] = mesh->mTextureCoords[0][i].x;
-				texCoord[i*2+1] = mesh->mTextureCoords[0][i].y;
-			}
-			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 1);
-			free(texCoord);
-		}
-
-		/* Fill in bone information */
-		if(mesh->mBones != NULL && mesh->mNumBones > 0)
-		{
-			if(mesh->mNumBones > MAX_BONES)
-			{
-				msg(FATAL, "This mesh has %d bones but we only support %d",
-				    mesh->mNumBones, MAX_BONES);
-				exit(EXIT_FAILURE);
-			}
-			
-			float *indices = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
-			float *weights = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
-			/* For each vertex */
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
+			if(success && mh.has_color)
 			{
-				/* Zero out weights */
-				for(int j=0; j<4; j++)
-				{
-					// If weight is zero, it doesn't matter what the index
-					// is as long as it isn't out of bounds.
-					indices[i*4+j] = 0;
-					weights[i*4+j] = 0;
-				}
-
-				int count = 0; /* How many bones refer to this vertex? */
-					
-				/* For each bone */
-				for(unsigned int j=0; j<mesh->mNumBones; j++)
+				for(unsigned int i=0; i<mesh->mNumVertices; i++)
 				{
-					/* Each vertex that this bone refers to. */
-					for(unsigned int k=0; k<mesh->mBones[j]->mNumWeights; k++)
+					if(haveDiffuse)
 					{
-						/* If this bone refers to a vertex that matches the one
-						   that we are on, use the data and send it to the vertex program.
-						 */
-						unsigned int idx = mesh->mBones[j]->mWeights[k].mVertexId;
-						float wght       = mesh->mBones[j]->mWeights[k].mWeight;
-						if(idx == i)
-						{
-							indices[i*4+count] = (float) j;
-							weights[i*4+count] = wght;
-							count++;
-						} // end if vertices match
-					} // end for each vertex the bone refers to
-				} // end for each bone
-			} // end for each vertex in mesh
-
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				if(weights[i*4+0] == 0)
-				{
-					msg(FATAL, "Every vertex should have at least one weight but vertex %ud has no weights!", i);
-					exit(EXIT_FAILURE);
+						buf[i*3+0] = diffuse.r;
+						buf[i*3+1] = diffuse.g;
+						buf[i*3+2] = diffuse.b;
+					}
+					else
+					{
+						buf[i*3+0] = mesh->mColors[0][i].r;
+						buf[i*3+1] = mesh->mColors[0][i].g;
+						buf[i*3+2] = mesh->mColors[0][i].b;
+					}
 				}
+				if(fwrite(buf, sizeof(float)*mesh->mNumVertices*3, 1, f) != 1)
+					success = 0;
 			}
-			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
-			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
-			free(indices);
-			free(weights);
-		} // end if there are bones 
-		
-		/* Find our texture and tell our kuhl_geometry object about
-		 * it. */
-		struct aiString texPath;	//contains filename of texture
-		int texIndex = 0;
-		if(AI_SUCCESS == aiGetMaterialTexture(sc->mMaterials[mesh->mMaterialIndex],
-		                                      aiTextureType_DIFFUSE, texIndex, &texPath,
-		                                      NULL, NULL, NULL, NULL, NULL, NULL))
-		{
-			GLuint texture = 0;
-			for(int i=0; i<textureIdMapSize; i++)
-			{
-				char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
-				if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
-					texture = textureIdMap[i].textureID;
-				free(fullpath);
-			}
-			if(texture == 0)
+			if(success && mh.has_texcoord)
 			{
-				msg(WARNING, "Mesh %u uses texture '%s'."
-				    "This texture should have been loaded earlier, but we can't find it now.",
-				    nd->mMeshes[n], texPath.data);
-			}
-			else
-			{
-				/* If model uses texture and we found the texture file,
-				   Make sure we repeat instead of clamp textures */
-				glBindTexture(GL_TEXTURE_2D, texture);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-				kuhl_errorcheck();
-
-				kuhl_geometry_texture(geom, texture, "tex", 0);
+				for(unsigned int i=0; i<mesh->mNumVertices; i++)
+				{
+					buf[i*2+0] = mesh->mTextureCoords[0][i].x;
+					buf[i*2+1] = mesh->mTextureCoords[0][i].y;
+				}
+				if(fwrite(buf, sizeof(float)*mesh->mNumVertices*2, 1, f) != 1)
+					success = 0;
 			}
+			free(buf);
 		}
 
-		if(mesh->mNumFaces > 0)
+		if(success && mh.index_count > 0)
 		{
-			/* Get indices to draw with */
-			GLuint numIndices = mesh->mNumFaces * meshPrimitiveType;
-			GLuint *indices = kuhl_malloc(sizeof(GLuint)*numIndices);
-			for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
-			{
-				const struct aiFace* face = &mesh->mFaces[t];
-				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
-					indices[t*meshPrimitiveType+x] = face->mIndices[x];
-			}
-			kuhl_geometry_indices(geom, indices, numIndices);
+			uint32_t *indices = kuhl_malloc(sizeof(uint32_t)*mh.index_count);
+			for(unsigned int t=0; t<mesh->mNumFaces; t++)
+				for(unsigned int x=0; x<meshPrimitiveType; x++)
+					indices[t*meshPrimitiveType+x] = mesh->mFaces[t].mIndices[x];
+			if(fwrite(indices, sizeof(uint32_t)*mh.index_count, 1, f) != 1)
+				success = 0;
 			free(indices);
 		}
+	} // end for each mesh in node
 
+	for(unsigned int i=0; success && i < nd->mNumChildren; i++)
+		success = kuhl_private_cache_write_node(f, sc, nd->mChildren[i], currentTransform,
+		                                        modelFilename, textureDirname);
 
-		/* Initialize list of bone matrices if this mesh has bones. */
-		if(mesh->mNumBones > 0)
+	mat4f_copy(currentTransform, origTransform);
+	return success;
+}
+
+/** Writes a binary cache file for a model that was just imported
+ * with ASSIMP. If the model can't be cached (e.g., it is animated),
+ * this function prints a message and returns without doing anything.
+ *
+ * @param modelFilename The filename of the model that was imported.
+ * @param textureDirname Directory containing the model's textures (may be NULL).
+ * @param scene The imported ASSIMP scene.
+ * @param bbox The bounding box that was calculated for the model.
+ */
+static void kuhl_private_model_cache_save(const char *modelFilename, const char *textureDirname,
+                                          const struct aiScene *scene, const float bbox[6])
+{
+	/* Animated models need the ASSIMP scene at runtime
+	 * (kuhl_update_model() walks the aiNode tree every frame), so we
+	 * can't serve them from the cache. */
+	if(scene->mNumAnimations > 0)
+	{
+		msg(DEBUG, "%s: Not caching this model because it contains animations.\n", modelFilename);
+		return;
+	}
+	for(unsigned int i=0; i<scene->mNumMeshes; i++)
+	{
+		if(scene->mMeshes[i]->mNumBones > 0)
 		{
-			kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
-			bones->count = mesh->mNumBones;
-			bones->mesh = n;
-			for(unsigned int b=0; b < mesh->mNumBones; b++)
-				bones->boneList[b] = mesh->mBones[b];
-			// set any unused bone matrices to the identity.
-			for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
-				mat4f_identity(bones->matrices[b]);
-			geom->bones = bones;
+			msg(DEBUG, "%s: Not caching this model because it contains bones.\n", modelFilename);
+			return;
 		}
+	}
 
-		msg(DEBUG, "Mesh #%03u in node \"%s\" (node has %d meshes): verts=%d indices=%d primType=%d normals=%s colors=%s texCoords=%s bones=%d tex=%s",
-		       nd->mMeshes[n], nd->mName.data, nd->mNumMeshes,
-		       mesh->mNumVertices,
-		       mesh->mNumFaces*meshPrimitiveType,
-		       meshPrimitiveType,
-		       mesh->mNormals       == NULL ? "n" : "y",
-		       mesh->mColors[0]==NULL ? "n" : "y", // mColors is an array of pointers
-		       mesh->mTextureCoords[0] == NULL ? "n" : "y",   // mTextureCoords is an array of pointers
-		       mesh->mNumBones,
-		       geom->texture_count == 0 ? "(null)" : texPath.data);
-	} // end for each mesh in node
+	char *cacheFilename = kuhl_private_cache_filename(modelFilename);
 
-	/* Process all of the meshes in the aiNode's children too */
-	for (unsigned int i = 0; i < nd->mNumChildren; i++)
+	/* Write to a temporary file and rename it into place when we are
+	 * done so other processes (e.g., DGR slaves on a shared
+	 * filesystem) never see a half-written cache. */
+	int tmpLen = strlen(cacheFilename)+5;
+	char *tmpFilename = kuhl_malloc(tmpLen);
+	snprintf(tmpFilename, tmpLen, "%s.tmp", cacheFilename);
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f == NULL)
 	{
-		kuhl_geometry *child_geom = kuhl_private_load_model(sc, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname);
-		first_geom = kuhl_geometry_append(first_geom, child_geom);
+		msg(DEBUG, "%s: Unable to write model cache file %s\n", modelFilename, tmpFilename);
+		free(tmpFilename);
+		free(cacheFilename);
+		return;
 	}
 
-	/* Restore the transform matrix to exactly as it was when this
-	 * function was called by the caller. */
-	mat4f_copy(currentTransform, origTransform);
+	kuhl_model_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "kuhlmdl", 8);
+	header.version = KUHL_MODEL_CACHE_VERSION;
+	header.mesh_count = kuhl_private_cache_count_meshes(scene, scene->mRootNode);
+	for(int i=0; i<6; i++)
+		header.bbox[i] = bbox[i];
 
-	return first_geom;
+	float transform[16];
+	mat4f_identity(transform);
+	int success = fwrite(&header, sizeof(header), 1, f) == 1;
+	if(success)
+		success = kuhl_private_cache_write_node(f, scene, scene->mRootNode, transform,
+		                                        modelFilename, textureDirname);
+	fclose(f);
+
+	if(success && rename(tmpFilename, cacheFilename) == 0)
+		msg(INFO, "%s: Wrote model cache file %s\n", modelFilename, cacheFilename);
+	else
+	{
+		msg(WARNING, "%s: Failed to write model cache file %s\n", modelFilename, cacheFilename);
+		unlink(tmpFilename);
+	}
+	free(tmpFilename);
+	free(cacheFilename);
 }
 
+/** Tries to load a model from its binary cache file instead of
+ * importing it with ASSIMP. The cache file is mmap()'d and the
+ * vertex/index arrays are copied directly into OpenGL buffers.
+ *
+ * @param modelFilename The filename of the model (not the cache file).
+ * @param program The GLSL program to draw the model with.
+ * @param bbox Filled in with the model's bounding box (may be NULL).
+ *
+ * @return A kuhl_geometry list on success. Returns NULL if there is
+ * no usable cache file (caller should fall back to ASSIMP).
+ */
+static kuhl_geometry* kuhl_private_model_cache_load(const char *modelFilename,
+                                                    GLuint program, float bbox[6])
+{
+	char *cacheFilename = kuhl_private_cache_filename(modelFilename);
 
-/** Setup a model to draw at a specific time.
+	/* The cache is only usable if it is newer than the model file. */
+	struct stat modelStat, cacheStat;
+	if(stat(cacheFilename, &cacheStat) != 0 ||
+	   stat(modelFilename, &modelStat) != 0 ||
+	   cacheStat.st_mtime < modelStat.st_mtime)
+	{
+		free(cacheFilename);
+		return NULL;
+	}
 
-    @param modelFilename Name of model file to update.
+	int fd = open(cacheFilename, O_RDONLY);
+	if(fd == -1)
+	{
+		free(cacheFilename);
+		return NULL;
+	}
+	size_t mapLen = cacheStat.st_size;
+	char *map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // mapping remains valid after close
+	if(map == MAP_FAILED)
+	{
+		msg(WARNING, "Failed to mmap model cache file %s\n", cacheFilename);
+		free(cacheFilename);
+		return NULL;
+	}
 
-    @param animationNum The animation to use. If the file only
-    contains one animation, set it to 0.
+	/* Validate the header. A stale or truncated cache is simply
+	 * ignored so we fall back to the normal ASSIMP path. */
+	const char *end = map + mapLen;
+	char *cursor = map;
+	if(mapLen < sizeof(kuhl_model_cache_header))
+		goto corrupt;
+	kuhl_model_cache_header *header = (kuhl_model_cache_header*) cursor;
+	cursor += sizeof(kuhl_model_cache_header);
+	if(memcmp(header->magic, "kuhlmdl", 8) != 0 ||
+	   header->version != KUHL_MODEL_CACHE_VERSION)
+		goto corrupt;
 
-    @param time The time in seconds to set the animation to. Setting
-    time to a negative displays the model in its bind pose.
-*/
-void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time)
-{
-	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	kuhl_geometry *first_geom = NULL;
+	for(uint32_t m=0; m < header->mesh_count; m++)
 	{
-		/* The aiScene object that this kuhl_geometry refers to. */
-		struct aiScene *scene = g->assimp_scene;
-		/* The aiNode object that this kuhl_geometry refers to. */
-		struct aiNode *node = g->assimp_node;
+		if(cursor + sizeof(kuhl_model_cache_mesh) > end)
+			goto corrupt;
+		kuhl_model_cache_mesh *mh = (kuhl_model_cache_mesh*) cursor;
+		cursor += sizeof(kuhl_model_cache_mesh);
 
-		/* If the geometry contains no animations, isn't associated
-		 * with an ASSIMP scene or node, then there is no need to try
-		 * to animate it. */
-		if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
-			continue;
-
-		/* If there are no bones, or if a negative time value was
-		 * provided, update g->matrix. If there are bones, we assume
-		 * that the bones will drive the animation. */
-		if(g->bones == NULL )
-		{
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->matrix);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->matrix, transform, g->matrix);
-				node = node->mParent;
-			} while(node != NULL);
+		const char *texpath = NULL;
+		if(mh->texpath_len > 0)
+		{
+			if(cursor + mh->texpath_len > end)
+				goto corrupt;
+			texpath = cursor;
+			cursor += mh->texpath_len;
 		}
 
-		/* Don't process bones if there aren't any. */
-		if(g->bones == NULL)
-			continue;
+		/* Verify that all of the arrays for this mesh are inside the file. */
+		size_t meshBytes = sizeof(float)*mh->vertex_count*3; // positions
+		if(mh->has_normal)   meshBytes += sizeof(float)*mh->vertex_count*3;
+		if(mh->has_color)    meshBytes += sizeof(float)*mh->vertex_count*3;
+		if(mh->has_texcoord) meshBytes += sizeof(float)*mh->vertex_count*2;
+		meshBytes += sizeof(uint32_t)*mh->index_count;
+		if(cursor + meshBytes > end)
+			goto corrupt;
 
-		/* Update the list of bone matrices. */
-		for(int b=0; b < g->bones->count; b++) // For each bone
+		kuhl_geometry *geom = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+		kuhl_geometry_new(geom, program, mh->vertex_count, mh->primitive_type);
+		first_geom = kuhl_geometry_append(first_geom, geom);
+		mat4f_copy(geom->matrix, mh->matrix);
+
+		/* The attribute data is copied out of the mapping by
+		 * glBufferData(), so nothing here outlives the munmap(). */
+		kuhl_geometry_attrib(geom, (float*) cursor, 3, "in_Position", KG_INTERLEAVE);
+		cursor += sizeof(float)*mh->vertex_count*3;
+		if(mh->has_normal)
+		{
+			kuhl_geometry_attrib(geom, (float*) cursor, 3, "in_Normal", KG_INTERLEAVE);
+			cursor += sizeof(float)*mh->vertex_count*3;
+		}
+		if(mh->has_color)
+		{
+			kuhl_geometry_attrib(geom, (float*) cursor, 3, "in_Color", KG_INTERLEAVE);
+			cursor += sizeof(float)*mh->vertex_count*3;
+		}
+		if(mh->has_texcoord)
+		{
+			kuhl_geometry_attrib(geom, (float*) cursor, 2, "in_TexCoord", KG_WARN|KG_INTERLEAVE);
+			cursor += sizeof(float)*mh->vertex_count*2;
+		}
+		if(mh->index_count > 0)
+		{
+			kuhl_geometry_indices(geom, (GLuint*) cursor, mh->index_count);
+			cursor += sizeof(uint32_t)*mh->index_count;
+		}
+
+		if(texpath != NULL)
 		{
-			// Find the bone node and the bone itself.
-			const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
-			if(node == NULL)
+			/* Reuse an already-loaded texture if possible; the texture
+			 * ID map is shared with the ASSIMP loading path. */
+			GLuint texture = 0;
+			for(int i=0; i<textureIdMapSize; i++)
 			{
-				msg(FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
-				exit(EXIT_FAILURE);
+				/* Skip atlas entries: the cached texcoords were not
+				 * remapped into an atlas sub-rectangle, so we need a
+				 * standalone texture here. */
+				if(textureIdMap[i].inAtlas)
+					continue;
+				if(strcmp(textureIdMap[i].textureFileName, texpath) == 0)
+					texture = textureIdMap[i].textureID;
+			}
+			if(texture == 0 && kuhl_read_texture_file(texpath, &texture) >= 0)
+			{
+				if(textureIdMapSize >= textureIdMapMaxSize)
+				{
+					msg(FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
+					exit(EXIT_FAILURE);
+				}
+				textureIdMap[textureIdMapSize].textureFileName = strdup(texpath);
+				textureIdMap[textureIdMapSize].textureID = texture;
+				textureIdMapSize++;
+			}
+			if(texture != 0)
+			{
+				/* Match the wrap settings used by the ASSIMP path. */
+				glBindTexture(GL_TEXTURE_2D, texture);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				glBindTexture(GL_TEXTURE_2D, 0);
+				kuhl_errorcheck();
+				kuhl_geometry_texture(geom, texture, "tex", 0);
 			}
-			const struct aiBone *bone = g->bones->boneList[b];
-
-
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->bones->matrices[b]);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->bones->matrices[b], transform, g->bones->matrices[b]);
-				node = node->mParent; // move to next node up
-			} while(node != NULL);
+			else
+				msg(WARNING, "%s: Cached model refers to texture %s which we could not load.\n", modelFilename, texpath);
+		}
 
-			/* Also apply the bone offset */
-			float offset[16];
-			mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->bones->matrices[b], offset);
+		msg(DEBUG, "Cached mesh #%03u: verts=%d indices=%d primType=%d normals=%s colors=%s texCoords=%s tex=%s",
+		    m, mh->vertex_count, mh->index_count, mh->primitive_type,
+		    mh->has_normal   ? "y" : "n",
+		    mh->has_color    ? "y" : "n",
+		    mh->has_texcoord ? "y" : "n",
+		    texpath == NULL ? "(null)" : texpath);
+	}
 
-		} // end for each bone
-	} // end for each geometry
+	if(bbox != NULL)
+	{
+		for(int i=0; i<6; i++)
+			bbox[i] = header->bbox[i];
+	}
+
+	munmap(map, mapLen);
+	msg(INFO, "%s: Loaded model from cache file %s\n", modelFilename, cacheFilename);
+	free(cacheFilename);
+	return first_geom;
+
+corrupt:
+	msg(WARNING, "%s: Model cache file appears to be corrupt or truncated; ignoring it.\n", cacheFilename);
+	munmap(map, mapLen);
+	free(cacheFilename);
+	return NULL;
 }
 
+
 /** Loads a model without drawing it.
  *
  * @param modelFilename The filename of the model.
@@ -3054,6 +7734,16 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
                                GLuint program, float bbox[6])
 {
 	char *newModelFilename = kuhl_find_file(modelFilename);
+
+	/* If there is an up-to-date binary cache file for this model, use
+	 * it and skip the (potentially slow) ASSIMP import entirely. */
+	kuhl_geometry *cached = kuhl_private_model_cache_load(newModelFilename, program, bbox);
+	if(cached != NULL)
+	{
+		free(newModelFilename);
+		return cached;
+	}
+
 	// Loads the model from the file and reads in all of the textures:
 	const struct aiScene *scene = kuhl_private_assimp_load(newModelFilename, textureDirname);
 	if(scene == NULL)
@@ -3069,6 +7759,46 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	                                             program, transform,
 	                                             newModelFilename, textureDirname);
 
+	/* Convert the staged meshes into flat attribute arrays on a
+	 * worker pool; one worker per processor (the GL thread acts as
+	 * one of the workers). */
+	if(kuhl_load_stage_count > 0)
+	{
+		int numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if(numThreads < 1)
+			numThreads = 1;
+		if(numThreads > kuhl_load_stage_count)
+			numThreads = kuhl_load_stage_count;
+
+		kuhl_load_stage_next = 0;
+		pthread_t *workers = kuhl_malloc(sizeof(pthread_t)*numThreads);
+		int started = 0;
+		for(int i=0; i<numThreads-1; i++)
+			if(pthread_create(&workers[started], NULL, kuhl_private_load_worker, NULL) == 0)
+				started++;
+		kuhl_private_load_worker(NULL);
+		for(int i=0; i<started; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+
+		/* Upload the converted arrays into OpenGL buffers. If
+		 * KUHL_LOAD_STREAM is set, upload only the first few meshes
+		 * now; kuhl_geometry_draw() uploads a few more per call so
+		 * the first frame appears sooner and the model fills in over
+		 * the following frames (meshes which haven't been uploaded
+		 * yet simply aren't drawn). */
+		int uploadNow = kuhl_load_stage_count;
+		if(getenv("KUHL_LOAD_STREAM") != NULL)
+			uploadNow = KUHL_LOAD_UPLOADS_PER_DRAW;
+		for(int i=0; i<kuhl_load_stage_count && i<uploadNow; i++)
+			kuhl_private_mesh_stage_upload(kuhl_load_stages[i]);
+
+		free(kuhl_load_stages);
+		kuhl_load_stages = NULL;
+		kuhl_load_stage_count = 0;
+		kuhl_load_stage_capacity = 0;
+	}
+
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
 	kuhl_update_model(ret, 0, -1);
@@ -3094,6 +7824,10 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 		for(int i=0; i<6; i++)
 			bbox[i] = bboxLocal[i];
 	}
+
+	/* Write a cache file so the next run can skip the ASSIMP import. */
+	kuhl_private_model_cache_save(newModelFilename, textureDirname, scene, bboxLocal);
+
 	return ret;
 }
 #endif // KUHL_UTIL_USE_ASSIMP
@@ -3316,102 +8050,644 @@ GLint kuhl_gen_framebuffer_msaa(int width, int height, GLuint *texture, GLuint *
 	glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
 	if(samples > GL_MAX_SAMPLES || samples < 1)
 	{
-		msg(ERROR, "Requested %d samples but maximum allowed is %d\n", samples,
-		            maxSamples);
+		msg(ERROR, "Requested %d samples but maximum allowed is %d\n", samples,
+		            maxSamples);
+		exit(EXIT_FAILURE);
+	}
+	GLint maxTextureSize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if(width < 0 || width > maxTextureSize ||
+	   height< 0 || height> maxTextureSize)
+	{
+		msg(ERROR, "Requested %d x %d texture but maximum allowed is %d\n",
+		            width, height, maxTextureSize);
+		exit(EXIT_FAILURE);
+	}
+		
+	
+	// set up texture
+	if(texture != NULL)
+	{
+		glGenTextures(1, texture);
+		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *texture);
+		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, GL_RGB8,
+		                        width, height, GL_TRUE);
+		kuhl_errorcheck();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	kuhl_errorcheck();
+	if(depthTexture != NULL)
+	{
+		glGenTextures(1, depthTexture);
+		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *depthTexture);
+		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, GL_DEPTH24_STENCIL8, width, height, GL_TRUE);
+		kuhl_errorcheck();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	kuhl_errorcheck();
+
+	// set up frame buffer object (FBO)
+	GLuint framebuffer = 0;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+	// setup depth buffer
+	GLuint depthbuffer = 0;
+	glGenRenderbuffers(1, &depthbuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthbuffer);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
+	
+	// Connect FBO to depth buffer
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+	                          GL_DEPTH_STENCIL_ATTACHMENT,
+	                          GL_RENDERBUFFER,
+	                          depthbuffer);
+	kuhl_errorcheck();
+	if(texture != NULL)
+	{
+		// Connect FBO to texture
+		glFramebufferTexture2D(GL_FRAMEBUFFER,
+		                       GL_COLOR_ATTACHMENT0,
+		                       GL_TEXTURE_2D_MULTISAMPLE,
+		                       *texture,      // texture id
+		                       0);            // mipmap level
+		kuhl_errorcheck();
+	}
+	else
+		glDrawBuffer(GL_NONE);
+
+	kuhl_errorcheck();
+
+	if(depthTexture != NULL)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER,
+		                       GL_DEPTH_STENCIL_ATTACHMENT,
+		                       GL_TEXTURE_2D_MULTISAMPLE,
+		                       *depthTexture,      // texture id
+		                       0);            // mipmap level
+	}
+	kuhl_errorcheck();
+
+	GLenum fbStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	kuhl_framebuffer_errormsg(fbStatus);
+	kuhl_errorcheck();
+
+	// Restore binding
+	glBindTexture(GL_TEXTURE_2D, origBoundTexture);
+	glBindFramebuffer(GL_FRAMEBUFFER, origBoundFrameBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, origBoundRenderBuffer);
+	kuhl_errorcheck();
+	return framebuffer;
+}
+
+
+/* --- Framebuffer pool ----------------------------------------------
+
+   kuhl_gen_framebuffer() creates fresh driver objects on every call
+   and there is no matching destroy. A program that re-creates its
+   render targets (on window resize, or once per pass in a multi-pass
+   pipeline) therefore leaks objects and pays a reallocation stall
+   each time. The pool below hands out render targets with
+   acquire/release semantics: a released target keeps its FBO and
+   textures and is handed back out by a later acquire of the same
+   size, and a target that merely needs a different size is resized in
+   place---only the texture storage is reallocated, the framebuffer
+   and its attachments are untouched. */
+
+/** How many render targets the pool can hold. */
+#define KUHL_FRAMEBUFFER_POOL_MAX 64
+
+static kuhl_render_target kuhl_framebuffer_pool[KUHL_FRAMEBUFFER_POOL_MAX];
+static int kuhl_framebuffer_pool_count = 0;
+
+/** Reallocates a render target's storage for a new size without
+ * rebuilding the framebuffer or its attachments. The texture IDs do
+ * not change, so the target can still be used anywhere the old
+ * texture IDs were already bound (for example, with
+ * kuhl_geometry_texture()). The old contents are discarded.
+ *
+ * @param target A render target from kuhl_framebuffer_acquire().
+ *
+ * @param width The new width in pixels.
+ *
+ * @param height The new height in pixels.
+ */
+void kuhl_framebuffer_resize(kuhl_render_target *target, int width, int height)
+{
+	if(target->width == width && target->height == height)
+		return;
+
+	GLint origBoundTexture;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &origBoundTexture);
+
+	if(target->samples > 0)
+	{
+		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, target->texture);
+		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, target->samples,
+		                        GL_RGB8, width, height, GL_TRUE);
+		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, target->depthTexture);
+		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, target->samples,
+		                        GL_DEPTH24_STENCIL8, width, height, GL_TRUE);
+		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_2D, target->texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
+		             GL_UNSIGNED_BYTE, 0);
+		glBindTexture(GL_TEXTURE_2D, target->depthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0,
+		             GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0);
+	}
+	target->width = width;
+	target->height = height;
+
+	glBindTexture(GL_TEXTURE_2D, origBoundTexture);
+	kuhl_errorcheck();
+}
+
+/** Acquires a render target (a framebuffer with a color texture and
+ * a depth texture) from the pool. If a previously released target
+ * with the same size and sample count exists, it is handed back out
+ * with no driver allocation at all; a released target with the same
+ * sample count but a different size is resized in place; otherwise a
+ * new one is created with kuhl_gen_framebuffer() (or the MSAA
+ * variant). Return the target with kuhl_framebuffer_release() when
+ * you are done with it.
+ *
+ * @param width The width of the render target in pixels.
+ *
+ * @param height The height of the render target in pixels.
+ *
+ * @param samples The number of MSAA samples, or 0 for a normal
+ * (non-multisampled) render target.
+ *
+ * @return The render target. Bind target->framebuffer to render into
+ * it; target->texture is the color texture the rendered image lands
+ * in.
+ */
+kuhl_render_target* kuhl_framebuffer_acquire(int width, int height, GLint samples)
+{
+	/* Prefer a released target that already has the right storage. */
+	for(int i=0; i<kuhl_framebuffer_pool_count; i++)
+	{
+		kuhl_render_target *t = &(kuhl_framebuffer_pool[i]);
+		if(t->inUse == 0 && t->samples == samples &&
+		   t->width == width && t->height == height)
+		{
+			t->inUse = 1;
+			return t;
+		}
+	}
+	/* Next best: a released target we can resize in place. */
+	for(int i=0; i<kuhl_framebuffer_pool_count; i++)
+	{
+		kuhl_render_target *t = &(kuhl_framebuffer_pool[i]);
+		if(t->inUse == 0 && t->samples == samples)
+		{
+			kuhl_framebuffer_resize(t, width, height);
+			t->inUse = 1;
+			return t;
+		}
+	}
+
+	if(kuhl_framebuffer_pool_count == KUHL_FRAMEBUFFER_POOL_MAX)
+	{
+		msg(FATAL, "The framebuffer pool is full (%d render targets). Are targets being acquired without being released?\n", KUHL_FRAMEBUFFER_POOL_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	kuhl_render_target *t = &(kuhl_framebuffer_pool[kuhl_framebuffer_pool_count]);
+	kuhl_framebuffer_pool_count++;
+	if(samples > 0)
+		t->framebuffer = kuhl_gen_framebuffer_msaa(width, height, &(t->texture),
+		                                           &(t->depthTexture), samples);
+	else
+		t->framebuffer = kuhl_gen_framebuffer(width, height, &(t->texture),
+		                                      &(t->depthTexture));
+	t->width = width;
+	t->height = height;
+	t->samples = samples;
+	t->inUse = 1;
+	return t;
+}
+
+/** Returns a render target to the pool so that a later
+ * kuhl_framebuffer_acquire() can reuse it. The target's driver
+ * objects are kept alive; nothing is deleted.
+ *
+ * @param target A render target from kuhl_framebuffer_acquire().
+ */
+void kuhl_framebuffer_release(kuhl_render_target *target)
+{
+	if(target < kuhl_framebuffer_pool ||
+	   target >= kuhl_framebuffer_pool+kuhl_framebuffer_pool_count)
+	{
+		msg(ERROR, "Tried to release a render target which didn't come from kuhl_framebuffer_acquire().\n");
+		return;
+	}
+	if(target->inUse == 0)
+		msg(WARNING, "Render target was released twice.\n");
+	target->inUse = 0;
+}
+
+
+/* --- Asynchronous picking ------------------------------------------
+
+   Color-ID picking without the pipeline stall: the program renders
+   each selectable object into a small offscreen buffer using a solid
+   color that encodes the object's ID (see kuhl_picker_color()), and
+   the pixels under the cursor (or under a rubber-band rectangle) are
+   read back through a pixel buffer object. glReadPixels() into a PBO
+   returns immediately; the result is collected with
+   kuhl_picker_result() on a LATER frame, after the GPU has finished
+   writing it, so the read never makes the CPU wait. Reading the
+   result one frame late is imperceptible for selection. */
+
+/** Initializes a kuhl_picker: an offscreen ID buffer plus the pixel
+ * buffer objects used to read it back asynchronously.
+ *
+ * @param picker The picker to initialize.
+ *
+ * @param width Width of the ID buffer in pixels. The buffer does not
+ * need to match the window size; a smaller buffer (say, 256x256)
+ * makes both the ID render and the readback cheaper at the cost of
+ * selection precision.
+ *
+ * @param height Height of the ID buffer in pixels.
+ */
+void kuhl_picker_init(kuhl_picker *picker, int width, int height)
+{
+	picker->width = width;
+	picker->height = height;
+	picker->framebuffer = kuhl_gen_framebuffer(width, height,
+	                                           &(picker->texture),
+	                                           &(picker->depthTexture));
+	glGenBuffers(2, picker->pbo);
+	for(int i=0; i<2; i++)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, picker->pbo[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, NULL,
+		             GL_STREAM_READ);
+		picker->pending[i] = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	picker->frame = 0;
+	kuhl_errorcheck();
+}
+
+/** Encodes an object ID as a color for the ID render. Set a uniform
+ * in your picking fragment program to this color (with no lighting,
+ * blending, or multisampling applied to it) before drawing the
+ * object between kuhl_picker_begin() and kuhl_picker_end().
+ *
+ * @param id The object's ID; 1 through 2^24-1. ID 0 is reserved to
+ * mean "no object" (the ID buffer is cleared to it).
+ *
+ * @param color The color to render the object with (to be filled in).
+ */
+void kuhl_picker_color(unsigned int id, float color[4])
+{
+	color[0] = ((id      ) & 0xff) / 255.0f;
+	color[1] = ((id >>  8) & 0xff) / 255.0f;
+	color[2] = ((id >> 16) & 0xff) / 255.0f;
+	color[3] = 1.0f;
+}
+
+/** Starts an ID render: binds the picker's offscreen buffer and
+ * clears it to "no object". Draw the selectable objects (with a
+ * program that outputs the colors from kuhl_picker_color()) and then
+ * call kuhl_picker_end(). The previously bound framebuffer and
+ * viewport are restored by kuhl_picker_end(). */
+void kuhl_picker_begin(kuhl_picker *picker)
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &(picker->origFramebuffer));
+	glGetIntegerv(GL_VIEWPORT, picker->origViewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, picker->framebuffer);
+	glViewport(0, 0, picker->width, picker->height);
+	glClearColor(0,0,0,0); // ID 0 = no object
+	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	kuhl_errorcheck();
+}
+
+/** Finishes an ID render: queues an asynchronous readback of a
+ * region of the ID buffer and restores the framebuffer and viewport
+ * that were bound when kuhl_picker_begin() was called. The IDs in the
+ * region are available from kuhl_picker_result() on a later frame.
+ *
+ * @param picker The picker kuhl_picker_begin() was called on.
+ *
+ * @param x Lower left corner of the region to query, in ID-buffer
+ * pixels (0,0 is the lower left of the buffer). For a single-point
+ * query (a cursor), use a 1x1 region at the cursor's position scaled
+ * into the ID buffer's dimensions.
+ *
+ * @param y Lower left corner of the region to query.
+ *
+ * @param width Width of the region to query.
+ *
+ * @param height Height of the region to query.
+ */
+void kuhl_picker_end(kuhl_picker *picker, int x, int y, int width, int height)
+{
+	/* Clamp the region to the buffer. */
+	if(x < 0) { width += x; x = 0; }
+	if(y < 0) { height += y; y = 0; }
+	if(x+width  > picker->width)  width  = picker->width -x;
+	if(y+height > picker->height) height = picker->height-y;
+	if(width < 1 || height < 1)
+	{
+		width = 0;
+		height = 0;
+	}
+
+	int slot = picker->frame % 2;
+	if(width > 0)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, picker->pbo[slot]);
+		/* With a PBO bound, glReadPixels() only queues the transfer. */
+		glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		picker->pending[slot] = 1;
+		picker->pendingPixels[slot] = width*height;
+	}
+	else
+		picker->pending[slot] = 0;
+	picker->frame++;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, picker->origFramebuffer);
+	glViewport(picker->origViewport[0], picker->origViewport[1],
+	           picker->origViewport[2], picker->origViewport[3]);
+	kuhl_errorcheck();
+}
+
+/** Collects the IDs found by an earlier kuhl_picker_end(). Call this
+ * once per frame (before kuhl_picker_begin()); it returns the result
+ * of the readback queued on the PREVIOUS frame, which the GPU has had
+ * a frame to complete---so mapping the buffer does not stall.
+ *
+ * @param picker The picker to collect a result from.
+ *
+ * @param ids An array to be filled with the distinct object IDs found
+ * in the queried region, most-covered first not guaranteed---the
+ * order is the order the IDs were first seen in. ID 0 (no object) is
+ * never reported.
+ *
+ * @param capacity The size of the 'ids' array.
+ *
+ * @return The number of distinct IDs written to 'ids', or -1 if no
+ * readback from a previous frame is ready (for example, on the first
+ * frame).
+ */
+int kuhl_picker_result(kuhl_picker *picker, unsigned int *ids, int capacity)
+{
+	/* kuhl_picker_end() incremented 'frame', so frame%2 is the slot
+	 * that was queued two calls ago---the one whose transfer is
+	 * complete. */
+	int slot = picker->frame % 2;
+	if(picker->pending[slot] == 0)
+		return -1;
+	picker->pending[slot] = 0;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, picker->pbo[slot]);
+	const unsigned char *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER,
+	                                          GL_READ_ONLY);
+	int found = 0;
+	if(pixels != NULL)
+	{
+		for(int i=0; i<picker->pendingPixels[slot]; i++)
+		{
+			unsigned int id = (unsigned int) pixels[i*4] |
+				((unsigned int) pixels[i*4+1] <<  8) |
+				((unsigned int) pixels[i*4+2] << 16);
+			if(id == 0)
+				continue;
+			int seen = 0;
+			for(int j=0; j<found; j++)
+				if(ids[j] == id)
+					seen = 1;
+			if(seen == 0 && found < capacity)
+				ids[found++] = id;
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_errorcheck();
+	return found;
+}
+
+
+/** Sets up the vertex attributes for one of a particle system's
+ * buffers. The attribute locations are looked up in whichever program
+ * the VAO will be used with; the update program must have both
+ * attributes, while a render program may ignore in_Velocity. */
+static void kuhl_particles_setup_vao(GLuint vao, GLuint buffer, GLuint program, int velocityRequired)
+{
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	GLint posLoc = glGetAttribLocation(program, "in_Position");
+	if(posLoc < 0)
+	{
+		msg(FATAL, "GLSL program %d is missing the in_Position attribute needed for particles.\n", program);
+		exit(EXIT_FAILURE);
+	}
+	glEnableVertexAttribArray(posLoc);
+	glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE,
+	                      6*sizeof(GLfloat), (void*) 0);
+
+	GLint velLoc = glGetAttribLocation(program, "in_Velocity");
+	if(velLoc >= 0)
+	{
+		glEnableVertexAttribArray(velLoc);
+		glVertexAttribPointer(velLoc, 3, GL_FLOAT, GL_FALSE,
+		                      6*sizeof(GLfloat), (void*) (3*sizeof(GLfloat)));
+	}
+	else if(velocityRequired)
+	{
+		msg(FATAL, "GLSL program %d is missing the in_Velocity attribute needed to update particles.\n", program);
+		exit(EXIT_FAILURE);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	kuhl_state_vao = 0; // keep the shadow state in sync with the bind above
+}
+
+/** Initializes a GPU-resident particle system. All of the particle
+ * state is uploaded into buffer objects once; after that, updating and
+ * drawing the particles involves no per-frame CPU work or data
+ * transfer.
+ *
+ * The update shader is a vertex shader which is run once per particle
+ * by kuhl_particles_update(). It must declare "in vec3 in_Position"
+ * and "in vec3 in_Velocity" inputs, "out vec3 out_Position" and "out
+ * vec3 out_Velocity" outputs (captured with transform feedback), and a
+ * "uniform float dt" containing the timestep in seconds. No fragment
+ * shader is used; rasterization is disabled during the update pass.
+ *
+ * @param p The particle system to initialize.
+ *
+ * @param count The number of particles.
+ *
+ * @param updateVertFilename Filename of the update vertex shader.
+ *
+ * @param renderProgram A GLSL program (from kuhl_create_program())
+ * used to draw the particles. It must have an "in vec3 in_Position"
+ * attribute and may optionally have "in vec3 in_Velocity" (useful for
+ * coloring particles by speed).
+ *
+ * @param pos The initial particle positions (count*3 floats), or NULL
+ * to start every particle at the origin.
+ *
+ * @param vel The initial particle velocities (count*3 floats), or
+ * NULL to start every particle at rest.
+ */
+void kuhl_particles_init(kuhl_particles *p, unsigned int count,
+                         const char *updateVertFilename, GLuint renderProgram,
+                         const GLfloat *pos, const GLfloat *vel)
+{
+	if(p == NULL || count == 0 || updateVertFilename == NULL)
+	{
+		msg(FATAL, "Invalid parameters for particle system initialization.\n");
 		exit(EXIT_FAILURE);
 	}
-	GLint maxTextureSize;
-	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
-	if(width < 0 || width > maxTextureSize ||
-	   height< 0 || height> maxTextureSize)
+	p->count = count;
+	p->renderProgram = renderProgram;
+	p->src = 0;
+
+	/* Create the update program. We have to tell OpenGL which outputs
+	 * to capture before the program is linked, so this doesn't go
+	 * through kuhl_create_program(). */
+	p->updateProgram = glCreateProgram();
+	if(p->updateProgram == 0)
 	{
-		msg(ERROR, "Requested %d x %d texture but maximum allowed is %d\n",
-		            width, height, maxTextureSize);
+		msg(FATAL, "Failed to create particle update program.\n");
 		exit(EXIT_FAILURE);
 	}
-		
-	
-	// set up texture
-	if(texture != NULL)
+	msg(INFO, "GLSL prog %d: Creating particle update shader (%s)\n",
+	    p->updateProgram, updateVertFilename);
+	GLuint updateShader = kuhl_create_shader(updateVertFilename, GL_VERTEX_SHADER);
+	glAttachShader(p->updateProgram, updateShader);
+	const char *varyings[2] = { "out_Position", "out_Velocity" };
+	glTransformFeedbackVaryings(p->updateProgram, 2, varyings, GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(p->updateProgram);
+	GLint linked = 0;
+	glGetProgramiv(p->updateProgram, GL_LINK_STATUS, &linked);
+	if(linked == GL_FALSE)
 	{
-		glGenTextures(1, texture);
-		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *texture);
-		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, GL_RGB8,
-		                        width, height, GL_TRUE);
-		kuhl_errorcheck();
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		kuhl_print_program_log(p->updateProgram);
+		msg(FATAL, "Failed to link particle update program.\n");
+		exit(EXIT_FAILURE);
 	}
 	kuhl_errorcheck();
-	if(depthTexture != NULL)
+
+	/* Interleave the initial positions and velocities and upload them
+	 * into both buffers. This is the only time particle data crosses
+	 * the CPU-GPU boundary. */
+	GLfloat *state = kuhl_malloc(count*6*sizeof(GLfloat));
+	for(unsigned int i=0; i<count; i++)
 	{
-		glGenTextures(1, depthTexture);
-		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *depthTexture);
-		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, GL_DEPTH24_STENCIL8, width, height, GL_TRUE);
-		kuhl_errorcheck();
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		for(int j=0; j<3; j++)
+		{
+			state[i*6+j]   = pos ? pos[i*3+j] : 0;
+			state[i*6+3+j] = vel ? vel[i*3+j] : 0;
+		}
 	}
-	kuhl_errorcheck();
-
-	// set up frame buffer object (FBO)
-	GLuint framebuffer = 0;
-	glGenFramebuffers(1, &framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-
-	// setup depth buffer
-	GLuint depthbuffer = 0;
-	glGenRenderbuffers(1, &depthbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, depthbuffer);
-	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
-	
-	// Connect FBO to depth buffer
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER,
-	                          GL_DEPTH_STENCIL_ATTACHMENT,
-	                          GL_RENDERBUFFER,
-	                          depthbuffer);
-	kuhl_errorcheck();
-	if(texture != NULL)
+	glGenBuffers(2, p->buffer);
+	glGenVertexArrays(2, p->updateVao);
+	glGenVertexArrays(2, p->renderVao);
+	for(int i=0; i<2; i++)
 	{
-		// Connect FBO to texture
-		glFramebufferTexture2D(GL_FRAMEBUFFER,
-		                       GL_COLOR_ATTACHMENT0,
-		                       GL_TEXTURE_2D_MULTISAMPLE,
-		                       *texture,      // texture id
-		                       0);            // mipmap level
-		kuhl_errorcheck();
+		glBindBuffer(GL_ARRAY_BUFFER, p->buffer[i]);
+		glBufferData(GL_ARRAY_BUFFER, count*6*sizeof(GLfloat),
+		             state, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_particles_setup_vao(p->updateVao[i], p->buffer[i], p->updateProgram, 1);
+		kuhl_particles_setup_vao(p->renderVao[i], p->buffer[i], renderProgram, 0);
 	}
-	else
-		glDrawBuffer(GL_NONE);
-
+	free(state);
 	kuhl_errorcheck();
+}
 
-	if(depthTexture != NULL)
-	{
-		glFramebufferTexture2D(GL_FRAMEBUFFER,
-		                       GL_DEPTH_STENCIL_ATTACHMENT,
-		                       GL_TEXTURE_2D_MULTISAMPLE,
-		                       *depthTexture,      // texture id
-		                       0);            // mipmap level
-	}
+/** Advances a particle system by one timestep entirely on the GPU:
+ * the update shader reads the current buffer and transform feedback
+ * captures the integrated state into the other buffer.
+ *
+ * @param p The particle system to update.
+ *
+ * @param dt The timestep in seconds.
+ */
+void kuhl_particles_update(kuhl_particles *p, float dt)
+{
+	kuhl_errorcheck();
+	kuhl_state_sync();
+	GLuint previouslyUsedProgram = kuhl_state_program;
+	GLuint previousVAO           = kuhl_state_vao;
+	int dst = 1 - p->src;
+
+	kuhl_state_use_program(p->updateProgram);
+	glUniform1f(kuhl_get_uniform("dt"), dt);
+	kuhl_state_bind_vao(p->updateVao[p->src]);
+
+	/* We only want the captured outputs, not rendered fragments. */
+	glEnable(GL_RASTERIZER_DISCARD);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, p->buffer[dst]);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, p->count);
+	glEndTransformFeedback();
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glDisable(GL_RASTERIZER_DISCARD);
+	p->src = dst;
+
+	kuhl_state_use_program(previouslyUsedProgram);
+	kuhl_state_bind_vao(previousVAO);
 	kuhl_errorcheck();
+}
 
-	GLenum fbStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	kuhl_framebuffer_errormsg(fbStatus);
+/** Draws a particle system as GL_POINTS straight out of the GPU
+ * buffer that the last update pass wrote. The caller should set any
+ * uniforms that the render program needs (such as ModelView and
+ * Projection) before calling this function.
+ *
+ * @param p The particle system to draw.
+ */
+void kuhl_particles_draw(kuhl_particles *p)
+{
 	kuhl_errorcheck();
+	kuhl_state_sync();
+	GLuint previouslyUsedProgram = kuhl_state_program;
+	GLuint previousVAO           = kuhl_state_vao;
 
-	// Restore binding
-	glBindTexture(GL_TEXTURE_2D, origBoundTexture);
-	glBindFramebuffer(GL_FRAMEBUFFER, origBoundFrameBuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, origBoundRenderBuffer);
+	kuhl_state_use_program(p->renderProgram);
+	kuhl_state_bind_vao(p->renderVao[p->src]);
+	glDrawArrays(GL_POINTS, 0, p->count);
+
+	kuhl_state_use_program(previouslyUsedProgram);
+	kuhl_state_bind_vao(previousVAO);
 	kuhl_errorcheck();
-	return framebuffer;
 }
 
+/** Deletes the OpenGL objects that a particle system created.
+ *
+ * @param p The particle system to delete.
+ */
+void kuhl_particles_delete(kuhl_particles *p)
+{
+	glDeleteBuffers(2, p->buffer);
+	glDeleteVertexArrays(2, p->updateVao);
+	glDeleteVertexArrays(2, p->renderVao);
+	glDeleteProgram(p->updateProgram);
+	p->count = 0;
+}
 
 
 /** Plays an audio files asynchronously. This method of playing sounds
@@ -3460,3 +8736,652 @@ void kuhl_play_sound(const char *filename)
 	msg(ERROR, "This sound function only works on Linux.\n");
 #endif
 }
+
+
+
+/* GPU timing zones let us attribute frame time to individual passes
+ * (per eye, per kuhl_geometry_draw() batch, the post-render blit,
+ * etc.). Each zone owns a small ring of GL_TIME_ELAPSED query objects;
+ * a query issued this frame isn't read back until the ring wraps
+ * around several frames later, so reading results never stalls the
+ * pipeline. Results are averaged and printed once per second, the same
+ * cadence kuhl_getfps() uses. */
+
+/** Maximum number of distinct GPU timing zones. */
+#define KUHL_GPU_ZONE_MAX 32
+/** Number of query objects per zone. Results are read this many
+ * frames after the query was issued. */
+#define KUHL_GPU_ZONE_RING 4
+
+struct kuhl_gpu_zone
+{
+	char *name;        /**< Name passed to kuhl_gpu_zone_begin() */
+	GLuint query[KUHL_GPU_ZONE_RING]; /**< Ring of GL_TIME_ELAPSED queries */
+	int issued[KUHL_GPU_ZONE_RING];   /**< Has this query been issued yet? */
+	int head;          /**< Next ring slot to issue a query into */
+	double elapsedSum; /**< Milliseconds accumulated since the last report */
+	int elapsedCount;  /**< Samples accumulated since the last report */
+	float avg;         /**< Average from the last report (ms) */
+	float newest;      /**< The most recently collected sample (ms); -1 before the first one. Used by the render-scale controller, which needs per-frame samples rather than the once-per-second average. */
+};
+static struct kuhl_gpu_zone kuhl_gpu_zones[KUHL_GPU_ZONE_MAX];
+static int kuhl_gpu_zone_count = 0;
+static struct kuhl_gpu_zone *kuhl_gpu_zone_active = NULL;
+static long kuhl_gpu_zone_timebase = -1;
+/** GPU milliseconds collected from all zones since kuhl_bench_frame()
+ * last reset it; gives the benchmark recorder a per-frame GPU total. */
+static double kuhl_gpu_zone_frame_ms = 0;
+
+/** Are timer queries available? GL_TIME_ELAPSED queries cannot nest,
+ * so the zone functions also become no-ops while another zone is
+ * open. */
+static int kuhl_gpu_zone_supported(void)
+{
+	static int supported = -1;
+	if(supported == -1)
+	{
+		supported = glewIsSupported("GL_ARB_timer_query") || glewIsSupported("GL_VERSION_3_3");
+		if(!supported)
+			msg(WARNING, "GL_ARB_timer_query is not available; GPU timing zones are disabled.\n");
+	}
+	return supported;
+}
+
+/** Finds or creates the zone with the given name. */
+static struct kuhl_gpu_zone* kuhl_gpu_zone_find(const char *name)
+{
+	for(int i=0; i<kuhl_gpu_zone_count; i++)
+		if(strcmp(kuhl_gpu_zones[i].name, name) == 0)
+			return &kuhl_gpu_zones[i];
+
+	if(kuhl_gpu_zone_count == KUHL_GPU_ZONE_MAX)
+	{
+		msg(WARNING, "Can't time GPU zone '%s'; all %d zones are in use.\n",
+		    name, KUHL_GPU_ZONE_MAX);
+		return NULL;
+	}
+	struct kuhl_gpu_zone *zone = &kuhl_gpu_zones[kuhl_gpu_zone_count++];
+	zone->name = strdup(name);
+	glGenQueries(KUHL_GPU_ZONE_RING, zone->query);
+	for(int i=0; i<KUHL_GPU_ZONE_RING; i++)
+		zone->issued[i] = 0;
+	zone->head = 0;
+	zone->elapsedSum = 0;
+	zone->elapsedCount = 0;
+	zone->avg = -1;
+	zone->newest = -1;
+	return zone;
+}
+
+/** Starts timing GPU work under the given zone name. Every call must
+ * be matched with a kuhl_gpu_zone_end() call, and zones cannot nest
+ * (GL_TIME_ELAPSED queries are not allowed to overlap). Call the same
+ * zone name at the same place every frame; results are averaged over
+ * one second and printed by kuhl_gpu_zone_report().
+ *
+ * @param name A short name identifying this zone (e.g. "left eye").
+ */
+void kuhl_gpu_zone_begin(const char *name)
+{
+	if(!kuhl_gpu_zone_supported())
+		return;
+	if(kuhl_gpu_zone_active != NULL)
+	{
+		msg(WARNING, "GPU zone '%s' began inside zone '%s'; timer queries cannot nest. Ignoring it.\n",
+		    name, kuhl_gpu_zone_active->name);
+		return;
+	}
+	struct kuhl_gpu_zone *zone = kuhl_gpu_zone_find(name);
+	if(zone == NULL)
+		return;
+
+	/* Before reusing the oldest query in the ring, collect its
+	 * result. It was issued KUHL_GPU_ZONE_RING frames ago, so the
+	 * result is almost certainly ready; if it somehow isn't, drop the
+	 * sample rather than stall waiting for it. */
+	GLuint query = zone->query[zone->head];
+	if(zone->issued[zone->head])
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if(available)
+		{
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+			zone->elapsedSum += nanoseconds / 1000000.0;
+			zone->elapsedCount++;
+			zone->newest = nanoseconds / 1000000.0;
+			kuhl_gpu_zone_frame_ms += nanoseconds / 1000000.0;
+		}
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	kuhl_gpu_zone_active = zone;
+}
+
+/** Stops timing the zone started by the last kuhl_gpu_zone_begin()
+ * call. */
+void kuhl_gpu_zone_end(void)
+{
+	if(kuhl_gpu_zone_active == NULL)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	kuhl_gpu_zone_active->issued[kuhl_gpu_zone_active->head] = 1;
+	kuhl_gpu_zone_active->head = (kuhl_gpu_zone_active->head+1) % KUHL_GPU_ZONE_RING;
+	kuhl_gpu_zone_active = NULL;
+}
+
+/** Returns the average GPU time in milliseconds that the named zone
+ * spent per frame, updated once per second by kuhl_gpu_zone_report().
+ *
+ * @param name The name passed to kuhl_gpu_zone_begin().
+ * @return Average milliseconds per frame, or -1 if no estimate is
+ * available yet.
+ */
+float kuhl_gpu_zone_time(const char *name)
+{
+	for(int i=0; i<kuhl_gpu_zone_count; i++)
+		if(strcmp(kuhl_gpu_zones[i].name, name) == 0)
+			return kuhl_gpu_zones[i].avg;
+	return -1;
+}
+
+/** Call once per frame (e.g., right next to kuhl_getfps()) to update
+ * the per-zone averages. Once per second---the same cadence
+ * kuhl_getfps() updates its estimate---a summary of every zone's
+ * average GPU time is printed at the INFO level. */
+void kuhl_gpu_zone_report(void)
+{
+	if(kuhl_gpu_zone_count == 0)
+		return;
+
+	long now = kuhl_milliseconds();
+	if(kuhl_gpu_zone_timebase == -1)
+		kuhl_gpu_zone_timebase = now;
+	if(now - kuhl_gpu_zone_timebase < 1000)
+		return;
+	kuhl_gpu_zone_timebase = now;
+
+	for(int i=0; i<kuhl_gpu_zone_count; i++)
+	{
+		struct kuhl_gpu_zone *zone = &kuhl_gpu_zones[i];
+		if(zone->elapsedCount == 0)
+			continue;
+		zone->avg = zone->elapsedSum / zone->elapsedCount;
+		zone->elapsedSum = 0;
+		zone->elapsedCount = 0;
+		msg(INFO, "GPU zone %-20s %8.3f ms/frame\n", zone->name, zone->avg);
+	}
+}
+
+
+/* --- Swap instrumentation ------------------------------------------
+
+   Tearing and missed vsyncs on a tiled display wall are usually
+   diagnosed by eye (see the teartest sample). Setting KUHL_SWAPSTATS=1
+   in the environment (or calling kuhl_swapstats_enable()) makes
+   viewmat_end_frame() measure every buffer swap instead:
+
+   - The CPU time of each swap is recorded and compared against the
+     display's refresh period (KUHL_SWAPSTATS_HZ, default 60). A
+     swap-to-swap interval much longer than one period counts as
+     missed vsyncs; the deviation of each interval from the period is
+     reported as jitter. An interval much *shorter* than one period
+     means the driver isn't syncing to vblank at all---the usual
+     precursor to tearing.
+
+   - A pair of GL_TIMESTAMP queries brackets the swap call so the
+     report also shows how long the GPU spent inside the swap (mostly
+     the wait for vblank when vsync is on).
+
+   - A binary frame-ID marker is drawn in the lower-left corner of the
+     screen: one square that alternates every frame followed by 16
+     squares encoding the frame counter (white=1, black=0, low bit
+     first). Pointing a camera at adjacent wall segments and comparing
+     the markers shows whether the DGR swap barrier is actually
+     keeping the segments on the same frame.
+
+   Each node prints its own once-per-second report prefixed with its
+   hostname under the "swap" message domain (see MSG_LOGLEVEL in
+   msg.h), so the logs from every node in a DGR cluster can be
+   concatenated and grepped to find the segment that started
+   misbehaving. */
+
+/** Number of in-flight timestamp query pairs; results are read this
+ * many frames after they were issued. */
+#define KUHL_SWAPSTATS_RING 4
+/** Size in pixels of each square in the frame-ID marker. */
+#define KUHL_SWAPSTATS_MARKER_PX 16
+/** Number of frame counter bits encoded in the marker. */
+#define KUHL_SWAPSTATS_MARKER_BITS 16
+
+static int kuhl_swapstats_enabled = -1; /**< 1=on, 0=off, -1=check KUHL_SWAPSTATS */
+static double kuhl_swapstats_period = 0; /**< Expected microseconds between swaps */
+static long kuhl_swapstats_prev = -1;   /**< CPU time of the previous swap (us) */
+static long kuhl_swapstats_frame = 0;   /**< Frame counter; also the ID in the marker */
+static long kuhl_swapstats_missed = 0;  /**< Missed vsyncs since the last report */
+static double kuhl_swapstats_intervalSum = 0; /**< Sum of swap-to-swap intervals (ms) */
+static double kuhl_swapstats_intervalMax = 0; /**< Longest interval since last report (ms) */
+static double kuhl_swapstats_jitterSum = 0;   /**< Sum of |interval - period| (ms) */
+static int kuhl_swapstats_count = 0;    /**< Intervals accumulated since last report */
+static long kuhl_swapstats_timebase = -1; /**< When the last report was printed (ms) */
+static GLuint kuhl_swapstats_query[KUHL_SWAPSTATS_RING][2]; /**< Timestamp pairs around the swap */
+static int kuhl_swapstats_issued[KUHL_SWAPSTATS_RING]; /**< Has this pair been issued? */
+static int kuhl_swapstats_head = 0;     /**< Next ring slot to issue into */
+static double kuhl_swapstats_gpuSum = 0; /**< Sum of GPU swap durations (ms) */
+static int kuhl_swapstats_gpuCount = 0; /**< GPU samples since the last report */
+
+/** Turns on swap instrumentation (see the comment block above for
+ * what gets measured). Programs don't need to call this: setting
+ * KUHL_SWAPSTATS=1 in the environment enables it for any program that
+ * uses viewmat.
+ *
+ * @param hz The display's refresh rate. Pass 0 to use the
+ * KUHL_SWAPSTATS_HZ environment variable or its default of 60.
+ */
+void kuhl_swapstats_enable(int hz)
+{
+	if(hz <= 0)
+	{
+		hz = 60;
+		const char *hzEnv = getenv("KUHL_SWAPSTATS_HZ");
+		if(hzEnv != NULL && atoi(hzEnv) > 0)
+			hz = atoi(hzEnv);
+	}
+	kuhl_swapstats_period = 1000000.0 / hz;
+	if(kuhl_swapstats_enabled != 1)
+	{
+		kuhl_swapstats_enabled = 1;
+		msgd("swap", INFO, "Swap instrumentation enabled; expecting %d swaps per second.\n", hz);
+	}
+}
+
+/** Checks KUHL_SWAPSTATS the first time instrumentation is queried. */
+static int kuhl_swapstats_check_enabled(void)
+{
+	if(kuhl_swapstats_enabled == -1)
+	{
+		const char *env = getenv("KUHL_SWAPSTATS");
+		if(env != NULL && atoi(env) != 0)
+			kuhl_swapstats_enable(0);
+		else
+			kuhl_swapstats_enabled = 0;
+	}
+	return kuhl_swapstats_enabled;
+}
+
+/** Draws the frame-ID marker into the lower-left corner of the
+ * currently bound framebuffer using scissored clears (no shader
+ * program or geometry needed). */
+static void kuhl_swapstats_draw_marker(void)
+{
+	int px = KUHL_SWAPSTATS_MARKER_PX;
+	glEnable(GL_SCISSOR_TEST);
+
+	/* A sync square which alternates every frame, so a camera can
+	 * tell consecutive frames apart even when the low ID bits are
+	 * hard to read. */
+	glScissor(0, 0, px, px);
+	float v = kuhl_swapstats_frame % 2 == 0 ? 1.0f : 0.0f;
+	glClearColor(v, v, v, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	/* The frame counter in binary, low bit first. */
+	for(int bit=0; bit<KUHL_SWAPSTATS_MARKER_BITS; bit++)
+	{
+		glScissor((bit+1)*px, 0, px, px);
+		v = (kuhl_swapstats_frame >> bit) & 1 ? 1.0f : 0.0f;
+		glClearColor(v, v, v, 1);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
+
+/** Called by viewmat_end_frame() right before the buffer swap. Draws
+ * the frame-ID marker and starts the GPU timestamp pair. */
+void kuhl_swapstats_pre_swap(void)
+{
+	if(!kuhl_swapstats_check_enabled())
+		return;
+
+	kuhl_swapstats_draw_marker();
+
+	if(!kuhl_gpu_zone_supported())
+		return;
+	if(kuhl_swapstats_query[0][0] == 0)
+		glGenQueries(KUHL_SWAPSTATS_RING*2, &kuhl_swapstats_query[0][0]);
+
+	/* Collect the oldest pair before reusing its slot. It was issued
+	 * several frames ago; if the result still isn't ready, drop the
+	 * sample rather than stall. */
+	if(kuhl_swapstats_issued[kuhl_swapstats_head])
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(kuhl_swapstats_query[kuhl_swapstats_head][1],
+		                    GL_QUERY_RESULT_AVAILABLE, &available);
+		if(available)
+		{
+			GLuint64 before = 0, after = 0;
+			glGetQueryObjectui64v(kuhl_swapstats_query[kuhl_swapstats_head][0],
+			                      GL_QUERY_RESULT, &before);
+			glGetQueryObjectui64v(kuhl_swapstats_query[kuhl_swapstats_head][1],
+			                      GL_QUERY_RESULT, &after);
+			kuhl_swapstats_gpuSum += (after - before) / 1000000.0;
+			kuhl_swapstats_gpuCount++;
+		}
+	}
+	glQueryCounter(kuhl_swapstats_query[kuhl_swapstats_head][0], GL_TIMESTAMP);
+}
+
+/** Called by viewmat_end_frame() right after the buffer swap.
+ * Finishes the GPU timestamp pair, accumulates CPU swap timing, and
+ * prints a per-node report once per second. */
+void kuhl_swapstats_post_swap(void)
+{
+	if(!kuhl_swapstats_check_enabled())
+		return;
+
+	if(kuhl_gpu_zone_supported())
+	{
+		glQueryCounter(kuhl_swapstats_query[kuhl_swapstats_head][1], GL_TIMESTAMP);
+		kuhl_swapstats_issued[kuhl_swapstats_head] = 1;
+		kuhl_swapstats_head = (kuhl_swapstats_head+1) % KUHL_SWAPSTATS_RING;
+	}
+
+	long now = kuhl_microseconds();
+	if(kuhl_swapstats_prev >= 0)
+	{
+		double interval = now - kuhl_swapstats_prev; // microseconds
+		kuhl_swapstats_intervalSum += interval / 1000.0;
+		if(interval / 1000.0 > kuhl_swapstats_intervalMax)
+			kuhl_swapstats_intervalMax = interval / 1000.0;
+		kuhl_swapstats_jitterSum += fabs(interval - kuhl_swapstats_period) / 1000.0;
+		if(interval > 1.5 * kuhl_swapstats_period)
+			kuhl_swapstats_missed += (long)(interval / kuhl_swapstats_period + .5) - 1;
+		kuhl_swapstats_count++;
+	}
+	kuhl_swapstats_prev = now;
+	kuhl_swapstats_frame++;
+
+	long nowMs = kuhl_milliseconds();
+	if(kuhl_swapstats_timebase == -1)
+		kuhl_swapstats_timebase = nowMs;
+	if(nowMs - kuhl_swapstats_timebase < 1000 || kuhl_swapstats_count == 0)
+		return;
+	kuhl_swapstats_timebase = nowMs;
+
+	static char hostname[256] = "";
+	if(hostname[0] == '\0')
+		if(gethostname(hostname, sizeof(hostname)) != 0)
+			snprintf(hostname, sizeof(hostname), "unknown");
+
+	double avgInterval = kuhl_swapstats_intervalSum / kuhl_swapstats_count;
+	double avgJitter = kuhl_swapstats_jitterSum / kuhl_swapstats_count;
+	if(kuhl_swapstats_gpuCount > 0)
+		msgd("swap", INFO, "%s frame %ld: interval avg %.2f max %.2f ms (expected %.2f); jitter %.2f ms; %ld missed vsyncs; GPU swap %.2f ms\n",
+		     hostname, kuhl_swapstats_frame, avgInterval,
+		     kuhl_swapstats_intervalMax, kuhl_swapstats_period/1000.0,
+		     avgJitter, kuhl_swapstats_missed,
+		     kuhl_swapstats_gpuSum / kuhl_swapstats_gpuCount);
+	else
+		msgd("swap", INFO, "%s frame %ld: interval avg %.2f max %.2f ms (expected %.2f); jitter %.2f ms; %ld missed vsyncs\n",
+		     hostname, kuhl_swapstats_frame, avgInterval,
+		     kuhl_swapstats_intervalMax, kuhl_swapstats_period/1000.0,
+		     avgJitter, kuhl_swapstats_missed);
+
+	/* Swapping much faster than the refresh rate means vsync is off
+	 * and tearing is likely; call it out explicitly since that is the
+	 * condition teartest exists to find. */
+	if(avgInterval < .5 * kuhl_swapstats_period / 1000.0)
+		msgd("swap", WARNING, "%s is swapping every %.2f ms but the display refreshes every %.2f ms; vsync appears to be off and tearing is likely.\n",
+		     hostname, avgInterval, kuhl_swapstats_period/1000.0);
+
+	kuhl_swapstats_intervalSum = 0;
+	kuhl_swapstats_intervalMax = 0;
+	kuhl_swapstats_jitterSum = 0;
+	kuhl_swapstats_count = 0;
+	kuhl_swapstats_missed = 0;
+	kuhl_swapstats_gpuSum = 0;
+	kuhl_swapstats_gpuCount = 0;
+}
+
+
+/* --- Dynamic resolution scaling ------------------------------------
+
+   A scene that renders into an offscreen target (and is composited
+   onto the screen through a fullscreen quad) doesn't have to render
+   at full resolution: when the GPU can't keep up, rendering into a
+   smaller region of the target and stretching it during the
+   composite converts dropped frames into mild softness. The
+   controller below watches the GPU time of the offscreen pass with a
+   timing zone and nudges a scale factor up or down each frame to
+   keep the pass under a target time. See the prerend sample for how
+   to apply the scale. */
+
+static float kuhl_render_scale_factor = 1;   /**< The current scale */
+static float kuhl_render_scale_min = .5;     /**< Never scale below this */
+static float kuhl_render_scale_target = -1;  /**< Target GPU ms for the scaled pass; -1 = controller disabled */
+static float kuhl_render_scale_smoothed = -1; /**< Smoothed GPU ms */
+
+/** Enables the render-scale controller.
+ *
+ * @param targetMs The GPU time budget in milliseconds for the work
+ * done between kuhl_render_scale_begin() and
+ * kuhl_render_scale_end(). For a 60 Hz display this should be
+ * somewhat under 16.6 to leave room for the rest of the frame. Pass
+ * 0 or a negative value to get a default of 14 ms.
+ *
+ * @param minScale The smallest scale factor the controller may
+ * choose (.5 means the scene renders at half width and half
+ * height). Pass 0 or a negative value to get the default of .5.
+ */
+void kuhl_render_scale_init(float targetMs, float minScale)
+{
+	kuhl_render_scale_target = targetMs > 0 ? targetMs : 14;
+	kuhl_render_scale_min = minScale > 0 ? minScale : .5f;
+	kuhl_render_scale_factor = 1;
+	kuhl_render_scale_smoothed = -1;
+}
+
+/** The scale factor the scene should render at this frame, between
+ * the minScale given to kuhl_render_scale_init() and 1. Multiply the
+ * offscreen viewport's width and height by it (and sample only that
+ * portion of the texture during the composite). Returns 1 if the
+ * controller was never initialized or timer queries are
+ * unavailable. */
+float kuhl_render_scale(void)
+{
+	return kuhl_render_scale_factor;
+}
+
+/** Starts timing the scaled pass; call just before rendering the
+ * scene into the offscreen target. Uses a GPU timing zone, so the
+ * same nesting rules as kuhl_gpu_zone_begin() apply. */
+void kuhl_render_scale_begin(void)
+{
+	if(kuhl_render_scale_target < 0)
+		return;
+	kuhl_gpu_zone_begin("render scale");
+}
+
+/** Stops timing the scaled pass and updates the scale factor for the
+ * next frame; call right after the scene has been rendered into the
+ * offscreen target. */
+void kuhl_render_scale_end(void)
+{
+	if(kuhl_render_scale_target < 0)
+		return;
+	kuhl_gpu_zone_end();
+
+	struct kuhl_gpu_zone *zone = kuhl_gpu_zone_find("render scale");
+	if(zone == NULL || zone->newest < 0)
+		return; // no sample yet (or no timer queries at all)
+
+	/* Smooth the samples a little so one hiccup doesn't swing the
+	 * resolution. */
+	if(kuhl_render_scale_smoothed < 0)
+		kuhl_render_scale_smoothed = zone->newest;
+	else
+		kuhl_render_scale_smoothed = .8f * kuhl_render_scale_smoothed
+			+ .2f * zone->newest;
+
+	/* Scale down quickly when we are at (or over) budget; scale back
+	 * up slowly once there is clear headroom. The asymmetry keeps the
+	 * controller from oscillating around the budget. */
+	if(kuhl_render_scale_smoothed > kuhl_render_scale_target * .95f)
+		kuhl_render_scale_factor -= .02f;
+	else if(kuhl_render_scale_smoothed < kuhl_render_scale_target * .75f)
+		kuhl_render_scale_factor += .005f;
+
+	if(kuhl_render_scale_factor < kuhl_render_scale_min)
+		kuhl_render_scale_factor = kuhl_render_scale_min;
+	if(kuhl_render_scale_factor > 1)
+		kuhl_render_scale_factor = 1;
+}
+
+
+/* --- Benchmark recorder --------------------------------------------
+
+   Set KUHL_BENCHMARK=some/path to record per-frame CPU and GPU
+   timings. Every frame the recorder stores the wall-clock time since
+   the previous frame and the total GPU time the timing zones
+   collected during the frame; after KUHL_BENCHMARK_FRAMES frames
+   (default 1000, after KUHL_BENCHMARK_WARMUP warmup frames, default
+   60) it writes <path>.csv with one row per frame, writes a
+   <path>.json summary with the mean/p95/p99 of both columns, and
+   exits. Combine with VIEWMAT_CONTROL_MODE=bench (a deterministic
+   scripted camera path) to get numbers that are comparable across
+   runs, drivers, and machines; the benchmark.sh script at the top of
+   the repository does this for several of the samples. */
+
+static int kuhl_bench_frames_wanted = 0; /**< Frames to record; 0 = recorder disabled */
+static int kuhl_bench_warmup = 60;      /**< Frames to discard before recording */
+static const char *kuhl_bench_path = NULL; /**< Output path prefix from KUHL_BENCHMARK */
+static float *kuhl_bench_cpu = NULL;    /**< Recorded CPU milliseconds per frame */
+static float *kuhl_bench_gpu = NULL;    /**< Recorded GPU milliseconds per frame */
+static int kuhl_bench_count = 0;        /**< Frames recorded so far */
+static long kuhl_bench_prev_time = -1;  /**< kuhl_microseconds() at the previous frame */
+
+/** qsort comparator for the percentile computation. */
+static int kuhl_bench_compare(const void *aVoid, const void *bVoid)
+{
+	float a = *(const float*) aVoid;
+	float b = *(const float*) bVoid;
+	if(a < b) return -1;
+	if(a > b) return 1;
+	return 0;
+}
+
+/** Returns the given percentile (0 to 1) of a sorted array. */
+static float kuhl_bench_percentile(const float *sorted, int count, double fraction)
+{
+	int index = (int) (fraction * (count-1) + .5);
+	return sorted[index];
+}
+
+/** Writes the recorded frames to <path>.csv, a summary to
+ * <path>.json, prints the summary, and exits. */
+static void kuhl_bench_finish(void)
+{
+	char filename[1024];
+
+	snprintf(filename, 1024, "%s.csv", kuhl_bench_path);
+	FILE *csv = fopen(filename, "w");
+	if(csv == NULL)
+	{
+		msg(FATAL, "Benchmark: can't write to %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(csv, "frame,cpu_ms,gpu_ms\n");
+	for(int i=0; i<kuhl_bench_count; i++)
+		fprintf(csv, "%d,%.3f,%.3f\n", i, kuhl_bench_cpu[i], kuhl_bench_gpu[i]);
+	fclose(csv);
+
+	/* Sort copies of both columns to get the percentiles. */
+	qsort(kuhl_bench_cpu, kuhl_bench_count, sizeof(float), kuhl_bench_compare);
+	qsort(kuhl_bench_gpu, kuhl_bench_count, sizeof(float), kuhl_bench_compare);
+	double cpuMean = 0, gpuMean = 0;
+	for(int i=0; i<kuhl_bench_count; i++)
+	{
+		cpuMean += kuhl_bench_cpu[i];
+		gpuMean += kuhl_bench_gpu[i];
+	}
+	cpuMean /= kuhl_bench_count;
+	gpuMean /= kuhl_bench_count;
+	float cpu95 = kuhl_bench_percentile(kuhl_bench_cpu, kuhl_bench_count, .95);
+	float cpu99 = kuhl_bench_percentile(kuhl_bench_cpu, kuhl_bench_count, .99);
+	float gpu95 = kuhl_bench_percentile(kuhl_bench_gpu, kuhl_bench_count, .95);
+	float gpu99 = kuhl_bench_percentile(kuhl_bench_gpu, kuhl_bench_count, .99);
+
+	snprintf(filename, 1024, "%s.json", kuhl_bench_path);
+	FILE *json = fopen(filename, "w");
+	if(json == NULL)
+	{
+		msg(FATAL, "Benchmark: can't write to %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(json, "{ \"frames\": %d,\n", kuhl_bench_count);
+	fprintf(json, "  \"cpu_ms\": { \"mean\": %.3f, \"p95\": %.3f, \"p99\": %.3f },\n",
+	        cpuMean, cpu95, cpu99);
+	fprintf(json, "  \"gpu_ms\": { \"mean\": %.3f, \"p95\": %.3f, \"p99\": %.3f } }\n",
+	        gpuMean, gpu95, gpu99);
+	fclose(json);
+
+	msg(INFO, "Benchmark: %d frames; cpu mean %.3f p95 %.3f p99 %.3f ms; gpu mean %.3f p95 %.3f p99 %.3f ms\n",
+	    kuhl_bench_count, cpuMean, cpu95, cpu99, gpuMean, gpu95, gpu99);
+	msg(INFO, "Benchmark: results written to %s.csv and %s.json\n",
+	    kuhl_bench_path, kuhl_bench_path);
+	exit(EXIT_SUCCESS);
+}
+
+/** Records one frame of benchmark data. Called automatically by
+ * viewmat_end_frame() right after the buffer swap; programs that
+ * don't use viewmat can call it once per frame themselves. Does
+ * nothing unless the KUHL_BENCHMARK environment variable is set. */
+void kuhl_bench_frame(void)
+{
+	static int initialized = 0;
+	if(initialized == 0)
+	{
+		initialized = 1;
+		kuhl_bench_path = getenv("KUHL_BENCHMARK");
+		if(kuhl_bench_path == NULL)
+			return;
+		kuhl_bench_frames_wanted = 1000;
+		const char *framesString = getenv("KUHL_BENCHMARK_FRAMES");
+		if(framesString != NULL && atoi(framesString) > 0)
+			kuhl_bench_frames_wanted = atoi(framesString);
+		const char *warmupString = getenv("KUHL_BENCHMARK_WARMUP");
+		if(warmupString != NULL && atoi(warmupString) >= 0)
+			kuhl_bench_warmup = atoi(warmupString);
+		kuhl_bench_cpu = kuhl_malloc(kuhl_bench_frames_wanted * sizeof(float));
+		kuhl_bench_gpu = kuhl_malloc(kuhl_bench_frames_wanted * sizeof(float));
+		msg(INFO, "Benchmark: recording %d frames (after %d warmup frames) to %s.csv\n",
+		    kuhl_bench_frames_wanted, kuhl_bench_warmup, kuhl_bench_path);
+	}
+	if(kuhl_bench_path == NULL)
+		return;
+
+	long now = kuhl_microseconds();
+	double gpuMs = kuhl_gpu_zone_frame_ms;
+	kuhl_gpu_zone_frame_ms = 0;
+	if(kuhl_bench_prev_time < 0)
+	{
+		kuhl_bench_prev_time = now;
+		return;
+	}
+	double cpuMs = (now - kuhl_bench_prev_time) / 1000.0;
+	kuhl_bench_prev_time = now;
+
+	if(kuhl_bench_warmup > 0)
+	{
+		kuhl_bench_warmup--;
+		return;
+	}
+
+	kuhl_bench_cpu[kuhl_bench_count] = cpuMs;
+	kuhl_bench_gpu[kuhl_bench_count] = gpuMs;
+	kuhl_bench_count++;
+	if(kuhl_bench_count == kuhl_bench_frames_wanted)
+		kuhl_bench_finish();
+}
@@ -63,6 +63,8 @@ typedef struct
 	unsigned int mesh; /**< The bones in this struct are associated with this matrix index */
 	const struct aiBone *boneList[MAX_BONES];
 	float matrices[MAX_BONES][16]; /**< Transformation matrices for each bone */
+	int nodeIndex[MAX_BONES]; /**< Index of each bone's node in the baked skeleton; -1 until resolved by kuhl_update_model() */
+	int matricesValid; /**< 1 once every entry in matrices has been computed at least once */
 } kuhl_bonemat;
 #endif
 
@@ -71,7 +73,9 @@ enum
 { /* Options used for some kuhl_geometry functions */
 	KG_NONE = 0,     /**< No options */
 	KG_WARN = 1,     /**< Warn if GLSL variable is missing */
-	KG_FULL_LIST = 2 /**< Apply to entire list of kuhl_geometry objects */
+	KG_FULL_LIST = 2, /**< Apply to entire list of kuhl_geometry objects */
+	KG_INSTANCED = 4, /**< Attribute advances once per instance instead of once per vertex (see kuhl_geometry_draw_instanced()) */
+	KG_INTERLEAVE = 8 /**< Pack this geometry's attributes into one interleaved vertex buffer (see kuhl_geometry_attrib()) */
 };
 
 /** There is an array of kuhl_attrib structs inside of
@@ -79,7 +83,15 @@ enum
 typedef struct
 {
 	char*    name; /**< GLSL variable name the attribute information should be linked with. */
-	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in */
+	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in (0 if the attribute lives in the geometry's interleaved buffer) */
+	GLuint   divisor; /**< 0 for per-vertex attributes, 1 for per-instance attributes (KG_INSTANCED) */
+	GLuint   components; /**< Number of floats per entry in this attribute */
+	GLuint   offset; /**< Byte offset of this attribute within an interleaved vertex, or of the active region within a streaming buffer */
+	GLfloat* staged; /**< CPU copy of interleaved attribute data (NULL for attributes in their own buffer) */
+	GLfloat* stream_map; /**< Persistently mapped pointer into a streaming buffer (NULL unless kuhl_geometry_attrib_stream() converted this attribute) */
+	GLsync   stream_fence[3]; /**< Fences guarding each region of a streaming buffer */
+	int      stream_region; /**< Streaming region currently bound for drawing */
+	int      stream_fallback; /**< 1 if GL_ARB_buffer_storage is unavailable and streaming falls back to map/unmap with orphaning */
 } kuhl_attrib;
 
 /** There is an array of kuhl_texture structs inside of
@@ -96,11 +108,13 @@ typedef struct
  * functions provide error checking and uses reasonable defaults. They
  * also provide significantly less flexibility than what OpenGL
  * provides. */
+struct kuhl_raycast_bvh; /* defined in kuhl-util.c */
 typedef struct _kuhl_geometry_
 {
 	GLuint vao;  /**< OpenGL Vertex Array Object - created by kuhl_geometry_new() */
 	GLuint program; /**< OpenGL program object to use with this geometry - filled in by kuhl_geometry_new(). */
 	GLuint vertex_count; /**< How many vertices are in this geometry? - Filled in by kuhl_geometry_new(). */
+	GLuint instance_count; /**< How many instances do per-instance attribute buffers hold data for? Set this before adding an attribute with KG_INSTANCED. */
 	GLenum primitive_type; /**< GL_TRIANGLES, GL_POINTS, etc. - Filled in by kuhl_geometry_new() */
 
 	kuhl_attrib attribs[MAX_ATTRIBUTES]; /**< A list of attributes, to add or modify an attribute, use kuhl_geometry_attrib(). */
@@ -113,12 +127,30 @@ typedef struct _kuhl_geometry_
 	GLuint indices_bufferobject; /**< What is the OpenGL buffer object that holds the indices? - Set by kuhl_geometry_init(). */
 
 	float matrix[16]; /**< A matrix that all of this geometry should be transformed by */
+	float aabb[6]; /**< Axis-aligned bounding box around this geometry's vertices (xmin, xmax, ymin, ymax, zmin, zmax) - filled in by kuhl_geometry_attrib() from the "in_Position" attribute. */
+	int has_aabb; /**< Has the aabb been filled in? */
 	int has_been_drawn; /**< Has this piece of geometry been drawn yet? */
+
+	GLuint occlusion_query; /**< Occlusion query measuring whether any of this geometry's samples pass the depth test (0 until created; see kuhl_occlusion_enable()) */
+	int occlusion_inflight; /**< Has a query been issued whose result hasn't been read yet? */
+	int occlusion_hidden; /**< Did recent occlusion queries report the geometry fully occluded? (0 = assume visible) */
+	int occlusion_zeros; /**< Consecutive query results with zero visible samples */
+	GLuint occlusion_vao; /**< VAO with the bounding-box proxy cube drawn while the geometry is occluded */
+	GLuint occlusion_buffer; /**< Vertex buffer backing occlusion_vao */
+	float occlusion_aabb[6]; /**< The aabb the proxy cube was built from; the cube is rebuilt when it changes */
+	int buffers_mapped; /**< Did kuhl_geometry_attrib_get() leave a buffer mapped? */
+	struct kuhl_raycast_bvh *raycast_bvh; /**< Triangle BVH used by kuhl_geometry_raycast() - built lazily on first ray cast, rebuilt when "in_Position" is re-uploaded. */
+
+	int interleaved; /**< Should attributes be packed into one interleaved buffer? Set by KG_INTERLEAVE. */
+	GLuint interleaved_bufferobject; /**< The interleaved buffer (0 until it is built at first draw) */
+	GLuint interleaved_stride; /**< Bytes per vertex in the interleaved buffer */
+	int interleaved_dirty; /**< Does the interleaved buffer need to be (re)uploaded before drawing? */
 	
 #if KUHL_UTIL_USE_ASSIMP
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
 	struct aiScene *assimp_scene; /**< Assimp scene that this kuhl_geometry object is a part of. */
 	kuhl_bonemat *bones; /**< Information about bones in the model */
+	struct kuhl_mesh_stage *pending_stage; /**< Converted attribute arrays awaiting GL upload (streamed model loading); NULL once uploaded */
 #endif
 
 	struct _kuhl_geometry_ *next; /**< A kuhl_geometry object can be a linked list. */
@@ -140,14 +172,25 @@ typedef struct _kuhl_geometry_
  * write every time an error occurs. We aren't using this seemingly
  * easier callback approach because it doesn't make it easy to narrow
  * down the line(s) of code causing an error.
+ *
+ * A better alternative on modern drivers is kuhl_debug_init(), which
+ * asks the driver to report problems through a GL_KHR_debug message
+ * callback; once it is installed, kuhl_errorcheck() calls skip the
+ * glGetError() polling entirely. Compiling with NDEBUG removes the
+ * checks at compile time for release builds.
  */
+#ifdef NDEBUG
+#define kuhl_errorcheck() 0
+#else
 #define kuhl_errorcheck() kuhl_errorcheckFileLine(__FILE__, __LINE__, __func__)
+#endif
 
 
 
 	
 // kuhl_errorcheck() calls this C function:
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func);
+void kuhl_debug_init(void);
 // kuhl_malloc() calls this C function:
 void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
@@ -158,39 +201,116 @@ void kuhl_delete_program(GLuint program);
 void kuhl_print_program_log(GLuint program);
 void kuhl_print_program_info(GLuint program);
 GLint kuhl_get_uniform(const char *uniformName);
+GLint kuhl_uniform_location(GLuint program, const char *uniformName);
 GLint kuhl_get_attribute(GLuint program, const char *attributeName);
 
 
 
 void kuhl_bbox_transform(float bbox[6], float mat[16]);
 
-#if 0
 int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16]);
-#endif
+
+void kuhl_collide_add(kuhl_geometry *geom, const float mat[16]);
+void kuhl_collide_remove(kuhl_geometry *geom);
+int kuhl_collide_overlaps(kuhl_geometry *geom, const float mat[16],
+                          kuhl_geometry **results, int maxResults);
+int kuhl_collide_ray(const float origin[3], const float direction[3],
+                     kuhl_geometry **results, int maxResults);
+
+/** Information about the nearest intersection found by
+ * kuhl_geometry_raycast(). */
+typedef struct
+{
+	float t;          /**< Distance along the ray to the intersection (in units of the direction vector's length) */
+	float point[3];   /**< World-space intersection point */
+	float normal[3];  /**< World-space unit normal of the hit triangle */
+	unsigned int triangle; /**< Index of the hit triangle within the geometry */
+	kuhl_geometry *geom;   /**< Which geometry in the linked list was hit */
+} kuhl_raycast_hit;
+
+int kuhl_geometry_raycast(kuhl_geometry *geom, float mat[16],
+                          const float origin[3], const float direction[3],
+                          kuhl_raycast_hit *hit);
+
+void kuhl_cull_set_frustum(const float projection[16], const float modelview[16]);
+void kuhl_cull_disable(void);
+void kuhl_cull_stats(int *drawn, int *culled);
+
+void kuhl_occlusion_enable(int enable);
+void kuhl_occlusion_stats(int *drawn, int *skipped);
 
 void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type);
 void kuhl_geometry_draw(kuhl_geometry *geom);
+void kuhl_geometry_draw_instanced(kuhl_geometry *geom, GLuint instanceCount);
 void kuhl_geometry_delete(kuhl_geometry *geom);
 unsigned int kuhl_geometry_count(const kuhl_geometry *geom);
 
+/** A compiled draw list: a kuhl_geometry linked list flattened into
+ * an array sorted by (program, texture, VAO) so that drawing it
+ * performs as few OpenGL state changes as possible. Build one with
+ * kuhl_drawlist_compile() and draw it with kuhl_drawlist_draw(). */
+typedef struct
+{
+	kuhl_geometry **items; /**< The geometry structs, sorted. */
+	unsigned int count;    /**< Number of entries in 'items'. */
+} kuhl_drawlist;
+
+void kuhl_drawlist_compile(kuhl_drawlist *drawlist, kuhl_geometry *geom);
+void kuhl_drawlist_draw(kuhl_drawlist *drawlist);
+void kuhl_drawlist_free(kuhl_drawlist *drawlist);
+
 void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options);
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size);
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
+GLfloat* kuhl_geometry_attrib_stream(kuhl_geometry *geom, const char *name);
+void kuhl_geometry_attrib_stream_commit(kuhl_geometry *geom, const char *name);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
 
+/** A GPU-resident particle system. The position and velocity of every
+ * particle live in a pair of OpenGL buffer objects; each update pass
+ * runs a vertex shader over one buffer and captures the integrated
+ * results into the other with transform feedback, and drawing reads
+ * straight from the current buffer. The CPU never touches particle
+ * data after initialization, so millions of particles can be
+ * simulated. See kuhl_particles_init() for the shader requirements. */
+typedef struct
+{
+	unsigned int count;    /**< Number of particles. */
+	GLuint updateProgram;  /**< Transform feedback program which integrates particle motion. */
+	GLuint renderProgram;  /**< Program used to draw the particles. */
+	GLuint buffer[2];      /**< Double-buffered particle state (position+velocity interleaved). */
+	GLuint updateVao[2];   /**< VAO which feeds buffer i into the update pass. */
+	GLuint renderVao[2];   /**< VAO which feeds buffer i into the render pass. */
+	int src;               /**< Index of the buffer holding the current state. */
+} kuhl_particles;
+
+void kuhl_particles_init(kuhl_particles *p, unsigned int count,
+                         const char *updateVertFilename, GLuint renderProgram,
+                         const GLfloat *pos, const GLfloat *vel);
+void kuhl_particles_update(kuhl_particles *p, float dt);
+void kuhl_particles_draw(kuhl_particles *p);
+void kuhl_particles_delete(kuhl_particles *p);
+
 
 
 void kuhl_flip_texture_rgba_array(unsigned char *image, const int width, const int height, const int components);
 GLuint kuhl_read_texture_rgba_array_wrap(const unsigned char *array, int width, int height, GLuint wrapS, GLuint wrapT);
 GLuint kuhl_read_texture_rgba_array(const unsigned char *array, int width, int height);
+GLuint kuhl_read_texture_rgba_array_async_wrap(const unsigned char *array, int width, int height, GLuint wrapS, GLuint wrapT);
+GLuint kuhl_read_texture_rgba_array_async(const unsigned char *array, int width, int height);
+int kuhl_texture_resident(GLuint texName);
 
 float kuhl_make_label(const char *label, GLuint *texName, float color[3], float bgcolor[4], float pointsize);
 float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
 float kuhl_read_texture_file(const char *filename, GLuint *texName);
 void kuhl_screenshot(const char *outputImageFilename);
+void kuhl_screenshot_async(const char *outputImageFilename);
+void kuhl_screenshot_async_finish(void);
 void kuhl_video_record(const char *fileLabel, int fps);
+void kuhl_video_record_pipe(const char *fileLabel, int fps);
+void kuhl_video_record_pipe_finish(void);
 
 #ifdef KUHL_UTIL_USE_ASSIMP
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time);
@@ -202,8 +322,71 @@ void kuhl_bbox_fit(float result[16], const float bbox[6], int sitOnXZPlane);
 GLint kuhl_gen_framebuffer(int width, int height, GLuint *texture, GLuint *depthTexture);
 GLint kuhl_gen_framebuffer_msaa(int width, int height, GLuint *texture, GLuint *depthTexture, GLint samples);
 
+/** A pooled render target: a framebuffer with a color texture and a
+ * depth texture attached. Get one with kuhl_framebuffer_acquire() and
+ * give it back with kuhl_framebuffer_release(); released targets are
+ * reused by later acquires instead of allocating new driver
+ * objects. */
+typedef struct
+{
+	GLint framebuffer;   /**< Framebuffer ID; bind it to render into the target. */
+	GLuint texture;      /**< The color texture the rendered image lands in. */
+	GLuint depthTexture; /**< The depth (and stencil) texture. */
+	int width;           /**< Width of the target in pixels. */
+	int height;          /**< Height of the target in pixels. */
+	GLint samples;       /**< MSAA samples; 0 if not multisampled. */
+	int inUse;           /**< Is this target currently acquired? Managed by the pool. */
+} kuhl_render_target;
+
+kuhl_render_target* kuhl_framebuffer_acquire(int width, int height, GLint samples);
+void kuhl_framebuffer_release(kuhl_render_target *target);
+void kuhl_framebuffer_resize(kuhl_render_target *target, int width, int height);
+
+/** Asynchronous color-ID picking. Objects are rendered into a small
+ * offscreen buffer with colors that encode their IDs, and the pixels
+ * under the cursor (or a rubber-band region) are read back through a
+ * pixel buffer object without stalling the pipeline; the result is
+ * available one frame later. See kuhl_picker_init() in kuhl-util.c
+ * for usage. */
+typedef struct
+{
+	int width;            /**< Width of the ID buffer in pixels. */
+	int height;           /**< Height of the ID buffer in pixels. */
+	GLint framebuffer;    /**< The offscreen buffer IDs are rendered into. */
+	GLuint texture;       /**< The color texture holding the rendered IDs. */
+	GLuint depthTexture;  /**< The ID buffer's depth texture. */
+	GLuint pbo[2];        /**< Pixel buffer objects; readbacks alternate between them. */
+	int pending[2];       /**< Does pbo[i] contain a readback we haven't collected? */
+	int pendingPixels[2]; /**< Number of pixels in pbo[i]'s readback. */
+	int frame;            /**< Counts kuhl_picker_end() calls to alternate PBOs. */
+	GLint origFramebuffer; /**< Framebuffer bound before kuhl_picker_begin(). */
+	GLint origViewport[4]; /**< Viewport set before kuhl_picker_begin(). */
+} kuhl_picker;
+
+void kuhl_picker_init(kuhl_picker *picker, int width, int height);
+void kuhl_picker_color(unsigned int id, float color[4]);
+void kuhl_picker_begin(kuhl_picker *picker);
+void kuhl_picker_end(kuhl_picker *picker, int x, int y, int width, int height);
+int kuhl_picker_result(kuhl_picker *picker, unsigned int *ids, int capacity);
+
 void kuhl_play_sound(const char *filename);
 
+void kuhl_gpu_zone_begin(const char *name);
+void kuhl_gpu_zone_end(void);
+float kuhl_gpu_zone_time(const char *name);
+void kuhl_gpu_zone_report(void);
+
+void kuhl_swapstats_enable(int hz);
+void kuhl_swapstats_pre_swap(void);
+void kuhl_swapstats_post_swap(void);
+
+void kuhl_render_scale_init(float targetMs, float minScale);
+float kuhl_render_scale(void);
+void kuhl_render_scale_begin(void);
+void kuhl_render_scale_end(void);
+
+void kuhl_bench_frame(void);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
@@ -16,12 +16,23 @@
 #include <time.h>      // time()
 #include <unistd.h>    // getpid()
 #include <sys/types.h> // getpid()
+#include <pthread.h>   // parallel list_sort()/list_find()/list_count()
 
 #include "list.h"
 #include "msg.h"
 
 #define LIST_MIN_CAPACITY 4  /*< The smallest allowable capacity of a list */
 
+/** Allocates space for a list's backing array through the list's
+ * allocator hook if one was set with list_new_arena(), or with
+ * malloc() otherwise. */
+static void* list_alloc_bytes(list *l, int bytes)
+{
+	if(l->alloc != NULL)
+		return l->alloc(l->allocData, bytes);
+	return malloc(bytes);
+}
+
 
 /** Verify that the list is valid. You should not need to call this
  * unless you are modifying the the list object yourself. */
@@ -81,6 +92,54 @@ list* list_new(int capacity, int itemSize, int (*compar)(const void *, const voi
 		return NULL;
 	}
 	l->data = NULL;
+	l->dataBytes = 0;
+	l->growthFactor = 2.0f;
+	l->alloc = NULL;
+	l->allocData = NULL;
+	if(list_reset(l, capacity, itemSize, compar) == 0)
+		return NULL;
+	return l;
+}
+
+/** Creates a new list whose space (both the list struct and the
+    backing array) comes from the given allocator instead of
+    malloc(). This is intended for bulk-created short-lived lists:
+    allocate them all out of one arena and reclaim the arena in one
+    step rather than free()'ing each list. list_free() is a no-op on
+    lists created this way. Note that when such a list grows, the old
+    backing array is simply abandoned inside the arena (the allocator
+    hook has no free function).
+
+    @param capacity Number of items that we should allocate space in
+    the list for.
+
+    @param itemSize The size of each item to be stored in the list.
+
+    @param alloc A function which returns a pointer to 'bytes' bytes
+    of space (or NULL on failure). It is called with allocData as its
+    first argument.
+
+    @param allocData A caller-defined pointer passed through to the
+    alloc function (e.g., the arena to allocate from).
+
+    @return A pointer to a list struct or NULL if the allocator failed.
+*/
+list* list_new_arena(int capacity, int itemSize, int (*compar)(const void *, const void *), void* (*alloc)(void *allocData, int bytes), void *allocData)
+{
+	if(alloc == NULL)
+		return list_new(capacity, itemSize, compar);
+
+	list *l = alloc(allocData, sizeof(list));
+	if(l == NULL)
+	{
+		msg(ERROR, "Failed to allocate space for a list which can hold %d %d byte items.", capacity, itemSize);
+		return NULL;
+	}
+	l->data = NULL;
+	l->dataBytes = 0;
+	l->growthFactor = 2.0f;
+	l->alloc = alloc;
+	l->allocData = allocData;
 	if(list_reset(l, capacity, itemSize, compar) == 0)
 		return NULL;
 	return l;
@@ -103,6 +162,10 @@ list* list_new_import(int numItems, int itemSize, int (*compar)(const void *, co
 		return NULL;
 	}
 	l->data = NULL;
+	l->dataBytes = 0;
+	l->growthFactor = 2.0f;
+	l->alloc = NULL;
+	l->allocData = NULL;
 	if(list_reset_import(l, numItems, itemSize, compar, array) == 0)
 		return NULL;
 	return l;
@@ -188,21 +251,35 @@ int list_reset(list *l, int capacity, int itemSize, int (*compar)(const void *,
 	l->compar   = compar;
 	
 	/* If the data isn't NULL, we are assuming that this is an old
-	 * list that we are reusing. We don't need to malloc new
-	 * space---just realloc space that is the appropriate size. */
+	 * list that we are reusing. We don't need to allocate new
+	 * space---just resize the space to the appropriate size. */
 	if(l->data != NULL)
 	{
 		if(list_set_capacity(l, l->capacity) == 0)
 		{
-			/* If we fail to realloc enough space, free the space and
-			 * set l->data to NULL */
-			free(l->data);
+			/* If we fail to get enough space, free the space and set
+			 * l->data to NULL. (The inline buffer and arena space are
+			 * not individually freeable.) */
+			if(l->data != l->sbo && l->alloc == NULL)
+				free(l->data);
 			l->data = NULL;
+			l->dataBytes = 0;
 		}
 	}
+	else if(l->capacity * l->itemSize <= LIST_SBO_SIZE)
+	{
+		/* If a new, short list: store the items inside the list
+		 * struct itself and skip the allocation entirely. */
+		l->data = l->sbo;
+		l->dataBytes = LIST_SBO_SIZE;
+	}
 	else
+	{
 		// If a new list, allocate space.
-		l->data = malloc(l->capacity * l->itemSize);
+		l->data = list_alloc_bytes(l, l->capacity * l->itemSize);
+		if(l->data != NULL)
+			l->dataBytes = l->capacity * l->itemSize;
+	}
 
 	if(l->data == NULL)
 	{
@@ -251,7 +328,13 @@ void list_free(list *l)
 {
 	if(l != NULL)
 	{
-		if(l->data != NULL)
+		/* Lists created with list_new_arena() live entirely inside
+		 * the arena and are reclaimed en masse by whoever owns it. */
+		if(l->alloc != NULL)
+			return;
+		/* The inline buffer lives inside the list struct; only free
+		 * the data if the list spilled to the heap. */
+		if(l->data != NULL && l->data != l->sbo)
 			free(l->data);
 		free(l);
 	}
@@ -278,12 +361,18 @@ int list_append(list *l, void *item)
 		return 0;
 	}
 
-	/* Make sure that we double the capacity when needed. list_set()
-	 * would also allocate more space for us---but will only increase
-	 * the capacity just as large as needed. */
+	/* Make sure that we multiply the capacity by the growth factor
+	 * when needed. list_set() would also allocate more space for
+	 * us---but will only increase the capacity just as large as
+	 * needed. */
 	if(l->length == l->capacity)
-		if(list_ensure_capacity(l, l->capacity*2) == 0)
+	{
+		int grown = (int)(l->capacity * l->growthFactor);
+		if(grown <= l->capacity) // small growth factor or overflow
+			grown = l->capacity + 1;
+		if(list_ensure_capacity(l, grown) == 0)
 			return 0;
+	}
 
 	return list_set(l, l->length, item);
 }
@@ -625,28 +714,81 @@ int list_set_capacity(list *l, int capacity)
 	if(capacity < LIST_MIN_CAPACITY)
 		capacity = LIST_MIN_CAPACITY;
 
-	void* newData = realloc(l->data, capacity * l->itemSize);
+	int bytes = capacity * l->itemSize;
 
-	if(newData == NULL)
+	if(l->data == l->sbo || l->alloc != NULL)
 	{
-		msg(ERROR, "Unable to increase list capacity from %d items to %d items", l->capacity, capacity);
-		return 0;
+		/* The inline buffer can't be realloc'd and the allocator hook
+		 * has no realloc either. If the new capacity fits in the
+		 * space we already have, just use it; otherwise get a fresh
+		 * block and copy the items over. (For an arena list, the old
+		 * block is abandoned inside the arena and reclaimed when the
+		 * arena is.) */
+		if(bytes > l->dataBytes)
+		{
+			void *newData = list_alloc_bytes(l, bytes);
+			if(newData == NULL)
+			{
+				msg(ERROR, "Unable to increase list capacity from %d items to %d items", l->capacity, capacity);
+				return 0;
+			}
+			memcpy(newData, l->data, l->dataBytes);
+			l->data = newData;
+			l->dataBytes = bytes;
+		}
+		l->capacity = capacity;
 	}
+	else
+	{
+		void* newData = realloc(l->data, bytes);
 
-	// if(newData != l->data)
-	//	printf("realloc moved our data!\n");
-	l->capacity = capacity;
+		if(newData == NULL)
+		{
+			msg(ERROR, "Unable to increase list capacity from %d items to %d items", l->capacity, capacity);
+			return 0;
+		}
+
+		// if(newData != l->data)
+		//	printf("realloc moved our data!\n");
+		l->capacity = capacity;
+		l->data = newData;
+		l->dataBytes = bytes;
+	}
 
 	/* If we reduced the capacity smaller than the number of items
 	 * already in the list. */
 	if(l->capacity < l->length)
 		l->length = l->capacity;
 
-	l->data = newData;
 	list_sanity_check(l);
 	return 1;
 }
 
+/** Sets the multiplier that list_append() and list_prepend() apply to
+    the capacity when an item is added to a full list. The default is
+    2 (doubling). Lists with a predictable modest size can use a
+    smaller factor (e.g., 1.5) to waste less memory, and lists that
+    grow very large can use a larger one to reallocate less often.
+
+    @param l The list to modify.
+
+    @param growthFactor The new growth factor. Must be greater than 1.
+
+    @return 1 if successful, 0 if failed.
+*/
+int list_set_growth_factor(list *l, float growthFactor)
+{
+	if(l == NULL)
+		return 0;
+	if(growthFactor <= 1.0f)
+	{
+		msg(ERROR, "Growth factor %f must be greater than 1", growthFactor);
+		return 0;
+	}
+	l->growthFactor = growthFactor;
+	return 1;
+}
+
 /** Ensures that the list has a capacity of at least the given
     capacity. Same as list_set_capacity() except that this function
     guarantees that we will never reduce the capacity of the list.
@@ -724,6 +866,7 @@ list* list_copy(const list *l)
 
 	list_sanity_check(l);
 	list *newl = list_new(l->capacity, l->itemSize, l->compar);
+	newl->growthFactor = l->growthFactor;
 	list_set_length(newl, l->length);
 	memcpy(newl->data, l->data, l->length*l->itemSize);
 	list_sanity_check(newl);
@@ -833,6 +976,7 @@ void list_print_stats(const list *l)
 	printf("Unused capacity:   %4d item(s)\n", l->capacity - l->length);
 	printf("Size of each item: %4d byte(s)\n", l->itemSize);
 	printf("Space allocated:   %4d bytes + %4d bytes\n", l->itemSize * l->capacity, (int) sizeof(list));
+	printf("Item storage:      %s\n", l->data == l->sbo ? "inline (in the list struct)" : "allocated");
 }
 
 /** Returns the length of the list. The caller could also access this
@@ -864,8 +1008,163 @@ int list_capacity(const list *l)
 	return l->capacity;
 }
 
+/* --- Parallel sort and search --------------------------------------
+
+   Lists holding tens of millions of items (tracker samples loaded
+   from TDL logs, for example) take tens of seconds to sort or scan on
+   one core. Above LIST_PARALLEL_THRESHOLD items, list_sort(),
+   list_find() and list_count() split the work across worker threads:
+   the sort becomes a merge sort (each worker qsorts a chunk, then
+   pairs of adjacent sorted runs are merged in parallel) and the
+   searches sweep disjoint ranges concurrently. Below the threshold
+   the old single-threaded code runs, and the comparator interface
+   from list_new() is unchanged---but a comparator used on a large
+   list must be thread-safe (the usual stateless comparators are).
+   Set LIST_THREADS in the environment to override the thread count
+   (LIST_THREADS=1 forces the single-threaded paths). */
+
+/** Lists shorter than this are always sorted/searched on one core;
+ * below this size the thread startup cost exceeds the savings. */
+#define LIST_PARALLEL_THRESHOLD 65536
+/** Most worker threads a single list operation will use. */
+#define LIST_PARALLEL_MAX_THREADS 8
+
+/** Returns the number of worker threads to use for an operation on a
+ * list with the given number of items. */
+static int list_parallel_threads(int length)
+{
+	if(length < LIST_PARALLEL_THRESHOLD)
+		return 1;
+
+	static int max = -1;
+	if(max == -1)
+	{
+		max = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		const char *env = getenv("LIST_THREADS");
+		if(env != NULL && atoi(env) > 0)
+			max = atoi(env);
+		if(max > LIST_PARALLEL_MAX_THREADS)
+			max = LIST_PARALLEL_MAX_THREADS;
+		if(max < 1)
+			max = 1;
+	}
+	return max;
+}
+
+/** Work description for the sort workers: either "qsort this range"
+ * (rightN == 0) or "merge these two adjacent sorted runs into out". */
+struct list_sort_task
+{
+	char *base;  /**< First item of the range (left run for merges) */
+	char *out;   /**< Where a merge writes its output */
+	int leftN;   /**< Items in the range (or in the left run) */
+	int rightN;  /**< Items in the right run; 0 for qsort tasks */
+	int itemSize;
+	int (*compar)(const void *, const void *);
+};
+
+static void* list_sort_worker(void *arg)
+{
+	struct list_sort_task *t = (struct list_sort_task*) arg;
+	if(t->rightN == 0)
+	{
+		qsort(t->base, t->leftN, t->itemSize, t->compar);
+		return NULL;
+	}
+
+	/* Merge the two adjacent sorted runs starting at t->base into
+	 * t->out. Ties take from the left run so the sort stays stable
+	 * relative to the per-chunk qsorts. */
+	char *a = t->base;
+	char *b = t->base + (size_t)t->leftN * t->itemSize;
+	char *dst = t->out;
+	int ai = 0, bi = 0;
+	while(ai < t->leftN && bi < t->rightN)
+	{
+		if(t->compar(a, b) <= 0)
+		{
+			memcpy(dst, a, t->itemSize);
+			a += t->itemSize;
+			ai++;
+		}
+		else
+		{
+			memcpy(dst, b, t->itemSize);
+			b += t->itemSize;
+			bi++;
+		}
+		dst += t->itemSize;
+	}
+	if(ai < t->leftN)
+		memcpy(dst, a, (size_t)(t->leftN-ai) * t->itemSize);
+	if(bi < t->rightN)
+		memcpy(dst, b, (size_t)(t->rightN-bi) * t->itemSize);
+	return NULL;
+}
+
+/** Work description for the search workers: scan items [start,stop). */
+struct list_search_task
+{
+	const list *l;
+	const void *item;
+	int start;
+	int stop;
+	int found; /**< Index of the first match in the range; -1 none; -2 error */
+	int count; /**< Number of matches in the range */
+};
+
+static void* list_search_worker(void *arg)
+{
+	struct list_search_task *t = (struct list_search_task*) arg;
+	t->found = -1;
+	t->count = 0;
+	for(int i=t->start; i<t->stop; i++)
+	{
+		int compareResult = list_index_compare(t->l, i, t->item);
+		if(compareResult == -1)
+		{
+			t->found = -2;
+			return NULL;
+		}
+		else if(compareResult == 1)
+		{
+			if(t->found < 0)
+				t->found = i;
+			t->count++;
+		}
+	}
+	return NULL;
+}
+
+/** Splits [0, l->length) into ranges and scans them with worker
+ * threads. Results are left in the tasks array; returns the number of
+ * tasks used. */
+static int list_search_parallel(const list *l, const void *item,
+                                struct list_search_task *tasks, int nthreads)
+{
+	pthread_t threads[LIST_PARALLEL_MAX_THREADS];
+	int started[LIST_PARALLEL_MAX_THREADS];
+	int per = l->length / nthreads;
+	for(int i=0; i<nthreads; i++)
+	{
+		tasks[i].l = l;
+		tasks[i].item = item;
+		tasks[i].start = i*per;
+		tasks[i].stop = i == nthreads-1 ? l->length : (i+1)*per;
+		started[i] = pthread_create(&threads[i], NULL, list_search_worker, &tasks[i]) == 0;
+		if(!started[i]) // thread creation failed; do the work here instead
+			list_search_worker(&tasks[i]);
+	}
+	for(int i=0; i<nthreads; i++)
+		if(started[i])
+			pthread_join(threads[i], NULL);
+	return nthreads;
+}
+
 /** Search the list for the first matching item in the
     list. Comparison uses the memcmp() function if l->compar is NULL.
+    Large lists are scanned by several threads at once (see the
+    comment above list_parallel_threads()).
 
     @param l The list to search.
 
@@ -879,6 +1178,23 @@ int list_find(const list *l, const void *item)
 	if(l == NULL)
 		return -2; // error
 
+	int nthreads = list_parallel_threads(l->length);
+	if(nthreads > 1)
+	{
+		struct list_search_task tasks[LIST_PARALLEL_MAX_THREADS];
+		list_search_parallel(l, item, tasks, nthreads);
+		/* The ranges are in list order, so the first range with a
+		 * match holds the first match overall. */
+		for(int i=0; i<nthreads; i++)
+		{
+			if(tasks[i].found == -2)
+				return -2; // error
+			if(tasks[i].found >= 0)
+				return tasks[i].found;
+		}
+		return -1; // not found
+	}
+
 	for(int i=0; i<l->length; i++)
 	{
 		int compareResult = list_index_compare(l, i, item);
@@ -892,6 +1208,8 @@ int list_find(const list *l, const void *item)
 
 /** Counts the number of times the specified item appears in the
     list. Comparison uses the memcmp() function if l->compar is NULL.
+    Large lists are scanned by several threads at once (see the
+    comment above list_parallel_threads()).
 
     @param l The list to search.
 
@@ -906,6 +1224,20 @@ int list_count(const list *l, const void *item)
 		return -1; // error
 	int count = 0;
 
+	int nthreads = list_parallel_threads(l->length);
+	if(nthreads > 1)
+	{
+		struct list_search_task tasks[LIST_PARALLEL_MAX_THREADS];
+		list_search_parallel(l, item, tasks, nthreads);
+		for(int i=0; i<nthreads; i++)
+		{
+			if(tasks[i].found == -2)
+				return -1; // error
+			count += tasks[i].count;
+		}
+		return count;
+	}
+
 	for(int i=0; i<l->length; i++)
 	{
 		int compareResult = list_index_compare(l, i, item);
@@ -918,7 +1250,9 @@ int list_count(const list *l, const void *item)
 }
 
 
-/** Sorts the items in the list. l->compar must be set.
+/** Sorts the items in the list. l->compar must be set. Large lists
+   are sorted with a multithreaded merge sort (see the comment above
+   list_parallel_threads()); smaller lists use qsort() as before.
 
    @param l The list to sort.
 
@@ -926,10 +1260,100 @@ int list_count(const list *l, const void *item)
 */
 int list_sort(list *l)
 {
+	int nthreads = list_parallel_threads(l == NULL ? 0 : l->length);
 	if(l == NULL || l->compar == NULL)
 		return 0;
 
-	qsort(l->data, l->length, l->itemSize, l->compar);
+	/* Merging needs scratch space the size of the list; if we can't
+	 * get it (or only one core is available), sort in place. */
+	char *temp = NULL;
+	if(nthreads > 1)
+		temp = malloc((size_t)l->length * l->itemSize);
+	if(temp == NULL)
+	{
+		qsort(l->data, l->length, l->itemSize, l->compar);
+		return 1;
+	}
+
+	pthread_t threads[LIST_PARALLEL_MAX_THREADS];
+	int started[LIST_PARALLEL_MAX_THREADS];
+	struct list_sort_task tasks[LIST_PARALLEL_MAX_THREADS];
+	int counts[LIST_PARALLEL_MAX_THREADS];
+
+	/* Phase 1: each worker sorts one contiguous chunk with qsort. */
+	int per = l->length / nthreads;
+	for(int i=0; i<nthreads; i++)
+	{
+		counts[i] = i == nthreads-1 ? l->length - i*per : per;
+		tasks[i].base = (char*)l->data + (size_t)i*per*l->itemSize;
+		tasks[i].out = NULL;
+		tasks[i].leftN = counts[i];
+		tasks[i].rightN = 0;
+		tasks[i].itemSize = l->itemSize;
+		tasks[i].compar = l->compar;
+		started[i] = pthread_create(&threads[i], NULL, list_sort_worker, &tasks[i]) == 0;
+		if(!started[i]) // thread creation failed; do the work here instead
+			list_sort_worker(&tasks[i]);
+	}
+	for(int i=0; i<nthreads; i++)
+		if(started[i])
+			pthread_join(threads[i], NULL);
+
+	/* Phase 2: repeatedly merge pairs of adjacent sorted runs, each
+	 * pair on its own thread. Each round ping-pongs between the
+	 * list's storage and the scratch buffer. */
+	char *src = (char*) l->data;
+	char *dst = temp;
+	int numRuns = nthreads;
+	while(numRuns > 1)
+	{
+		int newCounts[LIST_PARALLEL_MAX_THREADS];
+		int newRuns = 0;
+		int launched = 0;
+		size_t offset = 0;
+		for(int i=0; i<numRuns; i+=2)
+		{
+			if(i+1 < numRuns)
+			{
+				struct list_sort_task *t = &tasks[launched];
+				t->base = src + offset;
+				t->out = dst + offset;
+				t->leftN = counts[i];
+				t->rightN = counts[i+1];
+				t->itemSize = l->itemSize;
+				t->compar = l->compar;
+				started[launched] = pthread_create(&threads[launched], NULL, list_sort_worker, t) == 0;
+				if(!started[launched])
+					list_sort_worker(t);
+				newCounts[newRuns] = counts[i] + counts[i+1];
+				offset += (size_t)newCounts[newRuns] * l->itemSize;
+				launched++;
+			}
+			else
+			{
+				/* Odd run out this round; carry it to the other buffer. */
+				memcpy(dst + offset, src + offset, (size_t)counts[i] * l->itemSize);
+				newCounts[newRuns] = counts[i];
+				offset += (size_t)counts[i] * l->itemSize;
+			}
+			newRuns++;
+		}
+		for(int i=0; i<launched; i++)
+			if(started[i])
+				pthread_join(threads[i], NULL);
+
+		for(int i=0; i<newRuns; i++)
+			counts[i] = newCounts[i];
+		numRuns = newRuns;
+		char *swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	/* The final merge may have landed in the scratch buffer. */
+	if(src != (char*) l->data)
+		memcpy(l->data, src, (size_t)l->length * l->itemSize);
+	free(temp);
 	return 1;
 }
 
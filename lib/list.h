@@ -43,11 +43,19 @@
 
     list->capacity: The length of the list could grow up to this
     capacity without the need for any reallocations. list_append() and
-    list_prepend() will double the capacity if you add an item and the
-    current capacity is not sufficient---allowing you to frequently
-    add items to the list without frequent reallocations. list_set()
-    and other functions will only increment the capacity to be exactly
-    large enough to contain the list.
+    list_prepend() will multiply the capacity by the list's growth
+    factor (2 by default, adjustable with list_set_growth_factor()) if
+    you add an item and the current capacity is not
+    sufficient---allowing you to frequently add items to the list
+    without frequent reallocations. list_set() and other functions
+    will only increment the capacity to be exactly large enough to
+    contain the list.
+
+    Short lists avoid heap allocations for their backing array
+    entirely: a list whose items fit in LIST_SBO_SIZE bytes stores
+    them in a small buffer inside the list struct itself, and only
+    spills to the heap (or to the allocator hook, see
+    list_new_arena()) when it outgrows that buffer.
 
     list->itemSize: Each item in the list must be the same size. This
     variable indicates the size of the item in bytes.
@@ -62,16 +70,30 @@
 extern "C" {
 #endif
 
+/** Number of bytes of item storage kept inside the list struct
+ * itself. Lists whose capacity*itemSize fits in this many bytes don't
+ * allocate a backing array on the heap at all. */
+#define LIST_SBO_SIZE 64
+
 typedef struct {
 	int capacity;
 	int length;
 	int itemSize;
 	int (*compar)(const void *, const void *);
 	void *data;
+	int dataBytes;      /*< Number of bytes allocated at data. Internal to list.c. */
+	float growthFactor; /*< Capacity multiplier used by list_append(); see list_set_growth_factor(). */
+	/* Optional allocator hook (see list_new_arena()). If set, all
+	 * space for the list comes from this function instead of
+	 * malloc(), and list_free() is a no-op. */
+	void* (*alloc)(void *allocData, int bytes);
+	void *allocData;
+	char sbo[LIST_SBO_SIZE]; /*< Inline item storage for short lists. Internal to list.c. */
 } list;
-	
+
 list* list_new(int capacity, int itemSize, int (*compar)(const void *, const void *));
 list* list_new_import(int numItems, int itemSize, int (*compar)(const void *, const void *), void *array);
+list* list_new_arena(int capacity, int itemSize, int (*compar)(const void *, const void *), void* (*alloc)(void *allocData, int bytes), void *allocData);
 	
 int list_reset(list *l, int capacity, int itemSize, int (*compar)(const void *, const void *));
 int list_reset_import(list *l, int length, int itemSize, int (*compar)(const void *, const void *), void *array);
@@ -91,6 +113,7 @@ int list_prepend(list *l, void *item);
 
 int list_ensure_capacity(list *l, int capacity);
 int list_set_capacity(list *l, int capacity);
+int list_set_growth_factor(list *l, float growthFactor);
 int list_set_length(list *l, int length);
 int list_reclaim(list *l);
 
@@ -17,7 +17,12 @@
    case of significant error messages, stderr. The messages printed to
    the console are also highlighted to attract attention to the most
    significant messages.
-   
+
+   The MSG_LOGLEVEL environment variable filters out low-priority
+   messages, either globally (MSG_LOGLEVEL=warning) or for one log
+   domain at a time (MSG_LOGLEVEL=debug,dgr=warning silences only the
+   messages tagged with the "dgr" domain via the msgd() macro).
+
     @author Scott Kuhl
  */
 
@@ -30,12 +35,57 @@
 #include <string.h>
 #include <unistd.h> // isatty()
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "msg.h"
+#include "ringbuf.h"
 
 static FILE *f = NULL;  /*< The file stream for our log file */
 static char *logfile = NULL;
 
+/** The minimum message level that is logged at all. Set with the
+ * MSG_LOGLEVEL environment variable (debug, info, warning, error);
+ * defaults to logging everything. Suppressed messages are discarded
+ * before any formatting happens, so they cost a single branch. The
+ * developer message types (BOLD, GREEN, etc.) are never filtered. */
+static msg_type msg_min_level = DEBUG;
+
+/** A log domain: a module name (given to the msgd() macro) with its
+ * own minimum level. Domains named in MSG_LOGLEVEL (for example
+ * MSG_LOGLEVEL=debug,dgr=warning) get the requested level; any other
+ * domain follows the global level above. */
+typedef struct
+{
+	char name[32];
+	msg_type level;
+} msg_domain;
+#define MSG_DOMAIN_MAX 32
+static msg_domain msg_domains[MSG_DOMAIN_MAX];
+static int msg_domain_count = 0;
+
+/** A fully formatted message waiting in the asynchronous ring to be
+ * written out by the background thread. */
+typedef struct
+{
+	msg_type type;
+	int lineNum;
+	char fileName[64];  /*< basename of the source file */
+	char funcName[64];
+	char timestamp[32];
+	char msgbuf[1024];
+} msg_record;
+
+/* The asynchronous backend (enabled with the MSG_ASYNC environment
+ * variable): msg() formats messages on the calling thread but hands
+ * them to a background thread through a ring buffer, so console and
+ * log file I/O never stall the caller. The ring is single-consumer,
+ * so concurrent msg() callers are serialized by a mutex around the
+ * push---the critical section is just a memcpy(), never I/O. */
+static ringbuf *msg_async_ring = NULL;
+static int msg_async_running = 0;
+static pthread_mutex_t msg_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /** Writes a timestamp string to a pre-allocated char array.
 
     @param buf A buffer of len bytes where the timestamp should be stored.
@@ -189,6 +239,106 @@ static void msg_end_color(msg_type type, FILE *stream)
 
 
 
+/** Writes a fully formatted message record to the console and the log
+    file. In synchronous mode this runs on the thread which called
+    msg(); in asynchronous mode it runs on the background flusher
+    thread.
+
+    @param rec The record to write out.
+*/
+static void msg_output(const msg_record *rec)
+{
+	/* info to prepend to message printed to console */
+	char typestr[1024];
+	msg_type_string(rec->type, typestr, 1024);
+
+	/* Determine the stream that we are going to print out to: stdout,
+	 * stderr, or don't print to console */
+	FILE *stream = stdout;
+	if(rec->type == ERROR || rec->type == FATAL)
+		stream = stderr;
+	if(msg_show_type(rec->type) == 0)
+		stream = NULL;
+
+	/* Print the message to stderr or stdout */
+	if(stream)
+	{
+		// If using a non-standard logfile name, prepend the name to
+		// the message. This makes it easier to distinguish between
+		// which process is creating which message if there are
+		// multiple programs running at once.
+		char prepend[1024];
+		if(strcmp(logfile, "log.txt") == 0)
+			prepend[0] = '\0';
+		else
+			snprintf(prepend, 1024, "(%s) ", logfile);
+
+		msg_start_color(rec->type, stream);
+		/* Print additional details to console for significant errors */
+		if(rec->type == FATAL || rec->type == ERROR)
+		{
+			fprintf(stream, "%s %s%s\n", typestr, prepend, rec->msgbuf);
+			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
+			        typestr, prepend, rec->fileName, rec->lineNum, rec->funcName);
+		}
+		else
+			fprintf(stream, "%s %s%s\n", typestr, prepend, rec->msgbuf);
+		msg_end_color(rec->type, stream);
+	}
+
+	// Not using funcName to try to keep log shorter.
+	fprintf(f, "%s%s %12s:%-4d %s\n", typestr, rec->timestamp, rec->fileName, rec->lineNum, rec->msgbuf);
+
+	/* Ensure messages are written to the file or console. */
+	fflush(stream);
+	fflush(f);
+}
+
+/** Waits until every message which has already been handed to the
+ * asynchronous backend has been written out, then flushes the log
+ * file. Does nothing harmful in synchronous mode (messages are
+ * already flushed as they are written). Registered with atexit() and
+ * the crash signal handler so the tail of the log is not lost when
+ * the program ends. */
+void msg_flush(void)
+{
+	if(msg_async_running)
+		while(ringbuf_length(msg_async_ring) > 0)
+			usleep(1000);
+	if(f != NULL)
+		fflush(f);
+}
+
+/** Flushes pending log messages when the program crashes, then
+ * re-raises the signal so the default action (core dump, etc) still
+ * happens. Waiting on the flusher thread isn't strictly
+ * async-signal-safe, but losing the tail of the log---usually the
+ * most interesting part---on every crash is worse. */
+static void msg_crash_handler(int sig)
+{
+	msg_flush();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/** The background thread which drains the ring and performs all
+ * console and log file I/O when the asynchronous backend is
+ * enabled. */
+static void* msg_async_thread(void *arg)
+{
+	(void) arg;
+	msg_record records[16];
+	while(1)
+	{
+		int count = ringbuf_pop_batch(msg_async_ring, records, 16);
+		for(int i=0; i<count; i++)
+			msg_output(&records[i]);
+		if(count == 0)
+			usleep(1000);
+	}
+	return NULL;
+}
+
 /** Initializes the logging system, creates the log file if
  * needed. Also, writes a message informing the user about the
  * location of the log file. The time printed in the log file will be
@@ -230,6 +380,90 @@ static void msg_init(void)
 	fprintf(f, "[TYPE ]    seconds     filename:line message\n");
 	fprintf(f, "------------------------------------------\n");
 
+	/* Check if the user wants to filter out low-priority messages
+	 * entirely (before they are even formatted). The variable is a
+	 * comma-separated list; a bare level sets the global minimum and
+	 * "domain=level" entries override it for one log domain (the tag
+	 * given to the msgd() macro). For example,
+	 * MSG_LOGLEVEL=debug,dgr=warning logs everything except DGR's
+	 * debug and info chatter. */
+	const char* envvar_loglevel = getenv("MSG_LOGLEVEL");
+	if(envvar_loglevel != NULL && strlen(envvar_loglevel) > 0)
+	{
+		char *list = strdup(envvar_loglevel);
+		char *saveptr = NULL;
+		for(char *token = strtok_r(list, ",", &saveptr); token != NULL;
+		    token = strtok_r(NULL, ",", &saveptr))
+		{
+			char *levelString = strchr(token, '=');
+			if(levelString != NULL)
+			{
+				*levelString = '\0'; // token is now just the domain name
+				levelString++;
+			}
+			else
+				levelString = token;
+
+			msg_type level;
+			if(strcasecmp(levelString, "debug") == 0)
+				level = DEBUG;
+			else if(strcasecmp(levelString, "info") == 0)
+				level = INFO;
+			else if(strcasecmp(levelString, "warning") == 0)
+				level = WARNING;
+			else if(strcasecmp(levelString, "error") == 0)
+				level = ERROR;
+			else
+			{
+				msg(WARNING, "Ignoring unrecognized MSG_LOGLEVEL entry '%s' (expected debug, info, warning, or error)\n", levelString);
+				continue;
+			}
+
+			if(levelString == token) // no '=': the global level
+				msg_min_level = level;
+			else if(msg_domain_count < MSG_DOMAIN_MAX)
+			{
+				snprintf(msg_domains[msg_domain_count].name,
+				         sizeof(msg_domains[msg_domain_count].name),
+				         "%s", token);
+				msg_domains[msg_domain_count].level = level;
+				msg_domain_count++;
+			}
+			else
+				msg(WARNING, "Ignoring MSG_LOGLEVEL domain '%s'; only %d domains are supported.\n", token, MSG_DOMAIN_MAX);
+		}
+		free(list);
+	}
+
+	/* Check if the user wants the asynchronous backend. It is opt-in
+	 * because it keeps an extra thread around; set MSG_ASYNC if bursts
+	 * of messages (e.g., assimp importing a model with warnings) are
+	 * making the render thread stutter from log file I/O. */
+	const char* envvar_async = getenv("MSG_ASYNC");
+	if(envvar_async != NULL && strlen(envvar_async) > 0)
+	{
+		msg_async_ring = ringbuf_new(256, sizeof(msg_record));
+		if(msg_async_ring != NULL)
+		{
+			pthread_t flusher;
+			if(pthread_create(&flusher, NULL, msg_async_thread, NULL) == 0)
+			{
+				msg_async_running = 1;
+				/* Make sure queued messages get written out however
+				 * the program ends. */
+				atexit(msg_flush);
+				signal(SIGSEGV, msg_crash_handler);
+				signal(SIGABRT, msg_crash_handler);
+			}
+			else
+			{
+				ringbuf_free(msg_async_ring);
+				msg_async_ring = NULL;
+				msg(WARNING, "Failed to create the log flusher thread; messages will be written synchronously.\n");
+			}
+		}
+	}
+
 	// Write message so user knows the log file is being created.
 	if(append)
 		msg(INFO, "Messages are being appended to '%s'\n", logfile);
@@ -248,72 +482,114 @@ static void msg_init(void)
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...)
 {
 	msg_init();
-	
+
+	/* Discard filtered-out messages before doing any formatting work
+	 * so a suppressed level costs a single branch. The developer
+	 * message types (BOLD and up) are never filtered. */
+	if(type < msg_min_level && type <= FATAL)
+		return;
+
+	msg_record rec;
+	rec.type = type;
+	rec.lineNum = lineNum;
+
 	/* Construct a string for the user's message */
-	char msgbuf[1024];
 	va_list args;
 	va_start(args, msg);
-	vsnprintf(msgbuf, 1024, msg, args);
+	vsnprintf(rec.msgbuf, sizeof(rec.msgbuf), msg, args);
 	va_end(args);
 
 	/* Remove any newlines at the end of the message. */
-	int msgbufidx = strlen(msgbuf)-1;
-	while(msgbuf[msgbufidx] == '\n')
+	int msgbufidx = strlen(rec.msgbuf)-1;
+	while(msgbufidx >= 0 && rec.msgbuf[msgbufidx] == '\n')
 	{
-		msgbuf[msgbufidx] = '\0';
+		rec.msgbuf[msgbufidx] = '\0';
 		msgbufidx--;
 	}
-	
-	/* info to prepend to message printed to console */
-	char typestr[1024];
-	msg_type_string(type, typestr, 1024);
 
-	/* Determine the stream that we are going to print out to: stdout,
-	 * stderr, or don't print to console */
-	FILE *stream = stdout;
-	if(type == ERROR || type == FATAL)
-		stream = stderr;
-	if(msg_show_type(type) == 0)
-		stream = NULL;
+	msg_timestamp(rec.timestamp, sizeof(rec.timestamp));
 
-	char timestamp[1024];
-	msg_timestamp(timestamp, 1024);
 	char *fileNameCopy = strdup(fileName);
-	char *shortFileName = basename(fileNameCopy);
-	
-	/* Print the message to stderr or stdout */
-	if(stream)
+	snprintf(rec.fileName, sizeof(rec.fileName), "%s", basename(fileNameCopy));
+	free(fileNameCopy);
+	snprintf(rec.funcName, sizeof(rec.funcName), "%s", funcName);
+
+	if(msg_async_running)
 	{
-		// If using a non-standard logfile name, prepend the name to
-		// the message. This makes it easier to distinguish between
-		// which process is creating which message if there are
-		// multiple programs running at once.
-		char prepend[1024];
-		if(strcmp(logfile, "log.txt") == 0)
-			prepend[0] = '\0';
-		else
-			snprintf(prepend, 1024, "(%s) ", logfile);
-		
-		msg_start_color(type, stream);
-		/* Print additional details to console for significant errors */
-		if(type == FATAL || type == ERROR)
+		/* The ring buffer is single-consumer, so serialize the
+		 * producers. The critical section is a memcpy()---all of the
+		 * I/O happens on the flusher thread. If the ring is full, wait
+		 * for the flusher to make room rather than dropping the
+		 * message. */
+		pthread_mutex_lock(&msg_async_mutex);
+		while(ringbuf_push(msg_async_ring, &rec) == 0)
 		{
-			fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
-			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
-			        typestr, prepend, shortFileName, lineNum, funcName);
+			pthread_mutex_unlock(&msg_async_mutex);
+			usleep(100);
+			pthread_mutex_lock(&msg_async_mutex);
 		}
-		else
-			fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
-		msg_end_color(type, stream);
+		pthread_mutex_unlock(&msg_async_mutex);
+
+		/* Significant errors are often immediately followed by
+		 * exit(); make sure they (and everything queued before them)
+		 * reach the log file before we return. */
+		if(type == ERROR || type == FATAL)
+			msg_flush();
 	}
+	else
+		msg_output(&rec);
+}
 
-	// Not using funcName to try to keep log shorter.
-	fprintf(f, "%s%s %12s:%-4d %s\n", typestr, timestamp, shortFileName, lineNum, msgbuf);
-	free(fileNameCopy);
+/** Decides whether a message in a log domain should be printed. Called
+    by the msgd() macro; applications normally do not call it directly.
 
-	/* Ensure messages are written to the file or console. */
-	fflush(stream);
-	fflush(f);
+    The first call from a call site looks the domain up by name (adding
+    it to the domain table if MSG_LOGLEVEL didn't mention it) and caches
+    the table index in the macro's static variable, so subsequent calls
+    are an array lookup and a comparison.
+
+    @param cache A pointer to the call site's cached domain index
+    (initialized to -1 by the macro).
+    @param domain The name of the log domain (e.g. "dgr").
+    @param type The type of message being considered.
+    @return 1 if the message should be printed, 0 if it is suppressed
+    by the domain's minimum level.
+*/
+int msg_domain_check(int *cache, const char *domain, msg_type type)
+{
+	msg_init();
+
+	if(*cache < 0)
+	{
+		/* Look the domain up (or register it) under the mutex so two
+		 * threads hitting new call sites at once can't corrupt the
+		 * table. This only happens on the first call per call site. */
+		pthread_mutex_lock(&msg_async_mutex);
+		int index = -1;
+		for(int i=0; i<msg_domain_count; i++)
+			if(strcmp(msg_domains[i].name, domain) == 0)
+				index = i;
+		if(index < 0)
+		{
+			if(msg_domain_count < MSG_DOMAIN_MAX)
+			{
+				index = msg_domain_count;
+				snprintf(msg_domains[index].name,
+				         sizeof(msg_domains[index].name), "%s", domain);
+				msg_domains[index].level = msg_min_level;
+				msg_domain_count++;
+			}
+			else // table is full; fall back to the global level
+				index = MSG_DOMAIN_MAX;
+		}
+		pthread_mutex_unlock(&msg_async_mutex);
+		*cache = index;
+	}
+
+	msg_type level = msg_min_level;
+	if(*cache < MSG_DOMAIN_MAX)
+		level = msg_domains[*cache].level;
+	return type > FATAL || type >= level;
 }
 
 /** ASSIMP can be configured to call a callback function every time it
@@ -35,11 +35,41 @@ typedef enum {
 
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...);
 void msg_assimp_callback(const char* msg, char *usr);
+void msg_flush(void);
+int msg_domain_check(int *cache, const char *domain, msg_type type);
+
+/** Messages below this level are compiled out entirely: the call (and
+ * the evaluation of its arguments) disappears from the binary. Define
+ * it on the compiler command line (e.g. -DMSG_COMPILE_LEVEL=1 to
+ * remove DEBUG messages from a release build); the levels match the
+ * order of the msg_type enum (DEBUG=0, INFO=1, WARNING=2, ERROR=3).
+ * The developer message types (BOLD and up) are never compiled
+ * out. */
+#ifndef MSG_COMPILE_LEVEL
+#define MSG_COMPILE_LEVEL 0
+#endif
 
 /** Prints the message and saves information to a logfile. C99
  * requires that __VA_ARGS__ corresponds to at least one parameter
  * (not zero parameters). */
-#define msg(TYPE, ...) msg_details(TYPE, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define msg(TYPE, ...) \
+	do { if((int)(TYPE) > FATAL || (int)(TYPE) >= MSG_COMPILE_LEVEL) \
+		msg_details(TYPE, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+	} while(0)
+
+/** Like msg(), but tags the message with a log domain (a short module
+ * name such as "dgr") whose verbosity can be controlled independently
+ * of the rest of the program through the MSG_LOGLEVEL environment
+ * variable (e.g. MSG_LOGLEVEL=debug,dgr=warning). A message
+ * suppressed by its domain's level costs one branch and one function
+ * call; the format arguments are never evaluated. The domain lookup
+ * happens once per call site and is cached in a static variable. */
+#define msgd(DOMAIN, TYPE, ...) \
+	do { if((int)(TYPE) > FATAL || (int)(TYPE) >= MSG_COMPILE_LEVEL) { \
+		static int msgd_cached_domain = -1; \
+		if(msg_domain_check(&msgd_cached_domain, DOMAIN, TYPE)) \
+			msg_details(TYPE, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+	} } while(0)
 
 
 #ifdef __cplusplus
@@ -19,6 +19,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+
+/** A mailbox holding the newest orientation the reader thread has
+ * parsed. The seq counter is odd while the writer is mid-copy, which
+ * lets the render thread read the newest quaternion without either
+ * thread ever blocking the other (the same scheme vrpn-help.cpp uses
+ * for tracker records). */
+typedef struct
+{
+	volatile unsigned int seq; /**< Odd while a write is in progress. */
+	float quat[4];             /**< The newest orientation. */
+	time_t dataTime;           /**< When the orientation was parsed. */
+	int filled;                /**< Has any record been published yet? */
+} orient_mailbox;
+
+/** State owned by one background reader thread. */
+typedef struct
+{
+	pthread_t thread;
+	int fd;               /**< The serial port; the thread owns it (and reopens it after a disconnect). */
+	char deviceFile[32];  /**< Device to reopen on reconnect. */
+	volatile int done;    /**< Ask the thread to exit. */
+	orient_mailbox mailbox;
+} orient_sensor_reader;
+
+static void * orient_sensor_reader_thread(void *arg);
 
 /** Opens a connection to the orientation sensor.
 
@@ -70,6 +96,7 @@ OrientSensorState orient_sensor_init(const char* deviceFileIn, int sensorType)
 	state.isWorking = 0;
 	state.type = sensorType;
 	state.lastDataTime = 0;
+	state.reader = NULL;
 	for(int i=0; i<4; i++)
 		state.lastData[i] = 0.0;
 
@@ -81,7 +108,28 @@ OrientSensorState orient_sensor_init(const char* deviceFileIn, int sensorType)
 	}
 	else
 		state.fd = serial_open(deviceFile, 115200, 0, 1, 5);
-	
+
+	/* Service the sensor from a dedicated reader thread so that a
+	 * slow or disconnected sensor can never stall the thread calling
+	 * orient_sensor_get(). Set ORIENT_SENSOR_SYNC to fall back to
+	 * reading the port synchronously from the calling thread. */
+	if(sensorType == ORIENT_SENSOR_BNO055 &&
+	   getenv("ORIENT_SENSOR_SYNC") == NULL)
+	{
+		orient_sensor_reader *reader = kuhl_malloc(sizeof(orient_sensor_reader));
+		memset(reader, 0, sizeof(orient_sensor_reader));
+		reader->fd = state.fd;
+		strncpy(reader->deviceFile, state.deviceFile, 32);
+		reader->deviceFile[31] = '\0';
+		if(pthread_create(&reader->thread, NULL, orient_sensor_reader_thread, reader) == 0)
+			state.reader = reader;
+		else
+		{
+			msg(ERROR, "Failed to start the orientation sensor reader thread; reading the sensor synchronously instead.");
+			free(reader);
+		}
+	}
+
 	return state;
 }
 
@@ -92,11 +140,54 @@ static void orient_sensor_get_dsight(OrientSensorState *state, float quaternion[
 
 }
 
+/** Periodically complains if the BNO055's calibration is poor.
+
+    @param calib The four calibration bytes at the end of a sensor record.
+*/
+static void orient_sensor_report_calibration(const unsigned char *calib)
+{
+	static int calibrationMessage = 100;
+
+	uint8_t sys, gyro, accel, mag;
+	sys    = calib[0];
+	gyro   = calib[1];
+	accel  = calib[2];
+	mag    = calib[3];
+	calibrationMessage--;
+	if(calibrationMessage < 0)
+	{
+		calibrationMessage = 1000;
+
+		if(sys == 0)
+			msg(ERROR, "Sensor is uncalibrated.");
+		else if (sys == 1)
+			msg(WARNING, "Sensor calibration is poor.");
+
+		if(gyro == 0)
+			msg(WARNING, "Gyro is uncalibrated. Let sensor sit still.");
+		else if(gyro == 1)
+			msg(WARNING, "Gyro calibration is poor. Let sensor sit still.");
+
+		if(accel == 0)
+			msg(WARNING, "Accelerometer is uncalibrated. Place sensor on 6 sides of block.");
+		else if(accel == 1)
+			msg(WARNING, "Accelerometer calibration is poor. Place sensor on 6 sides of block.");
+
+		if(mag == 0)
+			msg(WARNING, "Magnetometer is uncalibrated. Use figure 8 motion.");
+		else if(mag == 1)
+			msg(WARNING, "Magnetometer calibration is poor. Use figure 8 motion.");
+
+		if(sys < 2 || gyro < 2 || accel < 2 || mag < 2)
+			msg(BLUE, "Raw orientation sensor calib data: sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
+	}
+	// msg(INFO, "sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
+}
+
 static void orient_sensor_get_bno055(OrientSensorState *state, float quaternion[4])
 {
 // 1 sanity check float, 4 floats for quat, 4 more bytes for calibration data
 #define RECORD_SIZE 4+4*4+4
-	static int calibrationMessage = 100;
 
 	int options = SERIAL_NONE;
 	if(state->isWorking == 0)
@@ -196,40 +287,7 @@ static void orient_sensor_get_bno055(OrientSensorState *state, float quaternion[
 	state->lastDataTime = time(NULL);
 	// msg(GREEN, "Record OK");
 
-	uint8_t sys, gyro, accel, mag;
-	sys    = temp[4*5+0];
-	gyro   = temp[4*5+1];
-	accel  = temp[4*5+2];
-	mag    = temp[4*5+3];
-	calibrationMessage--;
-	if(calibrationMessage < 0)
-	{
-		calibrationMessage = 1000;
-		
-		if(sys == 0)
-			msg(ERROR, "Sensor is uncalibrated.");
-		else if (sys == 1)
-			msg(WARNING, "Sensor calibration is poor.");
-
-		if(gyro == 0)
-			msg(WARNING, "Gyro is uncalibrated. Let sensor sit still.");
-		else if(gyro == 1)
-			msg(WARNING, "Gyro calibration is poor. Let sensor sit still.");
-
-		if(accel == 0)
-			msg(WARNING, "Accelerometer is uncalibrated. Place sensor on 6 sides of block.");
-		else if(accel == 1)
-			msg(WARNING, "Accelerometer calibration is poor. Place sensor on 6 sides of block.");
-		
-		if(mag == 0)
-			msg(WARNING, "Magnetometer is uncalibrated. Use figure 8 motion.");
-		else if(mag == 1)
-			msg(WARNING, "Magnetometer calibration is poor. Use figure 8 motion.");
-
-		if(sys < 2 || gyro < 2 || accel < 2 || mag < 2)
-			msg(BLUE, "Raw orientation sensor calib data: sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
-	}
-	// msg(INFO, "sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
+	orient_sensor_report_calibration((unsigned char*) temp+4*5);
 
 	/* Copy data from our buffer into quaternion buffer and into the lastData buffer */
 	memcpy(quaternion, temp+4, sizeof(float)*4);
@@ -239,6 +297,111 @@ static void orient_sensor_get_bno055(OrientSensorState *state, float quaternion[
 
 
 
+/** The background reader thread. It drains the serial port in large
+ * batched read() calls instead of record-sized ones, parses every
+ * complete record in the batch, and publishes only the newest
+ * orientation into the mailbox. Because all of the blocking,
+ * resynchronizing and reconnecting happens here, a slow or unplugged
+ * sensor delays this thread rather than the render thread. */
+static void * orient_sensor_reader_thread(void *arg)
+{
+	orient_sensor_reader *r = (orient_sensor_reader*) arg;
+	unsigned char buf[4096];
+	int have = 0;
+	const int32_t magic = 0x42f6e979; // hex for the 123.456 float sent from arduino
+	time_t lastRecord = time(NULL);
+	int synchronized = 0;
+
+	while(!r->done)
+	{
+		ssize_t n = read(r->fd, buf+have, sizeof(buf)-have);
+		if(n <= 0)
+		{
+			/* A read error or repeated end-of-file usually means the
+			 * cable was pulled; reopen the port (serial_open retries
+			 * for a while before giving up). */
+			if(n < 0 || time(NULL) - lastRecord >= 2)
+			{
+				msg(WARNING, "Lost contact with the orientation sensor. Trying to reconnect.");
+				serial_close(r->fd);
+				r->fd = serial_open(r->deviceFile, 115200, 0, 1, 5);
+				have = 0;
+				synchronized = 0;
+				lastRecord = time(NULL);
+			}
+			else
+				usleep(100*1000); // don't spin while the port is silent
+			continue;
+		}
+		have += n;
+
+		/* Parse every complete record in the buffer. Records start
+		 * with the magic bytes; if we are mid-stream (or lost bytes),
+		 * scanning forward one byte at a time resynchronizes us. */
+		int pos = 0;
+		while(have - pos >= RECORD_SIZE)
+		{
+			if(memcmp(buf+pos, &magic, sizeof(magic)) != 0)
+			{
+				if(synchronized)
+				{
+					msg(WARNING, "Synchronizing to orientation sensor stream...");
+					synchronized = 0;
+				}
+				pos++;
+				continue;
+			}
+			if(!synchronized)
+			{
+				msg(INFO, "Successfully synchronized to orientation sensor.\n");
+				synchronized = 1;
+			}
+
+			orient_sensor_report_calibration(buf+pos+4*5);
+
+			/* Publish the orientation. Readers retry while seq is
+			 * odd, so they never see a half-written quaternion. */
+			r->mailbox.seq++; // now odd: tells readers a write is in progress
+			__sync_synchronize();
+			memcpy(r->mailbox.quat, buf+pos+4, sizeof(float)*4);
+			r->mailbox.dataTime = time(NULL);
+			r->mailbox.filled = 1;
+			__sync_synchronize();
+			r->mailbox.seq++; // now even: record is stable again
+
+			lastRecord = time(NULL);
+			pos += RECORD_SIZE;
+		}
+		memmove(buf, buf+pos, have-pos);
+		have -= pos;
+	}
+	return NULL;
+}
+
+/** Reads the newest orientation out of the mailbox without blocking
+ * the reader thread.
+
+    @return 1 if the mailbox contained an orientation, 0 if the reader
+    thread hasn't published one yet.
+*/
+static int orient_mailbox_read(orient_mailbox *mailbox, float quat[4], time_t *dataTime)
+{
+	unsigned int seqBefore, seqAfter;
+	do
+	{
+		seqBefore = mailbox->seq;
+		if(seqBefore % 2 == 1) // writer is mid-copy, try again
+			continue;
+		__sync_synchronize();
+		memcpy(quat, mailbox->quat, sizeof(float)*4);
+		*dataTime = mailbox->dataTime;
+		__sync_synchronize();
+		seqAfter = mailbox->seq;
+	} while(seqBefore != seqAfter || seqBefore % 2 == 1);
+
+	return mailbox->filled;
+}
+
 /** Retrieve the latest orientation from the sensor.
 
     @param state A OrientSensorState struct created by orient_sensor_init()
@@ -246,6 +409,36 @@ static void orient_sensor_get_bno055(OrientSensorState *state, float quaternion[
 */
 void orient_sensor_get(OrientSensorState *state, float quaternion[4])
 {
+	/* If a reader thread is servicing this sensor, sample its mailbox
+	 * and return immediately---sensor hiccups never stall the caller. */
+	orient_sensor_reader *r = (orient_sensor_reader*) state->reader;
+	if(r != NULL)
+	{
+		time_t dataTime = 0;
+		if(orient_mailbox_read(&r->mailbox, quaternion, &dataTime))
+		{
+			memcpy(state->lastData, quaternion, sizeof(float)*4);
+			state->lastDataTime = dataTime;
+			state->isWorking = 1;
+		}
+		else
+		{
+			/* Nothing published yet; hand back the cached data. */
+			for(int i=0; i<4; i++)
+				quaternion[i] = state->lastData[i];
+		}
+
+		static time_t lastStaleWarning = 0;
+		if(state->isWorking &&
+		   time(NULL) - state->lastDataTime >= 2 &&
+		   time(NULL) - lastStaleWarning >= 2)
+		{
+			msg(WARNING, "We haven't received a new record from the orientation sensor in the past couple seconds. Is sensor still connected?");
+			lastStaleWarning = time(NULL);
+		}
+		return;
+	}
+
 	switch(state->type)
 	{
 		case ORIENT_SENSOR_BNO055:
@@ -29,6 +29,7 @@ typedef struct
 	int lastDataTime; /**< What time did we receive the data in lastData? */
 	int isWorking; /**< Set to 1 when we have successfully received data */
 	int type;
+	void *reader; /**< The background reader thread servicing this sensor, or NULL if the sensor is read synchronously. Managed internally by orient-sensor.c. */
 } OrientSensorState;
 
 	
@@ -0,0 +1,195 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+#include "msg.h"
+
+/** Creates a new single-producer/single-consumer ring buffer.
+
+    @param capacity The minimum number of items the ring buffer should
+    be able to hold. It is rounded up to the next power of two so that
+    the free-running counters can be reduced to array indices with a
+    mask (which also makes counter wraparound harmless).
+
+    @param itemSize The size of each item to be stored in the ring
+    buffer.
+
+    @return A pointer to a ringbuf struct or NULL if we failed to
+    allocate it. The ring buffer should eventually be free'd with
+    ringbuf_free().
+*/
+ringbuf* ringbuf_new(int capacity, int itemSize)
+{
+	if(capacity <= 0 || itemSize <= 0)
+	{
+		msg(ERROR, "Invalid ring buffer capacity %d or item size %d", capacity, itemSize);
+		return NULL;
+	}
+
+	int realCapacity = 1;
+	while(realCapacity < capacity)
+		realCapacity *= 2;
+
+	ringbuf *rb = malloc(sizeof(ringbuf));
+	char *buf = malloc((size_t)realCapacity * itemSize);
+	if(rb == NULL || buf == NULL)
+	{
+		if(rb != NULL) free(rb);
+		if(buf != NULL) free(buf);
+		msg(ERROR, "Failed to allocate ring buffer");
+		return NULL;
+	}
+	rb->buf = buf;
+	rb->capacity = realCapacity;
+	rb->itemSize = itemSize;
+	rb->read = 0;
+	rb->write = 0;
+	return rb;
+}
+
+/** Frees a ring buffer created with ringbuf_new(). Both the producer
+ * and the consumer must be finished with the ring buffer before it is
+ * freed.
+ *
+ * @param rb The ring buffer to free.
+ */
+void ringbuf_free(ringbuf *rb)
+{
+	if(rb == NULL)
+		return;
+	free(rb->buf);
+	free(rb);
+}
+
+/** Copies an item into the ring buffer. Only the producer thread may
+    call this function. It is wait-free: it never blocks, no matter
+    what the consumer is doing.
+
+    @param rb The ring buffer to push onto.
+
+    @param item The item to copy into the ring buffer.
+
+    @return 1 if the item was added, 0 if the ring buffer was full.
+*/
+int ringbuf_push(ringbuf *rb, const void *item)
+{
+	/* 'read' can advance concurrently, but that only makes more room;
+	 * if the ring doesn't look full now, it isn't. */
+	if(rb->write - rb->read >= (unsigned int) rb->capacity)
+		return 0;
+
+	unsigned int slot = rb->write & (unsigned int)(rb->capacity-1);
+	memcpy(rb->buf + (size_t)slot * rb->itemSize, item, rb->itemSize);
+
+	/* Make sure the item's bytes are visible to the consumer before
+	 * the counter update which publishes the item is. */
+	__sync_synchronize();
+	rb->write++;
+	return 1;
+}
+
+/** Copies the oldest item out of the ring buffer. Only the consumer
+    thread may call this function. It is wait-free: it never blocks,
+    no matter what the producer is doing.
+
+    @param rb The ring buffer to pop from.
+
+    @param result The item is copied here.
+
+    @return 1 if an item was removed, 0 if the ring buffer was empty.
+*/
+int ringbuf_pop(ringbuf *rb, void *result)
+{
+	return ringbuf_pop_batch(rb, result, 1);
+}
+
+/** Copies up to maxItems of the oldest items out of the ring buffer in
+    one call. Only the consumer thread may call this function. Popping
+    in batches lets a consumer drain a busy producer with two memcpy()
+    calls and a single counter update instead of paying the
+    synchronization cost once per item.
+
+    @param rb The ring buffer to pop from.
+
+    @param result The items are copied here, oldest first. Must have
+    room for maxItems items.
+
+    @param maxItems The maximum number of items to remove.
+
+    @return The number of items removed (0 if the ring buffer was
+    empty).
+*/
+int ringbuf_pop_batch(ringbuf *rb, void *result, int maxItems)
+{
+	if(maxItems <= 0)
+		return 0;
+
+	/* 'write' can advance concurrently, but that only adds items
+	 * beyond the ones we are about to take. */
+	unsigned int available = rb->write - rb->read;
+	if(available == 0)
+		return 0;
+
+	/* Make sure we read the items' bytes after the counter update
+	 * which published them. */
+	__sync_synchronize();
+
+	unsigned int count = available;
+	if(count > (unsigned int) maxItems)
+		count = (unsigned int) maxItems;
+
+	/* The items may wrap around the end of the buffer; copy them in
+	 * at most two contiguous pieces. */
+	unsigned int slot = rb->read & (unsigned int)(rb->capacity-1);
+	unsigned int firstPiece = (unsigned int) rb->capacity - slot;
+	if(firstPiece > count)
+		firstPiece = count;
+	memcpy(result, rb->buf + (size_t)slot * rb->itemSize,
+	       (size_t)firstPiece * rb->itemSize);
+	if(count > firstPiece)
+		memcpy((char*)result + (size_t)firstPiece * rb->itemSize,
+		       rb->buf, (size_t)(count-firstPiece) * rb->itemSize);
+
+	/* Make sure the copies above finish before the counter update
+	 * which hands the slots back to the producer. */
+	__sync_synchronize();
+	rb->read += count;
+	return (int) count;
+}
+
+/** Returns the number of items in the ring buffer. Note that the
+    length can change concurrently: a producer calling this sees a
+    length that can only shrink, and a consumer sees a length that can
+    only grow.
+
+    @param rb The ring buffer.
+
+    @return The number of items in the ring buffer.
+*/
+int ringbuf_length(const ringbuf *rb)
+{
+	return (int)(rb->write - rb->read);
+}
+
+/** Returns the number of items the ring buffer can hold (which may be
+    larger than the capacity passed to ringbuf_new() due to rounding up
+    to a power of two).
+
+    @param rb The ring buffer.
+
+    @return The capacity of the ring buffer.
+*/
+int ringbuf_capacity(const ringbuf *rb)
+{
+	return rb->capacity;
+}
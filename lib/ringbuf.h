@@ -0,0 +1,60 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Provides a fixed-capacity lock-free ring buffer for moving items
+    from exactly one producer thread to exactly one consumer thread
+    (for example, from a background image decoder or tracker reader to
+    the render thread). Unlike the queue structure, no mutex is needed:
+    push and pop are wait-free, so neither thread can ever be blocked
+    by the other.
+
+    The single-producer/single-consumer restriction is what makes the
+    lock-free implementation simple: only the producer writes the
+    write counter and only the consumer writes the read counter. If
+    multiple threads push (or multiple threads pop), the caller must
+    serialize them with its own lock---or use one ring buffer per
+    producer.
+
+    Like the queue structure, the ring buffer stores a *copy* of each
+    item. If you want a ring buffer of pointers, pass a pointer to a
+    pointer into ringbuf_push().
+
+    @author Scott Kuhl
+ */
+
+#ifndef __RINGBUF_H__
+#define __RINGBUF_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	char *buf;        /*< Storage for capacity items of itemSize bytes each. */
+	int capacity;     /*< Number of items the ring can hold; always a power of two. */
+	int itemSize;     /*< Size of each item in bytes. */
+	/* The counters run freely and are reduced modulo the capacity
+	 * when indexing into buf; 'write - read' is the number of items
+	 * in the ring. Only the producer modifies 'write' and only the
+	 * consumer modifies 'read'. */
+	volatile unsigned int read;  /*< Count of items popped so far. */
+	volatile unsigned int write; /*< Count of items pushed so far. */
+} ringbuf;
+
+ringbuf* ringbuf_new(int capacity, int itemSize);
+void ringbuf_free(ringbuf *rb);
+
+int ringbuf_push(ringbuf *rb, const void *item);
+int ringbuf_pop(ringbuf *rb, void *result);
+int ringbuf_pop_batch(ringbuf *rb, void *result, int maxItems);
+
+int ringbuf_length(const ringbuf *rb);
+int ringbuf_capacity(const ringbuf *rb);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // end __RINGBUF_H__
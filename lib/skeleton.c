@@ -0,0 +1,196 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ *
+ * Implements the forward-kinematics evaluation cache described in
+ * skeleton.h. The important invariant is that a parent joint is
+ * always stored at a lower index than its children (enforced by
+ * skeleton_add_joint()). A single front-to-back pass over the joint
+ * array is therefore guaranteed to see every joint after its parent,
+ * so skeleton_update() can decide per joint whether the cached world
+ * matrix is still valid: it is stale only if the joint's own local
+ * transformation changed or the parent's world matrix was recomputed
+ * earlier in the same pass.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "skeleton.h"
+#include "msg.h"
+#include "vecmat.h"
+
+/** Initializes a skeleton which can hold up to 'capacity' joints.
+ *
+ * @param s The skeleton to initialize.
+ * @param capacity The maximum number of joints the skeleton can hold.
+ */
+void skeleton_init(skeleton *s, int capacity)
+{
+	if(s == NULL)
+		return;
+	if(capacity < 1)
+		capacity = 1;
+	s->joints = malloc(sizeof(skeleton_joint)*capacity);
+	s->count = 0;
+	s->capacity = capacity;
+	s->dirtyCount = 0;
+	s->evals = 0;
+	s->updates = 0;
+}
+
+/** Frees the joint storage inside a skeleton (not the skeleton struct
+ * itself, which the caller owns). */
+void skeleton_free(skeleton *s)
+{
+	if(s == NULL)
+		return;
+	free(s->joints);
+	s->joints = NULL;
+	s->count = 0;
+	s->capacity = 0;
+}
+
+/** Adds a joint to the skeleton.
+ *
+ * @param s The skeleton to add a joint to.
+ * @param parent Index of the parent joint, or -1 to create a root
+ * joint. Because matrices are evaluated parents-first, the parent
+ * must already have been added (i.e., parent < the new joint's
+ * index).
+ * @param local The joint's transformation relative to its parent (or
+ * relative to the world for a root joint). If NULL, the identity is
+ * used.
+ * @return The index of the new joint, or -1 on error.
+ */
+int skeleton_add_joint(skeleton *s, int parent, const float local[16])
+{
+	if(s == NULL || s->joints == NULL)
+		return -1;
+	if(s->count >= s->capacity)
+	{
+		msg(ERROR, "Can't add a joint to a skeleton which already contains %d joints.", s->capacity);
+		return -1;
+	}
+	if(parent >= s->count)
+	{
+		msg(ERROR, "A joint's parent (%d) must be added before the joint itself (%d).", parent, s->count);
+		return -1;
+	}
+
+	skeleton_joint *j = &(s->joints[s->count]);
+	if(local != NULL)
+		mat4f_copy(j->local, local);
+	else
+		mat4f_identity(j->local);
+	j->parent = parent < 0 ? -1 : parent;
+	j->dirty = 1;
+	j->updated = 0;
+	s->dirtyCount++;
+	return s->count++;
+}
+
+/** Sets a joint's transformation relative to its parent and marks the
+ * joint dirty. The cached world matrices of the joint and its
+ * descendants are refreshed by the next skeleton_update(); joints
+ * that are not downstream of this one keep their cached matrices.
+ *
+ * @param s The skeleton containing the joint.
+ * @param joint The index of the joint to change.
+ * @param local The joint's new transformation relative to its parent.
+ */
+void skeleton_set_local(skeleton *s, int joint, const float local[16])
+{
+	if(s == NULL || joint < 0 || joint >= s->count || local == NULL)
+		return;
+	skeleton_joint *j = &(s->joints[joint]);
+	/* Skip the update entirely if the transformation didn't actually
+	 * change---solvers frequently restore a perturbed joint to its
+	 * previous value. */
+	if(memcmp(j->local, local, sizeof(float)*16) == 0)
+		return;
+	mat4f_copy(j->local, local);
+	if(j->dirty == 0)
+	{
+		j->dirty = 1;
+		s->dirtyCount++;
+	}
+}
+
+/** Recomputes the cached world matrix of every joint whose local
+ * transformation changed since the last update, plus every joint
+ * downstream of one that did. Joints unaffected by the changes keep
+ * their cached matrices; if nothing changed, this returns without
+ * touching any matrix. */
+void skeleton_update(skeleton *s)
+{
+	if(s == NULL)
+		return;
+	s->updates++;
+	if(s->dirtyCount == 0)
+		return;
+
+	/* One pass, parents before children. A joint's world matrix is
+	 * recomputed if the joint itself is dirty or if its parent's
+	 * world matrix was recomputed earlier in this pass. */
+	for(int i=0; i<s->count; i++)
+	{
+		skeleton_joint *j = &(s->joints[i]);
+		skeleton_joint *p = j->parent < 0 ? NULL : &(s->joints[j->parent]);
+		if(j->dirty == 0 && (p == NULL || p->updated == 0))
+		{
+			j->updated = 0;
+			continue;
+		}
+		if(p == NULL)
+			mat4f_copy(j->world, j->local);
+		else
+			mat4f_mult_mat4f_new(j->world, p->world, j->local);
+		j->dirty = 0;
+		j->updated = 1;
+		s->evals++;
+	}
+	s->dirtyCount = 0;
+}
+
+/** Returns a pointer to a joint's local-to-world matrix, updating the
+ * skeleton first if any joint changed since the last update. The
+ * pointer is valid until the skeleton is freed, but the matrix it
+ * points at changes whenever the joint is re-evaluated.
+ *
+ * @param s The skeleton containing the joint.
+ * @param joint The index of the joint.
+ * @return The joint's local-to-world matrix, or NULL on error.
+ */
+const float* skeleton_world(skeleton *s, int joint)
+{
+	if(s == NULL || joint < 0 || joint >= s->count)
+		return NULL;
+	if(s->dirtyCount > 0)
+		skeleton_update(s);
+	return s->joints[joint].world;
+}
+
+/** Transforms an array of points from a joint's local coordinate
+ * system into world coordinates using the batch matrix-vector kernel
+ * in vecmat. Useful for transforming many points attached to one
+ * joint at once (skin vertices, end-effector sample points, etc.).
+ *
+ * @param s The skeleton containing the joint.
+ * @param joint The index of the joint the points are attached to.
+ * @param result Location to store 'count' transformed 4-component points.
+ * @param points An array of 'count' 4-component points (w should be 1
+ * for positions). May be the same array as 'result'.
+ * @param count The number of points to transform.
+ */
+void skeleton_transform_points(skeleton *s, int joint, float *result,
+                               const float *points, int count)
+{
+	const float *world = skeleton_world(s, joint);
+	if(world == NULL || result == NULL || points == NULL || count < 1)
+		return;
+	mat4f_mult_vec4f_array_new(result, world, points, count);
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ *
+ * A forward-kinematics evaluation cache for a hierarchy of joints
+ * (for example, the arm in the inverse-kinematics sample). Each joint
+ * stores a transformation relative to its parent joint and a cached
+ * local-to-world matrix. Changing one joint's local transformation
+ * only marks that joint dirty; skeleton_update() then recomputes the
+ * world matrices of the changed joint and its descendants while
+ * reusing the cached matrices of everything else. This makes
+ * iterative solvers cheap: an IK iteration that perturbs one joint
+ * near the end of a long chain only redoes the tail of the chain
+ * instead of multiplying every matrix from the root down.
+ */
+#ifndef __SKELETON_H__
+#define __SKELETON_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** One joint in a skeleton. Fields are managed by the skeleton_*()
+ * functions; callers should treat them as read-only. */
+typedef struct
+{
+	float local[16]; /**< Transformation relative to the parent joint. */
+	float world[16]; /**< Cached local-to-world transformation. Only
+	                  * valid after skeleton_update(); use
+	                  * skeleton_world() to read it safely. */
+	int parent;  /**< Index of the parent joint; -1 for a root joint. */
+	int dirty;   /**< Has 'local' changed since 'world' was computed? */
+	int updated; /**< Was 'world' recomputed by the most recent
+	              * skeleton_update()? Children check this to know
+	              * their own cached matrix is stale. */
+} skeleton_joint;
+
+/** A set of joints forming one or more chains. Joints are stored so
+ * that a parent always appears before its children, which lets
+ * skeleton_update() refresh every stale matrix in a single pass. */
+typedef struct
+{
+	skeleton_joint *joints; /**< Array of joints, parents before children. */
+	int count;      /**< Number of joints added so far. */
+	int capacity;   /**< Number of joints allocated. */
+	int dirtyCount; /**< Number of joints whose 'local' changed since
+	                 * the last skeleton_update(). */
+	long evals;     /**< Statistics: total world matrices computed. */
+	long updates;   /**< Statistics: total skeleton_update() passes. */
+} skeleton;
+
+void skeleton_init(skeleton *s, int capacity);
+void skeleton_free(skeleton *s);
+int  skeleton_add_joint(skeleton *s, int parent, const float local[16]);
+void skeleton_set_local(skeleton *s, int joint, const float local[16]);
+void skeleton_update(skeleton *s);
+const float* skeleton_world(skeleton *s, int joint);
+void skeleton_transform_points(skeleton *s, int joint, float *result,
+                               const float *points, int count);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __SKELETON_H__
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #ifdef __cplusplus
 #include <cstdlib>
@@ -251,3 +252,338 @@ int tdl_validate(int fd)
 }
 
 
+
+/*
+ * ------ TDL version 2 ------
+ *
+ * See tdl-util.h for a description of the format. The layout of the
+ * fixed 64-byte header is:
+ *
+ * bytes  0-8   magic: 219 'T' 'D' '2' \r \n \032 \n NULL
+ * bytes  9-41  object name, NULL padded to 33 bytes
+ * bytes 42-49  record count (written by tdl2_finalize())
+ * bytes 50-57  byte offset of the index block (written by tdl2_finalize())
+ * bytes 58-63  reserved, zero
+ *
+ * Records follow the header; since the header is 64 bytes and each
+ * record is 56, every record's timestamp lands on an 8-byte boundary
+ * in the mapping. The index block lives after the last record: a
+ * record count for the index itself followed by the timestamp of
+ * every TDL2_INDEX_STRIDEth record.
+ */
+
+#define TDL2_HEADER_BYTES 64
+#define TDL2_INDEX_STRIDE 256
+
+/*
+ * Creates a new empty version 2 tdl file. See tdl-util.h.
+ */
+int tdl2_create(const char* path, const char* name)
+{
+	int pathLen = strlen(path);
+	int nameLen = strlen(name);
+	nameLen = nameLen > 32 ? 32 : nameLen;
+
+	char buff[1024];
+	//Check the last 5 chars in the path to see if they are .tdl2.
+	if(pathLen < 5 || strncmp(path + pathLen - 5, ".tdl2", 5) != 0)
+	{
+		buff[0] = '\0';
+		strncat(buff, path, pathLen);
+		strncat(buff, ".tdl2", 5);
+		path = buff;
+		pathLen += 5;
+	}
+
+	int fd = -1;
+	if((fd = open(path, O_CREAT | O_EXCL | O_RDWR , S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) < 0)
+	{
+		perror("File creation failed");
+		return fd;
+	}
+
+	unsigned char header[TDL2_HEADER_BYTES];
+	memset(header, 0, TDL2_HEADER_BYTES);
+	header[0] = 219;//INV ascii char for identifier
+	header[1] = 84;//T
+	header[2] = 68;//D
+	header[3] = 50;//2
+	header[4] = 13;//\r
+	header[5] = 10;//\n
+	header[6] = 26;//\032
+	header[7] = 10;//\n
+	header[8] = 0;//NULL term
+	memcpy(header+9, name, nameLen);
+	//Record count and index offset stay zero until tdl2_finalize().
+
+	if(write(fd, header, TDL2_HEADER_BYTES) < TDL2_HEADER_BYTES)
+	{
+		perror("Writing header failed");
+		return fd;
+	}
+
+	return fd;
+}
+
+/*
+ * Appends one record to a version 2 file. See tdl-util.h.
+ */
+void tdl2_write(int fd, double time, float pos[3], float orient[9])
+{
+	tdl2_record rec;
+	rec.time = time;
+	memcpy(rec.pos, pos, sizeof(rec.pos));
+	memcpy(rec.orient, orient, sizeof(rec.orient));
+	if(write(fd, &rec, sizeof(rec)) < (ssize_t)sizeof(rec))
+	{
+		perror("Writing record failed");
+	}
+}
+
+/*
+ * Writes the record count and the timestamp index block. See tdl-util.h.
+ */
+int tdl2_finalize(int fd)
+{
+	off_t end = lseek(fd, 0, SEEK_END);
+	if(end < TDL2_HEADER_BYTES || (end - TDL2_HEADER_BYTES) % (off_t)sizeof(tdl2_record) != 0)
+	{
+		fprintf(stderr, "tdl2_finalize: file has a partial record or a missing header\n");
+		return -1;
+	}
+	uint64_t recordCount = (end - TDL2_HEADER_BYTES) / sizeof(tdl2_record);
+	uint64_t indexOffset = end;
+
+	//Append the index block: its entry count, then every
+	//TDL2_INDEX_STRIDEth record's timestamp.
+	uint64_t indexCount = (recordCount + TDL2_INDEX_STRIDE - 1) / TDL2_INDEX_STRIDE;
+	if(write(fd, &indexCount, sizeof(indexCount)) < (ssize_t)sizeof(indexCount))
+	{
+		perror("Writing index failed");
+		return -1;
+	}
+	for(uint64_t i=0; i<indexCount; i++)
+	{
+		double time;
+		off_t recOffset = TDL2_HEADER_BYTES + (off_t)(i*TDL2_INDEX_STRIDE)*(off_t)sizeof(tdl2_record);
+		if(pread(fd, &time, sizeof(time), recOffset) < (ssize_t)sizeof(time) ||
+		   write(fd, &time, sizeof(time)) < (ssize_t)sizeof(time))
+		{
+			perror("Writing index failed");
+			return -1;
+		}
+	}
+
+	//Fill in the record count and index offset in the header.
+	if(pwrite(fd, &recordCount, sizeof(recordCount), 42) < (ssize_t)sizeof(recordCount) ||
+	   pwrite(fd, &indexOffset, sizeof(indexOffset), 50) < (ssize_t)sizeof(indexOffset))
+	{
+		perror("Writing header failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens and memory-maps a version 2 tdl file. See tdl-util.h.
+ */
+tdl2_log* tdl2_open(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		perror("Opening file failed");
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{
+		perror("Stating file failed");
+		close(fd);
+		return NULL;
+	}
+
+	if(st.st_size < TDL2_HEADER_BYTES)
+	{
+		fprintf(stderr, "tdl2_open: %s is too small to be a tdl2 file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//The mapping keeps its own reference to the file.
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror("Mapping file failed");
+		return NULL;
+	}
+
+	const unsigned char *header = (const unsigned char*) map;
+	if(!(header[0] == 219 && header[1] == 84 &&
+	     header[2] == 68 && header[3] == 50 &&
+	     header[4] == 13 && header[5] == 10 &&
+	     header[6] == 26 && header[7] == 10 &&
+	     header[8] == 0))
+	{
+		fprintf(stderr, "tdl2_open: %s is not a tdl2 file\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	uint64_t recordCount, indexOffset;
+	memcpy(&recordCount, header+42, sizeof(recordCount));
+	memcpy(&indexOffset, header+50, sizeof(indexOffset));
+
+	//Sanity check the header against the file size; catches files
+	//that were never tdl2_finalize()d (count and offset still zero).
+	uint64_t indexCount = (recordCount + TDL2_INDEX_STRIDE - 1) / TDL2_INDEX_STRIDE;
+	if(indexOffset != TDL2_HEADER_BYTES + recordCount*sizeof(tdl2_record) ||
+	   indexOffset + sizeof(uint64_t) + indexCount*sizeof(double) > (uint64_t)st.st_size)
+	{
+		fprintf(stderr, "tdl2_open: %s was not finalized or is truncated\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	tdl2_log *log = (tdl2_log*) malloc(sizeof(tdl2_log));
+	memset(log, 0, sizeof(tdl2_log));
+	memcpy(log->name, header+9, 32);
+	log->recordCount = recordCount;
+	log->records = (const tdl2_record*)(header + TDL2_HEADER_BYTES);
+	log->index = (const double*)(header + indexOffset + sizeof(uint64_t));
+	log->indexCount = indexCount;
+	log->cursor = 0;
+	log->map = map;
+	log->mapLen = st.st_size;
+	return log;
+}
+
+/*
+ * Returns the next tracked point in the log. See tdl-util.h.
+ */
+int tdl2_read(tdl2_log* log, double* time, float pos[3], float orient[9])
+{
+	if(log->cursor >= log->recordCount)
+	{
+		log->cursor = 0;
+		return 1;
+	}
+
+	const tdl2_record *rec = &(log->records[log->cursor]);
+	if(time != NULL)
+		*time = rec->time;
+	memcpy(pos, rec->pos, sizeof(rec->pos));
+	memcpy(orient, rec->orient, sizeof(rec->orient));
+	log->cursor++;
+	return 0;
+}
+
+/*
+ * Moves the cursor to the first record with timestamp >= time. See
+ * tdl-util.h.
+ */
+int64_t tdl2_seek_time(tdl2_log* log, double time)
+{
+	if(log->recordCount == 0)
+		return -1;
+
+	/*
+	 * Two-level binary search. The coarse index holds every
+	 * TDL2_INDEX_STRIDEth timestamp packed together, so the first
+	 * search narrows the target down to a stride-sized window while
+	 * touching only a handful of index pages---then the second search
+	 * runs inside that window of records. For a multi-hour log this
+	 * faults in a few pages instead of scanning from the start.
+	 */
+	uint64_t lo = 0, hi = log->indexCount;
+	while(lo < hi)
+	{
+		uint64_t mid = lo + (hi-lo)/2;
+		if(log->index[mid] < time)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	//lo is the first index entry >= time; the target record is in the
+	//window ending at that entry.
+	uint64_t windowStart = lo > 0 ? (lo-1)*TDL2_INDEX_STRIDE : 0;
+	uint64_t windowEnd = lo*TDL2_INDEX_STRIDE + 1;
+	if(windowEnd > log->recordCount)
+		windowEnd = log->recordCount;
+
+	lo = windowStart;
+	hi = windowEnd;
+	while(lo < hi)
+	{
+		uint64_t mid = lo + (hi-lo)/2;
+		if(log->records[mid].time < time)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if(lo >= log->recordCount) //past the end; use the last record
+		lo = log->recordCount-1;
+	log->cursor = lo;
+	return (int64_t)lo;
+}
+
+/*
+ * Unmaps and frees a log. See tdl-util.h.
+ */
+void tdl2_close(tdl2_log* log)
+{
+	munmap(log->map, log->mapLen);
+	free(log);
+}
+
+/*
+ * Converts a version 1 tdl file to version 2. See tdl-util.h.
+ */
+int tdl2_convert(const char* tdlPath, const char* tdl2Path, double interval)
+{
+	int in = open(tdlPath, O_RDONLY);
+	if(in < 0)
+	{
+		perror("Opening file failed");
+		return -1;
+	}
+
+	char *name = NULL;
+	if(tdl_prepare(in, &name) < 0)
+	{
+		fprintf(stderr, "tdl2_convert: %s is not a valid tdl file\n", tdlPath);
+		close(in);
+		return -1;
+	}
+
+	int out = tdl2_create(tdl2Path, name);
+	free(name);
+	if(out < 0)
+	{
+		close(in);
+		return -1;
+	}
+
+	//Version 1 files carry no timestamps; synthesize them at the
+	//capture interval the caller told us about.
+	int count = 0;
+	float pos[3], orient[9];
+	int readVal;
+	while((readVal = tdl_read(in, pos, orient)) == 0)
+	{
+		tdl2_write(out, count*interval, pos, orient);
+		count++;
+	}
+	close(in);
+
+	if(readVal < 0 || tdl2_finalize(out) < 0)
+	{
+		close(out);
+		return -1;
+	}
+	close(out);
+	return count;
+}
@@ -84,6 +84,126 @@ bool tdl_validate(int fd);
 int tdl_validate(int fd);
 #endif
 
+/*
+ * ------ TDL version 2 ------
+ *
+ * Version 2 is a binary indexed format built for fast replay. Every
+ * record is a fixed 56 bytes (a double timestamp in seconds followed
+ * by the position and orientation floats), the header is padded to a
+ * fixed 64 bytes, and a coarse timestamp index block is appended when
+ * the file is finalized. Readers map the whole file into memory, so
+ * sequential replay touches no read() calls at all and seeking to a
+ * timestamp is a binary search (coarse index block first, then within
+ * the narrowed window) instead of a scan from the start.
+ *
+ * Proper header: 219  84  68  50  13  10  26  10
+ * ASCII  header: INV   T   D   2  \r  \n \032 \n
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* One tracked data point in a version 2 file. */
+typedef struct
+{
+	double time;      /* seconds since the start of the capture */
+	float pos[3];     /* position */
+	float orient[9];  /* orientation (row-major 3x3 rotation matrix) */
+} tdl2_record;
+
+/* An open, memory-mapped version 2 log. Create with tdl2_open() and
+ * destroy with tdl2_close(). The fields are filled in by tdl2_open()
+ * and should be treated as read-only. */
+typedef struct
+{
+	char name[33];              /* name of the tracked object */
+	uint64_t recordCount;       /* number of records in the log */
+	const tdl2_record *records; /* the records, mapped read-only */
+	const double *index;        /* coarse index: every 256th timestamp */
+	uint64_t indexCount;        /* number of entries in the coarse index */
+	uint64_t cursor;            /* next record tdl2_read() will return */
+	void *map;                  /* the whole mapped file */
+	size_t mapLen;              /* length of the mapping */
+} tdl2_log;
+
+/*
+ * Creates a new empty version 2 tdl file. ".tdl2" will be appended to
+ * the file name if it is not specified in the path. As with
+ * tdl_create(), object names longer than 32 chars are truncated.
+ * After writing records with tdl2_write(), call tdl2_finalize() to
+ * write the record count and the index block---a file that is not
+ * finalized cannot be opened with tdl2_open().
+ *
+ * @return int - a file descriptor pointing to the newly created file,
+ *               or -1 if the file could not be created.
+ */
+int tdl2_create(const char* path, const char* name);
+
+/*
+ * Appends one record to a file created with tdl2_create().
+ *
+ * @param int fd - the file to write to
+ *		  double time - timestamp of the sample, seconds since the capture started.
+ *					    Timestamps must not decrease from record to record.
+ *		  float* pos - the position array
+ *		  float* orient - the orientation array
+ */
+void tdl2_write(int fd, double time, float pos[3], float orient[9]);
+
+/*
+ * Writes the record count and timestamp index block of a version 2
+ * file. Call once, after the last tdl2_write(). The file descriptor
+ * is still open afterward and should be close()d by the caller.
+ *
+ * @return int - 0 on success, -1 on failure.
+ */
+int tdl2_finalize(int fd);
+
+/*
+ * Opens and memory-maps a version 2 tdl file for reading.
+ *
+ * @return tdl2_log* - the opened log (free with tdl2_close()), or
+ *                     NULL if the file could not be opened or is not
+ *                     a finalized version 2 file.
+ */
+tdl2_log* tdl2_open(const char* path);
+
+/*
+ * Returns the next tracked point in the log. Mirrors tdl_read(): when
+ * the end of the log is reached, the cursor is moved back to the
+ * first record.
+ *
+ * @return int - 0 if the operation was normal.
+ *				 1 if the end of the log was reached and the cursor was reset.
+ */
+int tdl2_read(tdl2_log* log, double* time, float pos[3], float orient[9]);
+
+/*
+ * Moves the cursor to the first record whose timestamp is >= the
+ * given time, using the index block so the cost is O(log n) rather
+ * than a scan from the start of the file. A time past the end of the
+ * log positions the cursor on the last record.
+ *
+ * @return int64_t - the index of the record the cursor was moved to,
+ *                   or -1 if the log is empty.
+ */
+int64_t tdl2_seek_time(tdl2_log* log, double time);
+
+/*
+ * Unmaps and frees a log opened with tdl2_open().
+ */
+void tdl2_close(tdl2_log* log);
+
+/*
+ * Converts a version 1 tdl file to the version 2 format. Version 1
+ * files carry no timestamps, so they are synthesized: record i is
+ * stamped i*interval seconds (pass the interval the data was captured
+ * at, e.g. 1.0/72.0 for a 72Hz tracker).
+ *
+ * @return int - the number of records converted, or -1 on failure.
+ */
+int tdl2_convert(const char* tdlPath, const char* tdl2Path, double interval);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
@@ -297,6 +297,59 @@ extern inline void mat3f_from_mat4f(float  dest[ 9], const float  src[16]);
 extern inline void mat3d_from_mat4d(double dest[ 9], const double src[16]);
 
 
+/** Multiply an array of 4-component vectors by a single 4x4
+    matrix. This is much faster than calling mat4f_mult_vec4f_new()
+    once per vector when transforming many points (bounding boxes,
+    culling, particle systems, etc.) because the matrix only needs to
+    be loaded once.
+
+    @param result The location to store the transformed vectors. May
+    be the same location as v.
+    @param m The 4x4 matrix to multiply each vector against.
+    @param v An array of 'count' 4-component vectors (i.e., count*4 floats).
+    @param count The number of vectors to transform.
+ */
+void mat4f_mult_vec4f_array_new(float *result, const float m[16], const float *v, const unsigned int count)
+{
+	unsigned int i = 0;
+#ifdef __AVX__
+	/* Process two vectors per iteration. Each 128-bit lane of the
+	 * 256-bit registers holds one vector; the matrix columns are
+	 * duplicated into both lanes. */
+	__m256 col0 = _mm256_broadcast_ps((const __m128*)(m+0));
+	__m256 col1 = _mm256_broadcast_ps((const __m128*)(m+4));
+	__m256 col2 = _mm256_broadcast_ps((const __m128*)(m+8));
+	__m256 col3 = _mm256_broadcast_ps((const __m128*)(m+12));
+	for(; i+2 <= count; i+=2)
+	{
+		__m256 vv = _mm256_loadu_ps(v+i*4);
+		__m256 out = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(col0, _mm256_permute_ps(vv, 0x00)),
+			              _mm256_mul_ps(col1, _mm256_permute_ps(vv, 0x55))),
+			_mm256_add_ps(_mm256_mul_ps(col2, _mm256_permute_ps(vv, 0xAA)),
+			              _mm256_mul_ps(col3, _mm256_permute_ps(vv, 0xFF))));
+		_mm256_storeu_ps(result+i*4, out);
+	}
+#endif
+	/* Remaining vectors (or all of them if AVX is unavailable); the
+	 * SSE specialization of mat4f_mult_vec4f_new() is used when it is
+	 * available. */
+	for(; i < count; i++)
+		mat4f_mult_vec4f_new(result+i*4, m, v+i*4);
+}
+
+/** Multiply an array of 4-component vectors by a single 4x4 matrix in
+    place.
+
+    @param vectors An array of 'count' 4-component vectors to be transformed.
+    @param m The 4x4 matrix to multiply each vector against.
+    @param count The number of vectors to transform.
+ */
+void mat4f_mult_vec4f_array(float *vectors, const float m[16], const unsigned int count)
+{
+	mat4f_mult_vec4f_array_new(vectors, m, vectors, count);
+}
+
 /** Multiply an arbitrary list of matrices together. The last matrix must be NULL.
 
     @param out The product of all of the other matrices.
@@ -1580,7 +1633,84 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 	vec4d_normalize(result);
 }
 
-	
+/** Linearly interpolates an array of 3-component vectors in one
+ sweep. The loop is written so the compiler can vectorize it; calling
+ this once for a whole set of vectors is considerably faster than
+ interpolating them one at a time.
+
+ @param result An array of 'count' interpolated vectors (3*count floats).
+ @param start An array of 'count' starting vectors.
+ @param end An array of 'count' ending vectors.
+ @param t An array of 'count' interpolation parameters; as t[i] goes
+ from 0 to 1, result i goes from start i to end i.
+ @param count The number of vectors to interpolate.
+*/
+void vec3f_lerp_array(float * restrict result, const float * restrict start, const float * restrict end, const float * restrict t, int count)
+{
+	for(int i=0; i<count; i++)
+	{
+		float factor = t[i];
+		result[i*3+0] = start[i*3+0] + (end[i*3+0] - start[i*3+0]) * factor;
+		result[i*3+1] = start[i*3+1] + (end[i*3+1] - start[i*3+1]) * factor;
+		result[i*3+2] = start[i*3+2] + (end[i*3+2] - start[i*3+2]) * factor;
+	}
+}
+
+/** Spherical linear interpolation of an array of unit quaternions in
+ one sweep. Follows the same shorter-path convention as
+ quatf_slerp_new(); use this instead when many quaternions (e.g. every
+ channel of a skeleton) need to be interpolated at once so the work
+ happens in one tight loop over contiguous memory.
+
+ @param result An array of 'count' interpolated quaternions (4*count floats).
+ @param start An array of 'count' starting quaternions.
+ @param end An array of 'count' ending quaternions.
+ @param t An array of 'count' interpolation parameters; as t[i] goes
+ from 0 to 1, result i goes from start i to end i.
+ @param count The number of quaternions to interpolate.
+*/
+void quatf_slerp_array(float * restrict result, const float * restrict start, const float * restrict end, const float * restrict t, int count)
+{
+	for(int i=0; i<count; i++)
+	{
+		const float *qStart = start  + i*4;
+		const float *qEnd   = end    + i*4;
+		float       *qMid   = result + i*4;
+
+		float cosOmega = qStart[0]*qEnd[0] + qStart[1]*qEnd[1] +
+		                 qStart[2]*qEnd[2] + qStart[3]*qEnd[3];
+		/* Negating one endpoint selects the shorter of the two arcs. */
+		float startSign = 1.0f;
+		if(cosOmega < 0)
+		{
+			startSign = -1.0f;
+			cosOmega = -cosOmega;
+		}
+
+		float startScale, endScale;
+		if(1.0f-cosOmega > 1e-10f)
+		{
+			float omega = acosf(cosOmega);
+			float sinOmega = sinf(omega);
+			startScale = sinf((1.0f-t[i])*omega) / sinOmega;
+			endScale   = sinf(t[i]*omega) / sinOmega;
+		}
+		else
+		{
+			/* The quaternions are nearly identical; lerp. */
+			startScale = 1.0f - t[i];
+			endScale   = t[i];
+		}
+		startScale *= startSign;
+
+		qMid[0] = qStart[0]*startScale + qEnd[0]*endScale;
+		qMid[1] = qStart[1]*startScale + qEnd[1]*endScale;
+		qMid[2] = qStart[2]*startScale + qEnd[2]*endScale;
+		qMid[3] = qStart[3]*startScale + qEnd[3]*endScale;
+	}
+}
+
+
 
 
 /** Creates a new 4x4 float translation matrix with the rest of the matrix set to the identity.
@@ -32,6 +32,14 @@ extern "C" {
 #include <math.h>
 #include <string.h> /* needed for memcpy() */
 
+/* SSE/AVX intrinsics are used for the 4x4 float matrix math when the
+ * compiler is told the target CPU supports them (e.g., via
+ * -march=native or -msse). immintrin.h provides both the SSE and AVX
+ * intrinsics. */
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
 #include "list.h"
 #include "msg.h"
 	
@@ -1166,7 +1174,30 @@ static inline void mat3f_mult_mat3f_new(float  result[9], const float  matA[ 9],
 static inline void mat3d_mult_mat3d_new(double result[9], const double matA[ 9], const double matB[9])
 { matNd_mult_matNd_new(result, matA, matB, 3); }
 static inline void mat4f_mult_mat4f_new(float  result[16], const float  matA[16], const float  matB[16])
-{ matNf_mult_matNf_new(result, matA, matB, 4); }
+{
+#ifdef __SSE__
+	/* Matrices are stored column-major so each column of matB is
+	   contiguous in memory. Column j of the result is matA multiplied
+	   by column j of matB. Compute all of the columns before storing
+	   anything so callers can do: matrixA = matrixA * matrixB */
+	__m128 colA0 = _mm_loadu_ps(matA+0);
+	__m128 colA1 = _mm_loadu_ps(matA+4);
+	__m128 colA2 = _mm_loadu_ps(matA+8);
+	__m128 colA3 = _mm_loadu_ps(matA+12);
+	__m128 out[4];
+	for(int j=0; j<4; j++)
+	{
+		out[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(colA0, _mm_set1_ps(matB[j*4+0])),
+		                               _mm_mul_ps(colA1, _mm_set1_ps(matB[j*4+1]))),
+		                    _mm_add_ps(_mm_mul_ps(colA2, _mm_set1_ps(matB[j*4+2])),
+		                               _mm_mul_ps(colA3, _mm_set1_ps(matB[j*4+3]))));
+	}
+	for(int j=0; j<4; j++)
+		_mm_storeu_ps(result+j*4, out[j]);
+#else
+	matNf_mult_matNf_new(result, matA, matB, 4);
+#endif
+}
 static inline void mat4d_mult_mat4d_new(double result[16], const double matA[16], const double matB[16])
 { matNd_mult_matNd_new(result, matA, matB, 4); }
 
@@ -1220,7 +1251,20 @@ static inline void mat3f_mult_vec3f_new(float result[3], const float m[9], const
 static inline void mat3d_mult_vec3d_new(double result[3], const double m[9], const double v[3])
 { matNd_mult_vecNd_new(result, m, v, 3); }
 static inline void mat4f_mult_vec4f_new(float result[4], const float m[16], const float v[4])
-{ matNf_mult_vecNf_new(result, m, v, 4); }
+{
+#ifdef __SSE__
+	/* The matrix is stored column-major: the result is the sum of the
+	   matrix columns weighted by the vector components. Computed into
+	   a register first so result may point at the same memory as v. */
+	__m128 out = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m+0),  _mm_set1_ps(v[0])),
+	                                   _mm_mul_ps(_mm_loadu_ps(m+4),  _mm_set1_ps(v[1]))),
+	                        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m+8),  _mm_set1_ps(v[2])),
+	                                   _mm_mul_ps(_mm_loadu_ps(m+12), _mm_set1_ps(v[3]))));
+	_mm_storeu_ps(result, out);
+#else
+	matNf_mult_vecNf_new(result, m, v, 4);
+#endif
+}
 static inline void mat4d_mult_vec4d_new(double result[4], const double m[16], const double v[4])
 { matNd_mult_vecNd_new(result, m, v, 4); }
 
@@ -1638,6 +1682,8 @@ static inline void mat3d_scaleVec_new(double result[9], const double xyz[3])
 
 
 /* Multiply two or more matrices together. */
+void mat4f_mult_vec4f_array_new(float *result, const float m[16], const float *v, const unsigned int count);
+void mat4f_mult_vec4f_array(float *vectors, const float m[16], const unsigned int count);
 void mat4f_mult_mat4f_many(float  out[16], const float  *in, ...);
 void mat4d_mult_mat4d_many(double out[16], const double *in, ...);
 void mat3f_mult_mat3f_many(float  out[9],  const float  *in, ...);
@@ -1719,6 +1765,12 @@ void quatd_rotateAxisVec_new(double quat[4], double degrees, const double axis[3
 void quatf_slerp_new(float  result[4], const float  start[4], const float  end[4], float  t);
 void quatd_slerp_new(double result[4], const double start[4], const double end[4], double t);
 
+/* Batch interpolation: interpolate arrays of quaternions or vec3s in
+   one vectorizable sweep, with a separate interpolation parameter per
+   element. */
+void quatf_slerp_array(float *result, const float *start, const float *end, const float *t, int count);
+void vec3f_lerp_array(float *result, const float *start, const float *end, const float *t, int count);
+
 /* Create a new translation matrix (rotation part set to
    identity). Any data in the 'result' matrix that you pass to these
    functions will be ignored and lost. */
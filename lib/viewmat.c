@@ -61,6 +61,7 @@ typedef enum
 	VIEWMAT_HMD,        /* Side-by-side view */
 	VIEWMAT_OCULUS,     /* HMDs supported by libovr (Oculus DK1, DK2, etc). */
 	VIEWMAT_ANAGLYPH,   /* Red-Cyan anaglyph images */
+	VIEWMAT_WALL,       /* Multiple windows on one host, one viewport each */
 } ViewmatDisplayMode;
 
 /** The control mode specifies how the viewpoint position/orientation is determined. */
@@ -70,18 +71,41 @@ typedef enum
 	VIEWMAT_CONTROL_MOUSE,
 	VIEWMAT_CONTROL_VRPN,
 	VIEWMAT_CONTROL_ORIENT,
-	VIEWMAT_CONTROL_OCULUS
+	VIEWMAT_CONTROL_OCULUS,
+	VIEWMAT_CONTROL_BENCH  /* Deterministic scripted camera path for benchmarking */
 } ViewmatControlMode;
 
 
 #define MAX_VIEWPORTS 32 /**< Hard-coded maximum number of viewports supported. */
 static float viewports[MAX_VIEWPORTS][4]; /**< Contains one or more viewports. The values are the x coordinate, y coordinate, viewport width, and viewport height */
 static int viewports_size = 0; /**< Number of viewports in viewports array */
+
+#define VIEWMAT_MAX_WINDOWS 8 /**< Hard-coded maximum number of windows supported in wall mode. */
+/** GLUT window identifiers used by wall mode. Entry 0 is the window
+ * the program created itself; viewmat_init_wall() creates the
+ * rest. In every other display mode only entry 0 is meaningful. */
+static int viewmat_windows[VIEWMAT_MAX_WINDOWS];
+static int viewmat_windows_size = 1; /**< Number of windows in viewmat_windows array */
 static ViewmatDisplayMode viewmat_display_mode = 0;
 static ViewmatControlMode viewmat_control_mode = 0;
 static const char *viewmat_vrpn_obj = NULL; /**< Name of the VRPN object that we are tracking */
 static OrientSensorState viewmat_orientsense;
 
+/** Local-clock time (from kuhl_microseconds()) at which the tracker
+ * pose used for the current frame arrived, or -1 if we aren't using a
+ * tracker. Used to report pose-to-swap latency. */
+static long viewmat_pose_time = -1;
+
+/** The camera the scripted "bench" control mode orbits around:
+ * the position, look point, and up vector given to viewmat_init(). */
+static float viewmat_bench_pos[3], viewmat_bench_look[3], viewmat_bench_up[3];
+/** Which frame of the scripted camera path we are on. Frame-indexed
+ * (not wall-clock) so that every run renders exactly the same
+ * views. */
+static long viewmat_bench_frame = 0;
+
+static void viewmat_refresh_viewports(void);
+
 
 
 
@@ -150,6 +174,9 @@ static void viewmat_validate_viewportId(int viewportID)
 /** Should be called prior to rendering a frame. */
 void viewmat_begin_frame(void)
 {
+	/* Discard the previous frame's temporary allocations. */
+	kuhl_frame_reset();
+
 #ifndef MISSING_OVR
 	if(viewmat_display_mode == VIEWMAT_OCULUS)
 	{
@@ -159,14 +186,60 @@ void viewmat_begin_frame(void)
 #endif
 }
 
+/** Measures motion-to-photon latency. Called right after the buffer
+ * swap, it re-queries the tracker mailbox for the newest pose and
+ * compares it against the pose the frame was actually rendered
+ * with. Two numbers are reported once per second:
+ *
+ * pose-to-swap latency: how old the rendered pose was when the buffers
+ * were swapped. This is the portion of motion-to-photon latency that
+ * our rendering pipeline is responsible for (the display adds more).
+ *
+ * late-latch margin: how much fresher the newest pose in the mailbox
+ * was than the rendered pose at swap time. This is the latency that a
+ * late-latching reprojection step could remove. */
+static void viewmat_latency_report(void)
+{
+	if(viewmat_control_mode != VIEWMAT_CONTROL_VRPN || viewmat_pose_time < 0)
+		return;
+
+	long now = kuhl_microseconds();
+	long newest = vrpn_newest_pose_time(viewmat_vrpn_obj, NULL);
+
+	static double ageSum = 0, marginSum = 0;
+	static int count = 0;
+	static long lastReport = -1;
+	ageSum += (now - viewmat_pose_time) / 1000.0;
+	if(newest > viewmat_pose_time)
+		marginSum += (newest - viewmat_pose_time) / 1000.0;
+	count++;
+
+	if(lastReport < 0)
+		lastReport = kuhl_milliseconds();
+	if(kuhl_milliseconds() - lastReport >= 1000)
+	{
+		msg(INFO, "viewmat: pose-to-swap latency %.1f ms; late-latching would have provided a %.1f ms fresher pose.\n",
+		    ageSum/count, marginSum/count);
+		ageSum = 0;
+		marginSum = 0;
+		count = 0;
+		lastReport = kuhl_milliseconds();
+	}
+}
+
 /** Should be called when we have completed rendering a frame. For
  * HMDs, this should be called after both the left and right eyes have
  * been rendered. */
 void viewmat_end_frame(void)
 {
+	/* Close the GPU timing zone that viewmat_begin_eye() opened for
+	 * the final eye. */
+	kuhl_gpu_zone_end();
+
 	if(viewmat_display_mode == VIEWMAT_OCULUS)
 	{
 #ifndef MISSING_OVR
+		kuhl_gpu_zone_begin("viewmat blit");
 		/* Copy the prerendered image from a multisample antialiasing
 		   texture into a normal OpenGL texture. This section of code
 		   is not necessary if we are rendering directly into the
@@ -187,7 +260,8 @@ void viewmat_end_frame(void)
 			                  recommendTexSizeL.h, 0, 0, recommendTexSizeL.w,
 			                  recommendTexSizeL.h, buffersToBlit[i], GL_NEAREST);
 		kuhl_errorcheck();
-		
+		kuhl_gpu_zone_end();
+
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		if(hmd)
 			ovrHmd_EndFrame(hmd, pose, &EyeTexture[0].Texture);
@@ -201,7 +275,50 @@ void viewmat_end_frame(void)
 	/* Need to swap front and back buffers here unless we are using
 	 * Oculus. (Oculus draws to the screen directly). */
 	if(viewmat_display_mode != VIEWMAT_OCULUS)
+	{
+		/* Wall mode finishes the frame with the last window current;
+		 * make the primary window current again so the frame marker
+		 * and swap timing below always refer to the same window. */
+		if(viewmat_display_mode == VIEWMAT_WALL)
+			glutSetWindow(viewmat_windows[0]);
+
+		/* Draw the frame-ID marker and start the swap timestamp pair
+		 * before the swap barrier so marker drawing is finished by the
+		 * time this node reports itself ready to swap. Does nothing
+		 * unless swap instrumentation is enabled (KUHL_SWAPSTATS). */
+		kuhl_swapstats_pre_swap();
+
+		/* If the DGR swap-lock is enabled, wait here until every node
+		 * in the cluster has finished rendering so adjacent displays
+		 * swap in unison. Does nothing when DGR is off. */
+		dgr_swap_barrier();
+
+		/* Swap any extra wall-mode windows, then the primary
+		 * window. (The loop does nothing in other display modes.) */
+		for(int i=1; i<viewmat_windows_size; i++)
+		{
+			glutSetWindow(viewmat_windows[i]);
+			glutSwapBuffers();
+		}
+		if(viewmat_windows_size > 1)
+			glutSetWindow(viewmat_windows[0]);
 		glutSwapBuffers();
+
+		/* Record when the swap returned; once per second this prints
+		 * swap-to-swap jitter, missed vsyncs, and GPU swap time. */
+		kuhl_swapstats_post_swap();
+	}
+
+	/* Now that the buffers are swapped, measure how stale the pose we
+	 * rendered this frame with has become. */
+	viewmat_latency_report();
+
+	/* Print the per-zone GPU times once per second. */
+	kuhl_gpu_zone_report();
+
+	/* Record this frame's timings if the KUHL_BENCHMARK environment
+	 * variable asked for them. */
+	kuhl_bench_frame();
 }
 
 
@@ -254,7 +371,38 @@ int viewmat_get_blitted_framebuffer(int viewportID)
 void viewmat_begin_eye(int viewportID)
 {
 	viewmat_validate_viewportId(viewportID);
-	
+
+	/* Time each eye's rendering on the GPU in its own zone. End the
+	 * previous eye's zone first (a no-op for the first eye). */
+	kuhl_gpu_zone_end();
+	char zoneName[16];
+	snprintf(zoneName, 16, "eye %d", viewportID);
+	kuhl_gpu_zone_begin(zoneName);
+
+	if(viewmat_single_pass())
+	{
+		/* Set up one indexed viewport per eye. The program's vertex
+		 * shader routes each instance to an eye by writing
+		 * gl_ViewportIndex. Note that a plain glViewport() call sets
+		 * every indexed viewport to the same rectangle, so
+		 * single-pass programs must not call it after this point. */
+		viewmat_refresh_viewports();
+		for(int i=0; i<2; i++)
+			glViewportIndexedf(i, viewports[i][0], viewports[i][1],
+			                   viewports[i][2], viewports[i][3]);
+		return;
+	}
+
+	if(viewmat_display_mode == VIEWMAT_WALL)
+	{
+		/* Direct this viewport's rendering at its own window. All of
+		 * the windows share one OpenGL context (see
+		 * viewmat_init_wall()), so bound programs, buffers and
+		 * textures remain valid across the switch---only the
+		 * drawable changes. */
+		glutSetWindow(viewmat_windows[viewportID]);
+	}
+
 #ifndef MISSING_OVR
 	if(viewmat_display_mode == VIEWMAT_OCULUS)
 	{
@@ -388,6 +536,24 @@ static void viewmat_oculus_viewports(void)
 #endif
 }
 
+/** Sets up one full-window viewport per wall-mode window. This can be
+ * called every frame since resizing a window will change the size of
+ * its viewport! */
+static void viewmat_wall_viewports(void)
+{
+	int windowWidth, windowHeight;
+	viewmat_window_size(&windowWidth, &windowHeight);
+
+	viewports_size = viewmat_windows_size;
+	for(int i=0; i<viewports_size; i++)
+	{
+		viewports[i][0] = 0;
+		viewports[i][1] = 0;
+		viewports[i][2] = windowWidth;
+		viewports[i][3] = windowHeight;
+	}
+}
+
 
 /** This method should be called regularly to ensure that we adjust
  * our viewports after a window is resized. */
@@ -408,6 +574,9 @@ static void viewmat_refresh_viewports(void)
 		case VIEWMAT_ANAGLYPH:
 			viewmat_anaglyph_viewports();
 			break;
+		case VIEWMAT_WALL:
+			viewmat_wall_viewports();
+			break;
 		default:
 			msg(ERROR, "Unknown viewmat mode: %d\n", viewmat_display_mode);
 			exit(EXIT_FAILURE);
@@ -474,6 +643,85 @@ static void viewmat_init_mouse(float pos[3], float look[3], float up[3])
 
 
 
+/** GLUT requires every window to have a display callback. The extra
+ * wall-mode windows are redrawn from the primary window's display
+ * callback (viewmat_begin_eye() redirects rendering into them), so
+ * their own callback has nothing to do. */
+static void viewmat_wall_display(void)
+{
+}
+
+/** Creates the additional windows used by wall mode. The number of
+ * windows comes from the VIEWMAT_WINDOWS environment variable
+ * (default: 2). Wall mode drives several displays attached to a
+ * single host---for example, two projectors connected to a machine
+ * with two GPUs---from one process: one copy of the models in memory,
+ * one startup cost, and no DGR communication. Each window renders a
+ * horizontal slice of the overall view frustum, so windows arranged
+ * left to right form one continuous image.
+ *
+ * The extra windows reuse the OpenGL context of the window the
+ * program created, so geometry and textures uploaded once can be
+ * drawn in every window. Sharing the context requires freeglut; with
+ * other GLUT implementations each window would get its own context
+ * and the program's OpenGL objects would only exist in the first one,
+ * so we fall back to a single window. */
+static void viewmat_init_wall(void)
+{
+	viewmat_windows[0] = glutGetWindow();
+	viewmat_windows_size = 1;
+
+	int count = 2;
+	const char* countString = getenv("VIEWMAT_WINDOWS");
+	if(countString != NULL)
+		count = atoi(countString);
+	if(count < 1)
+		count = 1;
+	if(count > VIEWMAT_MAX_WINDOWS)
+	{
+		msg(WARNING, "viewmat: VIEWMAT_WINDOWS=%d exceeds the maximum of %d windows.\n",
+		    count, VIEWMAT_MAX_WINDOWS);
+		count = VIEWMAT_MAX_WINDOWS;
+	}
+
+#ifndef FREEGLUT
+	if(count > 1)
+	{
+		msg(ERROR, "viewmat: Wall mode needs freeglut to share one OpenGL context among windows; using a single window instead.\n");
+		count = 1;
+	}
+#else
+	/* Ask freeglut to attach new windows to the current OpenGL
+	 * context instead of creating a fresh context for each one. */
+	glutSetOption(GLUT_RENDERING_CONTEXT, GLUT_USE_CURRENT_CONTEXT);
+
+	int windowWidth, windowHeight;
+	viewmat_window_size(&windowWidth, &windowHeight);
+
+	for(int i=1; i<count; i++)
+	{
+		char title[32];
+		snprintf(title, 32, "viewmat window %d", i);
+		/* Place the windows side by side. A window manager
+		 * configured for a projector wall will typically move each
+		 * window to the correct output regardless. */
+		glutInitWindowPosition(i*windowWidth, 0);
+		glutInitWindowSize(windowWidth, windowHeight);
+		viewmat_windows[i] = glutCreateWindow(title);
+		glutDisplayFunc(viewmat_wall_display);
+		viewmat_windows_size++;
+	}
+
+	/* Restore the default for any windows created later and make the
+	 * primary window current again. */
+	glutSetOption(GLUT_RENDERING_CONTEXT, GLUT_CREATE_NEW_CONTEXT);
+	glutSetWindow(viewmat_windows[0]);
+#endif
+	msg(INFO, "viewmat display mode: Wall mode with %d window(s).\n",
+	    viewmat_windows_size);
+}
+
+
 /** Initialize the Oculus HMD.
  *
  * @param pos The position that we want the Oculus HMD to start at.
@@ -694,6 +942,14 @@ void viewmat_init(float pos[3], float look[3], float up[3])
 		msg(INFO, "viewmat control mode: Oculus");
 		viewmat_control_mode = VIEWMAT_CONTROL_OCULUS;
 	}
+	else if(strcasecmp(controlModeString, "bench") == 0)
+	{
+		msg(INFO, "viewmat control mode: Scripted benchmark camera");
+		viewmat_control_mode = VIEWMAT_CONTROL_BENCH;
+		vec3f_copy(viewmat_bench_pos, pos);
+		vec3f_copy(viewmat_bench_look, look);
+		vec3f_copy(viewmat_bench_up, up);
+	}
 	else
 	{
 		msg(FATAL, "viewmat control mode: unhandled mode '%s'.", controlModeString);
@@ -726,6 +982,11 @@ void viewmat_init(float pos[3], float look[3], float up[3])
 		viewmat_display_mode = VIEWMAT_DESKTOP;
 		msg(INFO, "viewmat display mode: Single window desktop mode.\n");
 	}
+	else if(strcasecmp(modeString, "wall") == 0)
+	{
+		viewmat_display_mode = VIEWMAT_WALL;
+		viewmat_init_wall(); // prints a "wall mode" message for us
+	}
 	else if(strcasecmp(modeString, "anaglyph") == 0)
 	{
 		viewmat_display_mode = VIEWMAT_ANAGLYPH;
@@ -754,7 +1015,8 @@ void viewmat_init(float pos[3], float look[3], float up[3])
 	// If there are two "viewports" then it is likely that we are
 	// doing stereoscopic rendering. Displaying the mouse cursor can
 	// interfere with stereo images, so we disable the cursor here.
-	if(viewports_size == 2)
+	// (Wall-mode viewports are separate windows, not stereo pairs.)
+	if(viewports_size == 2 && viewmat_display_mode != VIEWMAT_WALL)
 		glutSetCursor(GLUT_CURSOR_NONE);
 }
 
@@ -808,6 +1070,11 @@ static void viewmat_fix_rotation(float orient[16])
  * always need to be the case. */
 static viewmat_eye viewport_to_eye(int viewportNum)
 {
+	/* Wall-mode windows all show the same (middle) eye; they differ
+	 * only in which slice of the frustum they render. */
+	if(viewmat_display_mode == VIEWMAT_WALL)
+		return VIEWMAT_EYE_MIDDLE;
+
 	if(viewmat_display_mode == VIEWMAT_OCULUS)
 	{
 #ifndef MISSING_OVR
@@ -871,6 +1138,55 @@ static void viewmat_get_mouse(float viewmatrix[16], int viewportNum)
 }
 
 
+/** Get the view matrix for the scripted benchmark camera: a
+ * deterministic orbit around the look point given to viewmat_init(),
+ * with a slow vertical bob so that both the camera position and
+ * direction change every frame. The path is a function of the frame
+ * index, not the clock, so two runs of the same program render
+ * exactly the same sequence of views regardless of frame rate.
+ *
+ * @param viewmatrix The view matrix to be filled in.
+ *
+ * @param viewportNum Used to shift the eye position in side-by-side
+ * HMD modes, exactly as the mouse control mode does.
+ */
+static void viewmat_get_bench(float viewmatrix[16], int viewportNum)
+{
+	/* Advance the path once per frame, not once per viewport. */
+	if(viewportNum == 0)
+		viewmat_bench_frame++;
+
+	float offset[3];
+	vec3f_sub_new(offset, viewmat_bench_pos, viewmat_bench_look);
+	float radius = vec3f_norm(offset);
+	if(radius < 0.0001f)
+		radius = 1;
+
+	/* A full orbit every 1440 frames (24 seconds at 60 fps) and a
+	 * gentle bob at a little over twice that period. */
+	float angle = viewmat_bench_frame * (2*M_PI/1440.0f);
+	float bob   = sinf(viewmat_bench_frame * (2*M_PI/3000.0f));
+
+	float pos[3];
+	pos[0] = viewmat_bench_look[0] + radius * sinf(angle);
+	pos[1] = viewmat_bench_look[1] + offset[1] + radius * .2f * bob;
+	pos[2] = viewmat_bench_look[2] + radius * cosf(angle);
+	mat4f_lookatVec_new(viewmatrix, pos, viewmat_bench_look, viewmat_bench_up);
+
+	/* Update the view matrix based on which eye we are rendering */
+	float eyeDist = 0.055;
+	viewmat_eye eye = viewport_to_eye(viewportNum);
+	float eyeShift = 0;
+	if(eye == VIEWMAT_EYE_LEFT)
+		eyeShift = -eyeDist/2.0;
+	else if(eye == VIEWMAT_EYE_RIGHT)
+		eyeShift = eyeDist/2.0;
+	float shiftMatrix[16];
+	mat4f_translate_new(shiftMatrix, -eyeShift, 0, 0);
+	mat4f_mult_mat4f_new(viewmatrix, shiftMatrix, viewmatrix);
+}
+
+
 static void viewmat_get_vrpn(float viewmatrix[16], int viewportNum)
 {
 	if(viewmat_vrpn_obj == NULL)
@@ -1233,6 +1549,16 @@ viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewport
 	float f[6]; // left, right, bottom, top, near>0, far>0
 	projmat_get_frustum(f, viewport[2], viewport[3]);
 
+	/* In wall mode, each window renders one horizontal slice of the
+	 * overall frustum so that the windows form a single continuous
+	 * image across the attached displays. */
+	if(viewmat_display_mode == VIEWMAT_WALL && viewports_size > 1)
+	{
+		float sliceWidth = (f[1]-f[0]) / viewports_size;
+		f[1] = f[0] + sliceWidth*(viewportID+1);
+		f[0] = f[0] + sliceWidth*viewportID;
+	}
+
 	/* If we are running in IVS mode and using the tracking systems,
 	 * all computers need to update their frustum differently. The
 	 * master process will be controlled by VRPN, and all slaves will
@@ -1273,6 +1599,10 @@ viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewport
 				viewmat_get_vrpn(viewmatrix, viewportID);
 				mat4f_frustum_new(projmatrix, f[0], f[1], f[2], f[3], f[4], f[5]);
 				break;
+			case VIEWMAT_CONTROL_BENCH:
+				viewmat_get_bench(viewmatrix, viewportID);
+				mat4f_frustum_new(projmatrix, f[0], f[1], f[2], f[3], f[4], f[5]);
+				break;
 
 			default:
 				msg(FATAL, "Unknown viewmat control mode: %d\n", viewmat_control_mode);
@@ -1288,6 +1618,11 @@ viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewport
 	snprintf(dgrkey, 128, "!!viewmat%d", viewportID);
 	dgr_setget(dgrkey, viewmatrix, sizeof(float)*16);
 
+	/* Remember when the pose we just rendered with arrived so that
+	 * viewmat_end_frame() can report pose-to-swap latency. */
+	if(viewportID == 0 && viewmat_control_mode == VIEWMAT_CONTROL_VRPN)
+		viewmat_pose_time = vrpn_newest_pose_time(viewmat_vrpn_obj, NULL);
+
 	/* Sanity checks */
 	viewmat_validate_ipd(viewmatrix, viewportID);
 	viewmat_validate_fps(viewportID);
@@ -1318,8 +1653,90 @@ void viewmat_get_viewport(int viewportValue[4], int viewportNum)
 */
 int viewmat_num_viewports()
 {
+	if(viewmat_single_pass())
+		return 1;
 	viewmat_refresh_viewports();
 	return viewports_size;
 }
 
+/** Checks if single-pass stereo rendering is enabled. In single-pass
+ * mode, viewmat_num_viewports() returns 1 and the program submits the
+ * scene once: viewmat_begin_eye() sets up one indexed viewport per
+ * eye, the program retrieves both eyes' matrices with
+ * viewmat_get_stereo(), draws every piece of geometry with two
+ * instances (see kuhl_geometry_draw_instanced()), and the vertex
+ * shader writes gl_ViewportIndex to route each instance to an
+ * eye. This halves the CPU cost of submitting the scene, which is
+ * useful for programs which are CPU-bound instead of GPU-bound.
+ *
+ * Enable it by setting the VIEWMAT_SINGLE_PASS environment variable
+ * along with VIEWMAT_DISPLAY_MODE=hmd. It is not available in
+ * anaglyph mode (each eye needs a different glColorMask() setting) or
+ * Oculus mode (each eye renders into its own framebuffer).
+ *
+ * This function may be called before viewmat_init()---but only after
+ * the OpenGL context is created---so programs can compile an
+ * appropriate vertex shader.
+ *
+ * @return 1 if single-pass stereo rendering is enabled, 0 otherwise.
+ */
+int viewmat_single_pass(void)
+{
+	static int enabled = -1;
+	if(enabled != -1)
+		return enabled;
+	enabled = 0;
+
+	if(getenv("VIEWMAT_SINGLE_PASS") == NULL)
+		return 0;
+
+	const char* modeString = getenv("VIEWMAT_DISPLAY_MODE");
+	if(modeString == NULL || strcasecmp(modeString, "hmd") != 0)
+	{
+		msg(WARNING, "viewmat: VIEWMAT_SINGLE_PASS only works with VIEWMAT_DISPLAY_MODE=hmd; rendering each eye in its own pass instead.\n");
+		return 0;
+	}
+
+	if(!glewIsSupported("GL_ARB_viewport_array") ||
+	   !glewIsSupported("GL_ARB_shader_viewport_layer_array"))
+	{
+		msg(WARNING, "viewmat: Single-pass stereo requires the GL_ARB_viewport_array and GL_ARB_shader_viewport_layer_array extensions; rendering each eye in its own pass instead.\n");
+		return 0;
+	}
+
+	msg(INFO, "viewmat: Single-pass stereo rendering is enabled.\n");
+	enabled = 1;
+	return 1;
+}
+
+/** Fills in the view and projection matrices for both eyes at once
+ * for single-pass stereo rendering. Send the matrices to the vertex
+ * program as two-element uniform arrays.
+ *
+ * @param viewL A 4x4 view matrix for the left eye to be filled in.
+ * @param projL A 4x4 projection matrix for the left eye to be filled in.
+ * @param viewR A 4x4 view matrix for the right eye to be filled in.
+ * @param projR A 4x4 projection matrix for the right eye to be filled in.
+ */
+void viewmat_get_stereo(float viewL[16], float projL[16], float viewR[16], float projR[16])
+{
+	viewmat_get(viewL, projL, 0);
+	viewmat_get(viewR, projR, 1);
+}
+
+/** Returns the age of the tracker pose that the most recent
+ * viewmat_get() call returned. Programs can use this to stamp frames
+ * (in logs, screen overlays, etc.) with how stale the pose they were
+ * rendered with was.
+ *
+ * @return The age of the pose in microseconds, or -1 if we aren't
+ * using a tracker or haven't received a pose yet.
+ */
+long viewmat_pose_age(void)
+{
+	if(viewmat_pose_time < 0)
+		return -1;
+	return kuhl_microseconds() - viewmat_pose_time;
+}
+
 
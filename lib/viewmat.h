@@ -22,6 +22,11 @@
     will be placed on the user's head. Currently only used in "ivs"
     mode.
 
+    VIEWMAT_SINGLE_PASS=1 - Draw both eyes in a single pass instead
+    of submitting the scene once per eye. Only works with
+    VIEWMAT_DISPLAY_MODE=hmd and requires program support; see
+    viewmat_single_pass().
+
     @author Scott Kuhl
  */
 
@@ -47,6 +52,9 @@ void viewmat_init(float pos[3], float look[3], float up[3]);
 viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewportNum);
 int viewmat_num_viewports();
 void viewmat_get_viewport(int viewportValue[4], int viewportNum);
+int viewmat_single_pass(void);
+void viewmat_get_stereo(float viewL[16], float projL[16], float viewR[16], float projR[16]);
+long viewmat_pose_age(void);
 
 #ifdef __cplusplus
 } // end extern "C"
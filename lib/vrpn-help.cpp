@@ -9,8 +9,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <map>
 #include <string>
+#include <vector>
 
 #ifndef MISSING_VRPN
 #include <vrpn_Tracker.h>
@@ -30,13 +32,39 @@
 #ifndef MISSING_VRPN
 
 
+/** A mailbox holds the newest vrpn_TRACKERCB record for one tracked
+ * object. It is a sequence lock: the writer (either the render thread
+ * or, if the VRPN_THREAD mode is enabled, the background polling
+ * thread) increments 'seq' to an odd value, copies the record in, and
+ * increments 'seq' again. A reader copies the record out and retries if
+ * 'seq' was odd or changed during the copy. The writer never blocks and
+ * the reader only retries if a write happened mid-copy, so tracker I/O
+ * never stalls rendering. */
+typedef struct
+{
+	volatile unsigned int seq; /**< Even when the record is stable, odd mid-write. */
+	int filled;                /**< Has the callback ever stored a record here? */
+	vrpn_TRACKERCB t;          /**< The newest record from the tracker. */
+	long arrivalTime;          /**< Local kuhl_microseconds() time at which the record arrived. */
+} vrpn_mailbox;
+
 /** A mapping of object\@tracker strings to vrpn_Tracker_Remote objects
  * so we can quickly find the appropriate object given an
  * object\@tracker string. */
 std::map<std::string, vrpn_Tracker_Remote*> nameToTracker;
-/** A mapping of object\@tracker strings to the data that the callback
- * functions store the data into. */
-std::map<std::string, vrpn_TRACKERCB> nameToCallbackData;
+/** A mapping of object\@tracker strings to the mailbox that the
+ * callback functions store the newest record into. */
+std::map<std::string, vrpn_mailbox*> nameToMailbox;
+
+/** Protects the two maps above. It is held only while looking
+ * something up or registering a new tracker---never while mainloop()
+ * is running---so the render thread can't get stuck behind tracker
+ * I/O. */
+static pthread_mutex_t vrpn_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Nonzero if the background polling thread has been started (i.e.,
+ * the VRPN_THREAD environment variable was set). */
+static int vrpn_thread_running = 0;
 
 static kuhl_fps_state fps_state;
 static kalman_state kalman;
@@ -56,7 +84,7 @@ static void smooth(vrpn_TRACKERCB &t)
  * provides us with new data. This may be called repeatedly for each
  * record that we have missed if many records have been delivered
  * since the last call to the VRPN mainloop() function. */
-static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
+static void VRPN_CALLBACK handle_tracker(void *mailboxVoid, vrpn_TRACKERCB t)
 {
 	float fps = kuhl_getfps(&fps_state);
 	if(fps_state.frame == 0)
@@ -67,7 +95,7 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	 * update. */
 	float pos[3];
 	vec3f_set(pos, t.pos[0], t.pos[1], t.pos[2]);
-	
+
 	long microseconds = (t.msg_time.tv_sec* 1000000L) + t.msg_time.tv_usec;
 
 	if(0)
@@ -76,14 +104,80 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 		printf("Received position from vrpn: ");
 		vec3f_print(pos);
 	}
-	
+
 	if(vec3f_norm(pos) > 100)
 		return;
-	
-	// Store the data in our map so that someone can use it later.
-	std::string s = (char*)name;
-	nameToCallbackData[s] = t;
-	smooth(nameToCallbackData[s]);
+
+	smooth(t);
+
+	// Publish the record into the mailbox so someone can use it later.
+	vrpn_mailbox *mailbox = (vrpn_mailbox*) mailboxVoid;
+	mailbox->seq++; // now odd: tells readers a write is in progress
+	__sync_synchronize();
+	mailbox->t = t;
+	/* Record the local time too: the tracker's msg_time is from the
+	 * tracking computer's clock, so it can't be compared against our
+	 * own clock to measure latency. */
+	mailbox->arrivalTime = kuhl_microseconds();
+	mailbox->filled = 1;
+	__sync_synchronize();
+	mailbox->seq++; // now even: record is stable again
+}
+
+/** Reads the newest record out of a mailbox without blocking the
+ * writer.
+
+    @param mailbox The mailbox to read from.
+
+    @param t The record is copied here.
+
+    @return 1 if the mailbox contained a record, 0 if the callback
+    hasn't delivered one yet.
+*/
+static int vrpn_mailbox_read(vrpn_mailbox *mailbox, vrpn_TRACKERCB *t)
+{
+	unsigned int seqBefore, seqAfter;
+	do
+	{
+		seqBefore = mailbox->seq;
+		if(seqBefore % 2 == 1) // writer is mid-copy, try again
+			continue;
+		__sync_synchronize();
+		*t = mailbox->t;
+		__sync_synchronize();
+		seqAfter = mailbox->seq;
+	} while(seqBefore != seqAfter || seqBefore % 2 == 1);
+
+	return mailbox->filled;
+}
+
+/** The background polling thread. It services every VRPN connection at
+ * a high rate so that (1) network hiccups delay this thread instead of
+ * the render thread and (2) the pose the render thread reads was
+ * sampled as close to render time as possible instead of at the start
+ * of the previous frame. */
+static void* vrpn_poll_thread(void *unused)
+{
+	(void) unused;
+	while(1)
+	{
+		/* Copy the tracker pointers out under the lock, but call
+		 * mainloop() with the lock released so the render thread never
+		 * waits on tracker I/O. Trackers are never removed from the
+		 * map, so the pointers stay valid after we unlock. */
+		std::vector<vrpn_Tracker_Remote*> trackers;
+		pthread_mutex_lock(&vrpn_map_mutex);
+		for(std::map<std::string, vrpn_Tracker_Remote*>::iterator it = nameToTracker.begin();
+		    it != nameToTracker.end(); ++it)
+			trackers.push_back(it->second);
+		pthread_mutex_unlock(&vrpn_map_mutex);
+
+		for(unsigned int i=0; i<trackers.size(); i++)
+			trackers[i]->mainloop();
+
+		usleep(1000); // poll at roughly 1000 Hz
+	}
+	return NULL;
 }
 
 #endif
@@ -201,18 +295,32 @@ int vrpn_get(const char *object, const char *hostname, float pos[3], float orien
 	std::string fullname = objectcpp + "@" + hostnamecpp;
 
 	/* Check if we have a tracker object for that string in our map. */
+	pthread_mutex_lock(&vrpn_map_mutex);
+	vrpn_Tracker_Remote *tracker = NULL;
+	vrpn_mailbox *mailbox = NULL;
 	if(nameToTracker.count(fullname))
+	{
+		tracker = nameToTracker[fullname];
+		mailbox = nameToMailbox[fullname];
+	}
+	pthread_mutex_unlock(&vrpn_map_mutex);
+
+	if(tracker != NULL)
 	{
 		/* If we already have a tracker object, ask it to run the main
 		 * loop (and therefore call our handle_tracker() function if
-		 * there is new data). */
-		nameToTracker[fullname]->mainloop();
+		 * there is new data). If the VRPN_THREAD environment variable
+		 * is set, the background thread is already doing this for us
+		 * at a high rate---and more importantly, any network hiccup
+		 * stalls that thread instead of this one. */
+		if(!vrpn_thread_running)
+			tracker->mainloop();
 
-		/* If our callback has been called, get the callback object
-		 * and get the data out of it. */
-		if(nameToCallbackData.count(fullname))
+		/* If our callback has been called, get the newest record out
+		 * of the mailbox. */
+		vrpn_TRACKERCB t;
+		if(vrpn_mailbox_read(mailbox, &t))
 		{
-			vrpn_TRACKERCB t = nameToCallbackData[fullname];
 			float pos4[4];
 			for(int i=0; i<3; i++)
 				pos4[i] = t.pos[i];
@@ -286,15 +394,99 @@ int vrpn_get(const char *object, const char *hostname, float pos[3], float orien
 		    return 0;
 		}
 		vrpn_Tracker_Remote *tkr = new vrpn_Tracker_Remote(fullname.c_str(), connection);
+		vrpn_mailbox *newMailbox = (vrpn_mailbox*) kuhl_malloc(sizeof(vrpn_mailbox));
+		newMailbox->seq = 0;
+		newMailbox->filled = 0;
+		newMailbox->arrivalTime = -1;
+		/* The callback writes straight into the mailbox; it doesn't
+		 * need to know the object's name. */
+		tkr->register_change_handler((void*) newMailbox, handle_tracker);
+		pthread_mutex_lock(&vrpn_map_mutex);
 		nameToTracker[fullname] = tkr;
-		tkr->register_change_handler((void*) fullname.c_str(), handle_tracker);
+		nameToMailbox[fullname] = newMailbox;
+		pthread_mutex_unlock(&vrpn_map_mutex);
 		kuhl_getfps_init(&fps_state);
 		kalman_initialize(&kalman, 0.1, 0.1);
+
+		/* Setting the VRPN_THREAD environment variable makes a
+		 * background thread service the VRPN connections instead of
+		 * doing it here every time a pose is requested. */
+		if(!vrpn_thread_running && getenv("VRPN_THREAD") != NULL)
+		{
+			pthread_t thread;
+			if(pthread_create(&thread, NULL, vrpn_poll_thread, NULL) != 0)
+				msg(ERROR, "Failed to create VRPN polling thread; falling back to polling from the render thread.\n");
+			else
+			{
+				msg(INFO, "VRPN connections will be serviced by a background thread.\n");
+				vrpn_thread_running = 1;
+			}
+		}
 	}
 	return 0;
 #endif
 }
 
+/** Returns the local-clock time (in microseconds, from
+ * kuhl_microseconds()) at which the newest record for a tracked object
+ * arrived. Comparing this against the current time tells you how stale
+ * the pose returned by the last vrpn_get() call is.
+ *
+ * @param object The name of the object being tracked.
+ *
+ * @param hostname The IP address or hostname of the VRPN server. If
+ * NULL, the ~/.vrpn-server file is consulted.
+ *
+ * @return The arrival time in microseconds or -1 if we haven't
+ * received a record for the object (or VRPN support is missing).
+ */
+long vrpn_newest_pose_time(const char *object, const char *hostname)
+{
+#ifdef MISSING_VRPN
+	return -1;
+#else
+	if(object == NULL || strlen(object) == 0)
+		return -1;
+
+	std::string hostnamecpp;
+	if(hostname == NULL)
+	{
+		char *hostnameInFile = vrpn_default_host();
+		if(hostnameInFile == NULL)
+			return -1;
+		hostnamecpp = hostnameInFile;
+		free(hostnameInFile);
+	}
+	else
+		hostnamecpp = hostname;
+	std::string fullname = std::string(object) + "@" + hostnamecpp;
+
+	pthread_mutex_lock(&vrpn_map_mutex);
+	vrpn_mailbox *mailbox = NULL;
+	if(nameToMailbox.count(fullname))
+		mailbox = nameToMailbox[fullname];
+	pthread_mutex_unlock(&vrpn_map_mutex);
+	if(mailbox == NULL || !mailbox->filled)
+		return -1;
+
+	/* Read the arrival time out under the sequence lock so we never
+	 * see a half-written value. */
+	unsigned int seqBefore, seqAfter;
+	long arrivalTime;
+	do
+	{
+		seqBefore = mailbox->seq;
+		if(seqBefore % 2 == 1) // writer is mid-copy, try again
+			continue;
+		__sync_synchronize();
+		arrivalTime = mailbox->arrivalTime;
+		__sync_synchronize();
+		seqAfter = mailbox->seq;
+	} while(seqBefore != seqAfter || seqBefore % 2 == 1);
+
+	return arrivalTime;
+#endif
+}
+
 
-	
 } // extern C
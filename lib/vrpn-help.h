@@ -24,6 +24,7 @@ extern "C" {
 #endif
 
 int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16]);
+long vrpn_newest_pose_time(const char *object, const char *hostname);
 char* vrpn_default_host();
 	
 #ifdef __cplusplus
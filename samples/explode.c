@@ -10,6 +10,7 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <GL/glew.h>
 #ifdef FREEGLUT
@@ -61,12 +62,41 @@ typedef struct {
 
 particle **particles;
 
+/** CPU-side copy of each geometry's vertex positions. The positions
+ * are streamed to the GPU through a write-only mapping every frame
+ * (see update()), so we need our own readable copy to integrate. */
+GLfloat **cpuPos = NULL;
+
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
 
+/** Copies each geometry's vertex positions into cpuPos and gives the
+ * position attribute its own buffer so that update() can stream new
+ * positions into it each frame without the driver synchronization
+ * that re-uploading with glBufferData() would cause. (Attributes
+ * packed into the model's interleaved buffer can't be streamed.) */
+void init_cpu_positions()
+{
+	if(cpuPos != NULL)
+		return;
+	cpuPos = malloc(sizeof(GLfloat*)*kuhl_geometry_count(modelgeom));
+	int i = 0;
+	for(kuhl_geometry *g = modelgeom; g != NULL; g=g->next)
+	{
+		GLint numFloats = 0;
+		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position", &numFloats);
+		cpuPos[i] = malloc(sizeof(GLfloat)*numFloats);
+		memcpy(cpuPos[i], pos, sizeof(GLfloat)*numFloats);
+		kuhl_geometry_attrib(g, cpuPos[i], 3, "in_Position", KG_NONE);
+		i++;
+	}
+}
+
 /** Give each vertex a velocity when the explosion occurs. */
 void explode()
 {
+	init_cpu_positions();
+
 	kuhl_geometry *g = modelgeom;
 	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
 	{
@@ -105,16 +135,22 @@ void update()
 	kuhl_geometry *g = modelgeom;
 	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
 	{
-		int numFloats = 0;
-		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position",
-		                                        &numFloats);
+		/* If the points aren't moving, don't update anything */
+		if(g->vertex_count == 0 || vec3f_norm(particles[i][0].velocity) == 0)
+			return;
+
+		/* Get a write-only pointer into the next region of the
+		 * position attribute's triple-buffered streaming buffer. The
+		 * GPU keeps reading the previous region while we fill this
+		 * one, so no synchronization occurs. Our readable copy of the
+		 * positions lives in cpuPos. */
+		GLfloat *pos = kuhl_geometry_attrib_stream(g, "in_Position");
+		if(pos == NULL)
+			return;
+		GLfloat *cpu = cpuPos[i];
 
 		for(unsigned int j=0; j<g->vertex_count; j++)
 		{
-			/* If the first point isn't moving, don't update anything */
-			if(vec3f_norm(particles[i][j].velocity) == 0)
-				return;
-
 			/* Gravity is pushing particles down -Y, but we are
 			 * operating in object coordinates. If GeomTransform
 			 * (i.e., g->matrix) is used to rotate the model, then
@@ -124,28 +160,29 @@ void update()
 			float timestep = 0.1f; // change this to change speed of explosion
 			for(int k=0; k<3; k++)
 			{
-				pos[j*3+k] += timestep * (particles[i][j].velocity[k] + timestep * accel[k]/2);
+				cpu[j*3+k] += timestep * (particles[i][j].velocity[k] + timestep * accel[k]/2);
 				particles[i][j].velocity[k] += timestep * accel[k];
 			}
 #if 1   /* Bounce the particles off the xz-plane. */
-			if(pos[j*3+1] < 0)
+			if(cpu[j*3+1] < 0)
 			{
 				/* How much velocity is lost when a bounce occurs? */
 				float velocityLossFactor = .4;
 				/* If particle fell through floor, negate its position */
-				pos[j*3+1] *= -velocityLossFactor;
+				cpu[j*3+1] *= -velocityLossFactor;
 				/* Negative the Y velocity */
 				particles[i][j].velocity[1] *= -1;
 				/* Scale velocity in all directions */
 				vec3f_scalarMult(particles[i][j].velocity, velocityLossFactor); // lose energy on bounce
 			}
 #endif
+			vec3f_copy(&pos[j*3], &cpu[j*3]);
 		}
+
+		/* Make the next draw read the region we just wrote. */
+		kuhl_geometry_attrib_stream_commit(g, "in_Position");
 		g = g->next;
 	}
-
-
-	
 }
 
 
@@ -442,6 +479,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
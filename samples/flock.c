@@ -11,7 +11,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <GL/glew.h>
 #ifdef FREEGLUT
 #include <GL/freeglut.h>
@@ -33,12 +36,249 @@ GLuint program = 0; // id value for the GLSL program
 kuhl_geometry *modelgeom = NULL;
 float bbox[6], fitMatrix[16];
 
+/* The number of boids; change it at runtime with the FLOCK
+ * environment variable. */
 #define NUM_MODELS 5000
-float positions[NUM_MODELS][3];
+int numBoids = NUM_MODELS;
+
+/* Boid state is double buffered: the update for one boid reads every
+ * neighbor's OLD state and writes only its own NEW state. That keeps
+ * each boid's update independent (so they can run on any number of
+ * threads) and deterministic (the result doesn't depend on update
+ * order), which DGR master/slave consistency relies on. */
+float (*positions)[3];
+float (*velocities)[3];
+float (*newPositions)[3];
+float (*newVelocities)[3];
+
+/* Flocking parameters. */
+#define FLOCK_WORLD_SIZE    25.0f /* boids are pulled back toward the origin beyond this */
+#define FLOCK_NEIGHBOR_DIST 2.0f  /* cohesion/alignment neighbors must be this close */
+#define FLOCK_SEPARATE_DIST 0.8f  /* boids closer than this push each other apart */
+#define FLOCK_MAX_SPEED     5.0f
+
+/* A spatial hash so each boid only examines nearby boids instead of
+ * every other boid. The world is cut into cells of FLOCK_NEIGHBOR_DIST
+ * on a side; a boid's neighbors are in its own cell or one of the 26
+ * adjacent cells. Cells are hashed into a power-of-two table and each
+ * table slot holds a linked list (head + next indices) of the boids
+ * inside. Distant cells can hash to the same slot, but the distance
+ * check filters those boids out. */
+static int hashSize = 0;    /* number of slots; power of two */
+static int *cellHead = NULL; /* first boid in each slot or -1 */
+static int *cellNext = NULL; /* next boid in the same slot or -1 */
+
+/* The thread pool. Worker i updates boids [i*n/T, (i+1)*n/T); the
+ * main thread acts as the last worker. Two barriers bracket each
+ * frame's work: the first hands the workers a new timestep and the
+ * second tells the main thread everyone is finished. */
+static int numThreads = 4;
+static pthread_barrier_t flockStart, flockDone;
+static float flockDt = 0;
 
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
 
+/** Hashes a grid cell into a slot in the spatial hash table. */
+static int flock_cell_hash(int cx, int cy, int cz)
+{
+	/* Large primes spread neighboring cells across the table. */
+	unsigned int h = (unsigned int)cx*73856093u ^
+	                 (unsigned int)cy*19349663u ^
+	                 (unsigned int)cz*83492791u;
+	return (int)(h & (unsigned int)(hashSize-1));
+}
+
+/** Rebuilds the spatial hash from the current boid positions. Called
+ * once per frame by the main thread before the workers run. */
+static void flock_hash_rebuild(void)
+{
+	for(int i=0; i<hashSize; i++)
+		cellHead[i] = -1;
+	for(int i=0; i<numBoids; i++)
+	{
+		int cx = (int) floorf(positions[i][0]/FLOCK_NEIGHBOR_DIST);
+		int cy = (int) floorf(positions[i][1]/FLOCK_NEIGHBOR_DIST);
+		int cz = (int) floorf(positions[i][2]/FLOCK_NEIGHBOR_DIST);
+		int slot = flock_cell_hash(cx, cy, cz);
+		cellNext[i] = cellHead[slot];
+		cellHead[slot] = i;
+	}
+}
+
+/** Applies the boid rules (separation, cohesion, alignment) to boids
+ * start through end-1, reading old state and writing new state. Only
+ * boids in the 27 grid cells around a boid are examined. */
+static void flock_update_range(int start, int end, float dt)
+{
+	for(int i=start; i<end; i++)
+	{
+		int cx = (int) floorf(positions[i][0]/FLOCK_NEIGHBOR_DIST);
+		int cy = (int) floorf(positions[i][1]/FLOCK_NEIGHBOR_DIST);
+		int cz = (int) floorf(positions[i][2]/FLOCK_NEIGHBOR_DIST);
+
+		float separate[3] = { 0,0,0 };
+		float cohesion[3] = { 0,0,0 };
+		float align[3]    = { 0,0,0 };
+		int neighbors = 0;
+
+		for(int dx=-1; dx<=1; dx++)
+			for(int dy=-1; dy<=1; dy++)
+				for(int dz=-1; dz<=1; dz++)
+				{
+					int slot = flock_cell_hash(cx+dx, cy+dy, cz+dz);
+					for(int j=cellHead[slot]; j>=0; j=cellNext[j])
+					{
+						if(j == i)
+							continue;
+						float toNeighbor[3];
+						vec3f_sub_new(toNeighbor, positions[j], positions[i]);
+						float dist2 = vec3f_dot(toNeighbor, toNeighbor);
+						if(dist2 > FLOCK_NEIGHBOR_DIST*FLOCK_NEIGHBOR_DIST)
+							continue;
+						neighbors++;
+						vec3f_add_new(cohesion, cohesion, toNeighbor);
+						vec3f_add_new(align, align, velocities[j]);
+						if(dist2 < FLOCK_SEPARATE_DIST*FLOCK_SEPARATE_DIST)
+						{
+							/* Push away harder from very close neighbors. */
+							float push[3];
+							vec3f_scalarMult_new(push, toNeighbor, 1.0f/(dist2+.001f));
+							vec3f_sub_new(separate, separate, push);
+						}
+					}
+				}
+
+		float accel[3];
+		vec3f_scalarMult_new(accel, separate, 1.5f);
+		if(neighbors > 0)
+		{
+			/* Steer toward the center of nearby boids... */
+			vec3f_scalarMult(cohesion, .05f/neighbors);
+			vec3f_add_new(accel, accel, cohesion);
+			/* ...and toward their average velocity. */
+			vec3f_scalarMult(align, 1.0f/neighbors);
+			vec3f_sub_new(align, align, velocities[i]);
+			vec3f_scalarMult(align, .1f);
+			vec3f_add_new(accel, accel, align);
+		}
+
+		/* Pull boids which wander too far back toward the origin. */
+		if(vec3f_norm(positions[i]) > FLOCK_WORLD_SIZE)
+		{
+			float pull[3];
+			vec3f_scalarMult_new(pull, positions[i], -.05f);
+			vec3f_add_new(accel, accel, pull);
+		}
+
+		float vel[3];
+		vec3f_scalarMult_new(vel, accel, dt);
+		vec3f_add_new(vel, vel, velocities[i]);
+		float speed = vec3f_norm(vel);
+		if(speed > FLOCK_MAX_SPEED)
+			vec3f_scalarMult(vel, FLOCK_MAX_SPEED/speed);
+		vec3f_copy(newVelocities[i], vel);
+
+		vec3f_scalarMult_new(newPositions[i], vel, dt);
+		vec3f_add_new(newPositions[i], newPositions[i], positions[i]);
+	}
+}
+
+/** The thread pool worker: wait for a frame's work, update this
+ * worker's slice of the boids, signal completion, repeat. */
+static void* flock_worker(void *arg)
+{
+	long t = (long) arg;
+	int start = (int)((long)numBoids* t   /numThreads);
+	int end   = (int)((long)numBoids*(t+1)/numThreads);
+	while(1)
+	{
+		pthread_barrier_wait(&flockStart);
+		flock_update_range(start, end, flockDt);
+		pthread_barrier_wait(&flockDone);
+	}
+	return NULL;
+}
+
+/** Advances the flock by one timestep using the thread pool. Because
+ * each boid reads old state and writes only its own new state, the
+ * result is identical regardless of the number of threads---so DGR
+ * master and slave processes stay consistent as long as they use the
+ * same initial state and the same sequence of timesteps. */
+static void flock_update(float dt)
+{
+	flock_hash_rebuild();
+	flockDt = dt;
+
+	/* Release the workers; the main thread handles the last slice. */
+	pthread_barrier_wait(&flockStart);
+	flock_update_range((int)((long)numBoids*(numThreads-1)/numThreads),
+	                   numBoids, dt);
+	pthread_barrier_wait(&flockDone);
+
+	/* Swap the old and new state buffers. */
+	float (*tmp)[3];
+	tmp = positions;  positions  = newPositions;  newPositions  = tmp;
+	tmp = velocities; velocities = newVelocities; newVelocities = tmp;
+}
+
+/** Allocates the boid state and spatial hash and starts the thread
+ * pool. Every DGR process seeds drand48() identically, so they all
+ * generate the same initial flock. */
+static void flock_init(void)
+{
+	const char *countString = getenv("FLOCK");
+	if(countString != NULL && atoi(countString) > 0)
+		numBoids = atoi(countString);
+	const char *threadString = getenv("FLOCK_THREADS");
+	if(threadString != NULL && atoi(threadString) > 0)
+		numThreads = atoi(threadString);
+	else
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		if(cores > 0)
+			numThreads = (int) cores;
+	}
+	msg(INFO, "Flock: %d boids updated by %d threads.\n", numBoids, numThreads);
+
+	positions     = kuhl_malloc(numBoids*sizeof(float[3]));
+	velocities    = kuhl_malloc(numBoids*sizeof(float[3]));
+	newPositions  = kuhl_malloc(numBoids*sizeof(float[3]));
+	newVelocities = kuhl_malloc(numBoids*sizeof(float[3]));
+
+	srand48(42); // all DGR processes must generate the same flock
+	for(int i=0; i<numBoids; i++)
+	{
+		for(int k=0; k<3; k++)
+		{
+			positions[i][k]  = drand48()*50-25;
+			velocities[i][k] = drand48()*2-1;
+		}
+	}
+
+	/* Size the hash table to at least twice the boid count to keep
+	 * the chains short. */
+	hashSize = 1;
+	while(hashSize < numBoids*2)
+		hashSize *= 2;
+	cellHead = kuhl_malloc(hashSize*sizeof(int));
+	cellNext = kuhl_malloc(numBoids*sizeof(int));
+
+	/* Start the pool. The main thread is the last worker, so create
+	 * one fewer thread and make the barriers count all of them. */
+	pthread_barrier_init(&flockStart, NULL, numThreads);
+	pthread_barrier_init(&flockDone, NULL, numThreads);
+	for(long t=0; t<numThreads-1; t++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, flock_worker, (void*) t) != 0)
+		{
+			msg(FATAL, "Failed to create a flock worker thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
 /* Called by GLUT whenever a key is pressed. */
 void keyboard(unsigned char key, int x, int y)
 {
@@ -177,7 +417,7 @@ void display()
 		glUniform1f(kuhl_get_uniform("farPlane"), f[5]);
 
 		float modelview[16];
-		for(int i=0; i<NUM_MODELS; i++)
+		for(int i=0; i<numBoids; i++)
 		{
 			float modelMat[16];
 			get_model_matrix(modelMat, positions[i]);
@@ -238,6 +478,19 @@ void display()
 	dgr_setget("time", &time, sizeof(int));
 	kuhl_update_model(modelgeom, 0, ((time%10000)/1000.0));
 
+	/* Advance the flock. The master shares the timestep so every DGR
+	 * process applies the same sequence of updates to the same
+	 * initial flock and stays in sync. */
+	static int lastTime = -1;
+	if(lastTime < 0)
+		lastTime = time;
+	float dt = (time-lastTime) / 1000.0f;
+	if(dt > .1f) // don't take huge steps if rendering stalls
+		dt = .1f;
+	lastTime = time;
+	dgr_setget("dt", &dt, sizeof(float));
+	flock_update(dt);
+
 	/* Check for errors. If there are errors, consider adding more
 	 * calls to kuhl_errorcheck() in your code. */
 	kuhl_errorcheck();
@@ -323,6 +576,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -351,13 +605,8 @@ int main(int argc, char** argv)
 
 	kuhl_getfps_init(&fps_state);
 
-	for(int i=0; i<NUM_MODELS; i++)
-	{
-		positions[i][0] = drand48()*50-25;
-		positions[i][1] = drand48()*50-25;
-		positions[i][2] = drand48()*50-25;
-	}
-	
+	flock_init();
+
 	/* Tell GLUT to start running the main loop and to call display(),
 	 * keyboard(), etc callback methods as needed. */
 	glutMainLoop();
@@ -19,6 +19,7 @@
 
 #include "kuhl-util.h"
 #include "vecmat.h"
+#include "skeleton.h"
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
@@ -251,41 +252,51 @@ void get_model_matrix(float result[16])
 }
 
 
+/* The arm as a skeleton: joint 0 rotates at the base and joint 1 sits
+ * at the top of the first arm segment. The skeleton caches each
+ * joint's world matrix, so an IK iteration which only perturbs joint
+ * 1's angles reuses joint 0's cached matrix, and repeated evaluations
+ * with unchanged angles do no matrix math at all. */
+static skeleton arm;
+static int armInitialized = 0;
+
 /* Get arm matrices given a set of angles. The arm2 matrix already has
  * the arm1 matrix applied to it. */
 void get_arm_matrices(float arm1[16], float arm2[16], float angles[])
 {
-	list *stack = list_new(16, sizeof(float)*16, NULL);
+	if(armInitialized == 0)
+	{
+		skeleton_init(&arm, 2);
+		skeleton_add_joint(&arm, -1, NULL); // base of the arm
+		skeleton_add_joint(&arm,  0, NULL); // top of the first segment
+		armInitialized = 1;
+	}
 
-	float baseRotate[16];
-	mat4f_rotateEuler_new(baseRotate, angles[0], angles[1], angles[2], "XYZ");
-	mat4f_stack_mult(stack, baseRotate);
-	mat4f_stack_push(stack);
+	/* skeleton_set_local() ignores matrices which match the cached
+	 * ones, so only the joints whose angles actually changed get
+	 * marked dirty and re-evaluated. */
+	float rotate[16];
+	mat4f_rotateEuler_new(rotate, angles[0], angles[1], angles[2], "XYZ");
+	skeleton_set_local(&arm, 0, rotate);
+
+	float trans[16], local[16];
+	mat4f_rotateEuler_new(rotate, angles[3], angles[4], angles[5], "XYZ");
+	mat4f_translate_new(trans, 0, 4, 0);
+	mat4f_mult_mat4f_new(local, trans, rotate);
+	skeleton_set_local(&arm, 1, local);
 
+	/* The drawn segments are the joint world matrices with the box
+	 * shape (scaled and shifted so it extends away from the joint)
+	 * applied. */
 	float scale[16];
 	mat4f_scale_new(scale, .5, 4, .5);
 	float decenter[16];
 	mat4f_translate_new(decenter, 0, .5, 0);
+	float shape[16];
+	mat4f_mult_mat4f_new(shape, scale, decenter);
 
-	mat4f_stack_mult(stack, scale);
-	mat4f_stack_mult(stack, decenter);
-	mat4f_stack_peek(stack, arm1);
-	mat4f_stack_pop(stack);
-
-	float trans[16];
-	mat4f_translate_new(trans, 0, 4, 0);
-	mat4f_stack_mult(stack, trans);
-
-	mat4f_rotateEuler_new(baseRotate, angles[3], angles[4], angles[5], "XYZ");
-	mat4f_stack_mult(stack, baseRotate);
-	mat4f_stack_push(stack);
-
-	mat4f_stack_mult(stack, scale);
-	mat4f_stack_mult(stack, decenter);
-	mat4f_stack_peek(stack, arm2);
-	mat4f_stack_pop(stack);
-
-	list_free(stack);
+	mat4f_mult_mat4f_new(arm1, skeleton_world(&arm, 0), shape);
+	mat4f_mult_mat4f_new(arm2, skeleton_world(&arm, 1), shape);
 }
 
 /* Given a list of angles, calculate end effector location */
@@ -707,6 +718,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 
 #ifdef __linux__
 #include <unistd.h>
@@ -45,72 +46,105 @@ int autoAdvance = 0; // Automatically advance from image to image after a time o
 int lastAdvance = 0; // Time (in ms from when our program started) that we advanced picture.
 float scrollAmount = 0; // How far has the image scrolled?
 
-/* The current image that we are displaying. */
-GLuint numTiles=0;
-GLuint texNames[MAX_TILES];
-float aspectRatio;
-
-int alreadyDisplayedTexture = 0; // Used to determine if we need to reload currentTexture.
+int alreadyDisplayedTexture = 0; // Used to determine if we need to switch to a new currentTexture.
 int currentTexture = 0; // The texture to be displayed.
 int totalTextures = 0;
 char **globalargv = NULL;
 
-/* Readfile uses imageio to read in an image, and binds it to an OpenGL
- * texture name.  Requires OpenGL 2.0 or better.
+/* Each slide moves through these states: a background thread decodes
+ * image files into SLIDE_READY pixel buffers, and the main thread
+ * uploads ready slides into OpenGL textures when (or shortly before)
+ * they are displayed. */
+#define SLIDE_EMPTY    0 /* nothing loaded */
+#define SLIDE_DECODING 1 /* the prefetch thread is decoding the file */
+#define SLIDE_READY    2 /* decoded pixels are in RAM, not yet uploaded */
+#define SLIDE_UPLOADED 3 /* OpenGL textures are ready to draw */
+
+typedef struct
+{
+	int state;             // One of the SLIDE_* states above.
+	unsigned char *pixels; // Decoded RGBA pixels (SLIDE_READY only).
+	int width, height;     // Dimensions of the decoded image.
+	float aspectRatio;     // width/height
+	GLuint numTiles;       // Number of tiles in the horizontal direction.
+	GLuint texNames[MAX_TILES]; // OpenGL textures (SLIDE_UPLOADED only).
+	size_t vramBytes;      // Approximate VRAM the textures consume.
+	long lastUsed;         // Counter value when last displayed (for LRU eviction).
+} slide;
+
+slide *slides = NULL;
+long slideUseCounter = 0; // Incremented each time a slide is displayed.
+
+/* Settable with the SLIDESHOW_PREFETCH and SLIDESHOW_VRAM_MB
+ * environment variables. */
+int prefetchDistance = 2;             // How many next/previous slides to keep decoded.
+size_t vramBudget = 512*1024*1024;    // Evict distant slides beyond this texture budget.
+
+/* Protects the slide states and currentTexture; the condition variable
+ * wakes the prefetch thread when the current slide changes and wakes
+ * the main thread when a decode it is waiting on finishes. */
+pthread_mutex_t slideMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slideCond = PTHREAD_COND_INITIALIZER;
+
+/* Decodes an image file into an RGBA pixel array. Contains no OpenGL
+ * calls, so the prefetch thread can run it in the background.
  *
  * filename: name of file to load
  *
- * texName: A pointer to where the OpenGL texture name should be stored.
- * (Remember that the "texture name" is really just some unsigned int).
+ * width, height: filled in with the image dimensions.
  *
- * returns: aspect ratio of the image in the file.
+ * returns: the decoded pixels; the caller should free() them.
  */
-float readfile(char *filename, GLuint *texName, GLuint *numTiles)
+unsigned char* slide_decode(const char *filename, int *width, int *height)
 {
-	static int verbose=1;  // change this to 0 to print out less info
-
 	/* Try to load the image. */
 #if KUHL_UTIL_USE_IMAGEMAGICK
 	imageio_info iioinfo;
-	iioinfo.filename = filename;
+	iioinfo.filename = (char*) filename;
 	iioinfo.type = CharPixel;
 	iioinfo.map = "RGBA";
 	iioinfo.colorspace = sRGBColorspace;
 	unsigned char *image = (unsigned char*) imagein(&iioinfo);
-	int width  = (int)iioinfo.width;
-	int height = (int)iioinfo.height;
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
 #else
-	int width  = -1;
-	int height = -1;
 	int comp = -1;
 	int requestedComponents = STBI_rgb_alpha;
 	stbi_set_flip_vertically_on_load(1);
-	unsigned char *image = (unsigned char*) stbi_load(filename, &width, &height, &comp, requestedComponents);
+	unsigned char *image = (unsigned char*) stbi_load(filename, width, height, &comp, requestedComponents);
 #endif
 
 	if(image == NULL)
 	{
 		msg(FATAL, "Unable to read image: %s\n", filename);
-		return -1;
+		exit(EXIT_FAILURE);
 	}
 
 	/* "image" is a 1D array of characters (unsigned bytes) with four
 	 * bytes for each pixel (red, green, blue, alpha). The data in "image"
 	 * is in row major order. The first 4 bytes are the color information
 	 * for the lowest left pixel in the texture. */
-	float original_aspectRatio = (float)width/height;
-	if(verbose)
-		msg(INFO, "Finished reading %s (%dx%d)\n", filename, width, height);
-
-	/* OpenGL only supports textures if they are small enough. If
-	 * the texture is too large, we need to split it into smaller
-	 * textures and render each texture on its own
-	 * quad. Typically, the limit is 4096 pixels in each
-	 * dimension. This code will always split the image vertically
-	 * in half...and then decide how many tiles are necessary
-	 * horizontally. This allows for long horizontal panoramas but
-	 * not long vertical panoramas. */
-	
+	msg(INFO, "Finished reading %s (%dx%d)\n", filename, *width, *height);
+	return image;
+}
+
+/* Uploads a SLIDE_READY slide's pixels into OpenGL textures and frees
+ * the pixel buffer. Must be called from the main thread (it makes
+ * OpenGL calls). Requires OpenGL 2.0 or better.
+ *
+ * OpenGL only supports textures if they are small enough. If the
+ * texture is too large, we need to split it into smaller textures and
+ * render each texture on its own quad. Typically, the limit is 4096
+ * pixels in each dimension. This code will always split the image
+ * vertically in half...and then decide how many tiles are necessary
+ * horizontally. This allows for long horizontal panoramas but not long
+ * vertical panoramas. */
+void slide_upload(slide *s)
+{
+	int width = s->width;
+	int height = s->height;
+	unsigned char *image = s->pixels;
+
 	/* Since we display image as being two tiles tall, make sure
 	 * image isn't too tall. */
 	if(height > 4096*2)
@@ -121,19 +155,19 @@ float readfile(char *filename, GLuint *texName, GLuint *numTiles)
 
 	int subimgH = height/2; // height of a the tiles
 	int workingWidth = width;
-	*numTiles = 1; // number of tiles in horizontal direction
+	s->numTiles = 1; // number of tiles in horizontal direction
 	/* Calculate number of tiles horizontally we need. */
 	while(workingWidth > 4096)
 	{
 		/* If image is too wide, split the width of the tile
 		 * in half---doubling the number of tiles in the
 		 * horizontal direction */
-		*numTiles = *numTiles * 2;
+		s->numTiles = s->numTiles * 2;
 		workingWidth = workingWidth / 2;
 	}
 	int subimgW = workingWidth;
 
-	if(*numTiles > MAX_TILES/2.0)
+	if(s->numTiles > MAX_TILES/2.0)
 	{
 		msg(FATAL, "Too many tiles");
 		exit(EXIT_FAILURE);
@@ -146,16 +180,16 @@ float readfile(char *filename, GLuint *texName, GLuint *numTiles)
 
 	if(tmp == 0)
 	{
-		msg(FATAL, "%s: File is too large (%d x %d). I can't load it!\n", filename, subimgW, subimgH);
+		msg(FATAL, "File is too large (%d x %d). I can't load it!\n", subimgW, subimgH);
 		free(image);
 		exit(EXIT_FAILURE);
 	}
 
 
 	/* Generate all of the textures that we need. */
-	glGenTextures(*numTiles*2, texName);
+	glGenTextures(s->numTiles*2, s->texNames);
 
-	for(GLuint curTile=0; curTile < *numTiles*2; curTile = curTile+2)
+	for(GLuint curTile=0; curTile < s->numTiles*2; curTile = curTile+2)
 	{
 		/* Prepare to copy the data from the array into the
 		 * texture, tell OpenGL to skip pixels appropriately
@@ -165,7 +199,7 @@ float readfile(char *filename, GLuint *texName, GLuint *numTiles)
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS,   0);
 
-		glBindTexture(GL_TEXTURE_2D, texName[curTile]);
+		glBindTexture(GL_TEXTURE_2D, s->texNames[curTile]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -177,7 +211,7 @@ float readfile(char *filename, GLuint *texName, GLuint *numTiles)
 		glPixelStorei( GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW );
 		glPixelStorei( GL_UNPACK_SKIP_ROWS, subimgH);
 
-		glBindTexture(GL_TEXTURE_2D, texName[curTile+1]);
+		glBindTexture(GL_TEXTURE_2D, s->texNames[curTile+1]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -187,8 +221,16 @@ float readfile(char *filename, GLuint *texName, GLuint *numTiles)
 		             0, GL_RGBA, GL_UNSIGNED_BYTE, image);
 	}
 
+	/* Restore the unpacking state for anybody else who uploads
+	 * textures. */
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
 	free(image);
-	return original_aspectRatio;
+	s->pixels = NULL;
+	s->vramBytes = (size_t)s->numTiles*2*subimgW*subimgH*4;
+	s->state = SLIDE_UPLOADED;
 }
 
 int getNextTexture()
@@ -207,16 +249,172 @@ int getPrevTexture()
 	return next;
 }
 
-/* Deletes any tiles that are already loaded and then loads up the
- * current texture image. */
-void loadTexture(int textureIndex)
+/* How many slide advancements (forward or backward, whichever is
+ * shorter, with wraparound) separate two slide indices? */
+int slide_distance(int a, int b)
 {
-	if(numTiles > 0)
-		glDeleteTextures(numTiles*2, texNames);
+	int d = abs(a-b);
+	if(totalTextures-d < d)
+		d = totalTextures-d;
+	return d;
+}
 
-	scrollAmount = 0;
-	aspectRatio = readfile(globalargv[textureIndex], texNames, &numTiles);
-	lastAdvance = glutGet(GLUT_ELAPSED_TIME);
+/* Finds the highest-priority slide that needs decoding: the current
+ * slide first, then the ones closest to it within the prefetch
+ * window. Returns -1 if everything in the window is decoded. The
+ * caller must hold slideMutex. */
+int slide_find_decode_candidate(void)
+{
+	for(int d=0; d<=prefetchDistance; d++)
+	{
+		int candidates[2] = { (currentTexture+d)%totalTextures,
+		                      (currentTexture-d+totalTextures)%totalTextures };
+		for(int i=0; i<2; i++)
+			if(slides[candidates[i]].state == SLIDE_EMPTY)
+				return candidates[i];
+	}
+	return -1;
+}
+
+/* The prefetch thread: decodes the slides near the current one in the
+ * background so that advancing to them is just a texture upload (or
+ * nothing at all if they are already uploaded). */
+void* slide_prefetch_thread(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&slideMutex);
+	while(1)
+	{
+		int index = slide_find_decode_candidate();
+		if(index < 0)
+		{
+			/* Everything near the current slide is decoded; sleep
+			 * until the current slide changes. */
+			pthread_cond_wait(&slideCond, &slideMutex);
+			continue;
+		}
+
+		slide *s = &slides[index];
+		s->state = SLIDE_DECODING;
+		const char *filename = globalargv[index];
+		pthread_mutex_unlock(&slideMutex);
+
+		int width, height;
+		unsigned char *pixels = slide_decode(filename, &width, &height);
+
+		pthread_mutex_lock(&slideMutex);
+		s->pixels = pixels;
+		s->width = width;
+		s->height = height;
+		s->aspectRatio = (float)width/height;
+		s->state = SLIDE_READY;
+		/* The main thread may be blocked waiting for this decode. */
+		pthread_cond_broadcast(&slideCond);
+	}
+	return NULL;
+}
+
+/* Frees decoded-but-not-displayed pixel buffers and uploaded textures
+ * for slides far away from the current one. Textures are only evicted
+ * (least recently displayed first) when their total size exceeds the
+ * VRAM budget. The caller must hold slideMutex. */
+void slide_evict(void)
+{
+	size_t vramUsed = 0;
+	for(int i=0; i<totalTextures; i++)
+	{
+		slide *s = &slides[i];
+		if(s->state == SLIDE_UPLOADED)
+			vramUsed += s->vramBytes;
+		else if(s->state == SLIDE_READY && slide_distance(i, currentTexture) > prefetchDistance)
+		{
+			/* Decoded pixels that have scrolled out of the prefetch
+			 * window; drop them to bound RAM use. */
+			free(s->pixels);
+			s->pixels = NULL;
+			s->state = SLIDE_EMPTY;
+		}
+	}
+
+	while(vramUsed > vramBudget)
+	{
+		/* Evict the least recently displayed slide (but never the one
+		 * on screen). */
+		int victim = -1;
+		for(int i=0; i<totalTextures; i++)
+			if(slides[i].state == SLIDE_UPLOADED && i != currentTexture &&
+			   (victim < 0 || slides[i].lastUsed < slides[victim].lastUsed))
+				victim = i;
+		if(victim < 0)
+			break;
+		glDeleteTextures(slides[victim].numTiles*2, slides[victim].texNames);
+		vramUsed -= slides[victim].vramBytes;
+		slides[victim].state = SLIDE_EMPTY;
+	}
+}
+
+/* Makes sure the given slide's textures are ready to draw, uploading
+ * (or, if the prefetcher hasn't gotten to it, decoding) it if
+ * necessary, and marks it as recently used. Returns the slide. */
+slide* slide_show(int index)
+{
+	pthread_mutex_lock(&slideMutex);
+	slide *s = &slides[index];
+
+	/* If the prefetch thread is decoding this slide right now, wait
+	 * for it to finish rather than decoding it a second time. */
+	while(s->state == SLIDE_DECODING)
+		pthread_cond_wait(&slideCond, &slideMutex);
+
+	/* If the user outran the prefetcher, decode synchronously. */
+	if(s->state == SLIDE_EMPTY)
+	{
+		s->state = SLIDE_DECODING;
+		pthread_mutex_unlock(&slideMutex);
+		int width, height;
+		unsigned char *pixels = slide_decode(globalargv[index], &width, &height);
+		pthread_mutex_lock(&slideMutex);
+		s->pixels = pixels;
+		s->width = width;
+		s->height = height;
+		s->aspectRatio = (float)width/height;
+		s->state = SLIDE_READY;
+	}
+
+	if(s->state == SLIDE_READY)
+		slide_upload(s);
+
+	s->lastUsed = ++slideUseCounter;
+	slide_evict();
+	/* Wake the prefetch thread; the current slide may have changed. */
+	pthread_cond_broadcast(&slideCond);
+	pthread_mutex_unlock(&slideMutex);
+	return s;
+}
+
+/* Allocates the slide cache, reads the configuration environment
+ * variables and starts the prefetch thread. */
+void slide_init(void)
+{
+	slides = calloc(totalTextures, sizeof(slide));
+	if(slides == NULL)
+	{
+		msg(FATAL, "Failed to allocate the slide cache.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(getenv("SLIDESHOW_PREFETCH"))
+		prefetchDistance = atoi(getenv("SLIDESHOW_PREFETCH"));
+	if(getenv("SLIDESHOW_VRAM_MB"))
+		vramBudget = (size_t)atoi(getenv("SLIDESHOW_VRAM_MB"))*1024*1024;
+	msg(INFO, "Prefetching %d slide(s) in each direction; VRAM budget %d MB\n",
+	    prefetchDistance, (int)(vramBudget/(1024*1024)));
+
+	pthread_t prefetchThread;
+	if(pthread_create(&prefetchThread, NULL, slide_prefetch_thread, NULL) != 0)
+	{
+		msg(ERROR, "Failed to create the prefetch thread; slides will load when displayed.\n");
+	}
 }
 
 void display(void)
@@ -241,14 +439,22 @@ void display(void)
 	/* If the texture has changed since we were previously in display() */
 	if(alreadyDisplayedTexture != currentTexture)
 	{
-		// Load the new texture
-		loadTexture(currentTexture);
+		scrollAmount = 0;
+		lastAdvance = glutGet(GLUT_ELAPSED_TIME);
 		// Keep a record of which texture we are currently displaying
 		// so we can detect when DGR changes currentTexture on a
 		// slave.
 		alreadyDisplayedTexture = currentTexture;
 	}
 
+	/* Get the current slide, uploading or (if the prefetcher hasn't
+	 * decoded it yet) loading it first. Usually the slide is already
+	 * uploaded and this is just a constant-time state check. */
+	slide *cur = slide_show(currentTexture);
+	float aspectRatio = cur->aspectRatio;
+	GLuint numTiles = cur->numTiles;
+	GLuint *texNames = cur->texNames;
+
 	/* The view frustum is an orthographic frustum for this
 	 * application. The size of the frustum doesn't matter much, but
 	 * the aspect ratio of the frustum should match the aspect ratio
@@ -564,7 +770,11 @@ int main(int argc, char** argv)
 	dgr_init();
 	projmat_init();
 
-	loadTexture(currentTexture);
+	/* Set up the slide cache and start prefetching in the
+	 * background. The first slide is loaded by the first display()
+	 * call. */
+	slide_init();
+	lastAdvance = glutGet(GLUT_ELAPSED_TIME);
 
 	/* Tell GLUT to start running the main loop and to call display(),
 	 * keyboard(), etc callback methods as needed. */
@@ -11,7 +11,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include <GL/glew.h>
 #ifdef FREEGLUT
 #include <GL/freeglut.h>
@@ -24,6 +26,11 @@
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image.h"
+#endif
 GLuint program = 0; // id value for the GLSL program
 
 kuhl_geometry quad;
@@ -37,6 +44,40 @@ GLuint texIdRight = 0;
 GLuint cubemapLeftTex[6];
 GLuint cubemapRightTex[6];
 
+/* Tiled streaming mode (used for mono cylindrical panoramas): the
+ * source image is split into a grid of tiles, each small enough for
+ * GL_MAX_TEXTURE_SIZE on old GPUs. A background thread produces the
+ * tile pixels (from a disk cache of raw tiles written the first time
+ * an image is used, or by decoding the source image if no cache
+ * exists) plus a small preview of the whole panorama. The main thread
+ * uploads the preview as soon as it is ready and then streams in a
+ * couple of tiles per frame, nearest the view direction first, so the
+ * user sees a progressively sharpening panorama instead of waiting
+ * for a 16K image to decode. */
+#define PANO_TILE_COLS 8
+#define PANO_TILE_ROWS 2
+#define PANO_NUM_TILES (PANO_TILE_COLS*PANO_TILE_ROWS)
+#define PANO_PREVIEW_WIDTH 1024
+#define PANO_UPLOADS_PER_FRAME 2
+
+#define PANO_TILE_EMPTY    0 /* pixels not produced yet */
+#define PANO_TILE_READY    1 /* pixels in RAM, waiting for upload */
+#define PANO_TILE_UPLOADED 2 /* OpenGL texture ready to draw */
+
+int tiledMode = 0;              // Are we streaming a tiled panorama?
+char *tiledFilename = NULL;     // The panorama source image.
+kuhl_geometry tileGeom[PANO_NUM_TILES]; // One cylinder patch per tile.
+GLuint tileTex[PANO_NUM_TILES];
+int tileState[PANO_NUM_TILES];
+unsigned char *tilePixels[PANO_NUM_TILES];
+int tileWidth[PANO_NUM_TILES], tileHeight[PANO_NUM_TILES];
+unsigned char *previewPixels = NULL; // Low-res preview of the whole panorama.
+int previewW = 0, previewH = 0;
+int previewReady = 0;
+GLuint previewTex = 0;
+int focusCol = 0; // The tile column nearest the view direction.
+pthread_mutex_t panoMutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 
 /* Called by GLUT whenever a key is pressed. */
@@ -65,6 +106,390 @@ void keyboard(unsigned char key, int x, int y)
 	glutPostRedisplay();
 }
 
+/* Decodes an image file into an RGBA pixel array. Contains no OpenGL
+ * calls, so it can run on the background thread. */
+unsigned char* pano_decode(const char *filename, int *width, int *height)
+{
+	char *newFilename = kuhl_find_file(filename);
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename = newFilename;
+	iioinfo.type = CharPixel;
+	iioinfo.map = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
+#else
+	int comp = -1;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char *image = (unsigned char*) stbi_load(newFilename, width, height, &comp, STBI_rgb_alpha);
+#endif
+	free(newFilename);
+	if(image == NULL)
+	{
+		msg(FATAL, "Unable to read image: %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	return image;
+}
+
+/* The pixel range a tile covers in the source image. Tiles share the
+ * leftover pixels when the image size doesn't divide evenly; both the
+ * cache writer and the cache reader derive the same ranges from the
+ * image size. */
+void pano_tile_rect(int width, int height, int col, int row,
+                    int *x0, int *y0, int *w, int *h)
+{
+	*x0 = (long)col*width/PANO_TILE_COLS;
+	*y0 = (long)row*height/PANO_TILE_ROWS;
+	*w = (long)(col+1)*width/PANO_TILE_COLS - *x0;
+	*h = (long)(row+1)*height/PANO_TILE_ROWS - *y0;
+}
+
+/* Header at the start of a panorama tile cache file. The preview's
+ * RGBA pixels follow the header; then each tile's RGBA pixels in
+ * row-major tile order. */
+struct pano_cache_header
+{
+	char magic[8];     // "kuhlpano"
+	int version;       // bump if the layout changes
+	int width, height; // source image size
+	int cols, rows;    // tile grid dimensions
+	int previewW, previewH;
+};
+
+/* Constructs the cache filename for a panorama: the image path with
+ * ".kuhltiles" appended. Caller should free() the result. */
+char* pano_cache_filename(const char *imageFilename)
+{
+	char *found = kuhl_find_file(imageFilename);
+	char *cacheFilename = malloc(strlen(found)+strlen(".kuhltiles")+1);
+	sprintf(cacheFilename, "%s.kuhltiles", found);
+	free(found);
+	return cacheFilename;
+}
+
+/* Index of the tile nearest the view direction among tiles in the
+ * given state, or -1 if there are none. The caller must hold
+ * panoMutex (focusCol and tileState are shared with the worker). */
+int pano_nearest_tile(int state)
+{
+	int best = -1, bestDist = PANO_TILE_COLS;
+	for(int i=0; i<PANO_NUM_TILES; i++)
+	{
+		if(tileState[i] != state)
+			continue;
+		int col = i % PANO_TILE_COLS;
+		int dist = abs(col - focusCol);
+		if(PANO_TILE_COLS-dist < dist) // wraparound
+			dist = PANO_TILE_COLS-dist;
+		if(dist < bestDist)
+		{
+			bestDist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Serves tiles out of an existing cache file in view-priority order.
+ * Returns 1 on success, 0 if the cache was missing or stale. */
+int pano_stream_from_cache(const char *cacheFilename)
+{
+	FILE *f = fopen(cacheFilename, "rb");
+	if(f == NULL)
+		return 0;
+
+	struct pano_cache_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, "kuhlpano", 8) != 0 ||
+	   header.version != 1 ||
+	   header.cols != PANO_TILE_COLS || header.rows != PANO_TILE_ROWS)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	/* The preview comes first so something appears on screen
+	 * immediately. */
+	unsigned char *preview = malloc((size_t)header.previewW*header.previewH*4);
+	if(fread(preview, (size_t)header.previewW*header.previewH*4, 1, f) != 1)
+	{
+		free(preview);
+		fclose(f);
+		return 0;
+	}
+	pthread_mutex_lock(&panoMutex);
+	previewPixels = preview;
+	previewW = header.previewW;
+	previewH = header.previewH;
+	previewReady = 1;
+	pthread_mutex_unlock(&panoMutex);
+
+	/* Byte offset of each tile's pixels within the file. */
+	long offset = sizeof(header) + (long)header.previewW*header.previewH*4;
+	long tileOffset[PANO_NUM_TILES];
+	for(int i=0; i<PANO_NUM_TILES; i++)
+	{
+		int x0, y0, w, h;
+		pano_tile_rect(header.width, header.height, i%PANO_TILE_COLS, i/PANO_TILE_COLS, &x0, &y0, &w, &h);
+		tileOffset[i] = offset;
+		offset += (long)w*h*4;
+	}
+
+	/* Read the tiles, always picking the one nearest the current view
+	 * direction next. */
+	while(1)
+	{
+		pthread_mutex_lock(&panoMutex);
+		int i = pano_nearest_tile(PANO_TILE_EMPTY);
+		pthread_mutex_unlock(&panoMutex);
+		if(i < 0)
+			break;
+
+		int x0, y0, w, h;
+		pano_tile_rect(header.width, header.height, i%PANO_TILE_COLS, i/PANO_TILE_COLS, &x0, &y0, &w, &h);
+		unsigned char *pixels = malloc((size_t)w*h*4);
+		fseek(f, tileOffset[i], SEEK_SET);
+		if(fread(pixels, (size_t)w*h*4, 1, f) != 1)
+		{
+			msg(ERROR, "Failed to read tile %d from %s\n", i, cacheFilename);
+			free(pixels);
+			fclose(f);
+			return 0;
+		}
+
+		pthread_mutex_lock(&panoMutex);
+		tilePixels[i] = pixels;
+		tileWidth[i] = w;
+		tileHeight[i] = h;
+		tileState[i] = PANO_TILE_READY;
+		pthread_mutex_unlock(&panoMutex);
+	}
+	fclose(f);
+	return 1;
+}
+
+/* Decodes the source panorama, cuts it into tiles and a preview, and
+ * writes the cache file so future runs can stream without decoding. */
+void pano_build_tiles(const char *imageFilename, const char *cacheFilename)
+{
+	int width, height;
+	unsigned char *image = pano_decode(imageFilename, &width, &height);
+	msg(INFO, "Finished reading %s (%dx%d); building tile cache\n", imageFilename, width, height);
+
+	/* Downsample a preview by point sampling. */
+	int pw = PANO_PREVIEW_WIDTH < width ? PANO_PREVIEW_WIDTH : width;
+	int ph = (long)pw*height/width;
+	unsigned char *preview = malloc((size_t)pw*ph*4);
+	for(int y=0; y<ph; y++)
+		for(int x=0; x<pw; x++)
+			memcpy(preview + ((size_t)y*pw+x)*4,
+			       image + (((size_t)y*height/ph)*width + (size_t)x*width/pw)*4, 4);
+
+	pthread_mutex_lock(&panoMutex);
+	previewPixels = preview;
+	previewW = pw;
+	previewH = ph;
+	previewReady = 1;
+	pthread_mutex_unlock(&panoMutex);
+
+	/* Write to a temporary file and rename it so a crash mid-write
+	 * can't leave a truncated cache behind. */
+	char *tmpFilename = malloc(strlen(cacheFilename)+5);
+	sprintf(tmpFilename, "%s.tmp", cacheFilename);
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f != NULL)
+	{
+		struct pano_cache_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "kuhlpano", 8);
+		header.version = 1;
+		header.width = width;
+		header.height = height;
+		header.cols = PANO_TILE_COLS;
+		header.rows = PANO_TILE_ROWS;
+		header.previewW = pw;
+		header.previewH = ph;
+		fwrite(&header, sizeof(header), 1, f);
+		fwrite(preview, (size_t)pw*ph*4, 1, f);
+	}
+	else
+		msg(WARNING, "Unable to write panorama tile cache %s\n", tmpFilename);
+
+	/* Cut out each tile (rows are contiguous within a tile buffer)
+	 * and hand it to the main thread for upload. */
+	for(int i=0; i<PANO_NUM_TILES; i++)
+	{
+		int x0, y0, w, h;
+		pano_tile_rect(width, height, i%PANO_TILE_COLS, i/PANO_TILE_COLS, &x0, &y0, &w, &h);
+		unsigned char *pixels = malloc((size_t)w*h*4);
+		for(int y=0; y<h; y++)
+			memcpy(pixels + (size_t)y*w*4,
+			       image + (((size_t)(y0+y)*width)+x0)*4, (size_t)w*4);
+		if(f != NULL)
+			fwrite(pixels, (size_t)w*h*4, 1, f);
+
+		pthread_mutex_lock(&panoMutex);
+		tilePixels[i] = pixels;
+		tileWidth[i] = w;
+		tileHeight[i] = h;
+		tileState[i] = PANO_TILE_READY;
+		pthread_mutex_unlock(&panoMutex);
+	}
+	free(image);
+
+	if(f != NULL)
+	{
+		fclose(f);
+		rename(tmpFilename, cacheFilename);
+	}
+	free(tmpFilename);
+}
+
+/* The background streaming thread: serves tile pixels from the disk
+ * cache if one exists, otherwise decodes the image and creates the
+ * cache. Exits when every tile has been produced. */
+void* pano_stream_thread(void *arg)
+{
+	(void) arg;
+	char *cacheFilename = pano_cache_filename(tiledFilename);
+	if(!pano_stream_from_cache(cacheFilename))
+		pano_build_tiles(tiledFilename, cacheFilename);
+	free(cacheFilename);
+	return NULL;
+}
+
+/* Creates the cylinder patch for one tile. Each patch covers the
+ * tile's slice of the cylinder side using the same parameterization as
+ * init_geometryCylinder(), but at a slightly smaller radius so the
+ * sharp tiles draw in front of the low-res preview cylinder. */
+void pano_init_tile_geometry(kuhl_geometry *geom, GLuint prog, int col, int row)
+{
+	/* Texture x coordinate 'u' maps to cylinder angle (1-u)*2*pi; see
+	 * the texcoords in init_geometryCylinder(). */
+	float u0 = (float)col/PANO_TILE_COLS;
+	float u1 = (float)(col+1)/PANO_TILE_COLS;
+	float y0 = -.5f + (float)row/PANO_TILE_ROWS;
+	float y1 = -.5f + (float)(row+1)/PANO_TILE_ROWS;
+	float radius = .498f; // cylinder radius is .5; camera is inside
+
+	int segments = 8; // quads along this patch's arc
+	GLfloat vertices[(8+1)*2*3];
+	GLfloat texcoords[(8+1)*2*2];
+	GLuint indices[8*6];
+	for(int s=0; s<=segments; s++)
+	{
+		float u = u0 + (u1-u0)*s/segments;
+		float angle = (1-u)*2*M_PI;
+		for(int v=0; v<2; v++)
+		{
+			vertices[(s*2+v)*3+0] = radius*sin(angle);
+			vertices[(s*2+v)*3+1] = v == 0 ? y0 : y1;
+			vertices[(s*2+v)*3+2] = radius*cos(angle);
+			texcoords[(s*2+v)*2+0] = (float)s/segments;
+			texcoords[(s*2+v)*2+1] = (float)v;
+		}
+	}
+	for(int s=0; s<segments; s++)
+	{
+		indices[s*6+0] = s*2;
+		indices[s*6+1] = s*2+1;
+		indices[s*6+2] = s*2+2;
+		indices[s*6+3] = s*2+1;
+		indices[s*6+4] = s*2+3;
+		indices[s*6+5] = s*2+2;
+	}
+
+	kuhl_geometry_new(geom, prog, (segments+1)*2, GL_TRIANGLES);
+	kuhl_geometry_attrib(geom, vertices, 3, "in_Position", KG_WARN);
+	kuhl_geometry_attrib(geom, texcoords, 2, "in_TexCoord", KG_WARN);
+	kuhl_geometry_indices(geom, indices, segments*6);
+}
+
+/* Sets up tiled streaming mode: creates the tile patches and starts
+ * the background streaming thread. */
+void pano_init(const char *imageFilename, GLuint prog)
+{
+	tiledMode = 1;
+	tiledFilename = strdup(imageFilename);
+	for(int i=0; i<PANO_NUM_TILES; i++)
+		pano_init_tile_geometry(&tileGeom[i], prog, i%PANO_TILE_COLS, i/PANO_TILE_COLS);
+
+	pthread_t streamThread;
+	if(pthread_create(&streamThread, NULL, pano_stream_thread, NULL) != 0)
+	{
+		msg(FATAL, "Failed to create the panorama streaming thread.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Uploads RGBA pixels as a linearly-filtered clamped texture. */
+GLuint pano_upload_pixels(const unsigned char *pixels, int width, int height)
+{
+	GLuint texId;
+	glGenTextures(1, &texId);
+	glBindTexture(GL_TEXTURE_2D, texId);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+	             GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texId;
+}
+
+/* Called once per frame: updates which tile column the camera is
+ * looking at (the streaming thread and the uploader prioritize it)
+ * and uploads a bounded number of ready tiles so no frame stalls on a
+ * burst of uploads. */
+void pano_update(const float viewMat[16])
+{
+	/* The camera's look direction in world space is minus the third
+	 * row of the view matrix's rotation part. Convert it to a cylinder
+	 * angle and then to a tile column (texture u = 1 - angle/2pi). */
+	float angle = atan2f(-viewMat[2], -viewMat[10]);
+	float u = 1 - angle/(2*M_PI);
+	u = u - floorf(u);
+	pthread_mutex_lock(&panoMutex);
+	focusCol = (int)(u*PANO_TILE_COLS) % PANO_TILE_COLS;
+
+	if(previewReady && previewTex == 0)
+	{
+		previewTex = pano_upload_pixels(previewPixels, previewW, previewH);
+		free(previewPixels);
+		previewPixels = NULL;
+		kuhl_geometry_texture(&cylinder, previewTex, "tex", KG_WARN);
+		msg(INFO, "Panorama preview is up; streaming full-resolution tiles.\n");
+	}
+
+	for(int n=0; n<PANO_UPLOADS_PER_FRAME; n++)
+	{
+		int i = pano_nearest_tile(PANO_TILE_READY);
+		if(i < 0)
+			break;
+		tileTex[i] = pano_upload_pixels(tilePixels[i], tileWidth[i], tileHeight[i]);
+		free(tilePixels[i]);
+		tilePixels[i] = NULL;
+		tileState[i] = PANO_TILE_UPLOADED;
+		kuhl_geometry_texture(&tileGeom[i], tileTex[i], "tex", KG_WARN);
+	}
+	pthread_mutex_unlock(&panoMutex);
+}
+
+/* Draws the panorama: the low-res preview cylinder behind whichever
+ * full-resolution tiles have been uploaded so far. */
+void pano_draw(void)
+{
+	if(previewTex != 0)
+		kuhl_geometry_draw(&cylinder);
+	for(int i=0; i<PANO_NUM_TILES; i++)
+		if(tileState[i] == PANO_TILE_UPLOADED)
+			kuhl_geometry_draw(&tileGeom[i]);
+}
+
 void setupCubemap(GLuint texId[6], kuhl_geometry q, const float origModelView[16])
 {
 	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,origModelView);
@@ -182,7 +607,12 @@ void display()
 		                   modelview); // value
 		kuhl_errorcheck();
 
-		if(texIdLeft != 0 && texIdRight != 0) // cylinder
+		if(tiledMode) // tiled streaming cylinder
+		{
+			pano_update(viewMat);
+			pano_draw();
+		}
+		else if(texIdLeft != 0 && texIdRight != 0) // cylinder
 		{
 			/* Draw the cylinder with the appropriate texture */
 			if(eye == VIEWMAT_EYE_RIGHT)
@@ -467,6 +897,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -483,9 +914,12 @@ int main(int argc, char** argv)
 
 	if(argc == 2)
 	{
-		msg(INFO, "Cylinder mono image: %s\n", argv[1]);
-		kuhl_read_texture_file(argv[1], &texIdLeft);
-		texIdRight = texIdLeft;
+		/* Stream the image in as tiles instead of loading it with
+		 * kuhl_read_texture_file(): a single texture can exceed
+		 * GL_MAX_TEXTURE_SIZE for large panoramas, and decoding a 16K
+		 * image stalls startup for many seconds. */
+		msg(INFO, "Cylinder mono image (tiled streaming): %s\n", argv[1]);
+		pano_init(argv[1], program);
 	}
 	if(argc == 3)
 	{
@@ -0,0 +1,33 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+/* The particle update shader. kuhl_particles_update() runs this over
+ * every particle and captures out_Position and out_Velocity back into
+ * a buffer object with transform feedback; nothing is rasterized. */
+
+in vec3 in_Position;
+in vec3 in_Velocity;
+
+out vec3 out_Position;
+out vec3 out_Velocity;
+
+uniform float dt; // timestep in seconds
+
+void main()
+{
+	vec3 accel = vec3(0.0, -9.8, 0.0);
+	vec3 vel = in_Velocity + dt*accel;
+	vec3 pos = in_Position + dt*(in_Velocity + dt*accel/2.0);
+
+	/* Bounce the particles off the xz-plane, losing energy. */
+	if(pos.y < 0.0)
+	{
+		float velocityLossFactor = 0.4;
+		pos.y = -pos.y * velocityLossFactor;
+		vel.y = -vel.y;
+		vel = vel * velocityLossFactor;
+	}
+
+	out_Position = pos;
+	out_Velocity = vel;
+	gl_Position = vec4(pos, 1.0);
+}
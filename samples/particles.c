@@ -0,0 +1,256 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Demonstrates a GPU-resident particle system. All of the
+ * particle state lives in OpenGL buffer objects; a transform feedback
+ * pass integrates the motion and rendering reads straight from the
+ * GPU buffer, so the CPU never touches particle data after
+ * initialization. Compare with explode.c, which simulates particles
+ * on the CPU and re-uploads vertex data every frame.
+ *
+ * Set the PARTICLES environment variable to change the number of
+ * particles (default: 1 million). Press the space bar to restart the
+ * explosion.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <GL/glew.h>
+#ifdef FREEGLUT
+#include <GL/freeglut.h>
+#else
+#include <GLUT/glut.h>
+#endif
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "dgr.h"
+#include "projmat.h"
+#include "viewmat.h"
+GLuint program = 0; // id value for the GLSL program
+
+kuhl_particles particles;
+unsigned int numParticles = 1000000;
+
+/** Creates (or re-creates) the particle system: every particle starts
+ * near the origin with a random upward velocity. This is the only
+ * time particle data is generated on the CPU. */
+void init_particles(void)
+{
+	GLfloat *pos = kuhl_malloc(numParticles*3*sizeof(GLfloat));
+	GLfloat *vel = kuhl_malloc(numParticles*3*sizeof(GLfloat));
+	for(unsigned int i=0; i<numParticles; i++)
+	{
+		for(int k=0; k<3; k++)
+		{
+			pos[i*3+k] = (drand48()-.5)*.1;
+			vel[i*3+k] = (drand48()-.5)*4;
+		}
+		pos[i*3+1] += 1;   // start a bit above the floor
+		vel[i*3+1] += 5;   // make the burst move mostly upward
+	}
+	kuhl_particles_init(&particles, numParticles, "particles-update.vert",
+	                    program, pos, vel);
+	free(pos);
+	free(vel);
+}
+
+/* Called by GLUT whenever a key is pressed. */
+void keyboard(unsigned char key, int x, int y)
+{
+	switch(key)
+	{
+		case 'q':
+		case 'Q':
+		case 27: // ASCII code for Escape key
+			dgr_exit();
+			exit(EXIT_SUCCESS);
+			break;
+		case ' ': // restart the explosion
+			kuhl_particles_delete(&particles);
+			init_particles();
+			break;
+	}
+
+	/* Whenever any key is pressed, request that display() get
+	 * called. */
+	glutPostRedisplay();
+}
+
+/* Called by GLUT whenever the window needs to be redrawn. This
+ * function should not be called directly by the programmer. Instead,
+ * we can call glutPostRedisplay() to request that GLUT call display()
+ * at some point. */
+void display()
+{
+	/* If we are using DGR, send or receive data to keep multiple
+	 * processes/computers synchronized. */
+	dgr_update();
+
+	/* Advance the simulation once per frame (not once per viewport)
+	 * using the wall-clock time since the previous frame. All of the
+	 * work happens on the GPU. */
+	static int lastTime = -1;
+	int now = glutGet(GLUT_ELAPSED_TIME);
+	if(lastTime < 0)
+		lastTime = now;
+	float dt = (now-lastTime) / 1000.0f;
+	if(dt > .1f) // don't take huge steps if rendering stalls
+		dt = .1f;
+	lastTime = now;
+	/* Make sure all computers/processes use the same timestep. */
+	dgr_setget("dt", &dt, sizeof(float));
+	kuhl_particles_update(&particles, dt);
+
+	/* Render the scene once for each viewport. Frequently one
+	 * viewport will fill the entire screen. However, this loop will
+	 * run twice for HMDs (once for the left eye and once for the
+	 * right). */
+	viewmat_begin_frame();
+	for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
+	{
+		viewmat_begin_eye(viewportID);
+
+		/* Where is the viewport that we are drawing onto and what is its size? */
+		int viewport[4]; // x,y of lower left corner, width, height
+		viewmat_get_viewport(viewport, viewportID);
+		/* Tell OpenGL the area of the window that we will be drawing in. */
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+		/* Clear the current viewport. Without glScissor(), glClear()
+		 * clears the entire screen. We could call glClear() before
+		 * this viewport loop---but in order for all variations of
+		 * this code to work (Oculus support, etc), we can only draw
+		 * after viewmat_begin_eye(). */
+		glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glEnable(GL_SCISSOR_TEST);
+		glClearColor(.2,.2,.2,0); // set clear color to grey
+		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+		glEnable(GL_DEPTH_TEST); // turn on depth testing
+		kuhl_errorcheck();
+
+		/* Get the view matrix and the projection matrix */
+		float viewMat[16], perspective[16];
+		viewmat_get(viewMat, perspective, viewportID);
+
+		/* Tell OpenGL which GLSL program the subsequent
+		 * glUniformMatrix4fv() calls are for. */
+		kuhl_errorcheck();
+		glUseProgram(program);
+		kuhl_errorcheck();
+
+		/* Send the perspective projection matrix to the vertex program. */
+		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
+		                   1, // number of 4x4 float matrices
+		                   0, // transpose
+		                   perspective); // value
+		/* Send the modelview matrix to the vertex program. */
+		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
+		                   1, // number of 4x4 float matrices
+		                   0, // transpose
+		                   viewMat); // value
+		kuhl_errorcheck();
+		/* Draw the particles straight from the GPU buffer that the
+		 * update pass wrote into. */
+		kuhl_particles_draw(&particles);
+
+		glUseProgram(0); // stop using a GLSL program.
+
+	} // finish viewport loop
+	viewmat_end_frame();
+
+	/* Check for errors. If there are errors, consider adding more
+	 * calls to kuhl_errorcheck() in your code. */
+	kuhl_errorcheck();
+
+	static int fps_state_init = 0;
+	static kuhl_fps_state fps_state;
+	if(fps_state_init == 0)
+	{
+		kuhl_getfps_init(&fps_state);
+		fps_state_init = 1;
+	}
+	float fps = kuhl_getfps(&fps_state);
+	if(fps_state.frame == 0)
+		msg(INFO, "fps: %6.1f (%u particles)\n", fps, numParticles);
+
+	/* Ask GLUT to call display() again. We shouldn't call display()
+	 * ourselves recursively because it will not leave time for GLUT
+	 * to call other callback functions for when a key is pressed, the
+	 * window is resized, etc. */
+	glutPostRedisplay();
+}
+
+int main(int argc, char** argv)
+{
+	/* set up our GLUT window */
+	glutInit(&argc, argv);
+	glutInitWindowSize(512, 512);
+	/* Ask GLUT to for a double buffered, full color window that
+	 * includes a depth buffer */
+#ifdef FREEGLUT
+	glutSetOption(GLUT_MULTISAMPLE, 4); // set msaa samples; default to 4
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
+	glutInitContextVersion(3,2);
+	glutInitContextProfile(GLUT_CORE_PROFILE);
+#else
+	glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
+#endif
+	glutCreateWindow(argv[0]); // set window title to executable name
+	glEnable(GL_MULTISAMPLE);
+
+	/* Initialize GLEW */
+	glewExperimental = GL_TRUE;
+	GLenum glewError = glewInit();
+	if(glewError != GLEW_OK)
+	{
+		fprintf(stderr, "Error initializing GLEW: %s\n", glewGetErrorString(glewError));
+		exit(EXIT_FAILURE);
+	}
+	/* When experimental features are turned on in GLEW, the first
+	 * call to glGetError() or kuhl_errorcheck() may incorrectly
+	 * report an error. So, we call glGetError() to ensure that a
+	 * later call to glGetError() will only see correct errors. For
+	 * details, see:
+	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
+	glGetError();
+	kuhl_debug_init();
+
+	// setup callbacks
+	glutDisplayFunc(display);
+	glutKeyboardFunc(keyboard);
+
+	/* Allow the particle count to be changed without recompiling. */
+	const char* countString = getenv("PARTICLES");
+	if(countString != NULL && atoi(countString) > 0)
+		numParticles = (unsigned int) atoi(countString);
+	msg(INFO, "Simulating %u particles on the GPU.\n", numParticles);
+
+	/* Compile and link a GLSL program composed of a vertex shader and
+	 * a fragment shader. */
+	program = kuhl_create_program("particles.vert", "particles.frag");
+	kuhl_errorcheck();
+
+	/* Create the GPU particle system. */
+	init_particles();
+
+	dgr_init();     /* Initialize DGR based on environment variables. */
+	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
+
+	float initCamPos[3]  = {0,3,10}; // location of camera
+	float initCamLook[3] = {0,1,0};  // a point the camera is facing at
+	float initCamUp[3]   = {0,1,0};  // a vector indicating which direction is up
+	viewmat_init(initCamPos, initCamLook, initCamUp);
+
+	/* Tell GLUT to start running the main loop and to call display(),
+	 * keyboard(), etc callback methods as needed. */
+	glutMainLoop();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,9 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+in vec4 color;
+out vec4 fragColor;
+
+void main()
+{
+	fragColor = color;
+}
@@ -0,0 +1,19 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+in vec3 in_Position;
+in vec3 in_Velocity;
+
+out vec4 color;
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+
+void main()
+{
+	/* Color fast particles brighter than slow ones. */
+	float speed = clamp(length(in_Velocity)/10.0, 0.0, 1.0);
+	color = vec4(1.0, 1.0-speed*0.8, 0.2, 1.0);
+
+	vec4 pos = vec4(in_Position, 1.0);
+	gl_Position = Projection * ModelView * pos;
+}
@@ -0,0 +1,11 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+out vec4 fragColor;
+
+/* The object's ID encoded as a color; see kuhl_picker_color(). */
+uniform vec4 PickColor;
+
+void main()
+{
+	fragColor = PickColor;
+}
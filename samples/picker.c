@@ -4,8 +4,13 @@
  */
 
 /** @file This example demonstrates how to draw a HUD cursor and how
- * to use the stencil buffer to determine what piece of geometry the
- * cursor is on. For more information and details, see:
+ * to determine what piece of geometry the cursor is on without
+ * stalling the pipeline. Each object is drawn into a small offscreen
+ * buffer with a color that encodes its ID, and the pixel under the
+ * cursor is read back asynchronously through a pixel buffer object
+ * (see kuhl_picker_init() in kuhl-util.c); the answer arrives one
+ * frame later instead of making the CPU wait for the GPU. For more
+ * information about color picking, see:
  * http://en.wikibooks.org/wiki/OpenGL_Programming/Object_selection
  *
  * @author Scott Kuhl
@@ -27,11 +32,24 @@
 #include "projmat.h"
 #include "viewmat.h"
 GLuint program = 0; // id value for the GLSL program
+GLuint pickProgram = 0; // program that renders object IDs as colors
 
 kuhl_geometry cursor;
 kuhl_geometry triangle;
 kuhl_geometry quad;
 
+/* Position-only copies of the geometry, associated with pickProgram,
+ * used for the ID render. */
+kuhl_geometry pickTriangle;
+kuhl_geometry pickQuad;
+
+kuhl_picker picker;
+
+/* IDs that the picker reports for our two objects. 0 means "no
+ * object". */
+#define PICK_ID_TRIANGLE 1
+#define PICK_ID_QUAD     2
+
 
 /* Called by GLUT whenever a key is pressed. */
 void keyboard(unsigned char key, int x, int y)
@@ -83,7 +101,7 @@ void display()
 		glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
 		glEnable(GL_SCISSOR_TEST);
 		glClearColor(.2,.2,.2,0); // set clear color to grey
-		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT);
+		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 		glDisable(GL_SCISSOR_TEST);
 		glEnable(GL_DEPTH_TEST); // turn on depth testing
 		kuhl_errorcheck();
@@ -127,19 +145,11 @@ void display()
 		                   modelview); // value
 		kuhl_errorcheck();
 
-			/* Draw the geometry using the matrices that we sent to the
-			 * vertex programs immediately above. Use the stencil buffer
-			 * to keep track of which object appears on top. */
-		if(viewportID == 0)
-			glEnable(GL_STENCIL_TEST);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-		glStencilFunc(GL_ALWAYS, 1, -1);
+		/* Draw the geometry using the matrices that we sent to the
+		 * vertex programs immediately above. */
 		kuhl_geometry_draw(&triangle);
-		
-		glStencilFunc(GL_ALWAYS, 2, -1);
 		kuhl_geometry_draw(&quad);
-		glDisable(GL_STENCIL_TEST);
-		
+
 		/* If we have multiple viewports, only draw cursor in the
 		 * first viewport. */
 		if(viewportID == 0)
@@ -159,28 +169,45 @@ void display()
 			kuhl_geometry_draw(&cursor);
 			glEnable(GL_DEPTH_TEST);
 
-			/* When we render images on the Oculus, we are rendering
-			 * into a multisampled framebuffer object, and we can't
-			 * read from the multisample FBO until we have blitted it
-			 * into a normal FBO. Here, we get the blitted FBO for the
-			 * *previous* frame. */
-			GLint fb =viewmat_get_blitted_framebuffer(viewportID);
-			glBindFramebuffer(GL_FRAMEBUFFER, fb);
-			
-			GLuint stencilVal = 0;
-			kuhl_errorcheck();
-			glReadPixels(viewport[0]+viewport[2]/2, viewport[1]+viewport[3]/2,
-			             1,1, // get data for 1x1 area (i.e., a pixel)
-			             GL_STENCIL_INDEX, // query the stencil buffer
-			             GL_UNSIGNED_INT,
-			             &stencilVal);
-			kuhl_errorcheck();
-			if(stencilVal == 1)
-				printf("Cursor is on triangle.\n");
-			else if(stencilVal == 2)
-				printf("Cursor is on quad.\n");
-			else
+			/* Collect the result of the ID readback we queued on the
+			 * PREVIOUS frame. The GPU has had a whole frame to finish
+			 * the transfer, so this never stalls. */
+			unsigned int pickedIds[8];
+			int numPicked = kuhl_picker_result(&picker, pickedIds,
+			                                   8); // capacity
+			if(numPicked == 0)
 				printf("Cursor isn't on anything.\n");
+			for(int i=0; i<numPicked; i++)
+			{
+				if(pickedIds[i] == PICK_ID_TRIANGLE)
+					printf("Cursor is on triangle.\n");
+				else if(pickedIds[i] == PICK_ID_QUAD)
+					printf("Cursor is on quad.\n");
+			}
+
+			/* Render the object IDs into the picker's small offscreen
+			 * buffer and queue an asynchronous readback of the pixel
+			 * under the cursor. To support marquee selection, query a
+			 * larger region instead of a 1x1 one; every distinct ID in
+			 * the region is reported in one readback. */
+			kuhl_picker_begin(&picker);
+			glUseProgram(pickProgram);
+			glUniformMatrix4fv(kuhl_get_uniform("Projection"),
+			                   1, 0, perspective);
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
+			                   1, 0, modelview);
+			float pickColor[4];
+			kuhl_picker_color(PICK_ID_TRIANGLE, pickColor);
+			glUniform4fv(kuhl_get_uniform("PickColor"), 1, pickColor);
+			kuhl_geometry_draw(&pickTriangle);
+			kuhl_picker_color(PICK_ID_QUAD, pickColor);
+			glUniform4fv(kuhl_get_uniform("PickColor"), 1, pickColor);
+			kuhl_geometry_draw(&pickQuad);
+			kuhl_errorcheck();
+			/* The cursor is at the center of the viewport, which is
+			 * the center of the ID buffer. */
+			kuhl_picker_end(&picker, picker.width/2, picker.height/2,
+			                1, 1); // 1x1 region (i.e., a pixel)
 		}
 
 		glUseProgram(0); // stop using a GLSL program.
@@ -267,6 +294,31 @@ void init_geometryQuad(kuhl_geometry *geom, GLuint prog)
 	kuhl_errorcheck();
 }
 
+/* Position-only copies of the triangle and quad for the ID render;
+ * the picking program doesn't use the color attribute. */
+void init_geometryTrianglePick(kuhl_geometry *geom, GLuint prog)
+{
+	kuhl_geometry_new(geom, prog, 3, GL_TRIANGLES);
+	GLfloat vertexPositions[] = {0, 0, 0,
+	                             1, 0, 0,
+	                             1, 1, 0};
+	kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", KG_WARN);
+}
+
+void init_geometryQuadPick(kuhl_geometry *geom, GLuint prog)
+{
+	kuhl_geometry_new(geom, prog, 4, GL_TRIANGLES);
+	GLfloat vertexPositions[] = {0+1.1, 0, 0,
+	                             1+1.1, 0, 0,
+	                             1+1.1, 1, 0,
+	                             0+1.1, 1, 0 };
+	kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", KG_WARN);
+	GLuint indexData[] = { 0, 1, 2,
+	                       0, 2, 3 };
+	kuhl_geometry_indices(geom, indexData, 6);
+	kuhl_errorcheck();
+}
+
 int main(int argc, char** argv)
 {
 	/* set up our GLUT window */
@@ -300,6 +352,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -316,11 +369,20 @@ int main(int argc, char** argv)
 	/* Good practice: Unbind objects until we really need them. */
 	glUseProgram(0);
 
+	/* Compile the program that renders object IDs as colors and
+	 * create the offscreen ID buffer that the IDs get rendered
+	 * into. The ID buffer is much smaller than the window; picking
+	 * doesn't need full resolution. */
+	pickProgram = kuhl_create_program("picker-id.vert", "picker-id.frag");
+	kuhl_picker_init(&picker, 256, 256);
+
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
 	init_geometryCursor(&cursor, program);
 	init_geometryTriangle(&triangle, program);
 	init_geometryQuad(&quad, program);
+	init_geometryTrianglePick(&pickTriangle, pickProgram);
+	init_geometryQuadPick(&pickQuad, pickProgram);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
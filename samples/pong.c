@@ -81,6 +81,15 @@ GLuint texIdClouds;
 GLuint texIdStars;
 float ticks = 200.0f;
 
+/* The game advances at a fixed 60 steps per second (see game_step()),
+ * decoupled from the render rate, so the ball moves at the same speed
+ * no matter how fast or slow a machine renders. The ball and the
+ * background are drawn interpolated between their two most recent
+ * simulation states. */
+kuhl_timestep_state timestep;
+float ballPrevX = 0, ballPrevY = 0;
+float ticksPrev = 200.0f;
+
 float screen_width = 0.0f, screen_height = 0.0f;
 
 void drawPaddle(Paddle paddle, float depth);
@@ -354,19 +363,24 @@ void game()
 	}
 }
 
-void display()
+/* One fixed-size simulation step: remember the previous ball position
+ * and background scroll for interpolated rendering, then advance the
+ * game. kuhl_timestep_run() calls this at a steady 60 steps per second
+ * regardless of the render rate. */
+void game_step(float dt)
 {
-	/* If we are using DGR, send or receive data to keep multiple
-	 * processes/computers synchronized. */
-	dgr_update();
-		
-	/* Syncronize the DGR objects */
-	dgr_setget("paddleA", &paddleA, sizeof(Paddle));
-	dgr_setget("paddleB", &paddleB, sizeof(Paddle));
-	dgr_setget("ball", &ball, sizeof(Ball));
-	dgr_setget("planet", planet, sizeof(float)*3);
-	dgr_setget("state", &gameState, sizeof(int));
+	(void) dt; // the ball speed is tuned in units per step
+	ballPrevX = ball.xpos;
+	ballPrevY = ball.ypos;
+	ticksPrev = ticks;
+	game();
+	ticks += .005;
+	if(ticks > 360.0f)
+		ticks = 0.0f;
+}
 
+void draw_scene(float alpha)
+{
 	glEnable(GL_LIGHTING);
 	glEnable(GL_LIGHT0);
 	glEnable(GL_COLOR_MATERIAL);
@@ -408,8 +422,11 @@ void display()
  	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	
-	// Draw the background quad with the scrolling star texture
-	float tickmod = ticks / 200.0f;
+	// Draw the background quad with the scrolling star texture.
+	// Interpolate the scroll between the two most recent simulation
+	// steps so it stays smooth at any frame rate.
+	float tickdraw = ticksPrev + (ticks - ticksPrev) * alpha;
+	float tickmod = tickdraw / 200.0f;
 	glBegin(GL_QUADS);
 	glTexCoord2f(tickmod+1.0f, -tickmod);
 	glVertex3f(masterfrust[1], masterfrust[3], depth-3.0);
@@ -429,9 +446,7 @@ void display()
 	glTranslatef(planet[0], planet[1], depth-3.0);
 	glRotatef(25.0f, 0.0f, 0.0f, 1.0f);
 	glRotatef(-90, 1.0f, 0.0f, 0.0f);
-	glRotatef(ticks, 0.0f, 0.0f, 1.0f);
-	ticks += .005;
-	if(ticks > 360.0f)ticks = 0.0f;
+	glRotatef(tickdraw, 0.0f, 0.0f, 1.0f);
 	gluSphere(earth, planet[2]*1.65f, 200, 200);
 	glPopMatrix();
     
@@ -444,7 +459,7 @@ void display()
 	glTranslatef(planet[0], planet[1], depth-3.0);
 	glRotatef(25.0f, 0.0f, 0.0f, 1.0f);
 	glRotatef(-90, 1.0f, 0.0f, 0.0f);
-	glRotatef(ticks, 1.0f, 0.0f, 1.0f);
+	glRotatef(tickdraw, 1.0f, 0.0f, 1.0f);
 	gluSphere(clouds, planet[2]*1.652f, 200, 200);
 	glPopMatrix();
 	
@@ -461,23 +476,43 @@ void display()
 	
 	glDisable(GL_BLEND);
 	
-	// ball
+	// ball (interpolated between its two most recent simulation steps)
 	glEnable(GL_LIGHTING);
     glColor3fv(ball.color);
 	glPushMatrix();
-	glTranslatef(ball.xpos, ball.ypos, depth+4.0f);
+	glTranslatef(ballPrevX + (ball.xpos - ballPrevX) * alpha,
+	             ballPrevY + (ball.ypos - ballPrevY) * alpha,
+	             depth+4.0f);
 	glutSolidSphere(ball.radius, 100, 100);
 	glPopMatrix();
-	
-	/* If DGR is enabled, only do this in the master*/
-	if(dgr_is_enabled() == 0 || dgr_is_master())
-	{
-		// Run the game code
-		game();	
-	}
-	
+
 	glFlush();
 	glutSwapBuffers();
+}
+
+void display()
+{
+	/* If we are using DGR, send or receive data to keep multiple
+	 * processes/computers synchronized. */
+	dgr_update();
+
+	/* Syncronize the DGR objects */
+	dgr_setget("paddleA", &paddleA, sizeof(Paddle));
+	dgr_setget("paddleB", &paddleB, sizeof(Paddle));
+	dgr_setget("ball", &ball, sizeof(Ball));
+	dgr_setget("planet", planet, sizeof(float)*3);
+	dgr_setget("state", &gameState, sizeof(int));
+
+	/* The master advances the game at a fixed 60 steps per second no
+	 * matter how fast this frame loop runs, then renders interpolated
+	 * between the two most recent steps. Slaves don't run the game;
+	 * they draw the state the master sent exactly where it is
+	 * (alpha=1). */
+	if(dgr_is_enabled() == 0 || dgr_is_master())
+		kuhl_timestep_run(&timestep, game_step, draw_scene);
+	else
+		draw_scene(1);
+
 	glutPostRedisplay(); // call display() repeatedly
 }
 
@@ -552,6 +587,10 @@ int main( int argc, char* argv[] )
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
 
+	/* Run the game at 60 simulation steps per second regardless of the
+	 * render rate (see game_step()). */
+	kuhl_timestep_init(&timestep, 60);
+
 	float frustum[6]; // left, right, bottom, top, near, far
 	                  // 0     1      2       3    4     5
 	projmat_get_frustum(frustum, -1, -1);
@@ -29,9 +29,11 @@ GLuint program = 0; // id value for the GLSL program
 GLuint prerendProgram = 0;
 
 #define USE_MSAA 1
-GLuint prerenderFrameBuffer = 0;
-GLuint prerenderFrameBufferAA = 0;
-GLuint prerenderTexID = 0;
+/* Render targets acquired from the framebuffer pool in kuhl-util.c;
+ * the pool lets us resize them in place when the window changes size
+ * instead of creating new framebuffers and leaking the old ones. */
+kuhl_render_target *prerenderTarget = NULL;
+kuhl_render_target *prerenderTargetAA = NULL;
 
 kuhl_geometry triangle;
 kuhl_geometry quad;
@@ -135,49 +137,64 @@ void display()
 
 		/* Setup prerender directly to texture once (and reuse the
 		 * framebuffer object for subsequent draw commands). */
-		if(prerenderFrameBuffer == 0)
+		if(prerenderTarget == NULL)
 		{
 #if USE_MSAA==1
-			/* Generate a MSAA framebuffer + texture */
-			GLuint prerenderTexIDAA;
-			prerenderFrameBufferAA = kuhl_gen_framebuffer_msaa(viewport[2], viewport[3],
-			                                                   &prerenderTexIDAA,
-			                                                   NULL, 16);
+			/* Acquire a MSAA render target */
+			prerenderTargetAA = kuhl_framebuffer_acquire(viewport[2], viewport[3], 16);
 #endif
-			prerenderFrameBuffer = kuhl_gen_framebuffer(viewport[2], viewport[3],
-			                                                   &prerenderTexID,
-			                                                   NULL);
+			prerenderTarget = kuhl_framebuffer_acquire(viewport[2], viewport[3], 0);
 			/* Apply the texture to our geometry and draw the quad. */
-			kuhl_geometry_texture(&prerendQuad, prerenderTexID, "tex", 1);
+			kuhl_geometry_texture(&prerendQuad, prerenderTarget->texture, "tex", 1);
+		}
+		else
+		{
+			/* If the window was resized, resize the render targets to
+			 * match. The texture IDs don't change, so the texture we
+			 * applied to prerendQuad stays valid. These calls do
+			 * nothing when the size is unchanged. */
+#if USE_MSAA==1
+			kuhl_framebuffer_resize(prerenderTargetAA, viewport[2], viewport[3]);
+#endif
+			kuhl_framebuffer_resize(prerenderTarget, viewport[2], viewport[3]);
 		}
 		/* Switch to framebuffer and set the OpenGL viewport to cover
 		 * the entire framebuffer. */
 #if USE_MSAA==1
-		glBindFramebuffer(GL_FRAMEBUFFER, prerenderFrameBufferAA);
+		glBindFramebuffer(GL_FRAMEBUFFER, prerenderTargetAA->framebuffer);
 #else
-		glBindFramebuffer(GL_FRAMEBUFFER, prerenderFrameBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, prerenderTarget->framebuffer);
 #endif
-		glViewport(0,0,viewport[2], viewport[3]);
+		/* Render the scene at the resolution the render-scale
+		 * controller chose: when the GPU falls behind, we render into
+		 * a smaller corner of the target and stretch it during the
+		 * composite instead of dropping frames. */
+		float renderScale = kuhl_render_scale();
+		int scaledWidth  = (int) (viewport[2] * renderScale);
+		int scaledHeight = (int) (viewport[3] * renderScale);
+		glViewport(0,0,scaledWidth, scaledHeight);
 		kuhl_errorcheck();
 
 		/* Clear the framebuffer and the depth buffer. */
 		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 		/* Draw the geometry using the matrices that we sent to the
 		 * vertex programs immediately above */
+		kuhl_render_scale_begin();
 		kuhl_geometry_draw(&triangle);
 		kuhl_geometry_draw(&quad);
+		kuhl_render_scale_end();
 
 		/* Stop rendering to texture */
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glUseProgram(0);
 		kuhl_errorcheck();
-		
+
 #if USE_MSAA==1
 		/* Copy the MSAA framebuffer into the normal framebuffer */
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, prerenderFrameBufferAA);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, prerenderFrameBuffer);
-		glBlitFramebuffer(0,0,viewport[2],viewport[3],
-		                  0,0,viewport[2],viewport[3],
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, prerenderTargetAA->framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, prerenderTarget->framebuffer);
+		glBlitFramebuffer(0,0,scaledWidth,scaledHeight,
+		                  0,0,scaledWidth,scaledHeight,
 		                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
 		glBindFramebuffer(GL_READ_FRAMEBUFFER,0);
 		glBindFramebuffer(GL_DRAW_FRAMEBUFFER,0);
@@ -187,9 +204,15 @@ void display()
 		/* Set up the viewport to draw on the screen */
 		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 
-
+		/* Tell the composite shader which portion of the texture the
+		 * scene was rendered into so it stretches just that portion
+		 * over the screen. */
+		glUseProgram(prerendProgram);
+		glUniform2f(kuhl_get_uniform("texSubset"),
+		            scaledWidth /(float)viewport[2],
+		            scaledHeight/(float)viewport[3]);
 		kuhl_geometry_draw(&prerendQuad);
-		
+
 	} // finish viewport loop
 	viewmat_end_frame();
 
@@ -306,6 +329,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -328,7 +352,12 @@ int main(int argc, char** argv)
 	init_geometryQuad(&quad, program);
 
 	prerendProgram = kuhl_create_program("prerend.vert", "prerend.frag");
-	init_geometryQuadPrerender(&prerendQuad, prerendProgram);	
+	init_geometryQuadPrerender(&prerendQuad, prerendProgram);
+
+	/* Let the render-scale controller shrink the offscreen rendering
+	 * when the GPU can't finish the scene within 14 ms (leaving the
+	 * rest of a 60 Hz frame for the composite). */
+	kuhl_render_scale_init(14, .5);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
@@ -5,6 +5,10 @@ in vec2 out_TexCoord;
 
 uniform sampler2D tex;
 
+/* The portion of the texture the scene was rendered into (1,1 =
+ * all of it); smaller when dynamic resolution scaling kicked in. */
+uniform vec2 texSubset;
+
 
 void main() 
 {
@@ -39,7 +43,7 @@ void main()
 	    (warp_coord.t > 1 || warp_coord.t < 0.0))
 		fragColor = vec4(0,0,0,1); // black
 	else
-		fragColor = texture(tex, warp_coord);  // lookup into the texture
+		fragColor = texture(tex, warp_coord * texSubset);  // lookup into the rendered portion of the texture
 
 
 }
@@ -26,6 +26,18 @@
    
    https://wiki.archlinux.org/index.php/NVIDIA
 
+   Besides the qualitative flicker test, this program turns on the
+   library's swap instrumentation (see kuhl_swapstats_enable() in
+   kuhl-util.c): once per second it prints this node's swap-to-swap
+   jitter, missed vsync count, and GPU swap time, prefixed with the
+   hostname so reports from every node of a display wall can be
+   combined. It also draws a binary frame-ID marker in the lower-left
+   corner of the screen; photographing adjacent wall segments and
+   comparing the markers verifies that the DGR swap barrier is keeping
+   the segments on the same frame. Set KUHL_SWAPSTATS_HZ if your
+   displays do not refresh at 60 Hz. Any program that uses viewmat can
+   get the same reports by setting KUHL_SWAPSTATS=1.
+
    @author Scott Kuhl, Sam Seltzer-Johnston
 
  */
@@ -216,6 +228,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -246,6 +259,11 @@ int main(int argc, char** argv)
 	viewmat_init(initCamPos, initCamLook, initCamUp);
 
 	kuhl_getfps_init(&fps_state);
+
+	/* Measure the swaps instead of just eyeballing them; see the
+	 * comment at the top of this file. */
+	kuhl_swapstats_enable(0);
+
 	/* Tell GLUT to start running the main loop and to call display(),
 	 * keyboard(), etc callback methods as needed. */
 	glutMainLoop();
@@ -0,0 +1,21 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+#extension GL_ARB_shader_viewport_layer_array : require
+
+in vec3 in_Position;
+
+/* One matrix per eye (0=left, 1=right). */
+uniform mat4 ModelView[2];
+uniform mat4 Projection[2];
+
+uniform int red;
+
+void main()
+{
+	vec4 pos = vec4(in_Position.x, in_Position.y, in_Position.z, 1.0);
+	/* Each piece of geometry is drawn with two instances. Route
+	 * instance 0 into the left eye's viewport and instance 1 into the
+	 * right eye's viewport so the scene only has to be submitted
+	 * once. */
+	gl_ViewportIndex = gl_InstanceID;
+	gl_Position = Projection[gl_InstanceID] * ModelView[gl_InstanceID] * pos;
+}
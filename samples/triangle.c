@@ -66,28 +66,48 @@ void display()
 	{
 		viewmat_begin_eye(viewportID);
 
-		/* Where is the viewport that we are drawing onto and what is its size? */
-		int viewport[4]; // x,y of lower left corner, width, height
-		viewmat_get_viewport(viewport, viewportID);
-		/* Tell OpenGL the area of the window that we will be drawing in. */
-		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
-
-		/* Clear the current viewport. Without glScissor(), glClear()
-		 * clears the entire screen. We could call glClear() before
-		 * this viewport loop---but in order for all variations of
-		 * this code to work (Oculus support, etc), we can only draw
-		 * after viewmat_begin_eye(). */
-		glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
-		glEnable(GL_SCISSOR_TEST);
-		glClearColor(.2,.2,.2,0); // set clear color to grey
-		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-		glDisable(GL_SCISSOR_TEST);
-		glEnable(GL_DEPTH_TEST); // turn on depth testing
-		kuhl_errorcheck();
-
-		/* Get the view matrix and the projection matrix */
-		float viewMat[16], perspective[16];
-		viewmat_get(viewMat, perspective, viewportID);
+		if(viewmat_single_pass())
+		{
+			/* viewmat_begin_eye() has set up one indexed viewport per
+			 * eye and the vertex shader routes each instance to the
+			 * correct one; this single pass covers the whole window,
+			 * so clear it all at once. */
+			glClearColor(.2,.2,.2,0); // set clear color to grey
+			glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+			glEnable(GL_DEPTH_TEST); // turn on depth testing
+			kuhl_errorcheck();
+		}
+		else
+		{
+			/* Where is the viewport that we are drawing onto and what is its size? */
+			int viewport[4]; // x,y of lower left corner, width, height
+			viewmat_get_viewport(viewport, viewportID);
+			/* Tell OpenGL the area of the window that we will be drawing in. */
+			glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+			/* Clear the current viewport. Without glScissor(), glClear()
+			 * clears the entire screen. We could call glClear() before
+			 * this viewport loop---but in order for all variations of
+			 * this code to work (Oculus support, etc), we can only draw
+			 * after viewmat_begin_eye(). */
+			glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
+			glEnable(GL_SCISSOR_TEST);
+			glClearColor(.2,.2,.2,0); // set clear color to grey
+			glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+			glDisable(GL_SCISSOR_TEST);
+			glEnable(GL_DEPTH_TEST); // turn on depth testing
+			kuhl_errorcheck();
+		}
+
+		/* Get the view matrix and the projection matrix. In
+		 * single-pass stereo mode, get both eyes' matrices at once
+		 * (the second matrix in each array is for the right eye). */
+		float viewMat[32], perspective[32];
+		if(viewmat_single_pass())
+			viewmat_get_stereo(&viewMat[0], &perspective[0],
+			                   &viewMat[16], &perspective[16]);
+		else
+			viewmat_get(viewMat, perspective, viewportID);
 
 		/* Calculate an angle to rotate the
 		 * object. glutGet(GLUT_ELAPSED_TIME) is the number of
@@ -111,31 +131,44 @@ void display()
 		float modelMat[16];
 		mat4f_mult_mat4f_new(modelMat, scaleMat, rotateMat);
 
-		/* Construct a modelview matrix: modelview = viewMat * modelMat */
-		float modelview[16];
-		mat4f_mult_mat4f_new(modelview, viewMat, modelMat);
+		/* Construct a modelview matrix: modelview = viewMat * modelMat.
+		 * In single-pass stereo mode, construct one per eye. */
+		int eyeCount = viewmat_single_pass() ? 2 : 1;
+		float modelview[32];
+		for(int i=0; i<eyeCount; i++)
+			mat4f_mult_mat4f_new(&modelview[i*16], &viewMat[i*16], modelMat);
 
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
 		glUseProgram(program);
 		kuhl_errorcheck();
-		
+
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
+		                   eyeCount, // number of 4x4 float matrices
 		                   0, // transpose
 		                   perspective); // value
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-		                   1, // number of 4x4 float matrices
+		                   eyeCount, // number of 4x4 float matrices
 		                   0, // transpose
 		                   modelview); // value
 		kuhl_errorcheck();
 		/* Draw the geometry using the matrices that we sent to the
-		 * vertex programs immediately above */
-		kuhl_geometry_draw(&triangle);
-		kuhl_geometry_draw(&quad);
+		 * vertex programs immediately above. In single-pass stereo
+		 * mode, draw two instances---one routed to each eye's
+		 * viewport---instead of drawing the scene once per eye. */
+		if(viewmat_single_pass())
+		{
+			kuhl_geometry_draw_instanced(&triangle, 2);
+			kuhl_geometry_draw_instanced(&quad, 2);
+		}
+		else
+		{
+			kuhl_geometry_draw(&triangle);
+			kuhl_geometry_draw(&quad);
+		}
 
 		glUseProgram(0); // stop using a GLSL program.
 
@@ -233,14 +266,20 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
 	glutKeyboardFunc(keyboard);
 
 	/* Compile and link a GLSL program composed of a vertex shader and
-	 * a fragment shader. */
-	program = kuhl_create_program("triangle.vert", "triangle.frag");
+	 * a fragment shader. Single-pass stereo mode needs a vertex
+	 * shader which takes a matrix per eye and routes each instance to
+	 * an eye's viewport. */
+	if(viewmat_single_pass())
+		program = kuhl_create_program("triangle-stereo.vert", "triangle.frag");
+	else
+		program = kuhl_create_program("triangle.vert", "triangle.frag");
 
 	/* Use the GLSL program so subsequent calls to glUniform*() send the variable to
 	   the correct program. */
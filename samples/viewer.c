@@ -32,6 +32,10 @@ int renderStyle = 2;
 GLuint program = 0; // id value for the GLSL program
 kuhl_geometry *modelgeom = NULL;
 kuhl_geometry *origingeom = NULL;
+/** The model's meshes sorted by (program, texture, VAO) so that
+ * drawing them performs as few state changes as possible; compiled
+ * once after the model is loaded. */
+kuhl_drawlist modelDrawlist = { NULL, 0 };
 float bbox[6];
 
 int fitToView=0;  // was --fit option used?
@@ -82,6 +86,9 @@ void keyboard(unsigned char key, int x, int y)
 			program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
 			/* Apply the program to the model geometry */
 			kuhl_geometry_program(modelgeom, program, KG_FULL_LIST);
+			/* The program the meshes use is a sort key of the draw
+			 * list, so recompile it. */
+			kuhl_drawlist_compile(&modelDrawlist, modelgeom);
 			/* and the fps label*/
 			kuhl_geometry_program(&labelQuad, program, KG_FULL_LIST);
 
@@ -272,8 +279,15 @@ void display()
 		// Check if FPS value was just updated by kuhl_getfps()
 		if(fps_state.frame == 0)
 		{
+			/* How many meshes were drawn vs. frustum culled vs.
+			 * skipped as occluded since the last FPS update? */
+			int numDrawn, numCulled, numOccluded;
+			kuhl_cull_stats(&numDrawn, &numCulled);
+			kuhl_occlusion_stats(NULL, &numOccluded);
+
 			char label[1024];
-			snprintf(label, 1024, "FPS: %0.1f", fps);
+			snprintf(label, 1024, "FPS: %0.1f Drawn: %d Culled: %d Occluded: %d",
+			         fps, numDrawn, numCulled, numOccluded);
 
 			/* Delete old label if it exists */
 			if(fpsLabel != 0) 
@@ -358,7 +372,12 @@ void display()
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
 		kuhl_errorcheck();
-		kuhl_geometry_draw(modelgeom); /* Draw the model */
+		/* Cull meshes that are outside of the view frustum while the
+		 * model is drawn. The origin marker and the FPS label use
+		 * different matrices, so culling is turned off afterward. */
+		kuhl_cull_set_frustum(perspective, modelview);
+		kuhl_drawlist_draw(&modelDrawlist); /* Draw the model, sorted to minimize state changes */
+		kuhl_cull_disable();
 		kuhl_errorcheck();
 		if(showOrigin)
 		{
@@ -551,6 +570,7 @@ int main(int argc, char** argv)
 	 * details, see:
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
+	kuhl_debug_init();
 
 	// setup callbacks
 	glutDisplayFunc(display);
@@ -574,11 +594,19 @@ int main(int argc, char** argv)
 
 	// Load the model from the file
 	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
+	/* Sort the model's meshes so that drawing them minimizes state
+	 * changes. */
+	kuhl_drawlist_compile(&modelDrawlist, modelgeom);
 	if(showOrigin)
 		origingeom = kuhl_load_model("../models/origin/origin.obj", NULL, program, NULL);
 	
 	init_geometryQuad(&labelQuad, program);
 
+	/* Skip shading meshes that recent occlusion queries found fully
+	 * hidden behind other geometry (e.g. rooms behind walls in an
+	 * architectural model). Frustum culling can't catch those. */
+	kuhl_occlusion_enable(1);
+
 	kuhl_getfps_init(&fps_state);
 	
 	/* Tell GLUT to start running the main loop and to call display(),